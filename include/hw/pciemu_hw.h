@@ -22,8 +22,13 @@
 #define PCIEMU_HW_DEVICE_ID 0x1100
 #define PCIEMU_HW_REVISION 0x01
 
-/* BAR */
+/* BAR
+ *   - BAR0 : registers (MMIO, see below)
+ *   - BAR2 : DMA descriptor window (64-bit, prefetchable memory)
+ * PCIEMU_HW_BAR_CNT only counts the BARs exposed to userspace (BAR0).
+ */
 #define PCIEMU_HW_BAR0 0
+#define PCIEMU_HW_BAR2 2
 #define PCIEMU_HW_BAR_CNT 1
 
 /* MMIO - HARDWARE REGISTERS */
@@ -44,11 +49,105 @@
 #define PCIEMU_HW_BAR0_DMA_CFG_CMD 0x48
 #define PCIEMU_HW_BAR0_DMA_DOORBELL_RING 0x50
 
+/* MMIO - RX stream generator */
+#define PCIEMU_HW_BAR0_RX_CFG_RING_ADDR 0x58
+#define PCIEMU_HW_BAR0_RX_CFG_RING_SIZE 0x60
+#define PCIEMU_HW_BAR0_RX_CFG_PKT_SIZE 0x68
+#define PCIEMU_HW_BAR0_RX_CFG_RATE 0x70
+#define PCIEMU_HW_BAR0_RX_CFG_BURST 0x78
+#define PCIEMU_HW_BAR0_RX_HEAD 0x80
+#define PCIEMU_HW_BAR0_RX_TAIL 0x88
+#define PCIEMU_HW_BAR0_RX_CTRL 0x90
+
+/* MMIO - DMA pattern generator and verifier */
+#define PCIEMU_HW_BAR0_DMA_PATTERN_ERR_CNT 0x98
+#define PCIEMU_HW_BAR0_DMA_PATTERN_ERR_OFS 0xa0
+#define PCIEMU_HW_BAR0_DMA_CFG_PATTERN 0xa8
+#define PCIEMU_HW_BAR0_DMA_CFG_PATTERN_SEED 0xb0
+
+/* MMIO - DMA memory area size (read only) */
+#define PCIEMU_HW_BAR0_DMA_AREA_SIZE 0xb8
+
+/* MMIO - DMA status, error and completion counter (read only) */
+#define PCIEMU_HW_BAR0_DMA_STATUS 0xc0
+#define PCIEMU_HW_BAR0_DMA_ERROR 0xc8
+#define PCIEMU_HW_BAR0_DMA_DONE_CNT 0xd0
+
+/* MMIO - DMA descriptor doorbell (slot of the descriptor window in BAR2) */
+#define PCIEMU_HW_BAR0_DMA_DESC_DOORBELL 0xd8
+
+/* MMIO - DMA configuration of the encryption commands */
+#define PCIEMU_HW_BAR0_DMA_CFG_CRYPTO_KEY_SLOT 0xe0
+#define PCIEMU_HW_BAR0_DMA_CFG_CRYPTO_SECTOR_SIZE 0xe8
+#define PCIEMU_HW_BAR0_DMA_CFG_CRYPTO_SECTOR 0xf0
+
+/* MMIO - DMA submission queues
+ *   PCIEMU_HW_DMA_QUEUE_CNT blocks of registers, the one of queue q starting
+ *   at PCIEMU_HW_BAR0_DMA_QUEUE_START + q * PCIEMU_HW_BAR0_DMA_QUEUE_STRIDE
+ *   (offsets PCIEMU_HW_DMA_QUEUE_* below).
+ */
+#define PCIEMU_HW_BAR0_DMA_QUEUE_START 0x100
+#define PCIEMU_HW_BAR0_DMA_QUEUE_STRIDE 0x40
+#define PCIEMU_HW_BAR0_DMA_QUEUE_END \
+    (PCIEMU_HW_BAR0_DMA_QUEUE_START + \
+     PCIEMU_HW_DMA_QUEUE_CNT * PCIEMU_HW_BAR0_DMA_QUEUE_STRIDE - 8)
+
+/* MMIO - Key slot window (see PCIEMU_HW_CRYPTO_* below)
+ *   KEY_DATA is a range of PCIEMU_HW_CRYPTO_KEY_DATA_SIZE bytes, written
+ *   with 4-byte or 8-byte accesses (each one only sets its own bytes). An
+ *   access crossing the end of the range is ignored.
+ */
+#define PCIEMU_HW_BAR0_CRYPTO_KEY_SLOT 0x200
+#define PCIEMU_HW_BAR0_CRYPTO_KEY_CTRL 0x208
+#define PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_START 0x210
+#define PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_END \
+    (PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_START + PCIEMU_HW_CRYPTO_KEY_DATA_SIZE - 4)
+
+/* MMIO - DMA configuration of the atomic commands */
+#define PCIEMU_HW_BAR0_DMA_CFG_ATOMIC_OPERAND 0x250
+#define PCIEMU_HW_BAR0_DMA_CFG_ATOMIC_COMPARE 0x258
+
+/* MMIO - DMA original value of the last atomic command (read only) */
+#define PCIEMU_HW_BAR0_DMA_ATOMIC_RESULT 0x260
+
+/* MMIO - IRQ causes (see PCIEMU_HW_IRQ_CAUSE_* below) */
+#define PCIEMU_HW_BAR0_IRQ_CAUSE 0x268
+#define PCIEMU_HW_BAR0_IRQ_MASK 0x270
+#define PCIEMU_HW_BAR0_IRQ_QUEUE_THRESHOLD 0x278
+#define PCIEMU_HW_BAR0_IRQ_TIMER_NS 0x280
+
+/* MMIO - DMA configuration of the 2D transfers (PCIEMU_HW_DMA_CMD_FLAG_2D) */
+#define PCIEMU_HW_BAR0_DMA_CFG_2D_ROWS 0x288
+#define PCIEMU_HW_BAR0_DMA_CFG_2D_SRC_STRIDE 0x290
+#define PCIEMU_HW_BAR0_DMA_CFG_2D_DST_STRIDE 0x298
+
+/* MMIO - DMA configuration of the multicast commands */
+#define PCIEMU_HW_BAR0_DMA_CFG_MCAST_CNT 0x2a0
+
+/* MMIO - DMA configuration of the parity commands */
+#define PCIEMU_HW_BAR0_DMA_CFG_RAID_SRC_CNT 0x2a8
+#define PCIEMU_HW_BAR0_DMA_CFG_RAID_Q_DST 0x2b0
+
+/* MMIO - DMA configuration and result (read only) of the scan commands */
+#define PCIEMU_HW_BAR0_DMA_CFG_SCAN_KEY_LO 0x2b8
+#define PCIEMU_HW_BAR0_DMA_CFG_SCAN_KEY_HI 0x2c0
+#define PCIEMU_HW_BAR0_DMA_CFG_SCAN_CTRL 0x2c8
+#define PCIEMU_HW_BAR0_DMA_CFG_SCAN_MAX 0x2d0
+#define PCIEMU_HW_BAR0_DMA_SCAN_MATCH_CNT 0x2d8
+
+/* MMIO - DMA configuration of the sort command */
+#define PCIEMU_HW_BAR0_DMA_CFG_SORT_CTRL 0x2e0
+#define PCIEMU_HW_BAR0_DMA_CFG_SORT_IDX_DST 0x2e8
+
 /* MMIO BAR0 Boundaries */
 #define PCIEMU_HW_BAR0_START PCIEMU_HW_BAR0_REG_0
-#define PCIEMU_HW_BAR0_END PCIEMU_HW_BAR0_DMA_DOORBELL_RING
+#define PCIEMU_HW_BAR0_END PCIEMU_HW_BAR0_DMA_CFG_SORT_IDX_DST
 
-/* DMA */
+/* DMA
+ *   PCIEMU_HW_DMA_AREA_SIZE is the default size of the DMA memory area.
+ *   When the device memory is provided by a memory backend (memdev), the
+ *   actual size can be read from PCIEMU_HW_BAR0_DMA_AREA_SIZE.
+ */
 #define PCIEMU_HW_DMA_ADDR_CAPABILITY 32
 #define PCIEMU_HW_DMA_AREA_START 0x10000
 #define PCIEMU_HW_DMA_AREA_SIZE 0x1000
@@ -57,10 +156,382 @@
 #define PCIEMU_HW_DMA_DIRECTION_TO_DEVICE 0x1
 #define PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE 0x2
 
+/* DMA Commands using a pattern generated inside the device
+ *   - FILL writes the pattern to the bus address txdesc.dst (txdesc.len bytes)
+ *   - VERIFY checks the bus address txdesc.src (txdesc.len bytes) against
+ *     the pattern. The number of mismatching 32-bit words and the offset of
+ *     the first mismatching byte can then be read back.
+ */
+#define PCIEMU_HW_DMA_CMD_PATTERN_FILL 0x3
+#define PCIEMU_HW_DMA_CMD_PATTERN_VERIFY 0x4
+
+/* DMA Command streaming through the device
+ *   - STREAM copies txdesc.len bytes from the bus address txdesc.src to the
+ *     bus address txdesc.dst. The DMA memory area is used as a ring FIFO :
+ *     chunks are read from the source while the FIFO has room and written to
+ *     the destination as soon as they are in, so the length of the transfer
+ *     is not bounded by the size of the DMA memory area (whose content is
+ *     lost). The command completes once, after the last byte is written.
+ */
+#define PCIEMU_HW_DMA_CMD_STREAM 0x5
+
+/* DMA Commands encrypting through the device (AES-XTS, IEEE 1619)
+ *   - ENCRYPT reads txdesc.len bytes from the bus address txdesc.src,
+ *     encrypts them and writes them to the bus address txdesc.dst
+ *   - DECRYPT does the same, decrypting
+ *   The data is split into sectors (data units) of CRYPTO_SECTOR_SIZE bytes,
+ *   a power of two between PCIEMU_HW_CRYPTO_SECTOR_SIZE_MIN and _MAX, and
+ *   txdesc.len must be a multiple of it. The tweak of sector i of the
+ *   transfer is CRYPTO_SECTOR + i, as a 128-bit little endian number (same
+ *   as the plain64 IV of dm-crypt). The key is the one loaded in the key slot
+ *   CRYPTO_KEY_SLOT. src and dst may be the same buffer.
+ */
+#define PCIEMU_HW_DMA_CMD_ENCRYPT 0x6
+#define PCIEMU_HW_DMA_CMD_DECRYPT 0x7
+
+/* DMA Commands operating atomically on host memory (PCIe AtomicOps)
+ *   The operand of txdesc.len bytes (4 or 8) at the bus address txdesc.dst,
+ *   which must be naturally aligned, is read and modified as a single
+ *   atomic operation, also with respect to the CPUs :
+ *   - FETCH_ADD adds ATOMIC_OPERAND (wrapping around)
+ *   - SWAP writes ATOMIC_OPERAND
+ *   - CAS writes ATOMIC_OPERAND if the operand equals ATOMIC_COMPARE
+ *   A 4-byte operation only uses the low 32 bits of the registers. The
+ *   original value of the operand is returned in ATOMIC_RESULT (zero
+ *   extended) before DONE_CNT is incremented, and also written as txdesc.len
+ *   bytes to the bus address txdesc.src unless it is 0, so the driver (or a
+ *   queue) gets it without reading BAR0. Operands are little endian and
+ *   must be in RAM : an operand in MMIO (e.g. a BAR) fails with ERR_BUS.
+ */
+#define PCIEMU_HW_DMA_CMD_ATOMIC_FETCH_ADD 0x8
+#define PCIEMU_HW_DMA_CMD_ATOMIC_SWAP 0x9
+#define PCIEMU_HW_DMA_CMD_ATOMIC_CAS 0xa
+
+/* DMA Commands replicating a buffer to several destinations
+ *   txdesc.len bytes are copied to each of the MCAST_CNT destinations (1 to
+ *   PCIEMU_HW_DMA_MCAST_DST_MAX, PCIEMU_HW_DMA_ERR_BOUNDS otherwise), whose
+ *   bus addresses are read from a table of MCAST_CNT little endian 64-bit
+ *   entries at the bus address txdesc.dst. The source is read only once :
+ *   - MULTICAST reads it from the bus address txdesc.src
+ *   - MULTICAST_FROM_DEVICE reads it from the DMA memory area (txdesc.src is
+ *     a device address, as for PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE)
+ *   The destinations are written in the order of the table, chunk by chunk,
+ *   and the command stops at the first failing one. The command completes
+ *   once, after the last destination is written.
+ */
+#define PCIEMU_HW_DMA_CMD_MULTICAST 0xb
+#define PCIEMU_HW_DMA_CMD_MULTICAST_FROM_DEVICE 0xc
+#define PCIEMU_HW_DMA_MCAST_DST_MAX 64
+
+/* DMA Commands computing RAID parities (as md raid5 and raid6)
+ *   The RAID_SRC_CNT sources (1 to PCIEMU_HW_DMA_RAID_SRC_MAX,
+ *   PCIEMU_HW_DMA_ERR_BOUNDS otherwise) of txdesc.len bytes each are read
+ *   from the bus addresses listed in a table of RAID_SRC_CNT little endian
+ *   64-bit entries at the bus address txdesc.src :
+ *   - XOR writes P, the xor of the sources, to the bus address txdesc.dst
+ *   - PQ writes P to txdesc.dst and the Reed-Solomon syndrome Q to the bus
+ *     address RAID_Q_DST. Q is the sum of g^i * D_i over GF(2^8), D_i being
+ *     source i (its rank in the table) and g = {02}, with the polynomial
+ *     x^8 + x^4 + x^3 + x^2 + 1 (0x11d), same as the Linux raid6 library.
+ *   Each source is read only once.
+ */
+#define PCIEMU_HW_DMA_CMD_XOR 0xd
+#define PCIEMU_HW_DMA_CMD_PQ 0xe
+#define PCIEMU_HW_DMA_RAID_SRC_MAX 16
+
+/* DMA Commands searching a buffer
+ *   txdesc.len bytes are searched for the key, the first SCAN_CTRL_LEN
+ *   bytes (1 to PCIEMU_HW_DMA_SCAN_KEY_MAX, PCIEMU_HW_DMA_ERR_SCAN
+ *   otherwise) of SCAN_KEY_LO then SCAN_KEY_HI (little endian) :
+ *   - by default, the key is a byte string and every offset where it starts
+ *     is a match (matches may overlap)
+ *   - with SCAN_CTRL_SET, the key is a set of delimiters and every offset
+ *     holding one of them is a match
+ *   The offsets of the matches, in increasing order and from the start of
+ *   the buffer, are written as little endian 64-bit entries to the bus
+ *   address txdesc.dst, up to SCAN_MAX entries. SCAN_MATCH_CNT holds the
+ *   number of matches found (possibly more than SCAN_MAX) before DONE_CNT
+ *   is incremented.
+ *   - SCAN reads the buffer from the bus address txdesc.src
+ *   - SCAN_FROM_DEVICE reads it from the DMA memory area (txdesc.src is a
+ *     device address, as for PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE)
+ */
+#define PCIEMU_HW_DMA_CMD_SCAN 0xf
+#define PCIEMU_HW_DMA_CMD_SCAN_FROM_DEVICE 0x10
+#define PCIEMU_HW_DMA_SCAN_KEY_MAX 16
+#define PCIEMU_HW_DMA_SCAN_CTRL_LEN_MASK 0x1f
+#define PCIEMU_HW_DMA_SCAN_CTRL_SET 0x100
+
+/* DMA Command sorting keys
+ *   The txdesc.len bytes at the bus address txdesc.src are an array of
+ *   unsigned little endian keys, 32-bit or 64-bit with SORT_CTRL_KEY64.
+ *   They are written in increasing order to the bus address txdesc.dst
+ *   (stable sort). With SORT_CTRL_IDX, the original index of each sorted
+ *   key is also written, as a little endian 32-bit word, to the bus
+ *   address SORT_IDX_DST : a driver sorting records by key permutes its
+ *   payloads with them.
+ *   txdesc.len must be a multiple of the key size and hold at most
+ *   PCIEMU_HW_DMA_SORT_KEY_CNT_MAX keys (PCIEMU_HW_DMA_ERR_SORT otherwise).
+ *   The keys are read, sorted and written back by a worker thread of the
+ *   device, so the command completes some time after the doorbell, as a
+ *   stream does.
+ */
+#define PCIEMU_HW_DMA_CMD_SORT 0x11
+#define PCIEMU_HW_DMA_SORT_CTRL_KEY64 0x1
+#define PCIEMU_HW_DMA_SORT_CTRL_IDX 0x2
+#define PCIEMU_HW_DMA_SORT_KEY_CNT_MAX (1 << 22)
+
+/* DMA patterns : sequence of little endian 32-bit words, with word i being
+ *   - COUNTER : seed + i
+ *   - HASH : lowbias32 hash of (seed + i * PCIEMU_HW_DMA_PATTERN_HASH_STEP)
+ * computed modulo 2^32, so both repeat every 2^32 words (16 GiB). The HASH
+ * word only depends on its index, so the pattern can be generated or
+ * checked starting from any offset. Other values of the pattern register
+ * fail with PCIEMU_HW_DMA_ERR_PATTERN.
+ */
+#define PCIEMU_HW_DMA_PATTERN_COUNTER 0x1
+#define PCIEMU_HW_DMA_PATTERN_HASH 0x2
+#define PCIEMU_HW_DMA_PATTERN_HASH_STEP 0x9e3779b9
+#define PCIEMU_HW_DMA_PATTERN_ERR_OFS_NONE (~0ULL)
+
+/* DMA Command flags (or'ed with the command)
+ *   - NO_IRQ : do not raise PCIEMU_HW_IRQ_DMA_ENDED_VECTOR on completion,
+ *     the driver polls PCIEMU_HW_BAR0_DMA_DONE_CNT instead
+ *   - 2D : rectangular transfer (DIRECTION_TO_DEVICE and _FROM_DEVICE only,
+ *     other commands fail with PCIEMU_HW_DMA_ERR_CMD). 2D_ROWS rows of
+ *     txdesc.len bytes are transferred in order, row i going from
+ *     txdesc.src + i * 2D_SRC_STRIDE to txdesc.dst + i * 2D_DST_STRIDE, on
+ *     the bus as in the device memory. This gathers or scatters image tiles,
+ *     matrix sub-blocks or column slices (row length of one element) in a
+ *     single command. Strides may be smaller than the row length, rows are
+ *     then overwritten in order. The rows inside the device memory must all
+ *     fit in the DMA memory area, and there are at most
+ *     PCIEMU_HW_DMA_2D_ROWS_MAX rows (PCIEMU_HW_DMA_ERR_BOUNDS otherwise).
+ */
+#define PCIEMU_HW_DMA_CMD_MASK 0xff
+#define PCIEMU_HW_DMA_CMD_FLAG_NO_IRQ 0x100
+#define PCIEMU_HW_DMA_CMD_FLAG_2D 0x200
+#define PCIEMU_HW_DMA_2D_ROWS_MAX 65536
+
+/* Length of the commands run by the engine as soon as they start
+ *   The pattern, encryption, multicast, parity and scan commands move at
+ *   most PCIEMU_HW_DMA_SYNC_LEN_MAX bytes : txdesc.len, times MCAST_CNT for
+ *   a multicast and RAID_SRC_CNT for a parity (PCIEMU_HW_DMA_ERR_BOUNDS
+ *   otherwise). Longer copies go through STREAM, which is not limited.
+ */
+#define PCIEMU_HW_DMA_SYNC_LEN_MAX (16 << 20)
+
+/* DMA status register values */
+#define PCIEMU_HW_DMA_STATUS_IDLE 0x0
+#define PCIEMU_HW_DMA_STATUS_EXECUTING 0x1
+#define PCIEMU_HW_DMA_STATUS_OFF 0x2
+
+/* DMA error register values (error of the last completed command)
+ *   Every doorbell accepted by the engine (i.e. ringed while IDLE) completes :
+ *   the error register is updated before DONE_CNT is incremented, so a driver
+ *   polling DONE_CNT can read the error of the command that just completed.
+ *   - CMD : unknown command, or flag the command does not support
+ *   - BOUNDS : device address or length outside of the DMA memory area,
+ *     count of rows, destinations or sources out of range, or command
+ *     moving more than PCIEMU_HW_DMA_SYNC_LEN_MAX bytes
+ *   - BUS : the transfer on the bus failed (e.g. unmapped bus address)
+ *   - CRYPTO : empty key slot, invalid sector size or length not a multiple
+ *     of the sector size
+ *   - ATOMIC : operand size other than 4 or 8, or operand not naturally
+ *     aligned
+ *   - SCAN : key length of 0 or above PCIEMU_HW_DMA_SCAN_KEY_MAX
+ *   - SORT : length not a multiple of the key size, or too many keys
+ *   - PATTERN : unknown pattern
+ */
+#define PCIEMU_HW_DMA_ERR_NONE 0x0
+#define PCIEMU_HW_DMA_ERR_CMD 0x1
+#define PCIEMU_HW_DMA_ERR_BOUNDS 0x2
+#define PCIEMU_HW_DMA_ERR_BUS 0x3
+#define PCIEMU_HW_DMA_ERR_CRYPTO 0x4
+#define PCIEMU_HW_DMA_ERR_ATOMIC 0x5
+#define PCIEMU_HW_DMA_ERR_SCAN 0x6
+#define PCIEMU_HW_DMA_ERR_SORT 0x7
+#define PCIEMU_HW_DMA_ERR_PATTERN 0x8
+
+/* DMA descriptor window (BAR2)
+ *   Instead of writing the DMA configuration registers one by one (one MMIO
+ *   exit each), the driver writes a whole descriptor into a slot of the
+ *   window with a single burst, then writes the slot number to
+ *   PCIEMU_HW_BAR0_DMA_DESC_DOORBELL. The window is plain memory, so only the
+ *   doorbell traps : BAR2 is prefetchable and meant to be mapped
+ *   write-combining (e.g. pci_iomap_wc, then memcpy_toio or movdir64b), with
+ *   a write barrier between the descriptor and the doorbell.
+ *   When the doorbell is rung, the device reads the descriptor as a unit, as
+ *   if its fields were written to the DMA configuration registers right
+ *   before PCIEMU_HW_BAR0_DMA_DOORBELL_RING (so nothing happens if the engine
+ *   is not IDLE). The content of the window is undefined after a reset.
+ *
+ *   DMA descriptor layout (little endian) :
+ *     0x00 : txdesc.src (64 bits)
+ *     0x08 : txdesc.dst (64 bits)
+ *     0x10 : txdesc.len (64 bits)
+ *     0x18 : command, with its flags (64 bits)
+ *   The pattern commands (FILL and VERIFY) use 64-byte descriptors adding :
+ *     0x20 : pattern (32 bits)
+ *     0x24 : pattern seed (32 bits)
+ *     0x28 : reserved (up to 0x3f)
+ *   The encryption commands (ENCRYPT and DECRYPT) use 64-byte descriptors
+ *   adding :
+ *     0x20 : key slot (32 bits)
+ *     0x24 : sector size (32 bits)
+ *     0x28 : first sector (64 bits)
+ *     0x30 : reserved (up to 0x3f)
+ *   The atomic commands (FETCH_ADD, SWAP and CAS) use 64-byte descriptors
+ *   adding :
+ *     0x20 : operand (64 bits)
+ *     0x28 : compare value (64 bits)
+ *     0x30 : reserved (up to 0x3f)
+ *   The 2D transfers (PCIEMU_HW_DMA_CMD_FLAG_2D) use 64-byte descriptors
+ *   adding :
+ *     0x20 : rows (32 bits)
+ *     0x24 : reserved (32 bits)
+ *     0x28 : source stride (64 bits)
+ *     0x30 : destination stride (64 bits)
+ *     0x38 : reserved (up to 0x3f)
+ *   The multicast commands (MULTICAST and MULTICAST_FROM_DEVICE) use 64-byte
+ *   descriptors adding :
+ *     0x20 : count of destinations (32 bits)
+ *     0x24 : reserved (up to 0x3f)
+ *   The parity commands (XOR and PQ) use 64-byte descriptors adding :
+ *     0x20 : count of sources (32 bits)
+ *     0x24 : reserved (32 bits)
+ *     0x28 : bus address of Q (64 bits)
+ *     0x30 : reserved (up to 0x3f)
+ *   The scan commands (SCAN and SCAN_FROM_DEVICE) use 64-byte descriptors
+ *   adding :
+ *     0x20 : key, low half (64 bits)
+ *     0x28 : key, high half (64 bits)
+ *     0x30 : scan control (32 bits)
+ *     0x34 : reserved (32 bits)
+ *     0x38 : maximum number of entries written (64 bits)
+ *   The sort command (SORT) uses 64-byte descriptors adding :
+ *     0x20 : sort control (32 bits)
+ *     0x24 : reserved (32 bits)
+ *     0x28 : bus address of the indices (64 bits)
+ *     0x30 : reserved (up to 0x3f)
+ */
+#define PCIEMU_HW_DESC_WINDOW_SIZE 0x1000
+#define PCIEMU_HW_DESC_SLOT_SIZE 64
+#define PCIEMU_HW_DESC_SLOT_CNT \
+    (PCIEMU_HW_DESC_WINDOW_SIZE / PCIEMU_HW_DESC_SLOT_SIZE)
+#define PCIEMU_HW_DESC_SIZE 32
+#define PCIEMU_HW_DESC_PATTERN_SIZE 64
+#define PCIEMU_HW_DESC_SRC 0x00
+#define PCIEMU_HW_DESC_DST 0x08
+#define PCIEMU_HW_DESC_LEN 0x10
+#define PCIEMU_HW_DESC_CMD 0x18
+#define PCIEMU_HW_DESC_PATTERN 0x20
+#define PCIEMU_HW_DESC_PATTERN_SEED 0x24
+#define PCIEMU_HW_DESC_CRYPTO_KEY_SLOT 0x20
+#define PCIEMU_HW_DESC_CRYPTO_SECTOR_SIZE 0x24
+#define PCIEMU_HW_DESC_CRYPTO_SECTOR 0x28
+#define PCIEMU_HW_DESC_ATOMIC_OPERAND 0x20
+#define PCIEMU_HW_DESC_ATOMIC_COMPARE 0x28
+#define PCIEMU_HW_DESC_2D_ROWS 0x20
+#define PCIEMU_HW_DESC_2D_SRC_STRIDE 0x28
+#define PCIEMU_HW_DESC_2D_DST_STRIDE 0x30
+#define PCIEMU_HW_DESC_MCAST_CNT 0x20
+#define PCIEMU_HW_DESC_RAID_SRC_CNT 0x20
+#define PCIEMU_HW_DESC_RAID_Q_DST 0x28
+#define PCIEMU_HW_DESC_SCAN_KEY_LO 0x20
+#define PCIEMU_HW_DESC_SCAN_KEY_HI 0x28
+#define PCIEMU_HW_DESC_SCAN_CTRL 0x30
+#define PCIEMU_HW_DESC_SCAN_MAX 0x38
+#define PCIEMU_HW_DESC_SORT_CTRL 0x20
+#define PCIEMU_HW_DESC_SORT_IDX_DST 0x28
+
+/* DMA submission queues
+ *   Several submitters (e.g. tenants) share the DMA engine through queues of
+ *   PCIEMU_HW_DMA_QUEUE_SIZE descriptors : queue q uses the slots
+ *   [q * PCIEMU_HW_DMA_QUEUE_SIZE, (q + 1) * PCIEMU_HW_DMA_QUEUE_SIZE) of the
+ *   descriptor window as a ring. The driver writes descriptors at its tail
+ *   (slot tail % PCIEMU_HW_DMA_QUEUE_SIZE) and moves TAIL forward. HEAD is
+ *   moved forward by the device when it fetches a descriptor (its slot can
+ *   then be reused) and DONE_CNT/ERROR when the command completes, in order.
+ *   TAIL, HEAD and DONE_CNT are free running 32-bit counters.
+ *
+ *   Whenever the engine is IDLE, the arbiter picks the next descriptor :
+ *     - strict priority between classes (PRIO, 0 is the highest), so a queue
+ *       only waits for the command being executed when lower classes are busy
+ *     - weighted round-robin inside a class : WEIGHT commands in a row
+ *     - a queue with a RATE (bytes per second, 0 = unlimited) is only picked
+ *       while its token bucket is not empty. The bucket holds up to BURST
+ *       bytes and each command takes its length (times its rows for a 2D
+ *       transfer, its destinations for a multicast or its sources for a
+ *       parity) out of it (going negative if needed), so the average rate
+ *       of the queue is capped at RATE.
+ *   The commands of the queues are executed as if their descriptors were
+ *   pushed through PCIEMU_HW_BAR0_DMA_DESC_DOORBELL : a doorbell rung by
+ *   other means while a queued command is executing is ignored.
+ */
+#define PCIEMU_HW_DMA_QUEUE_CNT 4
+#define PCIEMU_HW_DMA_QUEUE_SIZE \
+    (PCIEMU_HW_DESC_SLOT_CNT / PCIEMU_HW_DMA_QUEUE_CNT)
+#define PCIEMU_HW_DMA_QUEUE_TAIL 0x00
+#define PCIEMU_HW_DMA_QUEUE_HEAD 0x08 /* read only */
+#define PCIEMU_HW_DMA_QUEUE_PRIO 0x10
+#define PCIEMU_HW_DMA_QUEUE_WEIGHT 0x18
+#define PCIEMU_HW_DMA_QUEUE_RATE 0x20
+#define PCIEMU_HW_DMA_QUEUE_BURST 0x28
+#define PCIEMU_HW_DMA_QUEUE_DONE_CNT 0x30 /* read only */
+#define PCIEMU_HW_DMA_QUEUE_ERROR 0x38    /* read only */
+#define PCIEMU_HW_DMA_QUEUE_PRIO_CNT 4
+#define PCIEMU_HW_DMA_QUEUE_WEIGHT_MAX 255
+
+/* Key slots of the encryption commands
+ *   The keys never go through the DMA : the driver selects a slot with
+ *   KEY_SLOT, writes the key to KEY_DATA (little endian registers, key 1
+ *   then key 2 of XTS, i.e. the 32 or 64 byte key of dm-crypt aes-xts-plain64)
+ *   and writes the size of the key to KEY_CTRL, which loads it into the slot
+ *   and wipes KEY_DATA. KEY_DATA reads as 0 and KEY_CTRL as the size of the
+ *   key loaded in the selected slot (KEY_CLEAR if empty). Writing KEY_CLEAR
+ *   empties the slot. The slots are emptied by a reset.
+ */
+#define PCIEMU_HW_CRYPTO_KEY_SLOT_CNT 16
+#define PCIEMU_HW_CRYPTO_KEY_DATA_SIZE 64
+#define PCIEMU_HW_CRYPTO_KEY_CLEAR 0x0
+#define PCIEMU_HW_CRYPTO_KEY_XTS_128 32 /* AES-128-XTS, 2 x 128-bit keys */
+#define PCIEMU_HW_CRYPTO_KEY_XTS_256 64 /* AES-256-XTS, 2 x 256-bit keys */
+#define PCIEMU_HW_CRYPTO_SECTOR_SIZE_MIN 512
+#define PCIEMU_HW_CRYPTO_SECTOR_SIZE_MAX 4096
+
+/* RX stream generator
+ *   The driver posts receive buffers in a ring of descriptors living in its
+ *   own memory and moves the tail forward. The device fills the buffers at
+ *   the configured packet size and rate (packets per second, 0 = as fast as
+ *   buffers are posted), writes back the used length and the DONE flag and
+ *   then moves the head forward.
+ *
+ *   RX descriptor layout (little endian, PCIEMU_HW_RX_DESC_SIZE bytes) :
+ *     0x0 : bus address of the buffer (64 bits)
+ *     0x8 : length of the buffer / length written by the device (32 bits)
+ *     0xc : flags (32 bits)
+ *
+ *   Up to burst packets (the depth of the token bucket, at most
+ *   PCIEMU_HW_RX_BURST_MAX, as many as the biggest ring) can be sent at once.
+ */
+#define PCIEMU_HW_RX_DESC_SIZE 16
+#define PCIEMU_HW_RX_DESC_ADDR 0x0
+#define PCIEMU_HW_RX_DESC_LEN 0x8
+#define PCIEMU_HW_RX_DESC_FLAGS 0xc
+#define PCIEMU_HW_RX_DESC_FLAG_DONE 0x1
+#define PCIEMU_HW_RX_RING_SIZE_MAX 4096
+#define PCIEMU_HW_RX_PKT_SIZE_MAX 9216
+#define PCIEMU_HW_RX_BURST_MAX 4096
+
+/* RX control register values */
+#define PCIEMU_HW_RX_CTRL_STOP 0x0
+#define PCIEMU_HW_RX_CTRL_START 0x1
+
 /* IRQs */
-#define PCIEMU_HW_IRQ_CNT 1
+#define PCIEMU_HW_IRQ_CNT 2
 #define PCIEMU_HW_IRQ_VECTOR_START 0
-#define PCIEMU_HW_IRQ_VECTOR_END 0
+#define PCIEMU_HW_IRQ_VECTOR_END 1
 #define PCIEMU_HW_IRQ_INTX 0 /* INTA */
 
 /* IRQs for DMA */
@@ -68,4 +539,45 @@
 #define PCIEMU_HW_IRQ_DMA_ENDED_ADDR PCIEMU_HW_BAR0_IRQ_0_RAISE
 #define PCIEMU_HW_IRQ_DMA_ACK_ADDR PCIEMU_HW_BAR0_IRQ_0_LOWER
 
+/* IRQs for RX stream generator (INTx is shared, ack with IRQ_0_LOWER) */
+#define PCIEMU_HW_IRQ_RX_DONE_VECTOR 1
+
+/* IRQ causes
+ *   Every event below sets its bit in IRQ_CAUSE, which stays set until the
+ *   driver writes it back (write 1 to clear). An event only interrupts if
+ *   its bit is clear in IRQ_MASK, and a masked cause interrupts as soon as
+ *   it is unmasked :
+ *     - INTx : the line stays asserted while an unmasked cause is set, so the
+ *       handler reads IRQ_CAUSE once, handles every event batched since the
+ *       last clear and clears them, which deasserts the line.
+ *     - MSI : every unmasked event is notified. A handler batches them by
+ *       masking the causes, then unmasking them once done : the causes set
+ *       in between are notified by a single MSI.
+ *   RX_DONE is notified on PCIEMU_HW_IRQ_RX_DONE_VECTOR, the other causes on
+ *   PCIEMU_HW_IRQ_DMA_ENDED_VECTOR. IRQ_0_LOWER still lowers the line
+ *   without clearing the causes, and IRQ_MASK resets to
+ *   PCIEMU_HW_IRQ_MASK_DEFAULT, so drivers ignoring the causes get the same
+ *   interrupts as before.
+ *
+ *   - DMA_DONE : a DMA command completed (unless FLAG_NO_IRQ)
+ *   - DMA_ERROR : a DMA command completed with an error (unless FLAG_NO_IRQ)
+ *   - QUEUE : a submission queue completed a command and is left with
+ *     IRQ_QUEUE_THRESHOLD commands or fewer posted but not completed, so
+ *     the driver can post more before it runs dry
+ *   - TIMER : IRQ_TIMER_NS nanoseconds elapsed (periodic, 0 = stopped).
+ *     Periods below PCIEMU_HW_IRQ_TIMER_NS_MIN are ignored, so the host is
+ *     not flooded with timer expirations and interrupts.
+ *   - RX_DONE : the RX stream generator filled buffers
+ */
+#define PCIEMU_HW_IRQ_CAUSE_DMA_DONE 0x1
+#define PCIEMU_HW_IRQ_CAUSE_DMA_ERROR 0x2
+#define PCIEMU_HW_IRQ_CAUSE_QUEUE 0x4
+#define PCIEMU_HW_IRQ_CAUSE_TIMER 0x8
+#define PCIEMU_HW_IRQ_CAUSE_RX_DONE 0x10
+#define PCIEMU_HW_IRQ_CAUSE_ALL 0x1f
+#define PCIEMU_HW_IRQ_TIMER_NS_MIN 1000
+#define PCIEMU_HW_IRQ_MASK_DEFAULT \
+    (PCIEMU_HW_IRQ_CAUSE_DMA_ERROR | PCIEMU_HW_IRQ_CAUSE_QUEUE | \
+     PCIEMU_HW_IRQ_CAUSE_TIMER)
+
 #endif /* PCIEMU_HW_H */
@@ -0,0 +1,67 @@
+/* pciemu_trace.h - Header file describing the trace file format
+ *
+ * This header can be used by different parts :
+ *   - the qemu implementation of the device (writing the trace)
+ *   - the replayer (reading the trace to drive the device model)
+ *   - any other tool decoding the trace.
+ *
+ * A trace file is a header followed by fixed-size records, all in the
+ * endianness of the host that recorded it.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+#ifndef PCIEMU_TRACE_H
+#define PCIEMU_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PCIEMU_TRACE_MAGIC "PCIEMUTR"
+#define PCIEMU_TRACE_VERSION 1
+
+/* header flags */
+#define PCIEMU_TRACE_FLAG_PAYLOAD_HASH 0x1
+
+/* record types */
+#define PCIEMU_TRACE_MMIO_READ 0x1
+#define PCIEMU_TRACE_MMIO_WRITE 0x2
+#define PCIEMU_TRACE_DMA_READ 0x3  /* host -> device (pci_dma_read) */
+#define PCIEMU_TRACE_DMA_WRITE 0x4 /* device -> host (pci_dma_write) */
+#define PCIEMU_TRACE_RESET 0x5
+
+typedef struct PCIEMUTraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+} PCIEMUTraceHeader;
+
+typedef struct PCIEMUTraceRecord {
+    uint64_t ts_ns; /* QEMU virtual clock */
+    uint64_t addr;  /* BAR0 offset (MMIO) or bus address (DMA) */
+    uint64_t val;   /* value (MMIO) or payload hash, 0 when disabled (DMA) */
+    /* access size (MMIO) or transfer length (DMA), in the low 56 bits */
+    uint64_t len : 56;
+    uint64_t type : 8; /* PCIEMU_TRACE_*, in the high byte */
+} PCIEMUTraceRecord;
+
+/**
+ * pciemu_trace_hash: FNV-1a (64-bit) hash of a DMA payload
+ *
+ * @buf: payload
+ * @len: length of the payload in bytes
+ */
+static inline uint64_t pciemu_trace_hash(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#endif /* PCIEMU_TRACE_H */
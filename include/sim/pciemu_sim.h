@@ -0,0 +1,149 @@
+/* pciemu_sim.h - In-process simulator of the pciemu device
+ *
+ * libpciemu-sim hosts the device model (src/hw/pciemu) inside a regular
+ * program, without QEMU nor a guest. It provides :
+ *   - the guest memory : a window of the bus address space backed by a host
+ *     buffer given by the caller, and/or a callback for any other bus
+ *     address. DMAs outside of both fail (bus error).
+ *   - the IRQs : delivered synchronously to a callback, as MSI vectors.
+ *   - the virtual clock : only moves when asked to, firing the device timers
+ *     (completion latency, RX stream generator, ...) on the way.
+ *   - a driver-like API on top of the BAR0 registers and of the descriptor
+ *     window in BAR2 (see pciemu_hw.h).
+ *
+ * A simulator is not thread safe : each one must be used by a single thread
+ * at a time.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_SIM_H
+#define PCIEMU_SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hw/pciemu_hw.h"
+
+typedef struct PCIEMUSim PCIEMUSim;
+
+/* called when the device raises the IRQ vector (PCIEMU_HW_IRQ_*_VECTOR) */
+typedef void (*PCIEMUSimIRQCallback)(void *opaque, unsigned int vector);
+
+/* called for DMAs outside of the guest memory window, returns 0 on success */
+typedef int (*PCIEMUSimDMACallback)(void *opaque, uint64_t addr, void *buf,
+                                    uint64_t len, bool is_write);
+
+typedef struct PCIEMUSimConfig {
+    /* guest memory : bus addresses [mem_base, mem_base + mem_size) */
+    void *mem;
+    uint64_t mem_base;
+    uint64_t mem_size;
+    /* guest memory outside of the window (optional) */
+    PCIEMUSimDMACallback dma_cb;
+    void *dma_opaque;
+    /* IRQs (optional) */
+    PCIEMUSimIRQCallback irq_cb;
+    void *irq_opaque;
+    /* optional, same meaning as the properties of the device */
+    const char *trace_file;
+    bool trace_payload_hash;
+    const char *latency_dist;
+    uint64_t latency_ns;
+    uint64_t latency_min_ns;
+    uint64_t latency_max_ns;
+    uint32_t latency_sigma_milli;
+    const char *latency_hist_file;
+    uint64_t latency_seed;
+} PCIEMUSimConfig;
+
+/* lifecycle : create returns NULL on errors (reported on stderr) */
+PCIEMUSim *pciemu_sim_create(const PCIEMUSimConfig *cfg);
+
+void pciemu_sim_destroy(PCIEMUSim *sim);
+
+void pciemu_sim_reset(PCIEMUSim *sim);
+
+/* BAR0 accesses (size of 4 or 8 bytes) */
+uint64_t pciemu_sim_mmio_read(PCIEMUSim *sim, uint64_t addr, unsigned int size);
+
+void pciemu_sim_mmio_write(PCIEMUSim *sim, uint64_t addr, uint64_t val,
+                           unsigned int size);
+
+/* device memory (DMA area), e.g. to check the result of a transfer */
+uint8_t *pciemu_sim_device_memory(PCIEMUSim *sim, uint64_t *size);
+
+/* DMA descriptor window (BAR 2), PCIEMU_HW_DESC_WINDOW_SIZE bytes */
+uint8_t *pciemu_sim_desc_window(PCIEMUSim *sim);
+
+/* virtual clock : the work handed by the device to its worker threads runs
+ * at the current time, before the timers */
+int64_t pciemu_sim_clock_ns(PCIEMUSim *sim);
+
+void pciemu_sim_advance(PCIEMUSim *sim, int64_t ns);
+
+bool pciemu_sim_step(PCIEMUSim *sim);
+
+/* expiry of the next device timer (virtual clock), the current time if work
+ * is pending, -1 if none is */
+int64_t pciemu_sim_deadline_ns(PCIEMUSim *sim);
+
+/* driver-like API : program the transfer descriptor and ring the doorbell.
+ * The wait functions run the clock until the engine is idle and return the
+ * error register (PCIEMU_HW_DMA_ERR_*), or -1 if it never completes.
+ */
+void pciemu_sim_dma_submit(PCIEMUSim *sim, uint64_t cmd, uint64_t src,
+                           uint64_t dst, uint64_t len);
+
+/* same, with the descriptor pushed into a slot of the descriptor window
+ * (modulo PCIEMU_HW_DESC_SLOT_CNT) and the descriptor doorbell */
+void pciemu_sim_dma_submit_desc(PCIEMUSim *sim, unsigned int slot,
+                                uint64_t cmd, uint64_t src, uint64_t dst,
+                                uint64_t len);
+
+int pciemu_sim_dma_wait(PCIEMUSim *sim);
+
+int pciemu_sim_dma_to_device(PCIEMUSim *sim, uint64_t bus_addr, uint64_t ofs,
+                             uint64_t len);
+
+int pciemu_sim_dma_from_device(PCIEMUSim *sim, uint64_t ofs, uint64_t bus_addr,
+                               uint64_t len);
+
+/* 2D transfer of rows of len bytes in a direction (PCIEMU_HW_DMA_DIRECTION_*),
+ * src and dst being the first row and stepping by their strides */
+int pciemu_sim_dma_2d(PCIEMUSim *sim, uint64_t cmd, uint64_t src,
+                      uint64_t src_stride, uint64_t dst, uint64_t dst_stride,
+                      uint64_t len, uint32_t rows);
+
+/* multicast command (PCIEMU_HW_DMA_CMD_MULTICAST*) of len bytes from src to
+ * the cnt destinations listed in the table at the bus address table */
+int pciemu_sim_dma_multicast(PCIEMUSim *sim, uint64_t cmd, uint64_t src,
+                             uint64_t table, uint32_t cnt, uint64_t len);
+
+/* parity command (PCIEMU_HW_DMA_CMD_XOR or _PQ) of the cnt sources of len
+ * bytes listed in the table at the bus address table, q_dst only used by PQ */
+int pciemu_sim_dma_raid(PCIEMUSim *sim, uint64_t cmd, uint64_t table,
+                        uint32_t cnt, uint64_t p_dst, uint64_t q_dst,
+                        uint64_t len);
+
+/* scan command (PCIEMU_HW_DMA_CMD_SCAN*) of len bytes at src for the key
+ * described by ctrl (PCIEMU_HW_DMA_SCAN_CTRL_*), writing up to max match
+ * offsets at dst and returning the number of matches in cnt */
+int pciemu_sim_dma_scan(PCIEMUSim *sim, uint64_t cmd, uint64_t src,
+                        uint64_t len, const void *key, uint32_t ctrl,
+                        uint64_t dst, uint64_t max, uint64_t *cnt);
+
+/* sort command (PCIEMU_HW_DMA_CMD_SORT) of the keys of len bytes at src,
+ * as described by ctrl (PCIEMU_HW_DMA_SORT_CTRL_*), into dst and idx_dst */
+int pciemu_sim_dma_sort(PCIEMUSim *sim, uint64_t src, uint64_t dst,
+                        uint64_t idx_dst, uint64_t len, uint32_t ctrl);
+
+/* atomic command (PCIEMU_HW_DMA_CMD_ATOMIC_*) on a 4 or 8-byte operand of the
+ * guest memory, returning the original value of the operand in old */
+int pciemu_sim_atomic(PCIEMUSim *sim, uint64_t cmd, uint64_t bus_addr,
+                      unsigned int size, uint64_t operand, uint64_t compare,
+                      uint64_t *old);
+
+#endif /* PCIEMU_SIM_H */
@@ -0,0 +1,35 @@
+# bench.mk - Makefile helper file for microbenchmarks
+#
+# A benchmark <target> includes the source file it measures (hw_src), so it
+# is linked with the other hw sources, the common sources and the fakes.
+# The results (JSON lines) are printed and kept in $(bench_results).
+#
+# Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+#
+# SPDX-License-Identifier: GPL-2.0
+#
+
+common := $(root_dir)/makefiles/common.mk
+include $(common)
+
+common_obj := $(addprefix $(build_dir)/, $(common_src:.c=.o))
+target_obj := $(addprefix $(build_dir)/, $(addsuffix .o, $(targets)))
+
+bench_results ?= $(build_dir)/bench.json
+
+# the common objects come first, so they override the weak fakes
+.SECONDEXPANSION:
+$(targets): %: $(build_dir)/%.o $(common_obj) \
+	       $$(filter-out $(build_dir)/hw/$$(*:pciemu_%=%).o, $(hw_obj)) \
+	       $(fakes_obj)
+	@printf $(KBLUE)"---- linking $@ ----\n"$(KNORM)
+	$(CC) -o $@ $^ $(ldflags)
+
+.PHONY : bench
+bench: $(targets)
+	@printf $(KBLUE)"---- running benchmarks ----\n"$(KNORM)
+	@rm -f $(bench_results)
+	@for f in $^ ; do ./$$f > $(build_dir)/$$f.json || exit 1 ; \
+		tee -a $(bench_results) < $(build_dir)/$$f.json ; done
+
+-include $(common_obj:.o=.d) $(target_obj:.o=.d)
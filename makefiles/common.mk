@@ -0,0 +1,64 @@
+# common.mk - Makefile helper file for building the device model on the host
+#
+# Shared by the unit tests, the microbenchmarks, the simulator and the
+# replayer: the hw sources, the QEMU fakes, the flags and the rules building
+# them. The including Makefile sets targets, fakes_src and its own flags
+# before including this file, so that all stays the default goal.
+#
+# Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+#
+# SPDX-License-Identifier: GPL-2.0
+#
+
+KBLUE := "\e[1;36m"
+KNORM := "\e[0m"
+
+# for including the source files
+src_hw_pciemu_dir := $(src_dir)/hw/pciemu
+
+hw_src := arbiter.c crypto.c dma.c hostnuma.c irq.c latency.c mapcache.c \
+	  mmio.c pipeline.c rx.c sort.c stats.c trace.c
+
+hw_obj := $(addprefix $(build_dir)/hw/, $(hw_src:.c=.o))
+fakes_obj := $(addprefix $(fakes_build_dir)/, $(fakes_src:.c=.o))
+
+includes += $(addprefix -I, $(include_dir)\
+			    $(include_dir)/hw\
+			    $(test_include_dir)\
+			    $(qemu_include_dir)\
+			    $(qemu_build_include_dir)\
+			    $(src_hw_pciemu_dir))
+
+# _GNU_SOURCE as in the QEMU build (CPU affinity of hostnuma.c)
+cflags += -Wall -Werror -O2 -D_GNU_SOURCE $(includes) \
+	  `pkg-config --cflags glib-2.0`
+
+# glib as in the QEMU build (buffers of the sort worker)
+ldflags += `pkg-config --libs glib-2.0`
+
+.PHONY : all
+all: $(targets)
+
+$(build_dir)/hw/%.o : $(src_hw_pciemu_dir)/%.c Makefile | $(build_dir)
+	@printf $(KBLUE)"---- building $@ ----\n"$(KNORM)
+	$(CC) $(cflags) -c -MMD -MP $< -o $@
+
+$(fakes_build_dir)/%.o : $(fakes_dir)/%.c Makefile | $(build_dir)
+	@printf $(KBLUE)"---- building $@ ----\n"$(KNORM)
+	$(CC) $(cflags) -c -MMD -MP $< -o $@
+
+$(build_dir)/%.o : %.c Makefile | $(build_dir)
+	@printf $(KBLUE)"---- building $< $@ ----\n"$(KNORM)
+	$(CC) $(cflags) -c -MMD -MP $< -o $@
+
+$(build_dir):
+	@printf $(KBLUE)"---- create $@ dir ----\n"$(KNORM)
+	mkdir -p $(build_dir)/hw $(fakes_build_dir)
+
+.PHONY : clean
+clean:
+	@printf $(KBLUE)"---- cleaning ----\n"$(KNORM)
+	rm -rf $(targets)
+	rm -rf $(build_dir)
+
+-include $(hw_obj:.o=.d) $(fakes_obj:.o=.d)
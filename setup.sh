@@ -24,6 +24,7 @@ ln -s $REPOSITORY_DIR/src/hw/$REPOSITORY_NAME/ $REPOSITORY_DIR/qemu/hw/misc/
 # Create symbolic link to the pciemu_hw.h include file
 # This will avoid changing the meson files to be able to find this include
 ln -s $REPOSITORY_DIR/include/hw/pciemu_hw.h $REPOSITORY_DIR/src/hw/$REPOSITORY_NAME/pciemu_hw.h
+ln -s $REPOSITORY_DIR/include/hw/pciemu_trace.h $REPOSITORY_DIR/src/hw/$REPOSITORY_NAME/pciemu_trace.h
 
 # Configure QEMU
 cd qemu
@@ -0,0 +1,421 @@
+/* arbiter.c - Arbitration between the DMA submission queues
+ *
+ * The queues post descriptors in their slots of the descriptor window, and
+ * the arbiter hands them to the DMA engine one command at a time, each time
+ * the engine goes IDLE (see pciemu_hw.h) :
+ *   - strict priority between the classes
+ *   - weighted round-robin between the queues of a class
+ *   - token bucket per queue, capping its rate in bytes per second
+ *
+ * When every queue with descriptors is out of tokens, a timer wakes the
+ * arbiter up once the first of them can go again.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/lockable.h"
+#include "qemu/log.h"
+#include "qemu/timer.h"
+#include "arbiter.h"
+#include "dma.h"
+#include "irq.h"
+#include "pciemu.h"
+#include "stats.h"
+
+/* -----------------------------------------------------------------------------
+ *  Private
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_arbiter_queue_reset: Queue reset (no limit, class 0, weight 1)
+ *
+ * @queue: queue being reset
+ */
+static void pciemu_arbiter_queue_reset(DMAQueue *queue)
+{
+    queue->prio = 0;
+    queue->weight = 1;
+    queue->rate = 0;
+    queue->burst = 0;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->credit = 1;
+    queue->tokens = 0;
+    queue->refill_ns = 0;
+    queue->done_cnt = 0;
+    queue->error = PCIEMU_HW_DMA_ERR_NONE;
+}
+
+/**
+ * pciemu_arbiter_refill: Put the tokens earned since the last refill back
+ *
+ * @queue: queue being refilled
+ * @now: current time (virtual clock)
+ */
+static void pciemu_arbiter_refill(DMAQueue *queue, int64_t now)
+{
+    if (queue->rate) {
+        queue->tokens += (double)queue->rate * (now - queue->refill_ns) /
+                         NANOSECONDS_PER_SECOND;
+        queue->tokens = MIN(queue->tokens, (double)queue->burst);
+    }
+    queue->refill_ns = now;
+}
+
+/**
+ * pciemu_arbiter_fill: Fill the token bucket
+ *
+ * @queue: queue being filled
+ */
+static void pciemu_arbiter_fill(DMAQueue *queue)
+{
+    queue->tokens = queue->burst;
+    queue->refill_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+}
+
+/**
+ * pciemu_arbiter_pending: Whether the queue has descriptors to fetch
+ *
+ * @queue: queue being checked
+ */
+static inline bool pciemu_arbiter_pending(DMAQueue *queue)
+{
+    return queue->head != queue->tail;
+}
+
+/**
+ * pciemu_arbiter_ready: Whether the queue can be picked (refilled first)
+ *
+ * @queue: queue being checked
+ */
+static inline bool pciemu_arbiter_ready(DMAQueue *queue)
+{
+    return pciemu_arbiter_pending(queue) && queue->tokens >= 0;
+}
+
+/**
+ * pciemu_arbiter_pick: Pick the queue of the next command
+ *
+ * The classes are served in order. Inside a class, the queue at the
+ * round-robin position is picked weight times in a row (credit), unless it
+ * is not ready. Once every ready queue of the class used its credit, a new
+ * round starts.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ *
+ * Returns the queue, or -1 if no queue is ready.
+ */
+static int pciemu_arbiter_pick(PCIEMUDevice *dev)
+{
+    DMAArbiter *arb = &dev->dma.arbiter;
+    for (unsigned int prio = 0; prio < PCIEMU_HW_DMA_QUEUE_PRIO_CNT; ++prio) {
+        for (int round = 0; round < 2; ++round) {
+            bool ready = false;
+            for (unsigned int i = 0; i < PCIEMU_HW_DMA_QUEUE_CNT; ++i) {
+                unsigned int q = (arb->rr[prio] + i) % PCIEMU_HW_DMA_QUEUE_CNT;
+                DMAQueue *queue = &arb->queues[q];
+                if (queue->prio != prio || !pciemu_arbiter_ready(queue))
+                    continue;
+                ready = true;
+                if (!queue->credit)
+                    continue;
+                /* stay on the queue until its credit is used */
+                if (!--queue->credit)
+                    arb->rr[prio] = (q + 1) % PCIEMU_HW_DMA_QUEUE_CNT;
+                else
+                    arb->rr[prio] = q;
+                return q;
+            }
+            if (!ready)
+                break;
+            for (unsigned int q = 0; q < PCIEMU_HW_DMA_QUEUE_CNT; ++q) {
+                if (arb->queues[q].prio == prio)
+                    arb->queues[q].credit = arb->queues[q].weight;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * pciemu_arbiter_throttle: Wake up when a throttled queue can go again
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @now: current time (virtual clock)
+ */
+static void pciemu_arbiter_throttle(PCIEMUDevice *dev, int64_t now)
+{
+    DMAArbiter *arb = &dev->dma.arbiter;
+    int64_t wake = INT64_MAX;
+    for (unsigned int q = 0; q < PCIEMU_HW_DMA_QUEUE_CNT; ++q) {
+        DMAQueue *queue = &arb->queues[q];
+        if (!pciemu_arbiter_pending(queue) || queue->tokens >= 0)
+            continue;
+        double ns = -queue->tokens * NANOSECONDS_PER_SECOND / queue->rate;
+        wake = MIN(wake, now + (int64_t)ns + 1);
+    }
+    if (wake != INT64_MAX)
+        timer_mod_ns(&arb->timer, wake);
+}
+
+/**
+ * pciemu_arbiter_dispatch: Hand the next descriptor of a queue to the engine
+ *
+ * The descriptor is copied out of its slot (HEAD moves forward), its length
+ * (times its rows for a 2D transfer, its destinations for a multicast or
+ * its sources for a parity) taken out of the token bucket and it is
+ * executed, its doorbell being the TAIL write that posted it.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @q: queue picked
+ */
+static void pciemu_arbiter_dispatch(PCIEMUDevice *dev, unsigned int q)
+{
+    DMAArbiter *arb = &dev->dma.arbiter;
+    DMAQueue *queue = &arb->queues[q];
+    uint8_t desc[PCIEMU_HW_DESC_SLOT_SIZE];
+    unsigned int slot = q * PCIEMU_HW_DMA_QUEUE_SIZE +
+                        queue->head % PCIEMU_HW_DMA_QUEUE_SIZE;
+    memcpy(desc, dev->dma.desc + slot * PCIEMU_HW_DESC_SLOT_SIZE,
+           sizeof(desc));
+    pciemu_stats_doorbell(dev, queue->doorbell_ns[queue->head %
+                                                  PCIEMU_HW_DMA_QUEUE_SIZE]);
+    qatomic_set(&queue->head, queue->head + 1);
+    if (queue->rate) {
+        uint64_t len = ldq_le_p(desc + PCIEMU_HW_DESC_LEN);
+        dma_cmd_t cmd = ldq_le_p(desc + PCIEMU_HW_DESC_CMD);
+        switch (cmd & PCIEMU_HW_DMA_CMD_MASK) {
+        case PCIEMU_HW_DMA_CMD_MULTICAST:
+        case PCIEMU_HW_DMA_CMD_MULTICAST_FROM_DEVICE:
+            len *= ldl_le_p(desc + PCIEMU_HW_DESC_MCAST_CNT);
+            break;
+        case PCIEMU_HW_DMA_CMD_XOR:
+        case PCIEMU_HW_DMA_CMD_PQ:
+            len *= ldl_le_p(desc + PCIEMU_HW_DESC_RAID_SRC_CNT);
+            break;
+        default:
+            if (cmd & PCIEMU_HW_DMA_CMD_FLAG_2D)
+                len *= ldl_le_p(desc + PCIEMU_HW_DESC_2D_ROWS);
+        }
+        queue->tokens -= len;
+    }
+    arb->active = q;
+    pciemu_dma_desc_execute(dev, desc);
+}
+
+/**
+ * pciemu_arbiter_tail_update: Descriptors posted by the driver
+ *
+ * The new slots are stamped with the arrival of the write (handed to the
+ * stats by pciemu_mmio_write), as they may wait here for a while.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @queue: queue being posted to
+ * @tail: new tail (free running)
+ */
+static void pciemu_arbiter_tail_update(PCIEMUDevice *dev, DMAQueue *queue,
+                                       uint32_t tail)
+{
+    if ((uint32_t)(tail - queue->head) > PCIEMU_HW_DMA_QUEUE_SIZE) {
+        qemu_log_mask(LOG_GUEST_ERROR, "queue tail (%u) beyond its ring\n",
+                      tail);
+        return;
+    }
+    uint32_t posted = tail - queue->tail; /* huge if TAIL moved backwards */
+    for (uint32_t i = 0; posted <= PCIEMU_HW_DMA_QUEUE_SIZE && i < posted; ++i)
+        queue->doorbell_ns[(queue->tail + i) % PCIEMU_HW_DMA_QUEUE_SIZE] =
+            dev->stats.doorbell_ns;
+    queue->tail = tail;
+    pciemu_arbiter_kick(dev);
+}
+
+/**
+ * pciemu_arbiter_timer_cb: A throttled queue got tokens back
+ *
+ * @opaque: opaque pointer that points to instantiated object
+ */
+static void pciemu_arbiter_timer_cb(void *opaque)
+{
+    PCIEMUDevice *dev = opaque;
+    QEMU_LOCK_GUARD(&dev->lock);
+    pciemu_arbiter_kick(dev);
+}
+
+/* -----------------------------------------------------------------------------
+ *  Public
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_arbiter_read: Read a register of a queue
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @addr: address inside BAR0 (PCIEMU_HW_BAR0_DMA_QUEUE_START to _END)
+ */
+uint64_t pciemu_arbiter_read(PCIEMUDevice *dev, hwaddr addr)
+{
+    hwaddr ofs = addr - PCIEMU_HW_BAR0_DMA_QUEUE_START;
+    DMAQueue *queue =
+        &dev->dma.arbiter.queues[ofs / PCIEMU_HW_BAR0_DMA_QUEUE_STRIDE];
+    switch (ofs % PCIEMU_HW_BAR0_DMA_QUEUE_STRIDE) {
+    case PCIEMU_HW_DMA_QUEUE_TAIL:
+        return queue->tail;
+    case PCIEMU_HW_DMA_QUEUE_HEAD:
+        return qatomic_read(&queue->head);
+    case PCIEMU_HW_DMA_QUEUE_PRIO:
+        return queue->prio;
+    case PCIEMU_HW_DMA_QUEUE_WEIGHT:
+        return queue->weight;
+    case PCIEMU_HW_DMA_QUEUE_RATE:
+        return queue->rate;
+    case PCIEMU_HW_DMA_QUEUE_BURST:
+        return queue->burst;
+    case PCIEMU_HW_DMA_QUEUE_DONE_CNT:
+        return qatomic_read(&queue->done_cnt);
+    case PCIEMU_HW_DMA_QUEUE_ERROR:
+        return qatomic_read(&queue->error);
+    }
+    return ~0ULL;
+}
+
+/**
+ * pciemu_arbiter_write: Write a register of a queue
+ *
+ * The weight is clamped to [1, PCIEMU_HW_DMA_QUEUE_WEIGHT_MAX]. Changing the
+ * rate or the burst fills the token bucket.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @addr: address inside BAR0 (PCIEMU_HW_BAR0_DMA_QUEUE_START to _END)
+ * @val: value to be written
+ */
+void pciemu_arbiter_write(PCIEMUDevice *dev, hwaddr addr, uint64_t val)
+{
+    hwaddr ofs = addr - PCIEMU_HW_BAR0_DMA_QUEUE_START;
+    DMAQueue *queue =
+        &dev->dma.arbiter.queues[ofs / PCIEMU_HW_BAR0_DMA_QUEUE_STRIDE];
+    switch (ofs % PCIEMU_HW_BAR0_DMA_QUEUE_STRIDE) {
+    case PCIEMU_HW_DMA_QUEUE_TAIL:
+        pciemu_arbiter_tail_update(dev, queue, val);
+        break;
+    case PCIEMU_HW_DMA_QUEUE_PRIO:
+        if (val >= PCIEMU_HW_DMA_QUEUE_PRIO_CNT) {
+            qemu_log_mask(LOG_GUEST_ERROR, "invalid queue prio (%" PRIu64 ")\n",
+                          val);
+            break;
+        }
+        queue->prio = val;
+        queue->credit = queue->weight;
+        break;
+    case PCIEMU_HW_DMA_QUEUE_WEIGHT:
+        queue->weight = MAX(1, MIN(val, PCIEMU_HW_DMA_QUEUE_WEIGHT_MAX));
+        queue->credit = queue->weight;
+        break;
+    case PCIEMU_HW_DMA_QUEUE_RATE:
+        queue->rate = val;
+        pciemu_arbiter_fill(queue);
+        pciemu_arbiter_kick(dev);
+        break;
+    case PCIEMU_HW_DMA_QUEUE_BURST:
+        queue->burst = val;
+        pciemu_arbiter_fill(queue);
+        pciemu_arbiter_kick(dev);
+        break;
+    }
+}
+
+/**
+ * pciemu_arbiter_kick: Hand the next command to the engine, if IDLE
+ *
+ * A command may complete before being handed over returns (e.g. no
+ * latency), which kicks the arbiter again : that kick is run by the loop
+ * below instead of recursing.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_arbiter_kick(PCIEMUDevice *dev)
+{
+    DMAArbiter *arb = &dev->dma.arbiter;
+    if (arb->kicking) {
+        arb->kick_again = true;
+        return;
+    }
+    arb->kicking = true;
+    do {
+        arb->kick_again = false;
+        if (arb->active >= 0 ||
+            qatomic_read(&dev->dma.status) != DMA_STATUS_IDLE)
+            break;
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        for (unsigned int q = 0; q < PCIEMU_HW_DMA_QUEUE_CNT; ++q)
+            pciemu_arbiter_refill(&arb->queues[q], now);
+        int q = pciemu_arbiter_pick(dev);
+        if (q < 0) {
+            pciemu_arbiter_throttle(dev, now);
+            break;
+        }
+        pciemu_arbiter_dispatch(dev, q);
+    } while (arb->kick_again);
+    arb->kicking = false;
+}
+
+/**
+ * pciemu_arbiter_complete: Completion of a command
+ *
+ * Called by the engine once IDLE again. The command may not come from a
+ * queue (registers or descriptor doorbell). A queue left with few commands
+ * in flight reports the QUEUE cause, even for commands without IRQ.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @err: error of the command (PCIEMU_HW_DMA_ERR_*)
+ */
+void pciemu_arbiter_complete(PCIEMUDevice *dev, uint64_t err)
+{
+    DMAArbiter *arb = &dev->dma.arbiter;
+    if (arb->active >= 0) {
+        DMAQueue *queue = &arb->queues[arb->active];
+        qatomic_set(&queue->error, err);
+        qatomic_set(&queue->done_cnt, queue->done_cnt + 1);
+        arb->active = -1;
+        if (queue->tail - queue->done_cnt <= dev->irq.queue_threshold)
+            pciemu_irq_event(dev, PCIEMU_HW_IRQ_CAUSE_QUEUE);
+    }
+    pciemu_arbiter_kick(dev);
+}
+
+/**
+ * pciemu_arbiter_reset: Arbiter reset
+ *
+ * Drops the descriptors posted and restores the default configuration.
+ *
+ * @dev: Instance of PCIEMUDevice object being reset
+ */
+void pciemu_arbiter_reset(PCIEMUDevice *dev)
+{
+    DMAArbiter *arb = &dev->dma.arbiter;
+    timer_del(&arb->timer);
+    for (unsigned int q = 0; q < PCIEMU_HW_DMA_QUEUE_CNT; ++q)
+        pciemu_arbiter_queue_reset(&arb->queues[q]);
+    for (unsigned int prio = 0; prio < PCIEMU_HW_DMA_QUEUE_PRIO_CNT; ++prio)
+        arb->rr[prio] = 0;
+    arb->active = -1;
+    arb->kicking = false;
+    arb->kick_again = false;
+}
+
+/**
+ * pciemu_arbiter_init: Arbiter initialization
+ *
+ * @dev: Instance of PCIEMUDevice object being initialized
+ */
+void pciemu_arbiter_init(PCIEMUDevice *dev)
+{
+    timer_init_ns(&dev->dma.arbiter.timer, QEMU_CLOCK_VIRTUAL,
+                  pciemu_arbiter_timer_cb, dev);
+    pciemu_arbiter_reset(dev);
+}
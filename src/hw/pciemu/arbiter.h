@@ -0,0 +1,61 @@
+/* arbiter.h - Arbitration between the DMA submission queues
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_ARBITER_H
+#define PCIEMU_ARBITER_H
+
+#include "qemu/osdep.h"
+#include "hw/pci/pci.h"
+#include "qemu/timer.h"
+#include "pciemu_hw.h"
+
+/* forward declaration (defined in pciemu.h) to avoid circular reference */
+typedef struct PCIEMUDevice PCIEMUDevice;
+
+/* submission queue (registers described in pciemu_hw.h) */
+typedef struct DMAQueue {
+    /* configuration */
+    uint32_t prio;
+    uint32_t weight;
+    uint64_t rate;    /* bytes per second, 0 = unlimited */
+    uint64_t burst;   /* size of the token bucket in bytes */
+    /* state */
+    uint32_t head;    /* descriptors fetched */
+    uint32_t tail;    /* descriptors posted */
+    uint32_t credit;  /* commands left in the current round */
+    double tokens;    /* bytes, negative after a command bigger than them */
+    int64_t refill_ns;
+    uint32_t done_cnt;
+    uint64_t error;
+    /* arrival of the TAIL write posting each slot, for the latency stats */
+    int64_t doorbell_ns[PCIEMU_HW_DMA_QUEUE_SIZE];
+} DMAQueue;
+
+typedef struct DMAArbiter {
+    DMAQueue queues[PCIEMU_HW_DMA_QUEUE_CNT];
+    unsigned int rr[PCIEMU_HW_DMA_QUEUE_PRIO_CNT]; /* next queue per class */
+    int active;       /* queue of the command executing, -1 if none */
+    bool kicking;
+    bool kick_again;
+    QEMUTimer timer;  /* fires when a throttled queue gets tokens back */
+} DMAArbiter;
+
+
+uint64_t pciemu_arbiter_read(PCIEMUDevice *dev, hwaddr addr);
+
+void pciemu_arbiter_write(PCIEMUDevice *dev, hwaddr addr, uint64_t val);
+
+void pciemu_arbiter_kick(PCIEMUDevice *dev);
+
+void pciemu_arbiter_complete(PCIEMUDevice *dev, uint64_t err);
+
+void pciemu_arbiter_reset(PCIEMUDevice *dev);
+
+void pciemu_arbiter_init(PCIEMUDevice *dev);
+
+#endif /* PCIEMU_ARBITER_H */
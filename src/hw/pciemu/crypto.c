@@ -0,0 +1,504 @@
+/* crypto.c - Encryption of the DMA commands (AES-XTS)
+ *
+ * The ENCRYPT and DECRYPT commands run AES-XTS (IEEE 1619) on the data going
+ * through the bounce buffer, sector by sector, with the keys of the key slots
+ * (see pciemu_hw.h).
+ *
+ * On x86 hosts with AES-NI, the transform is done by the AES instructions,
+ * the keys being expanded once when loaded, and four blocks are encrypted at
+ * a time to hide the latency of the rounds. Otherwise, each key slot holds a
+ * cipher of the QEMU crypto API (i.e. of the crypto library QEMU is built
+ * with).
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/log.h"
+#include "crypto/cipher.h"
+#include "crypto.h"
+#include "dma.h"
+#include "pciemu.h"
+
+/* -----------------------------------------------------------------------------
+ *  Private
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_crypto_load_qcrypto: Load a key into a slot (QEMU crypto API)
+ *
+ * Returns whether the key could be loaded.
+ *
+ * @ks: key slot being loaded (empty)
+ * @key: key 1 then key 2 of XTS
+ * @size: size of the key (PCIEMU_HW_CRYPTO_KEY_XTS_*)
+ */
+static bool pciemu_crypto_load_qcrypto(CryptoKeySlot *ks, const uint8_t *key,
+                                       uint32_t size)
+{
+    QCryptoCipherAlgorithm alg = size == PCIEMU_HW_CRYPTO_KEY_XTS_128
+                                     ? QCRYPTO_CIPHER_ALG_AES_128
+                                     : QCRYPTO_CIPHER_ALG_AES_256;
+    ks->cipher =
+        qcrypto_cipher_new(alg, QCRYPTO_CIPHER_MODE_XTS, key, size, NULL);
+    return ks->cipher != NULL;
+}
+
+/**
+ * pciemu_crypto_xts_qcrypto: Encrypt or decrypt sectors (QEMU crypto API)
+ *
+ * Returns 0, or -1 if the crypto library failed.
+ *
+ * @ks: key slot (loaded)
+ * @sector: number of the first sector (tweak)
+ * @sector_size: size of a sector in bytes
+ * @buf: data, encrypted or decrypted in place
+ * @len: length of the data (multiple of sector_size)
+ * @encrypt: encrypt if true, decrypt otherwise
+ */
+static int pciemu_crypto_xts_qcrypto(CryptoKeySlot *ks, uint64_t sector,
+                                     uint32_t sector_size, uint8_t *buf,
+                                     size_t len, bool encrypt)
+{
+    uint8_t iv[PCIEMU_CRYPTO_BLOCK_SIZE] = { 0 };
+    for (size_t ofs = 0; ofs < len; ofs += sector_size, ++sector) {
+        stq_le_p(iv, sector);
+        if (qcrypto_cipher_setiv(ks->cipher, iv, sizeof(iv), NULL) < 0)
+            return -1;
+        int ret = encrypt ? qcrypto_cipher_encrypt(ks->cipher, buf + ofs,
+                                                   buf + ofs, sector_size,
+                                                   NULL)
+                          : qcrypto_cipher_decrypt(ks->cipher, buf + ofs,
+                                                   buf + ofs, sector_size,
+                                                   NULL);
+        if (ret < 0)
+            return -1;
+    }
+    return 0;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include <immintrin.h>
+
+/**
+ * pciemu_crypto_expand_step: Next round key of the key expansion (AES-NI)
+ *
+ * @key: round key 1 (AES-128) or 2 (AES-256) positions before
+ * @gen: output of aeskeygenassist, with the word to add broadcast
+ */
+static inline __attribute__((target("aes"))) __m128i
+pciemu_crypto_expand_step(__m128i key, __m128i gen)
+{
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, gen);
+}
+
+/* aeskeygenassist needs the round constant as an immediate */
+#define PCIEMU_CRYPTO_EXPAND_128(rk, i, rcon)                               \
+    rk[i] = pciemu_crypto_expand_step(                                      \
+        rk[i - 1],                                                          \
+        _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i - 1], rcon), 0xff))
+#define PCIEMU_CRYPTO_EXPAND_256(rk, i, rcon)                               \
+    rk[i] = pciemu_crypto_expand_step(                                      \
+        rk[i - 2],                                                          \
+        _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i - 1], rcon), 0xff))
+#define PCIEMU_CRYPTO_EXPAND_256_ODD(rk, i)                                 \
+    rk[i] = pciemu_crypto_expand_step(                                      \
+        rk[i - 2],                                                          \
+        _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i - 1], 0), 0xaa))
+
+/**
+ * pciemu_crypto_expand_aesni: AES key expansion (AES-NI)
+ *
+ * Returns the number of rounds.
+ *
+ * @rk: round keys (encryption)
+ * @key: AES key
+ * @len: length of the key in bytes (16 or 32)
+ */
+static __attribute__((target("aes"))) unsigned int
+pciemu_crypto_expand_aesni(__m128i *rk, const uint8_t *key, size_t len)
+{
+    rk[0] = _mm_loadu_si128((const __m128i *)key);
+    if (len == 16) {
+        PCIEMU_CRYPTO_EXPAND_128(rk, 1, 0x01);
+        PCIEMU_CRYPTO_EXPAND_128(rk, 2, 0x02);
+        PCIEMU_CRYPTO_EXPAND_128(rk, 3, 0x04);
+        PCIEMU_CRYPTO_EXPAND_128(rk, 4, 0x08);
+        PCIEMU_CRYPTO_EXPAND_128(rk, 5, 0x10);
+        PCIEMU_CRYPTO_EXPAND_128(rk, 6, 0x20);
+        PCIEMU_CRYPTO_EXPAND_128(rk, 7, 0x40);
+        PCIEMU_CRYPTO_EXPAND_128(rk, 8, 0x80);
+        PCIEMU_CRYPTO_EXPAND_128(rk, 9, 0x1b);
+        PCIEMU_CRYPTO_EXPAND_128(rk, 10, 0x36);
+        return 10;
+    }
+    rk[1] = _mm_loadu_si128((const __m128i *)(key + 16));
+    PCIEMU_CRYPTO_EXPAND_256(rk, 2, 0x01);
+    PCIEMU_CRYPTO_EXPAND_256_ODD(rk, 3);
+    PCIEMU_CRYPTO_EXPAND_256(rk, 4, 0x02);
+    PCIEMU_CRYPTO_EXPAND_256_ODD(rk, 5);
+    PCIEMU_CRYPTO_EXPAND_256(rk, 6, 0x04);
+    PCIEMU_CRYPTO_EXPAND_256_ODD(rk, 7);
+    PCIEMU_CRYPTO_EXPAND_256(rk, 8, 0x08);
+    PCIEMU_CRYPTO_EXPAND_256_ODD(rk, 9);
+    PCIEMU_CRYPTO_EXPAND_256(rk, 10, 0x10);
+    PCIEMU_CRYPTO_EXPAND_256_ODD(rk, 11);
+    PCIEMU_CRYPTO_EXPAND_256(rk, 12, 0x20);
+    PCIEMU_CRYPTO_EXPAND_256_ODD(rk, 13);
+    PCIEMU_CRYPTO_EXPAND_256(rk, 14, 0x40);
+    return 14;
+}
+
+/**
+ * pciemu_crypto_load_aesni: Load a key into a slot (AES-NI)
+ *
+ * The decryption round keys are the encryption ones in reverse order, run
+ * through InvMixColumns (aesimc) but for the first and last ones.
+ * Returns whether the key could be loaded (always).
+ *
+ * @ks: key slot being loaded (empty)
+ * @key: key 1 then key 2 of XTS
+ * @size: size of the key (PCIEMU_HW_CRYPTO_KEY_XTS_*)
+ */
+static __attribute__((target("aes"))) bool
+pciemu_crypto_load_aesni(CryptoKeySlot *ks, const uint8_t *key, uint32_t size)
+{
+    __m128i enc[PCIEMU_CRYPTO_ROUND_KEY_CNT];
+    __m128i tweak[PCIEMU_CRYPTO_ROUND_KEY_CNT];
+    unsigned int nr = pciemu_crypto_expand_aesni(enc, key, size / 2);
+    pciemu_crypto_expand_aesni(tweak, key + size / 2, size / 2);
+    for (unsigned int i = 0; i <= nr; ++i) {
+        __m128i dec = (i == 0 || i == nr) ? enc[nr - i]
+                                          : _mm_aesimc_si128(enc[nr - i]);
+        _mm_storeu_si128((__m128i *)ks->enc[i], enc[i]);
+        _mm_storeu_si128((__m128i *)ks->dec[i], dec);
+        _mm_storeu_si128((__m128i *)ks->tweak[i], tweak[i]);
+    }
+    ks->rounds = nr;
+    return true;
+}
+
+/**
+ * pciemu_crypto_mul_alpha: Next tweak (multiplication by x in GF(2^128))
+ *
+ * The tweak is a 128-bit little endian number : it is shifted left by one
+ * bit, the bit 63 carried into bit 64 and the bit 127 reduced into 0x87.
+ *
+ * @t: tweak
+ */
+static inline __attribute__((target("aes"))) __m128i
+pciemu_crypto_mul_alpha(__m128i t)
+{
+    /* words 3 and 1 (holding the bits 127 and 63) moved to words 0 and 2 */
+    __m128i carry = _mm_srai_epi32(_mm_shuffle_epi32(t, 0x5f), 31);
+    carry = _mm_and_si128(carry, _mm_set_epi32(0, 1, 0, 0x87));
+    return _mm_xor_si128(_mm_slli_epi64(t, 1), carry);
+}
+
+/**
+ * pciemu_crypto_xts_aesni: Encrypt or decrypt sectors (AES-NI)
+ *
+ * Same as pciemu_crypto_xts_qcrypto, four blocks at a time.
+ */
+static __attribute__((target("aes"))) int
+pciemu_crypto_xts_aesni(CryptoKeySlot *ks, uint64_t sector,
+                        uint32_t sector_size, uint8_t *buf, size_t len,
+                        bool encrypt)
+{
+    __m128i rk[PCIEMU_CRYPTO_ROUND_KEY_CNT];
+    __m128i tk[PCIEMU_CRYPTO_ROUND_KEY_CNT];
+    unsigned int nr = ks->rounds;
+    for (unsigned int i = 0; i <= nr; ++i) {
+        rk[i] = _mm_loadu_si128(
+            (const __m128i *)(encrypt ? ks->enc[i] : ks->dec[i]));
+        tk[i] = _mm_loadu_si128((const __m128i *)ks->tweak[i]);
+    }
+    for (size_t ofs = 0; ofs < len; ofs += sector_size, ++sector) {
+        /* the first tweak is the sector number encrypted with key 2 */
+        __m128i t = _mm_xor_si128(_mm_set_epi64x(0, sector), tk[0]);
+        for (unsigned int i = 1; i < nr; ++i)
+            t = _mm_aesenc_si128(t, tk[i]);
+        t = _mm_aesenclast_si128(t, tk[nr]);
+        __m128i *p = (__m128i *)(buf + ofs);
+        size_t n = sector_size / PCIEMU_CRYPTO_BLOCK_SIZE;
+        size_t j = 0;
+        for (; j + 4 <= n; j += 4) {
+            __m128i t0 = t;
+            __m128i t1 = pciemu_crypto_mul_alpha(t0);
+            __m128i t2 = pciemu_crypto_mul_alpha(t1);
+            __m128i t3 = pciemu_crypto_mul_alpha(t2);
+            t = pciemu_crypto_mul_alpha(t3);
+            __m128i b0 = _mm_xor_si128(_mm_loadu_si128(p + j), t0);
+            __m128i b1 = _mm_xor_si128(_mm_loadu_si128(p + j + 1), t1);
+            __m128i b2 = _mm_xor_si128(_mm_loadu_si128(p + j + 2), t2);
+            __m128i b3 = _mm_xor_si128(_mm_loadu_si128(p + j + 3), t3);
+            b0 = _mm_xor_si128(b0, rk[0]);
+            b1 = _mm_xor_si128(b1, rk[0]);
+            b2 = _mm_xor_si128(b2, rk[0]);
+            b3 = _mm_xor_si128(b3, rk[0]);
+            if (encrypt) {
+                for (unsigned int i = 1; i < nr; ++i) {
+                    b0 = _mm_aesenc_si128(b0, rk[i]);
+                    b1 = _mm_aesenc_si128(b1, rk[i]);
+                    b2 = _mm_aesenc_si128(b2, rk[i]);
+                    b3 = _mm_aesenc_si128(b3, rk[i]);
+                }
+                b0 = _mm_aesenclast_si128(b0, rk[nr]);
+                b1 = _mm_aesenclast_si128(b1, rk[nr]);
+                b2 = _mm_aesenclast_si128(b2, rk[nr]);
+                b3 = _mm_aesenclast_si128(b3, rk[nr]);
+            } else {
+                for (unsigned int i = 1; i < nr; ++i) {
+                    b0 = _mm_aesdec_si128(b0, rk[i]);
+                    b1 = _mm_aesdec_si128(b1, rk[i]);
+                    b2 = _mm_aesdec_si128(b2, rk[i]);
+                    b3 = _mm_aesdec_si128(b3, rk[i]);
+                }
+                b0 = _mm_aesdeclast_si128(b0, rk[nr]);
+                b1 = _mm_aesdeclast_si128(b1, rk[nr]);
+                b2 = _mm_aesdeclast_si128(b2, rk[nr]);
+                b3 = _mm_aesdeclast_si128(b3, rk[nr]);
+            }
+            _mm_storeu_si128(p + j, _mm_xor_si128(b0, t0));
+            _mm_storeu_si128(p + j + 1, _mm_xor_si128(b1, t1));
+            _mm_storeu_si128(p + j + 2, _mm_xor_si128(b2, t2));
+            _mm_storeu_si128(p + j + 3, _mm_xor_si128(b3, t3));
+        }
+        /* sectors are a multiple of 4 blocks, but for the unit tests */
+        for (; j < n; ++j) {
+            __m128i b = _mm_xor_si128(_mm_loadu_si128(p + j), t);
+            b = _mm_xor_si128(b, rk[0]);
+            for (unsigned int i = 1; i < nr; ++i)
+                b = encrypt ? _mm_aesenc_si128(b, rk[i])
+                            : _mm_aesdec_si128(b, rk[i]);
+            b = encrypt ? _mm_aesenclast_si128(b, rk[nr])
+                        : _mm_aesdeclast_si128(b, rk[nr]);
+            _mm_storeu_si128(p + j, _mm_xor_si128(b, t));
+            t = pciemu_crypto_mul_alpha(t);
+        }
+    }
+    return 0;
+}
+#endif /* CONFIG_AVX2_OPT */
+
+/* kernels, selected in pciemu_crypto_init according to the host CPU */
+static bool (*pciemu_crypto_load)(CryptoKeySlot *, const uint8_t *,
+                                  uint32_t) = pciemu_crypto_load_qcrypto;
+static int (*pciemu_crypto_xts_sectors)(CryptoKeySlot *, uint64_t, uint32_t,
+                                        uint8_t *, size_t,
+                                        bool) = pciemu_crypto_xts_qcrypto;
+
+/**
+ * pciemu_crypto_select_kernels: Use the AES instructions if possible
+ */
+static void pciemu_crypto_select_kernels(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (__builtin_cpu_supports("aes")) {
+        pciemu_crypto_load = pciemu_crypto_load_aesni;
+        pciemu_crypto_xts_sectors = pciemu_crypto_xts_aesni;
+    }
+#endif
+}
+
+/**
+ * pciemu_crypto_key_clear: Empty a key slot
+ *
+ * @ks: key slot being emptied
+ */
+static void pciemu_crypto_key_clear(CryptoKeySlot *ks)
+{
+    qcrypto_cipher_free(ks->cipher);
+    ks->cipher = NULL;
+    ks->size = PCIEMU_HW_CRYPTO_KEY_CLEAR;
+    ks->rounds = 0;
+    memset(ks->enc, 0, sizeof(ks->enc));
+    memset(ks->dec, 0, sizeof(ks->dec));
+    memset(ks->tweak, 0, sizeof(ks->tweak));
+}
+
+/**
+ * pciemu_crypto_key_data: Stage bytes of the key written to KEY_DATA
+ *
+ * @crypto: key slots of the device
+ * @ofs: offset of the write inside KEY_DATA
+ * @val: value written (little endian in KEY_DATA)
+ * @size: write size in bytes (4 or 8)
+ */
+static void pciemu_crypto_key_data(DMACrypto *crypto, hwaddr ofs,
+                                   uint64_t val, unsigned int size)
+{
+    if (ofs + size > sizeof(crypto->key)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "key data write (%u bytes at 0x%" PRIx64
+                      ") beyond the key\n", size, ofs);
+        return;
+    }
+    if (size == sizeof(uint32_t))
+        stl_le_p(crypto->key + ofs, val);
+    else
+        stq_le_p(crypto->key + ofs, val);
+}
+
+/**
+ * pciemu_crypto_key_ctrl: Load the key written to KEY_DATA, or clear the slot
+ *
+ * KEY_DATA is wiped in any case.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @ctrl: size of the key (PCIEMU_HW_CRYPTO_KEY_XTS_*) or KEY_CLEAR
+ */
+static void pciemu_crypto_key_ctrl(PCIEMUDevice *dev, uint64_t ctrl)
+{
+    DMACrypto *crypto = &dev->dma.crypto;
+    CryptoKeySlot *ks = &crypto->slots[crypto->slot];
+    switch (ctrl) {
+    case PCIEMU_HW_CRYPTO_KEY_CLEAR:
+        pciemu_crypto_key_clear(ks);
+        break;
+    case PCIEMU_HW_CRYPTO_KEY_XTS_128:
+    case PCIEMU_HW_CRYPTO_KEY_XTS_256:
+        pciemu_crypto_key_clear(ks);
+        if (!pciemu_crypto_load(ks, crypto->key, ctrl)) {
+            qemu_log_mask(LOG_GUEST_ERROR, "key slot %u not loaded\n",
+                          crypto->slot);
+            break;
+        }
+        ks->size = ctrl;
+        break;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR, "invalid key ctrl (%" PRIu64 ")\n",
+                      ctrl);
+        break;
+    }
+    memset(crypto->key, 0, sizeof(crypto->key));
+}
+
+/* -----------------------------------------------------------------------------
+ *  Public
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_crypto_read: Read a register of the key slot window
+ *
+ * The keys cannot be read back.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @addr: address inside BAR0 (PCIEMU_HW_BAR0_CRYPTO_KEY_SLOT to _DATA_END)
+ */
+uint64_t pciemu_crypto_read(PCIEMUDevice *dev, hwaddr addr)
+{
+    DMACrypto *crypto = &dev->dma.crypto;
+    switch (addr) {
+    case PCIEMU_HW_BAR0_CRYPTO_KEY_SLOT:
+        return crypto->slot;
+    case PCIEMU_HW_BAR0_CRYPTO_KEY_CTRL:
+        return crypto->slots[crypto->slot].size;
+    case PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_START ...
+        PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_END:
+        return 0;
+    }
+    return ~0ULL;
+}
+
+/**
+ * pciemu_crypto_write: Write a register of the key slot window
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @addr: address inside BAR0 (PCIEMU_HW_BAR0_CRYPTO_KEY_SLOT to _DATA_END)
+ * @val: value to be written
+ * @size: write size in bytes (4 or 8)
+ */
+void pciemu_crypto_write(PCIEMUDevice *dev, hwaddr addr, uint64_t val,
+                         unsigned int size)
+{
+    DMACrypto *crypto = &dev->dma.crypto;
+    switch (addr) {
+    case PCIEMU_HW_BAR0_CRYPTO_KEY_SLOT:
+        if (val >= PCIEMU_HW_CRYPTO_KEY_SLOT_CNT) {
+            qemu_log_mask(LOG_GUEST_ERROR, "invalid key slot (%" PRIu64 ")\n",
+                          val);
+            break;
+        }
+        crypto->slot = val;
+        break;
+    case PCIEMU_HW_BAR0_CRYPTO_KEY_CTRL:
+        pciemu_crypto_key_ctrl(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_START ...
+        PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_END:
+        pciemu_crypto_key_data(crypto,
+                               addr - PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_START,
+                               val, size);
+        break;
+    }
+}
+
+/**
+ * pciemu_crypto_key_loaded: Whether a key slot holds a key
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @slot: key slot (any value)
+ */
+bool pciemu_crypto_key_loaded(PCIEMUDevice *dev, uint32_t slot)
+{
+    return slot < PCIEMU_HW_CRYPTO_KEY_SLOT_CNT &&
+           dev->dma.crypto.slots[slot].size != PCIEMU_HW_CRYPTO_KEY_CLEAR;
+}
+
+/**
+ * pciemu_crypto_xts: Encrypt or decrypt sectors in place
+ *
+ * Returns 0, or -1 if the crypto library failed.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @slot: key slot (loaded, see pciemu_crypto_key_loaded)
+ * @sector: number of the first sector (tweak)
+ * @sector_size: size of a sector in bytes (multiple of 16)
+ * @buf: data, encrypted or decrypted in place
+ * @len: length of the data (multiple of sector_size)
+ * @encrypt: encrypt if true, decrypt otherwise
+ */
+int pciemu_crypto_xts(PCIEMUDevice *dev, uint32_t slot, uint64_t sector,
+                      uint32_t sector_size, uint8_t *buf, size_t len,
+                      bool encrypt)
+{
+    return pciemu_crypto_xts_sectors(&dev->dma.crypto.slots[slot], sector,
+                                     sector_size, buf, len, encrypt);
+}
+
+/**
+ * pciemu_crypto_reset: Key slots reset
+ *
+ * Empties every key slot.
+ *
+ * @dev: Instance of PCIEMUDevice object being reset
+ */
+void pciemu_crypto_reset(PCIEMUDevice *dev)
+{
+    DMACrypto *crypto = &dev->dma.crypto;
+    for (unsigned int i = 0; i < PCIEMU_HW_CRYPTO_KEY_SLOT_CNT; ++i)
+        pciemu_crypto_key_clear(&crypto->slots[i]);
+    crypto->slot = 0;
+    memset(crypto->key, 0, sizeof(crypto->key));
+}
+
+/**
+ * pciemu_crypto_init: Key slots initialization
+ *
+ * @dev: Instance of PCIEMUDevice object being initialized
+ */
+void pciemu_crypto_init(PCIEMUDevice *dev)
+{
+    pciemu_crypto_select_kernels();
+    pciemu_crypto_reset(dev);
+}
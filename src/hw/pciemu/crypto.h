@@ -0,0 +1,58 @@
+/* crypto.h - Encryption of the DMA commands (AES-XTS)
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_CRYPTO_H
+#define PCIEMU_CRYPTO_H
+
+#include "qemu/osdep.h"
+#include "hw/pci/pci.h"
+#include "crypto/cipher.h"
+#include "pciemu_hw.h"
+
+/* AES block size and number of round keys of AES-256 (14 rounds) */
+#define PCIEMU_CRYPTO_BLOCK_SIZE 16
+#define PCIEMU_CRYPTO_ROUND_KEY_CNT 15
+
+/* forward declaration (defined in pciemu.h) to avoid circular reference */
+typedef struct PCIEMUDevice PCIEMUDevice;
+
+/* key loaded in a key slot */
+typedef struct CryptoKeySlot {
+    uint32_t size; /* PCIEMU_HW_CRYPTO_KEY_XTS_*, or _CLEAR if empty */
+    /* AES-NI : round keys of the data key (both ways) and of the tweak key */
+    unsigned int rounds;
+    uint8_t enc[PCIEMU_CRYPTO_ROUND_KEY_CNT][PCIEMU_CRYPTO_BLOCK_SIZE];
+    uint8_t dec[PCIEMU_CRYPTO_ROUND_KEY_CNT][PCIEMU_CRYPTO_BLOCK_SIZE];
+    uint8_t tweak[PCIEMU_CRYPTO_ROUND_KEY_CNT][PCIEMU_CRYPTO_BLOCK_SIZE];
+    /* otherwise : cipher of the QEMU crypto API */
+    QCryptoCipher *cipher;
+} CryptoKeySlot;
+
+typedef struct DMACrypto {
+    CryptoKeySlot slots[PCIEMU_HW_CRYPTO_KEY_SLOT_CNT];
+    uint32_t slot; /* slot selected by PCIEMU_HW_BAR0_CRYPTO_KEY_SLOT */
+    uint8_t key[PCIEMU_HW_CRYPTO_KEY_DATA_SIZE]; /* KEY_DATA, not loaded yet */
+} DMACrypto;
+
+
+uint64_t pciemu_crypto_read(PCIEMUDevice *dev, hwaddr addr);
+
+void pciemu_crypto_write(PCIEMUDevice *dev, hwaddr addr, uint64_t val,
+                         unsigned int size);
+
+bool pciemu_crypto_key_loaded(PCIEMUDevice *dev, uint32_t slot);
+
+int pciemu_crypto_xts(PCIEMUDevice *dev, uint32_t slot, uint64_t sector,
+                      uint32_t sector_size, uint8_t *buf, size_t len,
+                      bool encrypt);
+
+void pciemu_crypto_reset(PCIEMUDevice *dev);
+
+void pciemu_crypto_init(PCIEMUDevice *dev);
+
+#endif /* PCIEMU_CRYPTO_H */
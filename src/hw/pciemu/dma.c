@@ -7,10 +7,27 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "qemu/lockable.h"
 #include "qemu/log.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "arbiter.h"
+#include "crypto.h"
 #include "dma.h"
 #include "irq.h"
+#include "mapcache.h"
+#include "mmio.h"
 #include "pciemu.h"
+#include "pipeline.h"
+#include "sort.h"
+#include "stats.h"
+#include "trace.h"
+
+#ifdef CONFIG_AVX2_OPT
+#include <immintrin.h>
+#endif
 
 /* -----------------------------------------------------------------------------
  *  Private
@@ -38,12 +55,1300 @@ static inline dma_addr_t pciemu_dma_addr_mask(PCIEMUDevice *dev,
 /**
  * pciemu_dma_inside_device_boundaries: Check if addr is inside boundaries
  *
+ * @dev: Instance of PCIEMUDevice object being used
  * @addr: Address to be checked (address in device address space)
  */
-static inline bool pciemu_dma_inside_device_boundaries(dma_addr_t addr)
+static inline bool pciemu_dma_inside_device_boundaries(PCIEMUDevice *dev,
+                                                       dma_addr_t addr)
 {
     return (PCIEMU_HW_DMA_AREA_START <= addr &&
-            addr <= PCIEMU_HW_DMA_AREA_START + PCIEMU_HW_DMA_AREA_SIZE);
+            addr <= PCIEMU_HW_DMA_AREA_START + dev->dma.buff_size);
+}
+
+/**
+ * pciemu_dma_inside_device_length: Check if a transfer fits inside the area
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @ofs: offset of the transfer inside the DMA memory area (already checked)
+ * @len: length of the transfer in bytes
+ */
+static inline bool pciemu_dma_inside_device_length(PCIEMUDevice *dev,
+                                                   dma_addr_t ofs,
+                                                   dma_size_t len)
+{
+    return len <= dev->dma.buff_size - ofs;
+}
+
+/**
+ * pciemu_dma_memdev_init: Use the memory backend as device memory
+ *
+ * The memory backend (e.g. memory-backend-file) is mapped by QEMU, so the
+ * device memory is simply its RAM pointer. Thus, a file backend allows
+ * device memory bigger than the host RAM, going through the host page cache,
+ * and preloaded with a dataset without any copy.
+ *
+ * @dev: Instance of PCIEMUDevice object being initialized
+ * @errp: pointer to indicate errors
+ */
+static bool pciemu_dma_memdev_init(PCIEMUDevice *dev, Error **errp)
+{
+    DMAEngine *dma = &dev->dma;
+    if (host_memory_backend_is_mapped(dma->memdev)) {
+        error_setg(errp, "memdev is already in use");
+        return false;
+    }
+    MemoryRegion *mr = host_memory_backend_get_memory(dma->memdev);
+    host_memory_backend_set_mapped(dma->memdev, true);
+    dma->buff = memory_region_get_ram_ptr(mr);
+    dma->buff_size = memory_region_size(mr);
+    return true;
+}
+
+/**
+ * pciemu_dma_pattern_word: Word i of the pattern (host endianness)
+ *
+ * @type: pattern being generated (PCIEMU_HW_DMA_PATTERN_*)
+ * @seed: seed of the pattern
+ * @i: index of the 32-bit word inside the pattern
+ */
+static inline uint32_t pciemu_dma_pattern_word(dma_pattern_t type,
+                                               uint32_t seed, uint64_t i)
+{
+    if (type == PCIEMU_HW_DMA_PATTERN_COUNTER)
+        return seed + (uint32_t)i;
+    uint32_t x = seed + (uint32_t)i * PCIEMU_HW_DMA_PATTERN_HASH_STEP;
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+/**
+ * pciemu_dma_pattern_check: Check the pattern of a pattern command
+ *
+ * Returns the error of the command (PCIEMU_HW_DMA_ERR_*).
+ *
+ * @type: pattern register (PCIEMU_HW_DMA_PATTERN_* if valid)
+ */
+static dma_err_t pciemu_dma_pattern_check(dma_pattern_t type)
+{
+    if (type != PCIEMU_HW_DMA_PATTERN_COUNTER &&
+        type != PCIEMU_HW_DMA_PATTERN_HASH) {
+        qemu_log_mask(LOG_GUEST_ERROR, "unknown DMA pattern (%u)\n", type);
+        return PCIEMU_HW_DMA_ERR_PATTERN;
+    }
+    return PCIEMU_HW_DMA_ERR_NONE;
+}
+
+/**
+ * pciemu_dma_pattern_mismatch: Offset of the first mismatching byte of a word
+ *
+ * @word: index of the word inside the buffer
+ * @diff: xor between the word read and the expected one (host endianness)
+ */
+static inline size_t pciemu_dma_pattern_mismatch(size_t word, uint32_t diff)
+{
+    return word * sizeof(uint32_t) + ctz32(diff) / 8;
+}
+
+/**
+ * pciemu_dma_pattern_fill_scalar: Fill a buffer with the pattern
+ *
+ * @buf: buffer being filled
+ * @n: number of 32-bit words in buf
+ * @type: pattern being generated (PCIEMU_HW_DMA_PATTERN_*)
+ * @seed: seed of the pattern
+ * @idx: index of the first word of buf inside the pattern
+ */
+static void pciemu_dma_pattern_fill_scalar(uint32_t *buf, size_t n,
+                                           dma_pattern_t type, uint32_t seed,
+                                           uint64_t idx)
+{
+    for (size_t i = 0; i < n; ++i)
+        buf[i] = cpu_to_le32(pciemu_dma_pattern_word(type, seed, idx + i));
+}
+
+/**
+ * pciemu_dma_pattern_verify_scalar: Check a buffer against the pattern
+ *
+ * Returns the number of mismatching words.
+ *
+ * @buf: buffer being checked
+ * @n: number of 32-bit words in buf
+ * @type: pattern being checked (PCIEMU_HW_DMA_PATTERN_*)
+ * @seed: seed of the pattern
+ * @idx: index of the first word of buf inside the pattern
+ * @first: offset of the first mismatching byte (untouched if none)
+ */
+static uint64_t pciemu_dma_pattern_verify_scalar(const uint32_t *buf, size_t n,
+                                                 dma_pattern_t type,
+                                                 uint32_t seed, uint64_t idx,
+                                                 size_t *first)
+{
+    uint64_t cnt = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t diff = le32_to_cpu(buf[i]) ^
+                        pciemu_dma_pattern_word(type, seed, idx + i);
+        if (!diff)
+            continue;
+        if (!cnt)
+            *first = pciemu_dma_pattern_mismatch(i, diff);
+        cnt++;
+    }
+    return cnt;
+}
+
+#ifdef CONFIG_AVX2_OPT
+/**
+ * pciemu_dma_pattern_words_avx2: 8 consecutive words of the pattern
+ *
+ * @type: pattern being generated (PCIEMU_HW_DMA_PATTERN_*)
+ * @seed: seed of the pattern (broadcast)
+ * @idx: indexes of the words inside the pattern
+ */
+static inline __attribute__((target("avx2"))) __m256i
+pciemu_dma_pattern_words_avx2(dma_pattern_t type, __m256i seed, __m256i idx)
+{
+    if (type == PCIEMU_HW_DMA_PATTERN_COUNTER)
+        return _mm256_add_epi32(seed, idx);
+    __m256i step = _mm256_set1_epi32(PCIEMU_HW_DMA_PATTERN_HASH_STEP);
+    __m256i x = _mm256_add_epi32(seed, _mm256_mullo_epi32(idx, step));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x7feb352d));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x846ca68b));
+    return _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+}
+
+/**
+ * pciemu_dma_pattern_fill_avx2: Fill a buffer with the pattern (AVX2)
+ *
+ * Same as pciemu_dma_pattern_fill_scalar, 8 words at a time.
+ */
+static __attribute__((target("avx2"))) void
+pciemu_dma_pattern_fill_avx2(uint32_t *buf, size_t n, dma_pattern_t type,
+                             uint32_t seed, uint64_t idx)
+{
+    __m256i vseed = _mm256_set1_epi32(seed);
+    __m256i vidx = _mm256_add_epi32(_mm256_set1_epi32((uint32_t)idx),
+                                    _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256i vinc = _mm256_set1_epi32(8);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i w = pciemu_dma_pattern_words_avx2(type, vseed, vidx);
+        _mm256_storeu_si256((__m256i *)(buf + i), w);
+        vidx = _mm256_add_epi32(vidx, vinc);
+    }
+    pciemu_dma_pattern_fill_scalar(buf + i, n - i, type, seed, idx + i);
+}
+
+/**
+ * pciemu_dma_pattern_verify_avx2: Check a buffer against the pattern (AVX2)
+ *
+ * Same as pciemu_dma_pattern_verify_scalar, 8 words at a time.
+ */
+static __attribute__((target("avx2"))) uint64_t
+pciemu_dma_pattern_verify_avx2(const uint32_t *buf, size_t n,
+                               dma_pattern_t type, uint32_t seed, uint64_t idx,
+                               size_t *first)
+{
+    __m256i vseed = _mm256_set1_epi32(seed);
+    __m256i vidx = _mm256_add_epi32(_mm256_set1_epi32((uint32_t)idx),
+                                    _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256i vinc = _mm256_set1_epi32(8);
+    uint64_t cnt = 0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i w = pciemu_dma_pattern_words_avx2(type, vseed, vidx);
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i eq = _mm256_cmpeq_epi32(v, w);
+        unsigned int ne = ~_mm256_movemask_ps(_mm256_castsi256_ps(eq)) & 0xff;
+        vidx = _mm256_add_epi32(vidx, vinc);
+        if (!ne)
+            continue;
+        if (!cnt) {
+            size_t j = i + ctz32(ne);
+            uint32_t diff = buf[j] ^
+                            pciemu_dma_pattern_word(type, seed, idx + j);
+            *first = pciemu_dma_pattern_mismatch(j, diff);
+        }
+        cnt += ctpop32(ne);
+    }
+    size_t tail_first = 0;
+    uint64_t tail_cnt = pciemu_dma_pattern_verify_scalar(
+        buf + i, n - i, type, seed, idx + i, &tail_first);
+    if (tail_cnt && !cnt)
+        *first = i * sizeof(uint32_t) + tail_first;
+    return cnt + tail_cnt;
+}
+#endif /* CONFIG_AVX2_OPT */
+
+/* pattern kernels, selected in pciemu_dma_init according to the host CPU */
+static void (*pciemu_dma_pattern_fill)(
+    uint32_t *, size_t, dma_pattern_t, uint32_t,
+    uint64_t) = pciemu_dma_pattern_fill_scalar;
+static uint64_t (*pciemu_dma_pattern_verify)(
+    const uint32_t *, size_t, dma_pattern_t, uint32_t, uint64_t,
+    size_t *) = pciemu_dma_pattern_verify_scalar;
+
+/**
+ * pciemu_dma_pattern_select_kernels: Use the vectorized kernels if possible
+ */
+static void pciemu_dma_pattern_select_kernels(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (__builtin_cpu_supports("avx2")) {
+        pciemu_dma_pattern_fill = pciemu_dma_pattern_fill_avx2;
+        pciemu_dma_pattern_verify = pciemu_dma_pattern_verify_avx2;
+    }
+#endif
+}
+
+/**
+ * pciemu_dma_execute_pattern_fill: Write the pattern to the host
+ *
+ * The pattern is generated chunk by chunk into the bounce buffer, which is
+ * then written to the bus address txdesc.dst.
+ * Returns the error of the operation (PCIEMU_HW_DMA_ERR_*).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static dma_err_t pciemu_dma_execute_pattern_fill(PCIEMUDevice *dev)
+{
+    DMAEngine *dma = &dev->dma;
+    dma_addr_t dst = pciemu_dma_addr_mask(dev, dma->config.txdesc.dst);
+    dma_size_t len = dma->config.txdesc.len;
+    dma_err_t ret = pciemu_dma_pattern_check(dma->config.pattern);
+    if (ret != PCIEMU_HW_DMA_ERR_NONE)
+        return ret;
+    for (dma_size_t ofs = 0; ofs < len; ofs += PCIEMU_DMA_BOUNCE_SIZE) {
+        dma_size_t chunk = MIN(len - ofs, PCIEMU_DMA_BOUNCE_SIZE);
+        pciemu_dma_pattern_fill(dma->bounce,
+                                DIV_ROUND_UP(chunk, sizeof(uint32_t)),
+                                dma->config.pattern, dma->config.seed,
+                                ofs / sizeof(uint32_t));
+        int err = pciemu_dma_rw(dev, dst + ofs, dma->bounce, chunk,
+                                DMA_DIRECTION_FROM_DEVICE);
+        if (err) {
+            qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_write err=%d\n", err);
+            return PCIEMU_HW_DMA_ERR_BUS;
+        }
+    }
+    return PCIEMU_HW_DMA_ERR_NONE;
+}
+
+/**
+ * pciemu_dma_execute_pattern_verify: Check the host buffer against the pattern
+ *
+ * The bus address txdesc.src is read chunk by chunk into the bounce buffer
+ * and checked against the pattern. A trailing partial word only compares
+ * the bytes that were transferred. An unknown pattern reads nothing and
+ * fails with PCIEMU_HW_DMA_ERR_PATTERN.
+ * Returns the error of the operation (PCIEMU_HW_DMA_ERR_*).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static dma_err_t pciemu_dma_execute_pattern_verify(PCIEMUDevice *dev)
+{
+    DMAEngine *dma = &dev->dma;
+    DMAPatternResult *res = &dma->pattern;
+    dma_addr_t src = pciemu_dma_addr_mask(dev, dma->config.txdesc.src);
+    dma_size_t len = dma->config.txdesc.len;
+    res->err_cnt = 0;
+    res->err_ofs = PCIEMU_HW_DMA_PATTERN_ERR_OFS_NONE;
+    dma_err_t ret = pciemu_dma_pattern_check(dma->config.pattern);
+    if (ret != PCIEMU_HW_DMA_ERR_NONE)
+        return ret;
+    for (dma_size_t ofs = 0; ofs < len; ofs += PCIEMU_DMA_BOUNCE_SIZE) {
+        dma_size_t chunk = MIN(len - ofs, PCIEMU_DMA_BOUNCE_SIZE);
+        size_t words = chunk / sizeof(uint32_t);
+        size_t rem = chunk % sizeof(uint32_t);
+        uint64_t idx = ofs / sizeof(uint32_t);
+        size_t first = 0;
+        int err = pciemu_dma_rw(dev, src + ofs, dma->bounce, chunk,
+                                DMA_DIRECTION_TO_DEVICE);
+        if (err) {
+            qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_read err=%d\n", err);
+            return PCIEMU_HW_DMA_ERR_BUS;
+        }
+        uint64_t cnt = pciemu_dma_pattern_verify(
+            dma->bounce, words, dma->config.pattern, dma->config.seed, idx,
+            &first);
+        if (rem) {
+            uint32_t mask = (1U << (rem * 8)) - 1;
+            uint32_t diff = (le32_to_cpu(dma->bounce[words]) ^
+                             pciemu_dma_pattern_word(dma->config.pattern,
+                                                     dma->config.seed,
+                                                     idx + words)) & mask;
+            if (diff && !cnt)
+                first = pciemu_dma_pattern_mismatch(words, diff);
+            cnt += !!diff;
+        }
+        if (cnt && res->err_ofs == PCIEMU_HW_DMA_PATTERN_ERR_OFS_NONE)
+            res->err_ofs = ofs + first;
+        res->err_cnt += cnt;
+    }
+    return PCIEMU_HW_DMA_ERR_NONE;
+}
+
+/**
+ * pciemu_dma_execute_crypto: Encrypt or decrypt from the host to the host
+ *
+ * The bus address txdesc.src is read chunk by chunk into the bounce buffer,
+ * whose sectors are encrypted (or decrypted) in place before being written
+ * to the bus address txdesc.dst. The bounce buffer holds whole sectors.
+ * Returns the error of the operation (PCIEMU_HW_DMA_ERR_*).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @encrypt: encrypt if true, decrypt otherwise
+ */
+static dma_err_t pciemu_dma_execute_crypto(PCIEMUDevice *dev, bool encrypt)
+{
+    DMAEngine *dma = &dev->dma;
+    dma_addr_t src = pciemu_dma_addr_mask(dev, dma->config.txdesc.src);
+    dma_addr_t dst = pciemu_dma_addr_mask(dev, dma->config.txdesc.dst);
+    dma_size_t len = dma->config.txdesc.len;
+    uint32_t sector_size = dma->config.sector_size;
+    if (!is_power_of_2(sector_size) ||
+        sector_size < PCIEMU_HW_CRYPTO_SECTOR_SIZE_MIN ||
+        sector_size > PCIEMU_HW_CRYPTO_SECTOR_SIZE_MAX ||
+        len % sector_size) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "invalid sector size (%u) or len (%" PRIu64 ")\n",
+                      sector_size, len);
+        return PCIEMU_HW_DMA_ERR_CRYPTO;
+    }
+    if (!pciemu_crypto_key_loaded(dev, dma->config.key_slot)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "key slot %u is empty\n",
+                      dma->config.key_slot);
+        return PCIEMU_HW_DMA_ERR_CRYPTO;
+    }
+    for (dma_size_t ofs = 0; ofs < len; ofs += PCIEMU_DMA_BOUNCE_SIZE) {
+        dma_size_t chunk = MIN(len - ofs, PCIEMU_DMA_BOUNCE_SIZE);
+        int err = pciemu_dma_rw(dev, src + ofs, dma->bounce, chunk,
+                                DMA_DIRECTION_TO_DEVICE);
+        if (err) {
+            qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_read err=%d\n", err);
+            return PCIEMU_HW_DMA_ERR_BUS;
+        }
+        if (pciemu_crypto_xts(dev, dma->config.key_slot,
+                              dma->config.sector + ofs / sector_size,
+                              sector_size, (uint8_t *)dma->bounce, chunk,
+                              encrypt)) {
+            qemu_log_mask(LOG_GUEST_ERROR, "xts failed\n");
+            return PCIEMU_HW_DMA_ERR_CRYPTO;
+        }
+        err = pciemu_dma_rw(dev, dst + ofs, dma->bounce, chunk,
+                            DMA_DIRECTION_FROM_DEVICE);
+        if (err) {
+            qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_write err=%d\n", err);
+            return PCIEMU_HW_DMA_ERR_BUS;
+        }
+    }
+    return PCIEMU_HW_DMA_ERR_NONE;
+}
+
+/**
+ * pciemu_dma_atomic_op: New value of the operand of an atomic command
+ *
+ * @cmd: atomic command (PCIEMU_HW_DMA_CMD_ATOMIC_*)
+ * @val: current value of the operand
+ * @operand: value of the ATOMIC_OPERAND register
+ * @compare: value of the ATOMIC_COMPARE register
+ */
+static inline uint64_t pciemu_dma_atomic_op(dma_cmd_t cmd, uint64_t val,
+                                            uint64_t operand, uint64_t compare)
+{
+    switch (cmd) {
+    case PCIEMU_HW_DMA_CMD_ATOMIC_FETCH_ADD:
+        return val + operand;
+    case PCIEMU_HW_DMA_CMD_ATOMIC_CAS:
+        return val == compare ? operand : val;
+    }
+    return operand;
+}
+
+/**
+ * pciemu_dma_execute_atomic: Atomic operation on the host memory
+ *
+ * The operand at the bus address txdesc.dst is mapped rather than copied
+ * into the device, so it is modified with a host atomic instruction, which
+ * the CPUs of the guest observe as a single access. As the operand is little
+ * endian, every operation is done by a compare-and-swap loop. An operand
+ * outside of the guest RAM (e.g. MMIO) is mapped to a bounce buffer, which
+ * is neither read beforehand nor atomic : the operation is rejected then.
+ * The original value is then written to txdesc.src (if not 0) as a regular
+ * DMA.
+ * The mapped operand is not traced, only the write of the original value.
+ * Returns the error of the operation (PCIEMU_HW_DMA_ERR_*).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @cmd: atomic command (PCIEMU_HW_DMA_CMD_ATOMIC_*)
+ */
+static dma_err_t pciemu_dma_execute_atomic(PCIEMUDevice *dev, dma_cmd_t cmd)
+{
+    DMAEngine *dma = &dev->dma;
+    dma_addr_t dst = pciemu_dma_addr_mask(dev, dma->config.txdesc.dst);
+    dma_size_t len = dma->config.txdesc.len;
+    uint64_t operand = dma->config.operand;
+    uint64_t compare = dma->config.compare;
+    uint64_t old;
+    if ((len != sizeof(uint32_t) && len != sizeof(uint64_t)) || dst % len) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "invalid atomic len (%" PRIu64 ") or alignment\n", len);
+        return PCIEMU_HW_DMA_ERR_ATOMIC;
+    }
+    dma_addr_t plen = len;
+    ram_addr_t offset;
+    void *p = pci_dma_map(&dev->pci_dev, dst, &plen,
+                          DMA_DIRECTION_FROM_DEVICE);
+    if (!p || plen < len || !memory_region_from_host(p, &offset)) {
+        if (p)
+            pci_dma_unmap(&dev->pci_dev, p, plen, DMA_DIRECTION_FROM_DEVICE,
+                          0);
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "atomic operand at 0x%" PRIx64 " not in RAM\n", dst);
+        return PCIEMU_HW_DMA_ERR_BUS;
+    }
+    if (len == sizeof(uint32_t)) {
+        uint32_t *p32 = p;
+        uint32_t cur = qatomic_read(p32);
+        uint32_t prev;
+        while ((prev = qatomic_cmpxchg(
+                    p32, cur,
+                    cpu_to_le32(pciemu_dma_atomic_op(cmd, le32_to_cpu(cur),
+                                                     (uint32_t)operand,
+                                                     (uint32_t)compare)))) !=
+               cur)
+            cur = prev;
+        old = le32_to_cpu(cur);
+    } else {
+        uint64_t *p64 = p;
+        uint64_t cur = qatomic_read(p64);
+        uint64_t prev;
+        while ((prev = qatomic_cmpxchg(
+                    p64, cur,
+                    cpu_to_le64(pciemu_dma_atomic_op(cmd, le64_to_cpu(cur),
+                                                     operand, compare)))) !=
+               cur)
+            cur = prev;
+        old = le64_to_cpu(cur);
+    }
+    pci_dma_unmap(&dev->pci_dev, p, plen, DMA_DIRECTION_FROM_DEVICE, len);
+    dma->atomic_result = old;
+    if (!dma->config.txdesc.src)
+        return PCIEMU_HW_DMA_ERR_NONE;
+    uint8_t res[sizeof(uint64_t)];
+    stq_le_p(res, old);
+    int err = pciemu_dma_rw(dev, pciemu_dma_addr_mask(dev,
+                                                      dma->config.txdesc.src),
+                            res, len, DMA_DIRECTION_FROM_DEVICE);
+    if (err) {
+        qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_write err=%d\n", err);
+        return PCIEMU_HW_DMA_ERR_BUS;
+    }
+    return PCIEMU_HW_DMA_ERR_NONE;
+}
+
+/**
+ * pciemu_dma_execute_multicast: Copy of a buffer to several destinations
+ *
+ * The table of destinations is read first. A source on the bus is then read
+ * chunk by chunk into the bounce buffer, each chunk being written to every
+ * destination before the next one is read, so the source is read only once.
+ * A source in the device memory is written from there directly.
+ * Returns the error of the operation (PCIEMU_HW_DMA_ERR_*).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @from_device: source in the DMA memory area instead of on the bus
+ */
+static dma_err_t pciemu_dma_execute_multicast(PCIEMUDevice *dev,
+                                              bool from_device)
+{
+    DMAEngine *dma = &dev->dma;
+    dma_size_t len = dma->config.txdesc.len;
+    uint32_t cnt = dma->config.mcast_cnt;
+    uint64_t table[PCIEMU_HW_DMA_MCAST_DST_MAX];
+    if (!cnt || cnt > PCIEMU_HW_DMA_MCAST_DST_MAX) {
+        qemu_log_mask(LOG_GUEST_ERROR, "multicast count (%u) out of bounds\n",
+                      cnt);
+        return PCIEMU_HW_DMA_ERR_BOUNDS;
+    }
+    if (from_device &&
+        (!pciemu_dma_inside_device_boundaries(dev, dma->config.txdesc.src) ||
+         !pciemu_dma_inside_device_length(
+             dev, dma->config.txdesc.src - PCIEMU_HW_DMA_AREA_START, len))) {
+        qemu_log_mask(LOG_GUEST_ERROR, "src register out of bounds \n");
+        return PCIEMU_HW_DMA_ERR_BOUNDS;
+    }
+    int err = pciemu_dma_rw(dev,
+                            pciemu_dma_addr_mask(dev, dma->config.txdesc.dst),
+                            table, cnt * sizeof(table[0]),
+                            DMA_DIRECTION_TO_DEVICE);
+    if (err) {
+        qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_read err=%d\n", err);
+        return PCIEMU_HW_DMA_ERR_BUS;
+    }
+    for (uint32_t i = 0; i < cnt; ++i)
+        table[i] = pciemu_dma_addr_mask(dev, le64_to_cpu(table[i]));
+    if (from_device) {
+        uint8_t *src = dma->buff + dma->config.txdesc.src -
+                       PCIEMU_HW_DMA_AREA_START;
+        for (uint32_t i = 0; i < cnt; ++i) {
+            err = pciemu_dma_rw(dev, table[i], src, len,
+                                DMA_DIRECTION_FROM_DEVICE);
+            if (err) {
+                qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_write err=%d\n", err);
+                return PCIEMU_HW_DMA_ERR_BUS;
+            }
+        }
+        return PCIEMU_HW_DMA_ERR_NONE;
+    }
+    dma_addr_t src = pciemu_dma_addr_mask(dev, dma->config.txdesc.src);
+    for (dma_size_t ofs = 0; ofs < len; ofs += PCIEMU_DMA_BOUNCE_SIZE) {
+        dma_size_t chunk = MIN(len - ofs, PCIEMU_DMA_BOUNCE_SIZE);
+        err = pciemu_dma_rw(dev, src + ofs, dma->bounce, chunk,
+                            DMA_DIRECTION_TO_DEVICE);
+        if (err) {
+            qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_read err=%d\n", err);
+            return PCIEMU_HW_DMA_ERR_BUS;
+        }
+        for (uint32_t i = 0; i < cnt; ++i) {
+            err = pciemu_dma_rw(dev, table[i] + ofs, dma->bounce, chunk,
+                                DMA_DIRECTION_FROM_DEVICE);
+            if (err) {
+                qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_write err=%d\n", err);
+                return PCIEMU_HW_DMA_ERR_BUS;
+            }
+        }
+    }
+    return PCIEMU_HW_DMA_ERR_NONE;
+}
+
+/**
+ * pciemu_dma_raid_mul2: Multiplication by {02} of 8 bytes over GF(2^8)
+ *
+ * Each byte is shifted left and reduced by the polynomial 0x11d if its
+ * high bit was set.
+ *
+ * @v: 8 bytes, independently of the host endianness
+ */
+static inline uint64_t pciemu_dma_raid_mul2(uint64_t v)
+{
+    uint64_t hi = v & 0x8080808080808080ULL;
+    return ((v << 1) & 0xfefefefefefefefeULL) ^ ((hi >> 7) * 0x1d);
+}
+
+/**
+ * pciemu_dma_raid_xor_scalar: Fold a source into P
+ *
+ * @p: P being computed, P ^= D
+ * @d: source
+ * @n: number of bytes
+ */
+static void pciemu_dma_raid_xor_scalar(uint8_t *p, const uint8_t *d, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        stq_he_p(p + i, ldq_he_p(p + i) ^ ldq_he_p(d + i));
+    for (; i < n; ++i)
+        p[i] ^= d[i];
+}
+
+/**
+ * pciemu_dma_raid_pq_scalar: Fold a source into P and Q
+ *
+ * The sources are folded from the last one to the first one, so that
+ * Q = sum of g^i * D_i (Horner's rule).
+ *
+ * @p: P being computed, P ^= D
+ * @q: Q being computed, Q = Q * {02} ^ D
+ * @d: source
+ * @n: number of bytes
+ */
+static void pciemu_dma_raid_pq_scalar(uint8_t *p, uint8_t *q, const uint8_t *d,
+                                      size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v = ldq_he_p(d + i);
+        stq_he_p(p + i, ldq_he_p(p + i) ^ v);
+        stq_he_p(q + i, pciemu_dma_raid_mul2(ldq_he_p(q + i)) ^ v);
+    }
+    for (; i < n; ++i) {
+        p[i] ^= d[i];
+        q[i] = pciemu_dma_raid_mul2(q[i]) ^ d[i];
+    }
+}
+
+#ifdef CONFIG_AVX2_OPT
+/**
+ * pciemu_dma_raid_xor_avx2: Fold a source into P (AVX2)
+ *
+ * Same as pciemu_dma_raid_xor_scalar, 32 bytes at a time.
+ */
+static __attribute__((target("avx2"))) void
+pciemu_dma_raid_xor_avx2(uint8_t *p, const uint8_t *d, size_t n)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i vp = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i vd = _mm256_loadu_si256((const __m256i *)(d + i));
+        _mm256_storeu_si256((__m256i *)(p + i), _mm256_xor_si256(vp, vd));
+    }
+    pciemu_dma_raid_xor_scalar(p + i, d + i, n - i);
+}
+
+/**
+ * pciemu_dma_raid_pq_avx2: Fold a source into P and Q (AVX2)
+ *
+ * Same as pciemu_dma_raid_pq_scalar, 32 bytes at a time : the bytes whose
+ * high bit is set (negative) get the polynomial after being doubled.
+ */
+static __attribute__((target("avx2"))) void
+pciemu_dma_raid_pq_avx2(uint8_t *p, uint8_t *q, const uint8_t *d, size_t n)
+{
+    __m256i poly = _mm256_set1_epi8(0x1d);
+    __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i vp = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i vq = _mm256_loadu_si256((const __m256i *)(q + i));
+        __m256i vd = _mm256_loadu_si256((const __m256i *)(d + i));
+        __m256i hi = _mm256_cmpgt_epi8(zero, vq);
+        vq = _mm256_add_epi8(vq, vq);
+        vq = _mm256_xor_si256(vq, _mm256_and_si256(hi, poly));
+        _mm256_storeu_si256((__m256i *)(p + i), _mm256_xor_si256(vp, vd));
+        _mm256_storeu_si256((__m256i *)(q + i), _mm256_xor_si256(vq, vd));
+    }
+    pciemu_dma_raid_pq_scalar(p + i, q + i, d + i, n - i);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+/* parity kernels, selected in pciemu_dma_init according to the host CPU */
+static void (*pciemu_dma_raid_xor)(uint8_t *, const uint8_t *,
+                                   size_t) = pciemu_dma_raid_xor_scalar;
+static void (*pciemu_dma_raid_pq)(uint8_t *, uint8_t *, const uint8_t *,
+                                  size_t) = pciemu_dma_raid_pq_scalar;
+
+/**
+ * pciemu_dma_raid_select_kernels: Use the vectorized kernels if possible
+ */
+static void pciemu_dma_raid_select_kernels(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (__builtin_cpu_supports("avx2")) {
+        pciemu_dma_raid_xor = pciemu_dma_raid_xor_avx2;
+        pciemu_dma_raid_pq = pciemu_dma_raid_pq_avx2;
+    }
+#endif
+}
+
+/**
+ * pciemu_dma_execute_raid: Parity of several sources
+ *
+ * The table of sources is read first. The parities are then computed chunk
+ * by chunk in the bounce buffer : the chunk of each source is read next to
+ * P and Q and folded into them, from the last source to the first one,
+ * before P (and Q) are written. Each source is read only once.
+ * Returns the error of the operation (PCIEMU_HW_DMA_ERR_*).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @pq: compute Q too (PCIEMU_HW_DMA_CMD_PQ)
+ */
+static dma_err_t pciemu_dma_execute_raid(PCIEMUDevice *dev, bool pq)
+{
+    DMAEngine *dma = &dev->dma;
+    dma_addr_t p_dst = pciemu_dma_addr_mask(dev, dma->config.txdesc.dst);
+    dma_addr_t q_dst = pciemu_dma_addr_mask(dev, dma->config.q_dst);
+    dma_size_t len = dma->config.txdesc.len;
+    uint32_t cnt = dma->config.raid_cnt;
+    uint64_t table[PCIEMU_HW_DMA_RAID_SRC_MAX];
+    uint8_t *d = (uint8_t *)dma->bounce;
+    uint8_t *p = d + PCIEMU_DMA_RAID_CHUNK;
+    uint8_t *q = p + PCIEMU_DMA_RAID_CHUNK;
+    if (!cnt || cnt > PCIEMU_HW_DMA_RAID_SRC_MAX) {
+        qemu_log_mask(LOG_GUEST_ERROR, "raid count (%u) out of bounds\n",
+                      cnt);
+        return PCIEMU_HW_DMA_ERR_BOUNDS;
+    }
+    int err = pciemu_dma_rw(dev,
+                            pciemu_dma_addr_mask(dev, dma->config.txdesc.src),
+                            table, cnt * sizeof(table[0]),
+                            DMA_DIRECTION_TO_DEVICE);
+    if (err) {
+        qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_read err=%d\n", err);
+        return PCIEMU_HW_DMA_ERR_BUS;
+    }
+    for (uint32_t i = 0; i < cnt; ++i)
+        table[i] = pciemu_dma_addr_mask(dev, le64_to_cpu(table[i]));
+    for (dma_size_t ofs = 0; ofs < len; ofs += PCIEMU_DMA_RAID_CHUNK) {
+        dma_size_t chunk = MIN(len - ofs, PCIEMU_DMA_RAID_CHUNK);
+        memset(p, 0, chunk);
+        memset(q, 0, chunk);
+        for (uint32_t i = cnt; i-- > 0;) {
+            err = pciemu_dma_rw(dev, table[i] + ofs, d, chunk,
+                                DMA_DIRECTION_TO_DEVICE);
+            if (err) {
+                qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_read err=%d\n", err);
+                return PCIEMU_HW_DMA_ERR_BUS;
+            }
+            if (pq)
+                pciemu_dma_raid_pq(p, q, d, chunk);
+            else
+                pciemu_dma_raid_xor(p, d, chunk);
+        }
+        err = pciemu_dma_rw(dev, p_dst + ofs, p, chunk,
+                            DMA_DIRECTION_FROM_DEVICE);
+        if (!err && pq)
+            err = pciemu_dma_rw(dev, q_dst + ofs, q, chunk,
+                                DMA_DIRECTION_FROM_DEVICE);
+        if (err) {
+            qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_write err=%d\n", err);
+            return PCIEMU_HW_DMA_ERR_BUS;
+        }
+    }
+    return PCIEMU_HW_DMA_ERR_NONE;
+}
+
+/* key of a scan command */
+typedef struct DMAScanKey {
+    uint8_t bytes[PCIEMU_HW_DMA_SCAN_KEY_MAX];
+    size_t len;
+    bool set; /* set of delimiters rather than a byte string */
+} DMAScanKey;
+
+/**
+ * pciemu_dma_scan_span: Number of bytes a match spans
+ *
+ * @key: key being searched
+ */
+static inline size_t pciemu_dma_scan_span(const DMAScanKey *key)
+{
+    return key->set ? 1 : key->len;
+}
+
+/**
+ * pciemu_dma_scan_match: Whether a match starts at p
+ *
+ * @p: at least pciemu_dma_scan_span(key) bytes
+ * @key: key being searched
+ */
+static inline bool pciemu_dma_scan_match(const uint8_t *p,
+                                         const DMAScanKey *key)
+{
+    if (key->set)
+        return memchr(key->bytes, *p, key->len);
+    return !memcmp(p, key->bytes, key->len);
+}
+
+/**
+ * pciemu_dma_scan_scalar: Find the next matches of a buffer
+ *
+ * Returns the number of matches found, whose offsets inside buf are written
+ * to hits. The search stops once max matches are found : *from is then
+ * where to resume it.
+ *
+ * @buf: buffer being searched
+ * @n: size of buf, matches must end inside it
+ * @from: offset where the search starts, updated
+ * @key: key being searched
+ * @hits: offsets of the matches
+ * @max: size of hits
+ */
+static size_t pciemu_dma_scan_scalar(const uint8_t *buf, size_t n,
+                                     size_t *from, const DMAScanKey *key,
+                                     uint64_t *hits, size_t max)
+{
+    size_t span = pciemu_dma_scan_span(key);
+    size_t cnt = 0;
+    size_t i = *from;
+    for (; i + span <= n && cnt < max; ++i) {
+        if (pciemu_dma_scan_match(buf + i, key))
+            hits[cnt++] = i;
+    }
+    *from = i;
+    return cnt;
+}
+
+#ifdef CONFIG_AVX2_OPT
+/**
+ * pciemu_dma_scan_avx2: Find the next matches of a buffer (AVX2)
+ *
+ * Same as pciemu_dma_scan_scalar, 32 offsets at a time : a set of
+ * delimiters is compared byte by byte, a byte string by its first and
+ * last bytes, the candidates being checked one by one.
+ */
+static __attribute__((target("avx2"))) size_t
+pciemu_dma_scan_avx2(const uint8_t *buf, size_t n, size_t *from,
+                     const DMAScanKey *key, uint64_t *hits, size_t max)
+{
+    size_t span = pciemu_dma_scan_span(key);
+    __m256i first = _mm256_set1_epi8(key->bytes[0]);
+    __m256i last = _mm256_set1_epi8(key->bytes[span - 1]);
+    size_t cnt = 0;
+    size_t i = *from;
+    for (; cnt < max && i + span - 1 + 32 <= n; i += 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i m;
+        if (key->set) {
+            m = _mm256_setzero_si256();
+            for (size_t k = 0; k < key->len; ++k)
+                m = _mm256_or_si256(
+                    m, _mm256_cmpeq_epi8(b, _mm256_set1_epi8(key->bytes[k])));
+        } else {
+            __m256i e = _mm256_loadu_si256(
+                (const __m256i *)(buf + i + span - 1));
+            m = _mm256_and_si256(_mm256_cmpeq_epi8(b, first),
+                                 _mm256_cmpeq_epi8(e, last));
+        }
+        uint32_t mask = _mm256_movemask_epi8(m);
+        while (mask) {
+            size_t j = i + ctz32(mask);
+            mask &= mask - 1;
+            if (!key->set && !pciemu_dma_scan_match(buf + j, key))
+                continue;
+            hits[cnt++] = j;
+            if (cnt == max) {
+                *from = j + 1;
+                return cnt;
+            }
+        }
+    }
+    *from = i;
+    return cnt + pciemu_dma_scan_scalar(buf, n, from, key, hits + cnt,
+                                        max - cnt);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+/* scan kernel, selected in pciemu_dma_init according to the host CPU */
+static size_t (*pciemu_dma_scan)(const uint8_t *, size_t, size_t *,
+                                 const DMAScanKey *, uint64_t *,
+                                 size_t) = pciemu_dma_scan_scalar;
+
+/**
+ * pciemu_dma_scan_select_kernels: Use the vectorized kernel if possible
+ */
+static void pciemu_dma_scan_select_kernels(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (__builtin_cpu_supports("avx2"))
+        pciemu_dma_scan = pciemu_dma_scan_avx2;
+#endif
+}
+
+/**
+ * pciemu_dma_scan_emit: Write matches to the result buffer
+ *
+ * Every match is counted, but only the first SCAN_MAX ones are written.
+ * Returns the error of pciemu_dma_rw.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @hits: offsets of the matches inside the chunk, overwritten
+ * @cnt: number of matches in hits
+ * @base: offset of the chunk inside the buffer being searched
+ */
+static int pciemu_dma_scan_emit(PCIEMUDevice *dev, uint64_t *hits, size_t cnt,
+                                uint64_t base)
+{
+    DMAEngine *dma = &dev->dma;
+    uint64_t idx = dma->scan_cnt;
+    dma->scan_cnt += cnt;
+    if (idx >= dma->config.scan_max)
+        return 0;
+    cnt = MIN(cnt, dma->config.scan_max - idx);
+    for (size_t i = 0; i < cnt; ++i)
+        hits[i] = cpu_to_le64(hits[i] + base);
+    return pciemu_dma_rw(
+        dev,
+        pciemu_dma_addr_mask(dev, dma->config.txdesc.dst + idx * sizeof(*hits)),
+        hits, cnt * sizeof(*hits), DMA_DIRECTION_FROM_DEVICE);
+}
+
+/**
+ * pciemu_dma_scan_buffer: Search a buffer and write its matches
+ *
+ * Returns the error of pciemu_dma_rw.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @buf: buffer being searched
+ * @n: size of buf
+ * @key: key being searched
+ * @base: offset of buf inside the buffer being searched
+ */
+static int pciemu_dma_scan_buffer(PCIEMUDevice *dev, const uint8_t *buf,
+                                  size_t n, const DMAScanKey *key,
+                                  uint64_t base)
+{
+    uint64_t hits[PCIEMU_DMA_SCAN_BATCH];
+    size_t from = 0;
+    size_t cnt;
+    do {
+        cnt = pciemu_dma_scan(buf, n, &from, key, hits, ARRAY_SIZE(hits));
+        int err = pciemu_dma_scan_emit(dev, hits, cnt, base);
+        if (err)
+            return err;
+    } while (cnt == ARRAY_SIZE(hits));
+    return 0;
+}
+
+/**
+ * pciemu_dma_execute_scan: Search a buffer for a key
+ *
+ * A source in the device memory is searched in place. A source on the bus
+ * is read chunk by chunk into the bounce buffer, the last bytes of a chunk
+ * being kept in front of the next one, so a match crossing two chunks is
+ * found once.
+ * Returns the error of the operation (PCIEMU_HW_DMA_ERR_*).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @from_device: source in the DMA memory area instead of on the bus
+ */
+static dma_err_t pciemu_dma_execute_scan(PCIEMUDevice *dev, bool from_device)
+{
+    DMAEngine *dma = &dev->dma;
+    dma_size_t len = dma->config.txdesc.len;
+    DMAScanKey key = {
+        .len = dma->config.scan_ctrl & PCIEMU_HW_DMA_SCAN_CTRL_LEN_MASK,
+        .set = dma->config.scan_ctrl & PCIEMU_HW_DMA_SCAN_CTRL_SET,
+    };
+    int err;
+    dma->scan_cnt = 0;
+    if (!key.len || key.len > PCIEMU_HW_DMA_SCAN_KEY_MAX) {
+        qemu_log_mask(LOG_GUEST_ERROR, "invalid scan key len (%zu)\n",
+                      key.len);
+        return PCIEMU_HW_DMA_ERR_SCAN;
+    }
+    stq_le_p(key.bytes, dma->config.scan_key[0]);
+    stq_le_p(key.bytes + sizeof(uint64_t), dma->config.scan_key[1]);
+    if (from_device) {
+        dma_addr_t ofs = dma->config.txdesc.src - PCIEMU_HW_DMA_AREA_START;
+        if (!pciemu_dma_inside_device_boundaries(dev, dma->config.txdesc.src) ||
+            !pciemu_dma_inside_device_length(dev, ofs, len)) {
+            qemu_log_mask(LOG_GUEST_ERROR, "src register out of bounds \n");
+            return PCIEMU_HW_DMA_ERR_BOUNDS;
+        }
+        err = pciemu_dma_scan_buffer(dev, dma->buff + ofs, len, &key, 0);
+        if (err) {
+            qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_write err=%d\n", err);
+            return PCIEMU_HW_DMA_ERR_BUS;
+        }
+        return PCIEMU_HW_DMA_ERR_NONE;
+    }
+    dma_addr_t src = pciemu_dma_addr_mask(dev, dma->config.txdesc.src);
+    uint8_t *buf = (uint8_t *)dma->bounce;
+    size_t keep = 0;
+    for (dma_size_t ofs = 0; ofs < len;) {
+        dma_size_t chunk = MIN(len - ofs, PCIEMU_DMA_BOUNCE_SIZE - keep);
+        err = pciemu_dma_rw(dev, src + ofs, buf + keep, chunk,
+                            DMA_DIRECTION_TO_DEVICE);
+        if (err) {
+            qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_read err=%d\n", err);
+            return PCIEMU_HW_DMA_ERR_BUS;
+        }
+        size_t n = keep + chunk;
+        err = pciemu_dma_scan_buffer(dev, buf, n, &key, ofs - keep);
+        if (err) {
+            qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_write err=%d\n", err);
+            return PCIEMU_HW_DMA_ERR_BUS;
+        }
+        ofs += chunk;
+        /* matches starting in the last span - 1 bytes are not complete yet */
+        keep = MIN(pciemu_dma_scan_span(&key) - 1, n);
+        memmove(buf, buf + n - keep, keep);
+    }
+    return PCIEMU_HW_DMA_ERR_NONE;
+}
+
+/**
+ * pciemu_dma_execute_sort: Start sorting keys
+ *
+ * The keys are read, sorted and written back by a worker (see sort.c), and
+ * the command completes once it is done, with PCIEMU_HW_DMA_ERR_BUS if a
+ * transfer failed. An empty array completes right away.
+ * Returns the error of the operation (PCIEMU_HW_DMA_ERR_*).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static dma_err_t pciemu_dma_execute_sort(PCIEMUDevice *dev)
+{
+    DMAEngine *dma = &dev->dma;
+    uint32_t ctrl = dma->config.sort_ctrl;
+    unsigned int key_size = ctrl & PCIEMU_HW_DMA_SORT_CTRL_KEY64
+                                ? sizeof(uint64_t)
+                                : sizeof(uint32_t);
+    dma_size_t len = dma->config.txdesc.len;
+    if (len % key_size || len / key_size > PCIEMU_HW_DMA_SORT_KEY_CNT_MAX) {
+        qemu_log_mask(LOG_GUEST_ERROR, "invalid sort len (%" PRIu64 ")\n",
+                      len);
+        return PCIEMU_HW_DMA_ERR_SORT;
+    }
+    if (!len)
+        return PCIEMU_HW_DMA_ERR_NONE;
+    pciemu_sort_start(dev, pciemu_dma_addr_mask(dev, dma->config.txdesc.src),
+                      pciemu_dma_addr_mask(dev, dma->config.txdesc.dst),
+                      pciemu_dma_addr_mask(dev, dma->config.sort_idx_dst),
+                      len / key_size, key_size,
+                      ctrl & PCIEMU_HW_DMA_SORT_CTRL_IDX);
+    return PCIEMU_HW_DMA_ERR_NONE;
+}
+
+/**
+ * pciemu_dma_complete: Complete the DMA operation
+ *
+ * Called right after the execution, or when the completion timer expires
+ * if the latency model delays the completion. The engine stays EXECUTING
+ * (i.e. rejects new doorbells) until then.
+ * The error is published before the completion counter, so a driver polling
+ * the counter always reads the error of the command that just completed.
+ * The IRQ causes are skipped if the command asked for it (polling drivers).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static void pciemu_dma_complete(PCIEMUDevice *dev)
+{
+    DMAEngine *dma = &dev->dma;
+    qatomic_set(&dma->error, dma->result);
+    qatomic_set(&dma->done_cnt, dma->done_cnt + 1);
+    qatomic_set(&dma->status, DMA_STATUS_IDLE);
+    if (!(dma->config.cmd & PCIEMU_HW_DMA_CMD_FLAG_NO_IRQ))
+        pciemu_irq_event(dev, PCIEMU_HW_IRQ_CAUSE_DMA_DONE |
+                                  (dma->result ? PCIEMU_HW_IRQ_CAUSE_DMA_ERROR
+                                               : 0));
+    /* the engine is free for the next queued command */
+    pciemu_arbiter_complete(dev, dma->result);
+}
+
+/**
+ * pciemu_dma_complete_cb: The completion timer expired
+ *
+ * @opaque: opaque pointer that points to instantiated object
+ */
+static void pciemu_dma_complete_cb(void *opaque)
+{
+    PCIEMUDevice *dev = opaque;
+    QEMU_LOCK_GUARD(&dev->lock);
+    pciemu_dma_complete(dev);
+}
+
+/**
+ * pciemu_dma_complete_schedule: Complete the DMA operation after its latency
+ *
+ * The completion is delayed according to the latency model (if any).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static void pciemu_dma_complete_schedule(PCIEMUDevice *dev)
+{
+    uint64_t delay = pciemu_latency_sample(&dev->dma.latency);
+    if (!delay) {
+        pciemu_dma_complete(dev);
+        return;
+    }
+    timer_mod_ns(&dev->dma.completion,
+                 qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + delay);
+}
+
+/**
+ * pciemu_dma_end: End of a command ending after the doorbell
+ *
+ * Completes the command after its latency, or right away if it failed.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @err: error of the command (PCIEMU_HW_DMA_ERR_*)
+ */
+static void pciemu_dma_end(PCIEMUDevice *dev, dma_err_t err)
+{
+    pciemu_stats_event(dev, STATS_EVENT_DMA_END);
+    dev->dma.result = err;
+    if (err != PCIEMU_HW_DMA_ERR_NONE) {
+        pciemu_dma_complete(dev);
+        return;
+    }
+    pciemu_dma_complete_schedule(dev);
+}
+
+/**
+ * pciemu_dma_stream_step: Move a stream forward through the FIFO
+ *
+ * Chunks are read from the source into the FIFO (device memory) while it has
+ * room, and written from the FIFO to the destination. At most
+ * PCIEMU_DMA_STREAM_BURST bytes are moved per call : the timer is re-armed
+ * until the stream is over, so the main loop keeps running during long
+ * streams. The command completes once, after the last byte is written.
+ *
+ * @opaque: opaque pointer that points to instantiated object
+ */
+static void pciemu_dma_stream_step(void *opaque)
+{
+    PCIEMUDevice *dev = opaque;
+    DMAEngine *dma = &dev->dma;
+    DMAStream *st = &dma->stream;
+    dma_size_t budget = PCIEMU_DMA_STREAM_BURST;
+    int err;
+    QEMU_LOCK_GUARD(&dev->lock);
+    while (st->wr < st->len) {
+        if (!budget) {
+            timer_mod_ns(&st->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+            return;
+        }
+        /* fill the FIFO from the source, only if it has room */
+        dma_size_t room = dma->buff_size - (st->rd - st->wr);
+        if (st->rd < st->len && room) {
+            dma_size_t ofs = st->rd % dma->buff_size;
+            dma_size_t n = MIN(MIN(st->len - st->rd, room),
+                               MIN(dma->buff_size - ofs,
+                                   PCIEMU_DMA_STREAM_CHUNK));
+            err = pciemu_dma_rw(dev, st->src + st->rd, dma->buff + ofs, n,
+                                DMA_DIRECTION_TO_DEVICE);
+            if (err) {
+                qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_read err=%d\n", err);
+                goto fail;
+            }
+            st->rd += n;
+        }
+        /* and drain it to the destination (the FIFO is never empty here) */
+        dma_size_t ofs = st->wr % dma->buff_size;
+        dma_size_t n = MIN(MIN(st->rd - st->wr, dma->buff_size - ofs),
+                           PCIEMU_DMA_STREAM_CHUNK);
+        err = pciemu_dma_rw(dev, st->dst + st->wr, dma->buff + ofs, n,
+                            DMA_DIRECTION_FROM_DEVICE);
+        if (err) {
+            qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_write err=%d\n", err);
+            goto fail;
+        }
+        st->wr += n;
+        budget -= MIN(budget, n);
+    }
+    pciemu_dma_stream_end(dev, PCIEMU_HW_DMA_ERR_NONE);
+    return;
+fail:
+    pciemu_dma_stream_end(dev, PCIEMU_HW_DMA_ERR_BUS);
+}
+
+/**
+ * pciemu_dma_execute_stream: Start streaming from the host to the host
+ *
+ * The stream itself is moved forward by pciemu_dma_stream_step, or by the
+ * workers of the pipeline if enabled (see pipeline.c), and the command
+ * completes once the stream is over. An empty stream always goes through
+ * pciemu_dma_stream_step, so it does not complete before the doorbell returns.
+ * Returns the error of the operation (PCIEMU_HW_DMA_ERR_*).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static dma_err_t pciemu_dma_execute_stream(PCIEMUDevice *dev)
+{
+    DMAEngine *dma = &dev->dma;
+    DMAStream *st = &dma->stream;
+    st->src = pciemu_dma_addr_mask(dev, dma->config.txdesc.src);
+    st->dst = pciemu_dma_addr_mask(dev, dma->config.txdesc.dst);
+    st->len = dma->config.txdesc.len;
+    st->rd = 0;
+    st->wr = 0;
+    st->active = true;
+    if (pciemu_pipeline_enabled(dev) && st->len) {
+        pciemu_pipeline_start(dev, st->src, st->dst, st->len);
+        return PCIEMU_HW_DMA_ERR_NONE;
+    }
+    timer_mod_ns(&st->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    return PCIEMU_HW_DMA_ERR_NONE;
+}
+
+/**
+ * pciemu_dma_execute_rows: Transfer between the host and the device memory
+ *
+ * A plain transfer is a single row. A 2D transfer (PCIEMU_HW_DMA_CMD_FLAG_2D)
+ * moves config.rows rows, each at its own stride on the bus and inside the
+ * device memory, where they must all fit. Rows contiguous on both sides are
+ * moved as a single transfer.
+ * Returns the error of the operation (PCIEMU_HW_DMA_ERR_*).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @bus: bus address of the first row (not masked yet)
+ * @bus_stride: distance between two rows on the bus
+ * @ofs: offset of the first row inside the DMA memory area (already checked)
+ * @ofs_stride: distance between two rows inside the DMA memory area
+ * @dir: DMA_DIRECTION_TO_DEVICE (read from bus) or
+ *       DMA_DIRECTION_FROM_DEVICE (write to bus)
+ */
+static dma_err_t pciemu_dma_execute_rows(PCIEMUDevice *dev, dma_addr_t bus,
+                                         dma_size_t bus_stride, dma_addr_t ofs,
+                                         dma_size_t ofs_stride,
+                                         DMADirection dir)
+{
+    DMAEngine *dma = &dev->dma;
+    dma_size_t len = dma->config.txdesc.len;
+    uint64_t rows = 1;
+    if (dma->config.cmd & PCIEMU_HW_DMA_CMD_FLAG_2D) {
+        rows = dma->config.rows;
+        if (rows > PCIEMU_HW_DMA_2D_ROWS_MAX) {
+            qemu_log_mask(LOG_GUEST_ERROR, "rows register out of bounds \n");
+            return PCIEMU_HW_DMA_ERR_BOUNDS;
+        }
+        if (!rows)
+            return PCIEMU_HW_DMA_ERR_NONE;
+    }
+    if (!pciemu_dma_inside_device_length(dev, ofs, len) ||
+        (ofs_stride &&
+         rows - 1 > (dma->buff_size - ofs - len) / ofs_stride)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "len register out of bounds \n");
+        return PCIEMU_HW_DMA_ERR_BOUNDS;
+    }
+    if (bus_stride == len && ofs_stride == len) {
+        /* fits in the device memory, as checked above */
+        len *= rows;
+        rows = 1;
+    }
+    for (uint64_t i = 0; i < rows; ++i) {
+        int err = pciemu_dma_rw(dev,
+                                pciemu_dma_addr_mask(dev, bus + i * bus_stride),
+                                dma->buff + ofs + i * ofs_stride, len, dir);
+        if (err) {
+            qemu_log_mask(LOG_GUEST_ERROR, "%s err=%d\n",
+                          dir == DMA_DIRECTION_TO_DEVICE ? "pci_dma_read"
+                                                         : "pci_dma_write",
+                          err);
+            return PCIEMU_HW_DMA_ERR_BUS;
+        }
+    }
+    return PCIEMU_HW_DMA_ERR_NONE;
+}
+
+/**
+ * pciemu_dma_sync_len: Bytes moved by a command run as soon as it starts
+ *
+ * Those commands run right away, on the vCPU ringing the doorbell or in the
+ * main loop, so their length is bounded (PCIEMU_HW_DMA_SYNC_LEN_MAX). The
+ * others are either bounded by the DMA memory area or run in the background
+ * (STREAM, SORT) : 0 is returned for them.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @cmd: command, without its flags
+ */
+static uint64_t pciemu_dma_sync_len(PCIEMUDevice *dev, dma_cmd_t cmd)
+{
+    DMAConfig *config = &dev->dma.config;
+    /* clamped first, so the products below cannot overflow */
+    uint64_t len = MIN(config->txdesc.len, PCIEMU_HW_DMA_SYNC_LEN_MAX + 1);
+    switch (cmd) {
+    case PCIEMU_HW_DMA_CMD_PATTERN_FILL:
+    case PCIEMU_HW_DMA_CMD_PATTERN_VERIFY:
+    case PCIEMU_HW_DMA_CMD_ENCRYPT:
+    case PCIEMU_HW_DMA_CMD_DECRYPT:
+    case PCIEMU_HW_DMA_CMD_SCAN:
+    case PCIEMU_HW_DMA_CMD_SCAN_FROM_DEVICE:
+        return len;
+    case PCIEMU_HW_DMA_CMD_MULTICAST:
+    case PCIEMU_HW_DMA_CMD_MULTICAST_FROM_DEVICE:
+        return len * config->mcast_cnt;
+    case PCIEMU_HW_DMA_CMD_XOR:
+    case PCIEMU_HW_DMA_CMD_PQ:
+        return len * config->raid_cnt;
+    }
+    return 0;
 }
 
 /**
@@ -51,16 +1356,65 @@ static inline bool pciemu_dma_inside_device_boundaries(dma_addr_t addr)
  *
  * Effectively executes the DMA operation according to the configurations
  * in the transfer descriptor.
+ * Returns the error of the operation (PCIEMU_HW_DMA_ERR_*), which is
+ * reported to the guest in the error register.
  *
  * @dev: Instance of PCIEMUDevice object being used
  */
-static void pciemu_dma_execute(PCIEMUDevice *dev)
+static dma_err_t pciemu_dma_execute(PCIEMUDevice *dev)
 {
     DMAEngine *dma = &dev->dma;
-    if (dma->config.cmd != PCIEMU_HW_DMA_DIRECTION_TO_DEVICE &&
-        dma->config.cmd != PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE)
-        return;
-    if (dma->config.cmd == PCIEMU_HW_DMA_DIRECTION_TO_DEVICE) {
+    dma_cmd_t cmd = dma->config.cmd & PCIEMU_HW_DMA_CMD_MASK;
+    if ((dma->config.cmd & PCIEMU_HW_DMA_CMD_FLAG_2D) &&
+        cmd != PCIEMU_HW_DMA_DIRECTION_TO_DEVICE &&
+        cmd != PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE) {
+        qemu_log_mask(LOG_GUEST_ERROR, "2D flag on cmd (%" PRIx64 ") \n",
+                      dma->config.cmd);
+        return PCIEMU_HW_DMA_ERR_CMD;
+    }
+    if (pciemu_dma_sync_len(dev, cmd) > PCIEMU_HW_DMA_SYNC_LEN_MAX) {
+        qemu_log_mask(LOG_GUEST_ERROR, "cmd (%" PRIx64 ") too long\n",
+                      dma->config.cmd);
+        return PCIEMU_HW_DMA_ERR_BOUNDS;
+    }
+    switch (cmd) {
+    case PCIEMU_HW_DMA_DIRECTION_TO_DEVICE:
+    case PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE:
+        break;
+    case PCIEMU_HW_DMA_CMD_PATTERN_FILL:
+        return pciemu_dma_execute_pattern_fill(dev);
+    case PCIEMU_HW_DMA_CMD_PATTERN_VERIFY:
+        return pciemu_dma_execute_pattern_verify(dev);
+    case PCIEMU_HW_DMA_CMD_STREAM:
+        return pciemu_dma_execute_stream(dev);
+    case PCIEMU_HW_DMA_CMD_ENCRYPT:
+        return pciemu_dma_execute_crypto(dev, true);
+    case PCIEMU_HW_DMA_CMD_DECRYPT:
+        return pciemu_dma_execute_crypto(dev, false);
+    case PCIEMU_HW_DMA_CMD_ATOMIC_FETCH_ADD:
+    case PCIEMU_HW_DMA_CMD_ATOMIC_SWAP:
+    case PCIEMU_HW_DMA_CMD_ATOMIC_CAS:
+        return pciemu_dma_execute_atomic(dev, cmd);
+    case PCIEMU_HW_DMA_CMD_MULTICAST:
+        return pciemu_dma_execute_multicast(dev, false);
+    case PCIEMU_HW_DMA_CMD_MULTICAST_FROM_DEVICE:
+        return pciemu_dma_execute_multicast(dev, true);
+    case PCIEMU_HW_DMA_CMD_XOR:
+        return pciemu_dma_execute_raid(dev, false);
+    case PCIEMU_HW_DMA_CMD_PQ:
+        return pciemu_dma_execute_raid(dev, true);
+    case PCIEMU_HW_DMA_CMD_SCAN:
+        return pciemu_dma_execute_scan(dev, false);
+    case PCIEMU_HW_DMA_CMD_SCAN_FROM_DEVICE:
+        return pciemu_dma_execute_scan(dev, true);
+    case PCIEMU_HW_DMA_CMD_SORT:
+        return pciemu_dma_execute_sort(dev);
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR, "invalid cmd (%" PRIx64 ") \n",
+                      dma->config.cmd);
+        return PCIEMU_HW_DMA_ERR_CMD;
+    }
+    if (cmd == PCIEMU_HW_DMA_DIRECTION_TO_DEVICE) {
         /* DMA_DIRECTION_TO_DEVICE
          *   The transfer direction is RAM(or other device)->device.
          *   The content in the bus address dma->config.txdesc.src, which points
@@ -69,17 +1423,16 @@ static void pciemu_dma_execute(PCIEMUDevice *dev)
          *   dma->buff is the dedicated area inside the device to receive
          *   DMA transfers. Thus, dst is basically the offset of dma->buff.
          */
-        if (!pciemu_dma_inside_device_boundaries(dma->config.txdesc.dst)) {
+        if (!pciemu_dma_inside_device_boundaries(dev,
+                                                 dma->config.txdesc.dst)) {
             qemu_log_mask(LOG_GUEST_ERROR, "dst register out of bounds \n");
-            return;
+            return PCIEMU_HW_DMA_ERR_BOUNDS;
         }
-        dma_addr_t src = pciemu_dma_addr_mask(dev, dma->config.txdesc.src);
         dma_addr_t dst = dma->config.txdesc.dst - PCIEMU_HW_DMA_AREA_START;
-        int err = pci_dma_read(&dev->pci_dev, src, dma->buff + dst,
-                               dma->config.txdesc.len);
-        if (err) {
-            qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_read err=%d\n", err);
-        }
+        return pciemu_dma_execute_rows(dev, dma->config.txdesc.src,
+                                       dma->config.src_stride, dst,
+                                       dma->config.dst_stride,
+                                       DMA_DIRECTION_TO_DEVICE);
     } else {
         /* DMA_DIRECTION_FROM_DEVICE
          *   The transfer direction is device->RAM (or other device).
@@ -89,19 +1442,103 @@ static void pciemu_dma_execute(PCIEMUDevice *dev)
          *   dma->buff is the dedicated area inside the device to receive
          *   DMA transfers. Thus, src is basically the offset of dma->buff.
          */
-        if (!pciemu_dma_inside_device_boundaries(dma->config.txdesc.src)) {
+        if (!pciemu_dma_inside_device_boundaries(dev,
+                                                 dma->config.txdesc.src)) {
             qemu_log_mask(LOG_GUEST_ERROR, "src register out of bounds \n");
-            return;
+            return PCIEMU_HW_DMA_ERR_BOUNDS;
         }
         dma_addr_t src = dma->config.txdesc.src - PCIEMU_HW_DMA_AREA_START;
-        dma_addr_t dst = pciemu_dma_addr_mask(dev, dma->config.txdesc.dst);
-        int err = pci_dma_write(&dev->pci_dev, dst, dma->buff + src,
-                                dma->config.txdesc.len);
-        if (err) {
-            qemu_log_mask(LOG_GUEST_ERROR, "pci_dma_write err=%d\n", err);
-        }
+        return pciemu_dma_execute_rows(dev, dma->config.txdesc.dst,
+                                       dma->config.dst_stride, src,
+                                       dma->config.src_stride,
+                                       DMA_DIRECTION_FROM_DEVICE);
+    }
+}
+
+/**
+ * pciemu_dma_desc_load: Load a field of a descriptor into its register
+ *
+ * The field is traced as a write of the register, so a trace replays the
+ * same programming without the content of the descriptor window.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @addr: DMA configuration register (PCIEMU_HW_BAR0_DMA_CFG_*)
+ * @val: value of the field
+ */
+static void pciemu_dma_desc_load(PCIEMUDevice *dev, hwaddr addr, uint64_t val)
+{
+    pciemu_trace_mmio(dev, PCIEMU_TRACE_MMIO_WRITE, addr, 8, val);
+    switch (addr) {
+    case PCIEMU_HW_BAR0_DMA_CFG_TXDESC_SRC:
+        pciemu_dma_config_txdesc_src(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_TXDESC_DST:
+        pciemu_dma_config_txdesc_dst(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_TXDESC_LEN:
+        pciemu_dma_config_txdesc_len(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_CMD:
+        pciemu_dma_config_cmd(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_PATTERN:
+        pciemu_dma_config_pattern(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_PATTERN_SEED:
+        pciemu_dma_config_pattern_seed(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_CRYPTO_KEY_SLOT:
+        pciemu_dma_config_crypto_key_slot(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_CRYPTO_SECTOR_SIZE:
+        pciemu_dma_config_crypto_sector_size(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_CRYPTO_SECTOR:
+        pciemu_dma_config_crypto_sector(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_ATOMIC_OPERAND:
+        pciemu_dma_config_atomic_operand(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_ATOMIC_COMPARE:
+        pciemu_dma_config_atomic_compare(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_2D_ROWS:
+        pciemu_dma_config_2d_rows(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_2D_SRC_STRIDE:
+        pciemu_dma_config_2d_src_stride(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_2D_DST_STRIDE:
+        pciemu_dma_config_2d_dst_stride(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_MCAST_CNT:
+        pciemu_dma_config_mcast_cnt(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_RAID_SRC_CNT:
+        pciemu_dma_config_raid_src_cnt(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_RAID_Q_DST:
+        pciemu_dma_config_raid_q_dst(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_SCAN_KEY_LO:
+        pciemu_dma_config_scan_key_lo(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_SCAN_KEY_HI:
+        pciemu_dma_config_scan_key_hi(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_SCAN_CTRL:
+        pciemu_dma_config_scan_ctrl(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_SCAN_MAX:
+        pciemu_dma_config_scan_max(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_SORT_CTRL:
+        pciemu_dma_config_sort_ctrl(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_SORT_IDX_DST:
+        pciemu_dma_config_sort_idx_dst(dev, val);
+        break;
     }
-    pciemu_irq_raise(dev, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR);
 }
 
 /* -----------------------------------------------------------------------------
@@ -109,6 +1546,35 @@ static void pciemu_dma_execute(PCIEMUDevice *dev)
  * -----------------------------------------------------------------------------
  */
 
+/**
+ * pciemu_dma_rw: Transfer between a buffer and the bus address space
+ *
+ * Every DMA of the device goes through here, so they can all be traced
+ * (but the operands of the atomic commands, which are mapped instead).
+ * The ranges kept mapped by the map cache skip the bus address space.
+ * A vCPU takes the BQL first if the bus address space needs it (see
+ * pciemu_mmio_dma_prepare).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @addr: bus address of the transfer
+ * @buf: buffer inside the device
+ * @len: length of the transfer in bytes
+ * @dir: DMA_DIRECTION_TO_DEVICE (read from bus) or
+ *       DMA_DIRECTION_FROM_DEVICE (write to bus)
+ */
+int pciemu_dma_rw(PCIEMUDevice *dev, dma_addr_t addr, void *buf,
+                  dma_addr_t len, DMADirection dir)
+{
+    int err = 0;
+    if (!pciemu_mapcache_rw(dev, addr, buf, len, dir)) {
+        pciemu_mmio_dma_prepare(dev, addr, len, dir);
+        err = pci_dma_rw(&dev->pci_dev, addr, buf, len, dir,
+                         MEMTXATTRS_UNSPECIFIED);
+    }
+    pciemu_trace_dma(dev, dir, addr, buf, len);
+    return err;
+}
+
 /**
  * pciemu_dma_config_txdesc_src: Configure the source register
  *
@@ -164,6 +1630,12 @@ void pciemu_dma_config_txdesc_len(PCIEMUDevice *dev, dma_size_t size)
  * The command register can take the following values (pciemu_hw.h);
  *   - PCIEMU_HW_DMA_DIRECTION_TO_DEVICE - DMA to device memory (dma->buff)
  *   - PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE - DMA from device memory (dma->buff)
+ *   - PCIEMU_HW_DMA_CMD_PATTERN_FILL/VERIFY - pattern generator and verifier
+ *   - PCIEMU_HW_DMA_CMD_STREAM - host to host through the FIFO (dma->buff)
+ *   - PCIEMU_HW_DMA_CMD_ENCRYPT/DECRYPT - host to host through AES-XTS
+ *   - PCIEMU_HW_DMA_CMD_ATOMIC_* - atomic operation on host memory
+ * optionally or'ed with PCIEMU_HW_DMA_CMD_FLAG_NO_IRQ, and the directions
+ * with PCIEMU_HW_DMA_CMD_FLAG_2D.
  *
  * @dev: Instance of PCIEMUDevice object being used
  */
@@ -174,6 +1646,279 @@ void pciemu_dma_config_cmd(PCIEMUDevice *dev, dma_cmd_t cmd)
         dev->dma.config.cmd = cmd;
 }
 
+/**
+ * pciemu_dma_config_pattern: Configure the pattern register
+ *
+ * The pattern register can take the following values (pciemu_hw.h);
+ *   - PCIEMU_HW_DMA_PATTERN_COUNTER - incrementing 32-bit words
+ *   - PCIEMU_HW_DMA_PATTERN_HASH - pseudo-random 32-bit words
+ * Other values are kept, the pattern commands then fail.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_pattern(PCIEMUDevice *dev, dma_pattern_t pattern)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.pattern = pattern;
+}
+
+/**
+ * pciemu_dma_config_pattern_seed: Configure the pattern seed register
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_pattern_seed(PCIEMUDevice *dev, uint32_t seed)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.seed = seed;
+}
+
+/**
+ * pciemu_dma_config_crypto_key_slot: Configure the key slot register
+ *
+ * Key slot of the encryption commands, checked when executed.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_crypto_key_slot(PCIEMUDevice *dev, uint32_t slot)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.key_slot = slot;
+}
+
+/**
+ * pciemu_dma_config_crypto_sector_size: Configure the sector size register
+ *
+ * Size of the sectors (data units) of the encryption commands in bytes,
+ * checked when executed.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_crypto_sector_size(PCIEMUDevice *dev, uint32_t size)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.sector_size = size;
+}
+
+/**
+ * pciemu_dma_config_crypto_sector: Configure the sector register
+ *
+ * Number of the first sector of the encryption commands (tweak).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_crypto_sector(PCIEMUDevice *dev, uint64_t sector)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.sector = sector;
+}
+
+/**
+ * pciemu_dma_config_atomic_operand: Configure the atomic operand register
+ *
+ * Value added (FETCH_ADD) or written (SWAP and CAS) by the atomic commands.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_atomic_operand(PCIEMUDevice *dev, uint64_t operand)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.operand = operand;
+}
+
+/**
+ * pciemu_dma_config_atomic_compare: Configure the atomic compare register
+ *
+ * Value the operand of the CAS command is compared with.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_atomic_compare(PCIEMUDevice *dev, uint64_t compare)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.compare = compare;
+}
+
+/**
+ * pciemu_dma_config_2d_rows: Configure the rows register
+ *
+ * Number of rows of the 2D transfers, checked when executed.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_2d_rows(PCIEMUDevice *dev, uint32_t rows)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.rows = rows;
+}
+
+/**
+ * pciemu_dma_config_2d_src_stride: Configure the source stride register
+ *
+ * Distance in bytes between the start of two rows at the source of the 2D
+ * transfers (bus address or offset inside the DMA memory area).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_2d_src_stride(PCIEMUDevice *dev, dma_size_t stride)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.src_stride = stride;
+}
+
+/**
+ * pciemu_dma_config_2d_dst_stride: Configure the destination stride register
+ *
+ * Distance in bytes between the start of two rows at the destination of the
+ * 2D transfers (bus address or offset inside the DMA memory area).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_2d_dst_stride(PCIEMUDevice *dev, dma_size_t stride)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.dst_stride = stride;
+}
+
+/**
+ * pciemu_dma_config_mcast_cnt: Configure the multicast count register
+ *
+ * Number of destinations of the multicast commands, checked when executed.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_mcast_cnt(PCIEMUDevice *dev, uint32_t cnt)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.mcast_cnt = cnt;
+}
+
+/**
+ * pciemu_dma_config_raid_src_cnt: Configure the parity sources register
+ *
+ * Number of sources of the parity commands, checked when executed.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_raid_src_cnt(PCIEMUDevice *dev, uint32_t cnt)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.raid_cnt = cnt;
+}
+
+/**
+ * pciemu_dma_config_raid_q_dst: Configure the Q destination register
+ *
+ * Bus address where PCIEMU_HW_DMA_CMD_PQ writes the Q syndrome.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_raid_q_dst(PCIEMUDevice *dev, dma_addr_t dst)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.q_dst = dst;
+}
+
+/**
+ * pciemu_dma_config_scan_key_lo: Configure the low half of the scan key
+ *
+ * Bytes 0 to 7 of the key of the scan commands (little endian).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_scan_key_lo(PCIEMUDevice *dev, uint64_t key)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.scan_key[0] = key;
+}
+
+/**
+ * pciemu_dma_config_scan_key_hi: Configure the high half of the scan key
+ *
+ * Bytes 8 to 15 of the key of the scan commands (little endian).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_scan_key_hi(PCIEMUDevice *dev, uint64_t key)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.scan_key[1] = key;
+}
+
+/**
+ * pciemu_dma_config_scan_ctrl: Configure the scan control register
+ *
+ * Length of the key and kind of search (PCIEMU_HW_DMA_SCAN_CTRL_*),
+ * checked when executed.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_scan_ctrl(PCIEMUDevice *dev, uint32_t ctrl)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.scan_ctrl = ctrl;
+}
+
+/**
+ * pciemu_dma_config_scan_max: Configure the scan result capacity register
+ *
+ * Number of 64-bit entries of the result buffer of the scan commands.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_scan_max(PCIEMUDevice *dev, uint64_t max)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.scan_max = max;
+}
+
+/**
+ * pciemu_dma_config_sort_ctrl: Configure the sort control register
+ *
+ * Size of the keys and whether their indices are written
+ * (PCIEMU_HW_DMA_SORT_CTRL_*).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_sort_ctrl(PCIEMUDevice *dev, uint32_t ctrl)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.sort_ctrl = ctrl;
+}
+
+/**
+ * pciemu_dma_config_sort_idx_dst: Configure the sort index address register
+ *
+ * Bus address where PCIEMU_HW_DMA_CMD_SORT writes the original index of each
+ * sorted key, with PCIEMU_HW_DMA_SORT_CTRL_IDX.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_dma_config_sort_idx_dst(PCIEMUDevice *dev, dma_addr_t dst)
+{
+    DMAStatus status = qatomic_read(&dev->dma.status);
+    if (status == DMA_STATUS_IDLE)
+        dev->dma.config.sort_idx_dst = dst;
+}
+
 /**
  * pciemu_dma_doorbell_ring: Reception of a doorbell
  *
@@ -181,6 +1926,8 @@ void pciemu_dma_config_cmd(PCIEMUDevice *dev, dma_cmd_t cmd)
  * it is signaling to the DMA engine to start executing the DMA.
  * At this point, it is assumed that the host has already (and properly)
  * configured all necessary DMA engine registers.
+ * The completion is delayed according to the latency model (if any), except
+ * for failed commands, which complete right away.
  *
  * @dev: Instance of PCIEMUDevice object being used
  */
@@ -196,8 +1943,164 @@ void pciemu_dma_doorbell_ring(PCIEMUDevice *dev)
                                        DMA_STATUS_EXECUTING);
     if (status == DMA_STATUS_EXECUTING)
         return;
-    pciemu_dma_execute(dev);
-    qatomic_set(&dev->dma.status, DMA_STATUS_IDLE);
+    pciemu_stats_event(dev, STATS_EVENT_DMA_START);
+    dev->dma.result = pciemu_dma_execute(dev);
+    /* a stream ends by itself, after its last chunk, and a sort once its
+     * worker is done */
+    bool pending = dev->dma.stream.active || pciemu_sort_active(dev);
+    if (!pending)
+        pciemu_stats_event(dev, STATS_EVENT_DMA_END);
+    if (dev->dma.result != PCIEMU_HW_DMA_ERR_NONE) {
+        pciemu_dma_complete(dev);
+        return;
+    }
+    if (pending)
+        return;
+    pciemu_dma_complete_schedule(dev);
+}
+
+/**
+ * pciemu_dma_desc_execute: Execution of a descriptor
+ *
+ * The fields of the descriptor are loaded into the DMA configuration
+ * registers before ringing the doorbell, as if the driver had written them
+ * one by one (see pciemu_hw.h).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @desc: copy of the descriptor (PCIEMU_HW_DESC_SLOT_SIZE bytes)
+ */
+void pciemu_dma_desc_execute(PCIEMUDevice *dev, const uint8_t *desc)
+{
+    dma_cmd_t cmd = ldq_le_p(desc + PCIEMU_HW_DESC_CMD);
+    pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_SRC,
+                         ldq_le_p(desc + PCIEMU_HW_DESC_SRC));
+    pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_DST,
+                         ldq_le_p(desc + PCIEMU_HW_DESC_DST));
+    pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_LEN,
+                         ldq_le_p(desc + PCIEMU_HW_DESC_LEN));
+    pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_CMD, cmd);
+    /* only the pattern, encryption, atomic, multicast, parity, scan and sort
+     * commands use the second half */
+    switch (cmd & PCIEMU_HW_DMA_CMD_MASK) {
+    case PCIEMU_HW_DMA_CMD_PATTERN_FILL:
+    case PCIEMU_HW_DMA_CMD_PATTERN_VERIFY:
+        pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_PATTERN,
+                             ldl_le_p(desc + PCIEMU_HW_DESC_PATTERN));
+        pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_PATTERN_SEED,
+                             ldl_le_p(desc + PCIEMU_HW_DESC_PATTERN_SEED));
+        break;
+    case PCIEMU_HW_DMA_CMD_ENCRYPT:
+    case PCIEMU_HW_DMA_CMD_DECRYPT:
+        pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_CRYPTO_KEY_SLOT,
+                             ldl_le_p(desc + PCIEMU_HW_DESC_CRYPTO_KEY_SLOT));
+        pciemu_dma_desc_load(
+            dev, PCIEMU_HW_BAR0_DMA_CFG_CRYPTO_SECTOR_SIZE,
+            ldl_le_p(desc + PCIEMU_HW_DESC_CRYPTO_SECTOR_SIZE));
+        pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_CRYPTO_SECTOR,
+                             ldq_le_p(desc + PCIEMU_HW_DESC_CRYPTO_SECTOR));
+        break;
+    case PCIEMU_HW_DMA_CMD_ATOMIC_FETCH_ADD:
+    case PCIEMU_HW_DMA_CMD_ATOMIC_SWAP:
+    case PCIEMU_HW_DMA_CMD_ATOMIC_CAS:
+        pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_ATOMIC_OPERAND,
+                             ldq_le_p(desc + PCIEMU_HW_DESC_ATOMIC_OPERAND));
+        pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_ATOMIC_COMPARE,
+                             ldq_le_p(desc + PCIEMU_HW_DESC_ATOMIC_COMPARE));
+        break;
+    case PCIEMU_HW_DMA_CMD_MULTICAST:
+    case PCIEMU_HW_DMA_CMD_MULTICAST_FROM_DEVICE:
+        pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_MCAST_CNT,
+                             ldl_le_p(desc + PCIEMU_HW_DESC_MCAST_CNT));
+        break;
+    case PCIEMU_HW_DMA_CMD_XOR:
+    case PCIEMU_HW_DMA_CMD_PQ:
+        pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_RAID_SRC_CNT,
+                             ldl_le_p(desc + PCIEMU_HW_DESC_RAID_SRC_CNT));
+        pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_RAID_Q_DST,
+                             ldq_le_p(desc + PCIEMU_HW_DESC_RAID_Q_DST));
+        break;
+    case PCIEMU_HW_DMA_CMD_SCAN:
+    case PCIEMU_HW_DMA_CMD_SCAN_FROM_DEVICE:
+        pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_SCAN_KEY_LO,
+                             ldq_le_p(desc + PCIEMU_HW_DESC_SCAN_KEY_LO));
+        pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_SCAN_KEY_HI,
+                             ldq_le_p(desc + PCIEMU_HW_DESC_SCAN_KEY_HI));
+        pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_SCAN_CTRL,
+                             ldl_le_p(desc + PCIEMU_HW_DESC_SCAN_CTRL));
+        pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_SCAN_MAX,
+                             ldq_le_p(desc + PCIEMU_HW_DESC_SCAN_MAX));
+        break;
+    case PCIEMU_HW_DMA_CMD_SORT:
+        pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_SORT_CTRL,
+                             ldl_le_p(desc + PCIEMU_HW_DESC_SORT_CTRL));
+        pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_SORT_IDX_DST,
+                             ldq_le_p(desc + PCIEMU_HW_DESC_SORT_IDX_DST));
+        break;
+    }
+    /* and the 2D transfers (the flag is only valid with the directions) */
+    if (cmd & PCIEMU_HW_DMA_CMD_FLAG_2D) {
+        pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_2D_ROWS,
+                             ldl_le_p(desc + PCIEMU_HW_DESC_2D_ROWS));
+        pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_2D_SRC_STRIDE,
+                             ldq_le_p(desc + PCIEMU_HW_DESC_2D_SRC_STRIDE));
+        pciemu_dma_desc_load(dev, PCIEMU_HW_BAR0_DMA_CFG_2D_DST_STRIDE,
+                             ldq_le_p(desc + PCIEMU_HW_DESC_2D_DST_STRIDE));
+    }
+    pciemu_trace_mmio(dev, PCIEMU_TRACE_MMIO_WRITE,
+                      PCIEMU_HW_BAR0_DMA_DOORBELL_RING, 8, 1);
+    pciemu_dma_doorbell_ring(dev);
+}
+
+/**
+ * pciemu_dma_desc_doorbell_ring: Reception of a descriptor doorbell
+ *
+ * The driver pushed a descriptor into a slot of the descriptor window (BAR 2)
+ * and wrote the slot number to the descriptor doorbell. The whole descriptor
+ * is copied at once, so it cannot change while being decoded.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @slot: slot of the descriptor window holding the descriptor
+ */
+void pciemu_dma_desc_doorbell_ring(PCIEMUDevice *dev, uint64_t slot)
+{
+    uint8_t desc[PCIEMU_HW_DESC_SLOT_SIZE];
+    if (slot >= PCIEMU_HW_DESC_SLOT_CNT) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "descriptor slot (%" PRIu64 ") out of the window\n",
+                      slot);
+        return;
+    }
+    memcpy(desc, dev->dma.desc + slot * PCIEMU_HW_DESC_SLOT_SIZE,
+           sizeof(desc));
+    pciemu_dma_desc_execute(dev, desc);
+}
+
+/**
+ * pciemu_dma_stream_end: End of a stream
+ *
+ * Completes the command once the last byte is written (after its latency),
+ * or right away if the stream failed.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @err: error of the stream (PCIEMU_HW_DMA_ERR_*)
+ */
+void pciemu_dma_stream_end(PCIEMUDevice *dev, dma_err_t err)
+{
+    dev->dma.stream.active = false;
+    pciemu_dma_end(dev, err);
+}
+
+/**
+ * pciemu_dma_sort_end: End of a sort
+ *
+ * Same as pciemu_dma_stream_end, once the sorted keys are written.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @err: error of the sort (PCIEMU_HW_DMA_ERR_*)
+ */
+void pciemu_dma_sort_end(PCIEMUDevice *dev, dma_err_t err)
+{
+    pciemu_dma_end(dev, err);
 }
 
 /**
@@ -205,21 +2108,59 @@ void pciemu_dma_doorbell_ring(PCIEMUDevice *dev)
  *
  * Resets the DMA block for the instantiated PCIEMUDevice object.
  * This can be considered a hard reset as we do not wait for the
- * current operation to finish.
+ * current operation to finish. Only the workers still holding part of it
+ * are waited for, so none of them touches the device afterwards (and
+ * pciemu_dma_fini can free it).
  *
  * @dev: Instance of PCIEMUDevice object being used
  */
 void pciemu_dma_reset(PCIEMUDevice *dev)
 {
     DMAEngine *dma = &dev->dma;
+    timer_del(&dma->completion);
+    timer_del(&dma->stream.timer);
+    dma->stream.active = false;
+    pciemu_pipeline_reset(dev);
+    pciemu_sort_reset(dev);
+    pciemu_arbiter_reset(dev);
+    pciemu_crypto_reset(dev);
+    pciemu_mapcache_reset(dev);
+    pciemu_latency_reset(&dma->latency);
     dma->status = DMA_STATUS_IDLE;
     dma->config.txdesc.src = 0;
     dma->config.txdesc.dst = 0;
     dma->config.txdesc.len = 0;
     dma->config.cmd = 0;
+    dma->config.pattern = PCIEMU_HW_DMA_PATTERN_COUNTER;
+    dma->config.seed = 0;
+    dma->config.key_slot = 0;
+    dma->config.sector_size = PCIEMU_HW_CRYPTO_SECTOR_SIZE_MIN;
+    dma->config.sector = 0;
+    dma->config.operand = 0;
+    dma->config.compare = 0;
+    dma->config.rows = 1;
+    dma->config.src_stride = 0;
+    dma->config.dst_stride = 0;
+    dma->config.mcast_cnt = 1;
+    dma->config.raid_cnt = 1;
+    dma->config.q_dst = 0;
+    dma->config.scan_key[0] = 0;
+    dma->config.scan_key[1] = 0;
+    dma->config.scan_ctrl = 0;
+    dma->config.scan_max = 0;
+    dma->config.sort_ctrl = 0;
+    dma->config.sort_idx_dst = 0;
+    dma->pattern.err_cnt = 0;
+    dma->pattern.err_ofs = PCIEMU_HW_DMA_PATTERN_ERR_OFS_NONE;
+    dma->atomic_result = 0;
+    dma->scan_cnt = 0;
+    dma->result = PCIEMU_HW_DMA_ERR_NONE;
+    dma->error = PCIEMU_HW_DMA_ERR_NONE;
+    dma->done_cnt = 0;
 
-    /* clear the internal buffer */
-    memset(dma->buff, 0, PCIEMU_HW_DMA_AREA_SIZE);
+    /* clear the internal buffer (a memory backend keeps its content) */
+    if (!dma->memdev && dma->buff)
+        memset(dma->buff, 0, dma->buff_size);
 }
 
 /**
@@ -234,11 +2175,76 @@ void pciemu_dma_reset(PCIEMUDevice *dev)
  */
 void pciemu_dma_init(PCIEMUDevice *dev, Error **errp)
 {
+    DMAEngine *dma = &dev->dma;
+    Error *err = NULL;
+
+    /* delay of the completions, pipeline, map cache and host placement,
+     * parsed first as they may fail */
+    pciemu_latency_init(&dma->latency, &err);
+    if (err)
+        goto err;
+    pciemu_pipeline_init(dev, &err);
+    if (err)
+        goto err;
+    pciemu_mapcache_init(dev, &err);
+    if (err)
+        goto err_pipeline;
+    pciemu_hostnuma_init(dev, &err);
+    if (err)
+        goto err_mapcache;
+    timer_init_ns(&dma->completion, QEMU_CLOCK_VIRTUAL, pciemu_dma_complete_cb,
+                  dev);
+    timer_init_ns(&dma->stream.timer, QEMU_CLOCK_VIRTUAL,
+                  pciemu_dma_stream_step, dev);
+    pciemu_arbiter_init(dev);
+    pciemu_crypto_init(dev);
+    pciemu_sort_init(dev);
+
+    /* descriptor window, mapped as BAR 2 by pciemu_mmio_init (the region
+     * belongs to the device, which frees it) */
+    memory_region_init_ram(&dev->desc, OBJECT(dev), "pciemu-desc",
+                           PCIEMU_HW_DESC_WINDOW_SIZE, &err);
+    if (err)
+        goto err_hostnuma;
+    dma->desc = memory_region_get_ram_ptr(&dev->desc);
+
+    /* device memory comes from memdev if provided, otherwise it is inline
+     * unless it has to be placed on host nodes */
+    if (dma->memdev) {
+        if (!pciemu_dma_memdev_init(dev, &err))
+            goto err_hostnuma;
+    } else if (pciemu_hostnuma_enabled(dev)) {
+        dma->buff = pciemu_hostnuma_alloc(dev, PCIEMU_HW_DMA_AREA_SIZE, &err);
+        if (!dma->buff)
+            goto err_hostnuma;
+        dma->buff_size = PCIEMU_HW_DMA_AREA_SIZE;
+    } else {
+        dma->buff = dma->buff_inline;
+        dma->buff_size = PCIEMU_HW_DMA_AREA_SIZE;
+    }
+
     /* Basically reset the DMA engine */
     pciemu_dma_reset(dev);
 
     /* and set the DMA mask, which does not change */
     dev->dma.config.mask = DMA_BIT_MASK(PCIEMU_HW_DMA_ADDR_CAPABILITY);
+
+    /* pick the fastest pattern, parity and scan kernels for this host */
+    pciemu_dma_pattern_select_kernels();
+    pciemu_dma_raid_select_kernels();
+    pciemu_dma_scan_select_kernels();
+    return;
+
+    /* undo the steps done so far, in reverse order (the timers are not
+     * armed yet) */
+err_hostnuma:
+    pciemu_hostnuma_fini(dev);
+err_mapcache:
+    pciemu_mapcache_fini(dev);
+err_pipeline:
+    pciemu_pipeline_reset(dev);
+err:
+    error_propagate(errp, err);
 }
 
 
@@ -254,5 +2260,9 @@ void pciemu_dma_init(PCIEMUDevice *dev, Error **errp)
 void pciemu_dma_fini(PCIEMUDevice *dev)
 {
     pciemu_dma_reset(dev);
+    pciemu_mapcache_fini(dev);
+    pciemu_hostnuma_fini(dev);
     dev->dma.status = DMA_STATUS_OFF;
+    if (dev->dma.memdev)
+        host_memory_backend_set_mapped(dev->dma.memdev, false);
 }
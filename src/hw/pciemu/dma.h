@@ -10,8 +10,18 @@
 #define PCIEMU_DMA_H
 
 #include "qemu/osdep.h"
+#include "qemu/units.h"
 #include "hw/pci/pci.h"
+#include "qemu/timer.h"
+#include "sysemu/hostmem.h"
 #include "pciemu_hw.h"
+#include "arbiter.h"
+#include "crypto.h"
+#include "hostnuma.h"
+#include "latency.h"
+#include "mapcache.h"
+#include "pipeline.h"
+#include "sort.h"
 
 #define DMA_BIT_MASK(n) (((n) == 64) ? ~0ULL : ((1ULL << (n)) - 1))
 
@@ -27,6 +37,24 @@ typedef dma_addr_t dma_size_t;
 /* dma mask */
 typedef uint64_t dma_mask_t;
 
+/* dma pattern */
+typedef uint32_t dma_pattern_t;
+
+/* size of the bounce buffer used by commands operating on chunks */
+#define PCIEMU_DMA_BOUNCE_SIZE (64 * KiB)
+
+/* parity commands : the bounce buffer holds a chunk of a source, of P and
+ * of Q */
+#define PCIEMU_DMA_RAID_CHUNK (PCIEMU_DMA_BOUNCE_SIZE / 4)
+
+/* scan commands : matches written to the bus at once */
+#define PCIEMU_DMA_SCAN_BATCH 256
+
+/* streaming : largest chunk moved at once and bytes moved per timer tick,
+ * so a long stream gives the hand back to the main loop regularly */
+#define PCIEMU_DMA_STREAM_CHUNK (64 * KiB)
+#define PCIEMU_DMA_STREAM_BURST (1 * MiB)
+
 /* transfer descriptor */
 typedef struct DMATransferDesc {
     dma_addr_t src;
@@ -39,22 +67,91 @@ typedef struct DMAConfig {
     DMATransferDesc txdesc;
     dma_cmd_t cmd;
     dma_mask_t mask;
+    dma_pattern_t pattern;
+    uint32_t seed;
+    uint32_t key_slot;
+    uint32_t sector_size;
+    uint64_t sector;
+    uint64_t operand;
+    uint64_t compare;
+    uint32_t rows; /* 2D transfers */
+    dma_size_t src_stride;
+    dma_size_t dst_stride;
+    uint32_t mcast_cnt; /* multicast commands */
+    uint32_t raid_cnt; /* parity commands */
+    dma_addr_t q_dst;
+    uint64_t scan_key[2]; /* scan commands */
+    uint32_t scan_ctrl;
+    uint64_t scan_max;
+    uint32_t sort_ctrl; /* sort command */
+    dma_addr_t sort_idx_dst;
 } DMAConfig;
 
-/* status of the DMA engine */
+/* result of the last pattern verification */
+typedef struct DMAPatternResult {
+    uint64_t err_cnt;
+    uint64_t err_ofs;
+} DMAPatternResult;
+
+/* dma error (PCIEMU_HW_DMA_ERR_*) */
+typedef uint64_t dma_err_t;
+
+/* state of a stream going through the FIFO (device memory)
+ *   rd and wr only grow : rd - wr bytes are in the FIFO, starting at
+ *   offset wr % buff_size of the device memory
+ */
+typedef struct DMAStream {
+    dma_addr_t src;
+    dma_addr_t dst;
+    dma_size_t len;
+    dma_size_t rd; /* bytes read from src into the FIFO */
+    dma_size_t wr; /* bytes written from the FIFO to dst */
+    bool active;
+    QEMUTimer timer;
+} DMAStream;
+
+/* status of the DMA engine (as read from PCIEMU_HW_BAR0_DMA_STATUS) */
 typedef enum DMAStatus {
-    DMA_STATUS_IDLE,
-    DMA_STATUS_EXECUTING,
-    DMA_STATUS_OFF,
+    DMA_STATUS_IDLE = PCIEMU_HW_DMA_STATUS_IDLE,
+    DMA_STATUS_EXECUTING = PCIEMU_HW_DMA_STATUS_EXECUTING,
+    DMA_STATUS_OFF = PCIEMU_HW_DMA_STATUS_OFF,
 } DMAStatus;
 
 typedef struct DMAEngine {
     DMAConfig config;
     DMAStatus status;
-    uint8_t buff[PCIEMU_HW_DMA_AREA_SIZE];
+    DMAPatternResult pattern;
+    uint64_t atomic_result; /* original value of the last atomic command */
+    uint64_t scan_cnt; /* matches found by the last scan command */
+    DMAStream stream;
+    DMAPipeline pipeline;
+    DMASort sort;
+    DMAArbiter arbiter;
+    DMACrypto crypto;
+    DMAMapCache mapcache;
+    DMAHostNuma numa;
+    /* outcome of the command being completed and of the last completed one */
+    dma_err_t result;
+    dma_err_t error;
+    uint64_t done_cnt;
+    /* delay between the end of a transfer and its completion (IRQ) */
+    LatencyModel latency;
+    QEMUTimer completion;
+    /* device memory : buff_inline, memory bound to the host nodes (numa)
+     * or the memory backend (memdev) */
+    HostMemoryBackend *memdev;
+    uint8_t *buff;
+    dma_size_t buff_size;
+    uint8_t buff_inline[PCIEMU_HW_DMA_AREA_SIZE];
+    uint32_t bounce[PCIEMU_DMA_BOUNCE_SIZE / sizeof(uint32_t)];
+    /* descriptor window (BAR 2), written by the driver */
+    uint8_t *desc;
 } DMAEngine;
 
 
+int pciemu_dma_rw(PCIEMUDevice *dev, dma_addr_t addr, void *buf,
+                  dma_addr_t len, DMADirection dir);
+
 void pciemu_dma_config_txdesc_src(PCIEMUDevice *dev, dma_addr_t src);
 
 void pciemu_dma_config_txdesc_dst(PCIEMUDevice *dev, dma_addr_t dst);
@@ -63,8 +160,54 @@ void pciemu_dma_config_txdesc_len(PCIEMUDevice *dev, dma_size_t size);
 
 void pciemu_dma_config_cmd(PCIEMUDevice *dev, dma_cmd_t cmd);
 
+void pciemu_dma_config_pattern(PCIEMUDevice *dev, dma_pattern_t pattern);
+
+void pciemu_dma_config_pattern_seed(PCIEMUDevice *dev, uint32_t seed);
+
+void pciemu_dma_config_crypto_key_slot(PCIEMUDevice *dev, uint32_t slot);
+
+void pciemu_dma_config_crypto_sector_size(PCIEMUDevice *dev, uint32_t size);
+
+void pciemu_dma_config_crypto_sector(PCIEMUDevice *dev, uint64_t sector);
+
+void pciemu_dma_config_atomic_operand(PCIEMUDevice *dev, uint64_t operand);
+
+void pciemu_dma_config_atomic_compare(PCIEMUDevice *dev, uint64_t compare);
+
+void pciemu_dma_config_2d_rows(PCIEMUDevice *dev, uint32_t rows);
+
+void pciemu_dma_config_2d_src_stride(PCIEMUDevice *dev, dma_size_t stride);
+
+void pciemu_dma_config_2d_dst_stride(PCIEMUDevice *dev, dma_size_t stride);
+
+void pciemu_dma_config_mcast_cnt(PCIEMUDevice *dev, uint32_t cnt);
+
+void pciemu_dma_config_raid_src_cnt(PCIEMUDevice *dev, uint32_t cnt);
+
+void pciemu_dma_config_raid_q_dst(PCIEMUDevice *dev, dma_addr_t dst);
+
+void pciemu_dma_config_scan_key_lo(PCIEMUDevice *dev, uint64_t key);
+
+void pciemu_dma_config_scan_key_hi(PCIEMUDevice *dev, uint64_t key);
+
+void pciemu_dma_config_scan_ctrl(PCIEMUDevice *dev, uint32_t ctrl);
+
+void pciemu_dma_config_scan_max(PCIEMUDevice *dev, uint64_t max);
+
+void pciemu_dma_config_sort_ctrl(PCIEMUDevice *dev, uint32_t ctrl);
+
+void pciemu_dma_config_sort_idx_dst(PCIEMUDevice *dev, dma_addr_t dst);
+
 void pciemu_dma_doorbell_ring(PCIEMUDevice *dev);
 
+void pciemu_dma_desc_execute(PCIEMUDevice *dev, const uint8_t *desc);
+
+void pciemu_dma_desc_doorbell_ring(PCIEMUDevice *dev, uint64_t slot);
+
+void pciemu_dma_stream_end(PCIEMUDevice *dev, dma_err_t err);
+
+void pciemu_dma_sort_end(PCIEMUDevice *dev, dma_err_t err);
+
 void pciemu_dma_reset(PCIEMUDevice *dev);
 
 void pciemu_dma_init(PCIEMUDevice *dev, Error **errp);
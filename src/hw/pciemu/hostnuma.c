@@ -0,0 +1,363 @@
+/* hostnuma.c - Placement of the device on host NUMA nodes
+ *
+ * On a NUMA host, the device memory and the threads copying to and from it
+ * should sit on the node of the guest RAM they serve, otherwise every DMA
+ * crosses the interconnect. host-nodes and policy place the device as
+ * host-nodes/policy place a memory backend :
+ *
+ *   -device pciemu,host-nodes=1,policy=bind
+ *
+ *  - the device memory is allocated page aligned and mbind'ed to the nodes
+ *    (memdev : the host-nodes/policy of the memory backend apply instead)
+ *  - the workers of the pipeline are pinned to the CPUs of the nodes while
+ *    they run a transfer of the device, the thread pool being shared
+ *
+ * Without host-nodes, the device follows the VM topology : if its PCI bus is
+ * attached to a guest NUMA node (e.g. pxb-pcie,numa_node=1) whose memory
+ * backend is placed, the device takes the same placement.
+ *
+ * The properties are read when the device is realized.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qapi-builtin-visit.h"
+#include "hw/boards.h"
+#include "hw/pci/pci.h"
+#include "hostnuma.h"
+#include "pciemu.h"
+
+#ifdef CONFIG_NUMA
+#include <numaif.h>
+#endif
+
+/* -----------------------------------------------------------------------------
+ *  Private
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_hostnuma_last_node: Highest host node set
+ *
+ * Returns MAX_NODES if no node is set.
+ *
+ * @numa: placement of the device
+ */
+static unsigned long pciemu_hostnuma_last_node(DMAHostNuma *numa)
+{
+    for (unsigned long node = MAX_NODES; node-- > 0;) {
+        if (test_bit(node, numa->host_nodes))
+            return node;
+    }
+    return MAX_NODES;
+}
+
+/**
+ * pciemu_hostnuma_follow_guest: Take the placement of the guest node
+ *
+ * The placement is copied from the memory backend of the guest NUMA node
+ * the PCI bus of the device is attached to, if any.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static void pciemu_hostnuma_follow_guest(PCIEMUDevice *dev)
+{
+    DMAHostNuma *numa = &dev->dma.numa;
+    MachineState *ms = current_machine;
+    if (!ms || !ms->numa_state)
+        return;
+    int node = pci_bus_numa_node(pci_get_bus(&dev->pci_dev));
+    if (node == NUMA_NODE_UNASSIGNED || node >= ms->numa_state->num_nodes)
+        return;
+    HostMemoryBackend *memdev = ms->numa_state->nodes[node].node_memdev;
+    if (!memdev || memdev->policy == HOST_MEM_POLICY_DEFAULT)
+        return;
+    bitmap_copy(numa->host_nodes, memdev->host_nodes, MAX_NODES + 1);
+    numa->policy = memdev->policy;
+}
+
+#ifdef CONFIG_LINUX
+/**
+ * pciemu_hostnuma_parse_cpus: Add a CPU list to a CPU set
+ *
+ * The list is formatted as the cpulist files of sysfs, e.g. "0-3,8,10-11".
+ *
+ * @list: CPU list
+ * @cpus: CPU set receiving the CPUs
+ */
+static bool pciemu_hostnuma_parse_cpus(const char *list, cpu_set_t *cpus)
+{
+    const char *p = list;
+    while (*p && *p != '\n') {
+        char *end;
+        unsigned long first = strtoul(p, &end, 10);
+        unsigned long last = first;
+        if (end == p)
+            return false;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+            if (end == p || last < first)
+                return false;
+        }
+        for (unsigned long cpu = first; cpu <= last && cpu < CPU_SETSIZE;
+             ++cpu)
+            CPU_SET(cpu, cpus);
+        if (*end == ',')
+            ++end;
+        else if (*end && *end != '\n')
+            return false;
+        p = end;
+    }
+    return true;
+}
+
+/**
+ * pciemu_hostnuma_node_cpus: Add the CPUs of a host node to a CPU set
+ *
+ * Returns false if the node does not exist. A node without CPU (memory
+ * only) adds nothing.
+ *
+ * @node: host node
+ * @cpus: CPU set receiving the CPUs
+ */
+static bool pciemu_hostnuma_node_cpus(unsigned long node, cpu_set_t *cpus)
+{
+    char path[64];
+    char *line = NULL;
+    size_t n = 0;
+    bool ok = false;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%lu/cpulist",
+             node);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return false;
+    if (getline(&line, &n, fp) >= 0)
+        ok = pciemu_hostnuma_parse_cpus(line, cpus);
+    free(line);
+    fclose(fp);
+    return ok;
+}
+#endif /* CONFIG_LINUX */
+
+/* -----------------------------------------------------------------------------
+ *  Public
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_hostnuma_get_nodes: Getter of the host-nodes property
+ *
+ * @obj: Instance of PCIEMUDevice object being queried
+ * @v: visitor of the property
+ * @name: name of the property
+ * @opaque: unused
+ * @errp: pointer to indicate errors
+ */
+void pciemu_hostnuma_get_nodes(Object *obj, Visitor *v, const char *name,
+                               void *opaque, Error **errp)
+{
+    PCIEMUDevice *dev = PCIEMU_DEVICE(obj);
+    uint16List *host_nodes = NULL;
+    uint16List **tail = &host_nodes;
+    for (unsigned long node = 0; node < MAX_NODES; ++node) {
+        if (test_bit(node, dev->dma.numa.host_nodes))
+            QAPI_LIST_APPEND(tail, node);
+    }
+    visit_type_uint16List(v, name, &host_nodes, errp);
+    qapi_free_uint16List(host_nodes);
+}
+
+/**
+ * pciemu_hostnuma_set_nodes: Setter of the host-nodes property
+ *
+ * @obj: Instance of PCIEMUDevice object being configured
+ * @v: visitor of the property
+ * @name: name of the property
+ * @opaque: unused
+ * @errp: pointer to indicate errors
+ */
+void pciemu_hostnuma_set_nodes(Object *obj, Visitor *v, const char *name,
+                               void *opaque, Error **errp)
+{
+    PCIEMUDevice *dev = PCIEMU_DEVICE(obj);
+    uint16List *l, *host_nodes = NULL;
+    if (!visit_type_uint16List(v, name, &host_nodes, errp))
+        return;
+    for (l = host_nodes; l; l = l->next) {
+        if (l->value >= MAX_NODES) {
+            error_setg(errp, "Invalid host-nodes value: %d", l->value);
+            goto out;
+        }
+    }
+    for (l = host_nodes; l; l = l->next)
+        set_bit(l->value, dev->dma.numa.host_nodes);
+out:
+    qapi_free_uint16List(host_nodes);
+}
+
+/**
+ * pciemu_hostnuma_get_policy: Getter of the policy property
+ *
+ * @obj: Instance of PCIEMUDevice object being queried
+ * @errp: pointer to indicate errors
+ */
+int pciemu_hostnuma_get_policy(Object *obj, Error **errp)
+{
+    return PCIEMU_DEVICE(obj)->dma.numa.policy;
+}
+
+/**
+ * pciemu_hostnuma_set_policy: Setter of the policy property
+ *
+ * @obj: Instance of PCIEMUDevice object being configured
+ * @policy: HostMemPolicy
+ * @errp: pointer to indicate errors
+ */
+void pciemu_hostnuma_set_policy(Object *obj, int policy, Error **errp)
+{
+    PCIEMU_DEVICE(obj)->dma.numa.policy = policy;
+}
+
+/**
+ * pciemu_hostnuma_enabled: Whether the device is placed on host nodes
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+bool pciemu_hostnuma_enabled(PCIEMUDevice *dev)
+{
+    return dev->dma.numa.policy != HOST_MEM_POLICY_DEFAULT;
+}
+
+/**
+ * pciemu_hostnuma_alloc: Allocate device memory on the host nodes
+ *
+ * The memory is zeroed and freed by pciemu_hostnuma_fini.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @size: size of the device memory in bytes
+ * @errp: pointer to indicate errors
+ */
+uint8_t *pciemu_hostnuma_alloc(PCIEMUDevice *dev, size_t size, Error **errp)
+{
+    DMAHostNuma *numa = &dev->dma.numa;
+    uint8_t *buff = qemu_memalign(qemu_real_host_page_size(), size);
+#ifdef CONFIG_NUMA
+    /* HostMemPolicy matches the MPOL_* modes, and mbind drops the last node
+     * of the mask (as in hostmem.c) : one more node is passed */
+    unsigned long maxnode = pciemu_hostnuma_last_node(numa) + 1;
+    if (mbind(buff, size, numa->policy, numa->host_nodes, maxnode + 1,
+              MPOL_MF_STRICT | MPOL_MF_MOVE)) {
+        error_setg_errno(errp, errno,
+                         "cannot bind the device memory to the host nodes");
+        qemu_vfree(buff);
+        return NULL;
+    }
+#endif
+    /* first touch, once bound */
+    memset(buff, 0, size);
+    numa->buff = buff;
+    return buff;
+}
+
+/**
+ * pciemu_hostnuma_pin: Pin the calling thread to the host nodes
+ *
+ * Used by the workers around a transfer of the device. Nothing is done if
+ * the device is not placed (or its nodes have no CPU).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @saved: affinity of the thread, restored by pciemu_hostnuma_unpin
+ */
+void pciemu_hostnuma_pin(PCIEMUDevice *dev, HostNumaAffinity *saved)
+{
+    saved->pinned = false;
+#ifdef CONFIG_LINUX
+    DMAHostNuma *numa = &dev->dma.numa;
+    if (!CPU_COUNT(&numa->cpus))
+        return;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(saved->cpus),
+                               &saved->cpus))
+        return;
+    saved->pinned = !pthread_setaffinity_np(pthread_self(), sizeof(numa->cpus),
+                                            &numa->cpus);
+#endif
+}
+
+/**
+ * pciemu_hostnuma_unpin: Restore the affinity of the calling thread
+ *
+ * @saved: affinity saved by pciemu_hostnuma_pin
+ */
+void pciemu_hostnuma_unpin(HostNumaAffinity *saved)
+{
+#ifdef CONFIG_LINUX
+    if (saved->pinned)
+        pthread_setaffinity_np(pthread_self(), sizeof(saved->cpus),
+                               &saved->cpus);
+#endif
+    saved->pinned = false;
+}
+
+/**
+ * pciemu_hostnuma_init: Host NUMA placement initialization
+ *
+ * Checks host-nodes against policy, as a memory backend does, and gathers
+ * the CPUs of the nodes.
+ *
+ * @dev: Instance of PCIEMUDevice object being initialized
+ * @errp: pointer to indicate errors
+ */
+void pciemu_hostnuma_init(PCIEMUDevice *dev, Error **errp)
+{
+    DMAHostNuma *numa = &dev->dma.numa;
+    numa->buff = NULL;
+#ifdef CONFIG_LINUX
+    CPU_ZERO(&numa->cpus);
+#endif
+    if (pciemu_hostnuma_last_node(numa) == MAX_NODES &&
+        numa->policy == HOST_MEM_POLICY_DEFAULT)
+        pciemu_hostnuma_follow_guest(dev);
+
+    unsigned long last = pciemu_hostnuma_last_node(numa);
+    if (last == MAX_NODES) {
+        if (numa->policy != HOST_MEM_POLICY_DEFAULT)
+            error_setg(errp, "host-nodes must be set for policy %s",
+                       HostMemPolicy_str(numa->policy));
+        return;
+    }
+    if (numa->policy == HOST_MEM_POLICY_DEFAULT) {
+        error_setg(errp, "host-nodes must be empty for policy default, or "
+                   "you should explicitly specify a policy other than default");
+        return;
+    }
+#ifdef CONFIG_NUMA
+    for (unsigned long node = 0; node <= last; ++node) {
+        if (!test_bit(node, numa->host_nodes))
+            continue;
+        if (!pciemu_hostnuma_node_cpus(node, &numa->cpus)) {
+            error_setg(errp, "host node %lu does not exist", node);
+            return;
+        }
+    }
+#else
+    error_setg(errp, "NUMA node binding is not supported by this QEMU");
+#endif
+}
+
+/**
+ * pciemu_hostnuma_fini: Host NUMA placement finalization
+ *
+ * @dev: Instance of PCIEMUDevice object being finalized
+ */
+void pciemu_hostnuma_fini(PCIEMUDevice *dev)
+{
+    DMAHostNuma *numa = &dev->dma.numa;
+    qemu_vfree(numa->buff);
+    numa->buff = NULL;
+}
@@ -0,0 +1,64 @@
+/* hostnuma.h - Placement of the device on host NUMA nodes
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_HOSTNUMA_H
+#define PCIEMU_HOSTNUMA_H
+
+#include "qemu/osdep.h"
+#include "qemu/bitops.h"
+#include "qapi/visitor.h"
+#include "qom/object.h"
+#include "sysemu/hostmem.h"
+#include "sysemu/numa.h"
+
+/* forward declaration (defined in pciemu.h) to avoid circular reference */
+typedef struct PCIEMUDevice PCIEMUDevice;
+
+/* affinity of a worker thread, restored once its transfer is done */
+typedef struct HostNumaAffinity {
+    bool pinned;
+#ifdef CONFIG_LINUX
+    cpu_set_t cpus;
+#endif
+} HostNumaAffinity;
+
+typedef struct DMAHostNuma {
+    /* properties (host-nodes and policy, as for a memory backend) */
+    DECLARE_BITMAP(host_nodes, MAX_NODES + 1);
+    HostMemPolicy policy;
+    /* state */
+#ifdef CONFIG_LINUX
+    cpu_set_t cpus; /* CPUs of the host nodes, empty if not pinned */
+#endif
+    uint8_t *buff; /* device memory bound to the host nodes (no memdev) */
+} DMAHostNuma;
+
+
+void pciemu_hostnuma_get_nodes(Object *obj, Visitor *v, const char *name,
+                               void *opaque, Error **errp);
+
+void pciemu_hostnuma_set_nodes(Object *obj, Visitor *v, const char *name,
+                               void *opaque, Error **errp);
+
+int pciemu_hostnuma_get_policy(Object *obj, Error **errp);
+
+void pciemu_hostnuma_set_policy(Object *obj, int policy, Error **errp);
+
+bool pciemu_hostnuma_enabled(PCIEMUDevice *dev);
+
+uint8_t *pciemu_hostnuma_alloc(PCIEMUDevice *dev, size_t size, Error **errp);
+
+void pciemu_hostnuma_pin(PCIEMUDevice *dev, HostNumaAffinity *saved);
+
+void pciemu_hostnuma_unpin(HostNumaAffinity *saved);
+
+void pciemu_hostnuma_init(PCIEMUDevice *dev, Error **errp);
+
+void pciemu_hostnuma_fini(PCIEMUDevice *dev);
+
+#endif /* PCIEMU_HOSTNUMA_H */
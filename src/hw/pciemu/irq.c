@@ -1,4 +1,9 @@
 /* irq.c - Interrupt Request operations
+ *
+ * The interrupt controllers need the BQL, which a vCPU writing BAR0 does not
+ * hold (see mmio.c) : the vCPU records the signal (the MSI vector or the
+ * level of the pin) and the main loop sends it right after, so a doorbell
+ * never waits for the BQL to raise its IRQ.
  *
  * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
  *
@@ -7,7 +12,10 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "qemu/lockable.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
 #include "hw/pci/msi.h"
 #include "pciemu.h"
 #include "irq.h"
@@ -57,6 +65,35 @@ static inline void pciemu_irq_init_intx(PCIEMUDevice *dev, Error **errp)
     pci_config_set_interrupt_pin(pci_conf, PCIEMU_HW_IRQ_INTX + 1);
 }
 
+/**
+ * pciemu_irq_signal_defer: Leave a signal to the main loop, without the BQL
+ *
+ * Returns false if the BQL is held : the signal is sent right away then.
+ *
+ * @dev: Instance of PCIEMUDevice object
+ */
+static bool pciemu_irq_signal_defer(PCIEMUDevice *dev)
+{
+    if (qemu_mutex_iothread_locked())
+        return false;
+    timer_mod_ns(&dev->irq.signal, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    return true;
+}
+
+/**
+ * pciemu_irq_set_pin: Set the level of the pin to its status
+ *
+ * @dev: Instance of PCIEMUDevice object
+ */
+static void pciemu_irq_set_pin(PCIEMUDevice *dev)
+{
+    if (pciemu_irq_signal_defer(dev)) {
+        dev->irq.signal_pin = true;
+        return;
+    }
+    pci_set_irq(&dev->pci_dev, dev->irq.status.pin.raised);
+}
+
 /**
  * pciemu_irq_raise_intx: Raise the IRQ if MSI is disabled
  *
@@ -65,7 +102,7 @@ static inline void pciemu_irq_init_intx(PCIEMUDevice *dev, Error **errp)
 static inline void pciemu_irq_raise_intx(PCIEMUDevice *dev)
 {
     dev->irq.status.pin.raised = true;
-    pci_set_irq(&dev->pci_dev, 1);
+    pciemu_irq_set_pin(dev);
 }
 
 /**
@@ -81,6 +118,10 @@ static inline void pciemu_irq_raise_msi(PCIEMUDevice *dev, unsigned int vector)
     MSIVector *msi_vector = &dev->irq.status.msi.msi_vectors[vector];
 
     msi_vector->raised = true;
+    if (pciemu_irq_signal_defer(dev)) {
+        dev->irq.signal_msi |= 1u << vector;
+        return;
+    }
     msi_notify(&dev->pci_dev, vector);
 }
 
@@ -92,7 +133,7 @@ static inline void pciemu_irq_raise_msi(PCIEMUDevice *dev, unsigned int vector)
 static inline void pciemu_irq_lower_intx(PCIEMUDevice *dev)
 {
     dev->irq.status.pin.raised = false;
-    pci_set_irq(&dev->pci_dev, 0);
+    pciemu_irq_set_pin(dev);
 }
 
 /**
@@ -111,28 +152,221 @@ static inline void pciemu_irq_lower_msi(PCIEMUDevice *dev, unsigned int vector)
     msi_vector->raised = false;
 }
 
+/**
+ * pciemu_irq_notify: Raise the IRQ of a vector
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @vector: the IRQ vector being raised
+ */
+static void pciemu_irq_notify(PCIEMUDevice *dev, unsigned int vector)
+{
+    /* If no MSI available on host, we should fallback to pin IRQ assertion */
+    if (!msi_enabled(&dev->pci_dev))
+        pciemu_irq_raise_intx(dev);
+    else /* MSI is available */
+        pciemu_irq_raise_msi(dev, vector);
+}
+
+/**
+ * pciemu_irq_deliver: Raise the IRQs of unmasked causes
+ *
+ * A single IRQ is raised per vector, whatever the number of causes.
+ * Only DMA_DONE closes the latency stages of the DMA command.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @cause: causes to deliver (PCIEMU_HW_IRQ_CAUSE_*, already unmasked)
+ */
+static void pciemu_irq_deliver(PCIEMUDevice *dev, uint32_t cause)
+{
+    if (cause & PCIEMU_HW_IRQ_CAUSE_RX_DONE)
+        pciemu_irq_notify(dev, PCIEMU_HW_IRQ_RX_DONE_VECTOR);
+    if (cause & ~PCIEMU_HW_IRQ_CAUSE_RX_DONE)
+        pciemu_irq_notify(dev, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR);
+    if (cause & PCIEMU_HW_IRQ_CAUSE_DMA_DONE)
+        pciemu_stats_irq(dev, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR);
+}
+
+/**
+ * pciemu_irq_update_intx: Deassert the line once no unmasked cause is set
+ *
+ * Nothing to do with MSI, whose notifications are edges.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static void pciemu_irq_update_intx(PCIEMUDevice *dev)
+{
+    IRQStatus *irq = &dev->irq;
+    if (!msi_enabled(&dev->pci_dev) && irq->status.pin.raised &&
+        !(irq->cause & ~irq->mask))
+        pciemu_irq_lower_intx(dev);
+}
+
+/**
+ * pciemu_irq_timer_arm: (Re)start the periodic TIMER cause
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static void pciemu_irq_timer_arm(PCIEMUDevice *dev)
+{
+    IRQStatus *irq = &dev->irq;
+    timer_del(&irq->timer);
+    if (irq->timer_ns)
+        timer_mod_ns(&irq->timer,
+                     qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + irq->timer_ns);
+}
+
+/**
+ * pciemu_irq_timer_cb: The period of the TIMER cause elapsed
+ *
+ * @opaque: opaque pointer that points to instantiated object
+ */
+static void pciemu_irq_timer_cb(void *opaque)
+{
+    PCIEMUDevice *dev = opaque;
+    QEMU_LOCK_GUARD(&dev->lock);
+    pciemu_irq_timer_arm(dev);
+    pciemu_irq_event(dev, PCIEMU_HW_IRQ_CAUSE_TIMER);
+}
+
+/**
+ * pciemu_irq_signal_cb: Send the signals left by the vCPUs
+ *
+ * The pin ends at its last level, whatever the levels in between.
+ *
+ * @opaque: opaque pointer that points to instantiated object
+ */
+static void pciemu_irq_signal_cb(void *opaque)
+{
+    PCIEMUDevice *dev = opaque;
+    IRQStatus *irq = &dev->irq;
+    QEMU_LOCK_GUARD(&dev->lock);
+    while (irq->signal_msi) {
+        unsigned int vector = ctz32(irq->signal_msi);
+        irq->signal_msi &= irq->signal_msi - 1;
+        /* MSI may have been disabled meanwhile */
+        if (msi_enabled(&dev->pci_dev))
+            msi_notify(&dev->pci_dev, vector);
+    }
+    if (irq->signal_pin) {
+        irq->signal_pin = false;
+        pci_set_irq(&dev->pci_dev, irq->status.pin.raised);
+    }
+}
+
+/**
+ * pciemu_irq_cause_reset: Clear the causes and restore the default mask
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static void pciemu_irq_cause_reset(PCIEMUDevice *dev)
+{
+    IRQStatus *irq = &dev->irq;
+    irq->cause = 0;
+    irq->mask = PCIEMU_HW_IRQ_MASK_DEFAULT;
+    irq->queue_threshold = 0;
+    irq->timer_ns = 0;
+    timer_del(&irq->timer);
+}
+
 /* -----------------------------------------------------------------------------
  *  Public
  * -----------------------------------------------------------------------------
  */
 
+/**
+ * pciemu_irq_read: Read a register of the IRQ causes
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @addr: address inside BAR0 (PCIEMU_HW_BAR0_IRQ_CAUSE to _TIMER_NS)
+ */
+uint64_t pciemu_irq_read(PCIEMUDevice *dev, hwaddr addr)
+{
+    IRQStatus *irq = &dev->irq;
+    switch (addr) {
+    case PCIEMU_HW_BAR0_IRQ_CAUSE:
+        return irq->cause;
+    case PCIEMU_HW_BAR0_IRQ_MASK:
+        return irq->mask;
+    case PCIEMU_HW_BAR0_IRQ_QUEUE_THRESHOLD:
+        return irq->queue_threshold;
+    case PCIEMU_HW_BAR0_IRQ_TIMER_NS:
+        return irq->timer_ns;
+    }
+    return ~0ULL;
+}
+
+/**
+ * pciemu_irq_write: Write a register of the IRQ causes
+ *
+ * Clearing the causes or masking them deasserts INTx once no unmasked cause
+ * is left. Unmasking causes already set raises their IRQ. A timer period
+ * below PCIEMU_HW_IRQ_TIMER_NS_MIN is ignored, the current one is kept.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @addr: address inside BAR0 (PCIEMU_HW_BAR0_IRQ_CAUSE to _TIMER_NS)
+ * @val: value to be written
+ */
+void pciemu_irq_write(PCIEMUDevice *dev, hwaddr addr, uint64_t val)
+{
+    IRQStatus *irq = &dev->irq;
+    uint32_t unmasked;
+    switch (addr) {
+    case PCIEMU_HW_BAR0_IRQ_CAUSE:
+        irq->cause &= ~val;
+        pciemu_irq_update_intx(dev);
+        break;
+    case PCIEMU_HW_BAR0_IRQ_MASK:
+        unmasked = irq->cause & irq->mask & ~val;
+        irq->mask = val & PCIEMU_HW_IRQ_CAUSE_ALL;
+        if (unmasked)
+            pciemu_irq_deliver(dev, unmasked);
+        else
+            pciemu_irq_update_intx(dev);
+        break;
+    case PCIEMU_HW_BAR0_IRQ_QUEUE_THRESHOLD:
+        irq->queue_threshold = MIN(val, PCIEMU_HW_DMA_QUEUE_SIZE);
+        break;
+    case PCIEMU_HW_BAR0_IRQ_TIMER_NS:
+        if (val && val < PCIEMU_HW_IRQ_TIMER_NS_MIN) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "IRQ timer period (%" PRIu64 " ns) below %d ns\n",
+                          val, PCIEMU_HW_IRQ_TIMER_NS_MIN);
+            break;
+        }
+        irq->timer_ns = val;
+        pciemu_irq_timer_arm(dev);
+        break;
+    }
+}
+
+/**
+ * pciemu_irq_event: Record interrupt events
+ *
+ * Sets the causes and raises the IRQ of those which are not masked.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @cause: events (PCIEMU_HW_IRQ_CAUSE_*)
+ */
+void pciemu_irq_event(PCIEMUDevice *dev, uint32_t cause)
+{
+    IRQStatus *irq = &dev->irq;
+    irq->cause |= cause;
+    if (cause & ~irq->mask)
+        pciemu_irq_deliver(dev, cause & ~irq->mask);
+}
+
 /**
  * pciemu_irq_raise: Raise the IRQ
  *
- * Used to raise an interrupt.
+ * Used to raise an interrupt regardless of the causes (debug register).
  *
  * @dev: Instance of PCIEMUDevice object being used
  * @vector: the IRQ vector being raised
  */
 void pciemu_irq_raise(PCIEMUDevice *dev, unsigned int vector)
 {
-    /* If no MSI available on host, we should fallback to pin IRQ assertion */
-    if (!msi_enabled(&dev->pci_dev)) {
-        pciemu_irq_raise_intx(dev);
-        return;
-    }
-    /* MSI is available */
-    pciemu_irq_raise_msi(dev, vector);
+    pciemu_irq_notify(dev, vector);
+    pciemu_stats_irq(dev, vector);
 }
 
 /**
@@ -157,7 +391,8 @@ void pciemu_irq_lower(PCIEMUDevice *dev, unsigned int vector)
 /**
  * pciemu_irq_reset: IRQ reset
  *
- * Basically resets (lowers) all IRQ vectors
+ * Basically resets (lowers) all IRQ vectors, clears the causes and stops
+ * the TIMER cause. The signals left by the vCPUs are dropped.
  *
  * @dev: Instance of PCIEMUDevice object being reset
  */
@@ -165,6 +400,10 @@ void pciemu_irq_reset(PCIEMUDevice *dev)
 {
     for (int i = PCIEMU_HW_IRQ_VECTOR_START; i <= PCIEMU_HW_IRQ_VECTOR_END; ++i)
         pciemu_irq_lower(dev, i);
+    pciemu_irq_cause_reset(dev);
+    timer_del(&dev->irq.signal);
+    dev->irq.signal_msi = 0;
+    dev->irq.signal_pin = false;
 }
 
 /**
@@ -183,6 +422,11 @@ void pciemu_irq_init(PCIEMUDevice *dev, Error **errp)
     pciemu_irq_init_intx(dev, errp);
     /* try to confingure MSI based interrupt (preferred) */
     pciemu_irq_init_msi(dev, errp);
+    timer_init_ns(&dev->irq.timer, QEMU_CLOCK_VIRTUAL, pciemu_irq_timer_cb,
+                  dev);
+    timer_init_ns(&dev->irq.signal, QEMU_CLOCK_VIRTUAL, pciemu_irq_signal_cb,
+                  dev);
+    pciemu_irq_cause_reset(dev);
 }
 
 /**
@@ -11,6 +11,7 @@
 
 #include "qemu/osdep.h"
 #include "hw/pci/pci.h"
+#include "qemu/timer.h"
 
 #define PCIEMU_IRQ_MAX_VECTORS 32
 
@@ -28,11 +29,7 @@ typedef struct IRQStatusMSI {
 } IRQStatusMSI;
 
 typedef struct IRQStatusPin {
-    /* our simple device has only one interrupt, a more complex one
-     * would require us to track in some way which event caused the
-     * interrupt. Thus, a bool type would not be appropriate.
-     * We would probably need to use a masked scheme .
-     */
+    /* the events behind the interrupt are tracked by IRQStatus.cause */
     bool raised;
 } IRQStatusPin;
 
@@ -42,8 +39,24 @@ typedef struct IRQStatus {
         IRQStatusMSI msi;
         IRQStatusPin pin;
     } status;
+    /* causes (PCIEMU_HW_IRQ_CAUSE_*, registers described in pciemu_hw.h) */
+    uint32_t cause;
+    uint32_t mask;
+    uint32_t queue_threshold;
+    uint64_t timer_ns; /* period of the TIMER cause, 0 = stopped */
+    QEMUTimer timer;
+    /* signals left to the main loop by a vCPU (see irq.c) */
+    uint32_t signal_msi; /* vectors to notify */
+    bool signal_pin;     /* level of the pin to set */
+    QEMUTimer signal;
 } IRQStatus;
 
+uint64_t pciemu_irq_read(PCIEMUDevice *dev, hwaddr addr);
+
+void pciemu_irq_write(PCIEMUDevice *dev, hwaddr addr, uint64_t val);
+
+void pciemu_irq_event(PCIEMUDevice *dev, uint32_t cause);
+
 void pciemu_irq_raise(PCIEMUDevice *dev, unsigned int vector);
 
 void pciemu_irq_lower(PCIEMUDevice *dev, unsigned int vector);
@@ -0,0 +1,245 @@
+/* latency.c - Completion latency model
+ *
+ * Draws the delay between the end of a transfer and its completion (IRQ)
+ * from a configurable distribution, so drivers can be studied under
+ * jittery hardware (p99, p999) instead of instantaneous completions :
+ *   - fixed : always mean_ns
+ *   - uniform : uniformly distributed in [min_ns, max_ns]
+ *   - lognormal : mean of mean_ns, with sigma (shape) of sigma_milli / 1000
+ *   - histogram : empirical distribution loaded from hist_file
+ * Every sample is then clamped to [min_ns, max_ns] (max_ns = 0 : no bound).
+ *
+ * The generator is seeded with the seed property, so a given configuration
+ * always produces the same sequence of delays (e.g. for replays).
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include <math.h>
+#include "qapi/error.h"
+#include "latency.h"
+
+/* -----------------------------------------------------------------------------
+ *  Private
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_latency_rand: Next 64-bit pseudo-random number (splitmix64)
+ *
+ * @lat: latency model being used
+ */
+static inline uint64_t pciemu_latency_rand(LatencyModel *lat)
+{
+    uint64_t z = (lat->rng += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * pciemu_latency_rand_unit: Pseudo-random number uniformly in (0, 1]
+ *
+ * @lat: latency model being used
+ */
+static inline double pciemu_latency_rand_unit(LatencyModel *lat)
+{
+    return ((pciemu_latency_rand(lat) >> 11) + 1) * 0x1.0p-53;
+}
+
+/**
+ * pciemu_latency_lognormal: Sample of the lognormal distribution
+ *
+ * The normal sample comes from the Box-Muller transform. The location is
+ * chosen so that the mean of the distribution is mean_ns.
+ *
+ * @lat: latency model being used
+ */
+static uint64_t pciemu_latency_lognormal(LatencyModel *lat)
+{
+    double sigma = lat->sigma_milli / 1000.0;
+    double u1 = pciemu_latency_rand_unit(lat);
+    double u2 = pciemu_latency_rand_unit(lat);
+    double z = sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+    double ns = lat->mean_ns * exp(sigma * z - sigma * sigma / 2.0);
+    /* a large sigma overflows the conversion (undefined) : saturate */
+    return ns < 0x1.0p64 ? ns : UINT64_MAX;
+}
+
+/**
+ * pciemu_latency_hist: Sample of the empirical histogram
+ *
+ * @lat: latency model being used
+ */
+static uint64_t pciemu_latency_hist(LatencyModel *lat)
+{
+    uint64_t total = lat->hist[lat->hist_cnt - 1].cum_weight;
+    uint64_t r = pciemu_latency_rand(lat) % total;
+    unsigned int lo = 0, hi = lat->hist_cnt - 1;
+    /* first bin whose cumulative weight is above r */
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        if (lat->hist[mid].cum_weight > r)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lat->hist[lo].ns;
+}
+
+/**
+ * pciemu_latency_load_hist: Load the empirical histogram from hist_file
+ *
+ * Each line holds a latency in ns and its weight (e.g. a count of samples).
+ * Empty lines and lines starting with '#' are ignored.
+ *
+ * @lat: latency model being used
+ * @errp: pointer to indicate errors
+ */
+static bool pciemu_latency_load_hist(LatencyModel *lat, Error **errp)
+{
+    char line[256];
+    unsigned int lineno = 0;
+    uint64_t cum = 0;
+    bool ok = true;
+    FILE *fp;
+
+    if (!lat->hist_file) {
+        error_setg(errp, "latency-dist=histogram requires latency-hist-file");
+        return false;
+    }
+    fp = fopen(lat->hist_file, "r");
+    if (!fp) {
+        error_setg(errp, "failed to open %s: %s", lat->hist_file,
+                   strerror(errno));
+        return false;
+    }
+    lat->hist_cnt = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        uint64_t ns, weight;
+        char *p = line + strspn(line, " \t");
+        lineno++;
+        if (*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+        if (sscanf(p, "%" SCNu64 " %" SCNu64, &ns, &weight) != 2) {
+            error_setg(errp, "%s:%u: expected '<ns> <weight>'",
+                       lat->hist_file, lineno);
+            ok = false;
+            break;
+        }
+        if (!weight)
+            continue;
+        if (lat->hist_cnt == PCIEMU_LATENCY_HIST_MAX) {
+            error_setg(errp, "%s: more than %d bins", lat->hist_file,
+                       PCIEMU_LATENCY_HIST_MAX);
+            ok = false;
+            break;
+        }
+        cum += weight;
+        lat->hist[lat->hist_cnt].ns = ns;
+        lat->hist[lat->hist_cnt].cum_weight = cum;
+        lat->hist_cnt++;
+    }
+    fclose(fp);
+    if (!ok)
+        return false;
+    if (!lat->hist_cnt) {
+        error_setg(errp, "%s: empty histogram", lat->hist_file);
+        return false;
+    }
+    return true;
+}
+
+/* -----------------------------------------------------------------------------
+ *  Public
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_latency_sample: Draw the delay of the next completion
+ *
+ * Returns the delay in ns (0 means an immediate completion).
+ *
+ * @lat: latency model being used
+ */
+uint64_t pciemu_latency_sample(LatencyModel *lat)
+{
+    uint64_t ns, span;
+    switch (lat->type) {
+    case LATENCY_DIST_FIXED:
+        ns = lat->mean_ns;
+        break;
+    case LATENCY_DIST_UNIFORM:
+        span = lat->max_ns - lat->min_ns;
+        ns = lat->min_ns;
+        /* the whole 64-bit range has no modulo */
+        if (span == UINT64_MAX)
+            ns = pciemu_latency_rand(lat);
+        else if (lat->max_ns > lat->min_ns)
+            ns += pciemu_latency_rand(lat) % (span + 1);
+        break;
+    case LATENCY_DIST_LOGNORMAL:
+        ns = pciemu_latency_lognormal(lat);
+        break;
+    case LATENCY_DIST_HIST:
+        ns = pciemu_latency_hist(lat);
+        break;
+    default:
+        return 0;
+    }
+    ns = MAX(ns, lat->min_ns);
+    if (lat->max_ns)
+        ns = MIN(ns, lat->max_ns);
+    return ns;
+}
+
+/**
+ * pciemu_latency_reset: Latency model reset
+ *
+ * Reseeds the generator, so the sequence of delays restarts.
+ *
+ * @lat: latency model being used
+ */
+void pciemu_latency_reset(LatencyModel *lat)
+{
+    lat->rng = lat->seed;
+}
+
+/**
+ * pciemu_latency_init: Latency model initialization
+ *
+ * Parses the distribution and loads the histogram, if any. The bounds are
+ * rejected if inverted (min_ns above a non-zero max_ns).
+ *
+ * @lat: latency model being initialized
+ * @errp: pointer to indicate errors
+ */
+void pciemu_latency_init(LatencyModel *lat, Error **errp)
+{
+    lat->type = LATENCY_DIST_NONE;
+    pciemu_latency_reset(lat);
+    if (!lat->dist || !strcmp(lat->dist, "none"))
+        return;
+    if (lat->max_ns && lat->min_ns > lat->max_ns) {
+        error_setg(errp, "latency-min-ns (%" PRIu64 ") above latency-max-ns "
+                   "(%" PRIu64 ")", lat->min_ns, lat->max_ns);
+        return;
+    }
+    if (!strcmp(lat->dist, "fixed")) {
+        lat->type = LATENCY_DIST_FIXED;
+    } else if (!strcmp(lat->dist, "uniform")) {
+        lat->type = LATENCY_DIST_UNIFORM;
+    } else if (!strcmp(lat->dist, "lognormal")) {
+        lat->type = LATENCY_DIST_LOGNORMAL;
+    } else if (!strcmp(lat->dist, "histogram")) {
+        if (pciemu_latency_load_hist(lat, errp))
+            lat->type = LATENCY_DIST_HIST;
+    } else {
+        error_setg(errp, "invalid latency-dist '%s' (expected none, fixed, "
+                   "uniform, lognormal or histogram)", lat->dist);
+    }
+}
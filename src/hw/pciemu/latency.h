@@ -0,0 +1,55 @@
+/* latency.h - Completion latency model
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_LATENCY_H
+#define PCIEMU_LATENCY_H
+
+#include "qemu/osdep.h"
+
+/* maximum number of bins of an empirical histogram */
+#define PCIEMU_LATENCY_HIST_MAX 1024
+
+/* distribution of the completion latency */
+typedef enum LatencyDist {
+    LATENCY_DIST_NONE,
+    LATENCY_DIST_FIXED,
+    LATENCY_DIST_UNIFORM,
+    LATENCY_DIST_LOGNORMAL,
+    LATENCY_DIST_HIST,
+} LatencyDist;
+
+/* bin of an empirical histogram */
+typedef struct LatencyBin {
+    uint64_t ns;
+    uint64_t cum_weight; /* sum of the weights up to this bin (inclusive) */
+} LatencyBin;
+
+typedef struct LatencyModel {
+    /* properties */
+    char *dist;         /* none, fixed, uniform, lognormal or histogram */
+    uint64_t mean_ns;   /* fixed value or mean of the lognormal */
+    uint64_t min_ns;    /* lower bound (and of the uniform range) */
+    uint64_t max_ns;    /* upper bound (and of the uniform range), 0 = none */
+    uint32_t sigma_milli; /* sigma of the lognormal, in thousandths */
+    char *hist_file;    /* empirical histogram : "<ns> <weight>" per line */
+    uint64_t seed;
+    /* state */
+    LatencyDist type;
+    uint64_t rng;
+    LatencyBin hist[PCIEMU_LATENCY_HIST_MAX];
+    unsigned int hist_cnt;
+} LatencyModel;
+
+
+uint64_t pciemu_latency_sample(LatencyModel *lat);
+
+void pciemu_latency_reset(LatencyModel *lat);
+
+void pciemu_latency_init(LatencyModel *lat, Error **errp);
+
+#endif /* PCIEMU_LATENCY_H */
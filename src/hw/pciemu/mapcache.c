@@ -0,0 +1,402 @@
+/* mapcache.c - Cache of the mappings of guest memory used by the DMAs
+ *
+ * Without cache, every DMA goes through the address space of the bus : the
+ * address is translated (through the IOMMU, if any) and dispatched to the
+ * memory region behind it, transfer after transfer. With
+ * map-cache-entries=N, the device keeps up to N ranges of guest RAM mapped
+ * into the host instead, so the transfers to a fixed set of buffers (e.g. a
+ * registered buffer pool) are a plain copy once their range is mapped.
+ *
+ * A range is cached when it is first transferred, if it is backed by RAM as
+ * a whole : a transfer crossing two regions (or two IOMMU pages) is not.
+ * The mappings are dropped when the bus address space changes (memory
+ * listener : RAM unplugged, bus master disabled, ...), when an IOMMU unmaps
+ * them (IOMMU notifiers) and on reset. Writes through a mapping set the RAM
+ * dirty, as an unmap would, so they are still seen by migration.
+ *
+ * The cache is used under the device lock, by the main loop and the vCPUs
+ * (see mmio.c), whose lock the listener and the notifiers take as well. The
+ * workers of the thread pool go through the address space.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/lockable.h"
+#include "qapi/error.h"
+#include "mapcache.h"
+#include "mmio.h"
+#include "pciemu.h"
+
+/* -----------------------------------------------------------------------------
+ *  Private
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_mapcache_evict: Drop the mapping of an entry
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @e: valid entry
+ */
+static void pciemu_mapcache_evict(PCIEMUDevice *dev, MapCacheEntry *e)
+{
+    /* the writes already set the RAM dirty, nothing left to account */
+    pci_dma_unmap(&dev->pci_dev, e->host, e->len, DMA_DIRECTION_FROM_DEVICE,
+                  0);
+    e->valid = false;
+}
+
+/**
+ * pciemu_mapcache_flush: Drop the mappings of all the entries
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static void pciemu_mapcache_flush(PCIEMUDevice *dev)
+{
+    DMAMapCache *mc = &dev->dma.mapcache;
+    for (uint32_t i = 0; i < mc->size; ++i) {
+        if (mc->entries[i].valid)
+            pciemu_mapcache_evict(dev, &mc->entries[i]);
+    }
+}
+
+/**
+ * pciemu_mapcache_invalidate: Drop the mappings overlapping a bus range
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @start: first bus address of the range
+ * @last: last bus address of the range (inclusive)
+ */
+static void pciemu_mapcache_invalidate(PCIEMUDevice *dev, hwaddr start,
+                                       hwaddr last)
+{
+    DMAMapCache *mc = &dev->dma.mapcache;
+    for (uint32_t i = 0; i < mc->size; ++i) {
+        MapCacheEntry *e = &mc->entries[i];
+        if (e->valid && e->addr <= last && start <= e->addr + e->len - 1) {
+            pciemu_mapcache_evict(dev, e);
+            mc->invalidations++;
+        }
+    }
+}
+
+/**
+ * pciemu_mapcache_disable: Stop caching for good
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static void pciemu_mapcache_disable(PCIEMUDevice *dev)
+{
+    warn_report("pciemu: cannot watch the IOMMU, map cache disabled");
+    dev->dma.mapcache.disabled = true;
+    pciemu_mapcache_flush(dev);
+}
+
+/**
+ * pciemu_mapcache_iommu_unmap: IOMMU notifier, a range was unmapped
+ *
+ * @n: notifier of the IOMMU region (MapCacheIOMMU)
+ * @iotlb: range unmapped, as an I/O virtual address (inside the region)
+ */
+static void pciemu_mapcache_iommu_unmap(IOMMUNotifier *n, IOMMUTLBEntry *iotlb)
+{
+    MapCacheIOMMU *iommu = container_of(n, MapCacheIOMMU, n);
+    hwaddr start = iommu->offset + iotlb->iova;
+    QEMU_LOCK_GUARD(&iommu->dev->lock);
+    pciemu_mapcache_invalidate(iommu->dev, start, start + iotlb->addr_mask);
+}
+
+/**
+ * pciemu_mapcache_region_add: Memory listener, a section appeared
+ *
+ * Only the IOMMU regions matter, their unmaps are watched from now on.
+ *
+ * @listener: listener of the bus address space (DMAMapCache)
+ * @section: section added to the bus address space
+ */
+static void pciemu_mapcache_region_add(MemoryListener *listener,
+                                       MemoryRegionSection *section)
+{
+    PCIEMUDevice *dev =
+        container_of(listener, PCIEMUDevice, dma.mapcache.listener);
+    DMAMapCache *mc = &dev->dma.mapcache;
+    MapCacheIOMMU *iommu = NULL;
+    if (!memory_region_is_iommu(section->mr))
+        return;
+    QEMU_LOCK_GUARD(&dev->lock);
+    for (int i = 0; i < PCIEMU_MAPCACHE_IOMMU_MAX && !iommu; ++i) {
+        if (!mc->iommus[i].used)
+            iommu = &mc->iommus[i];
+    }
+    if (!iommu) {
+        pciemu_mapcache_disable(dev);
+        return;
+    }
+    Int128 end = int128_add(int128_make64(section->offset_within_region),
+                            section->size);
+    int idx = memory_region_iommu_attrs_to_index(
+        IOMMU_MEMORY_REGION(section->mr), MEMTXATTRS_UNSPECIFIED);
+    iommu_notifier_init(&iommu->n, pciemu_mapcache_iommu_unmap,
+                        IOMMU_NOTIFIER_UNMAP, section->offset_within_region,
+                        int128_get64(int128_sub(end, int128_one())), idx);
+    if (memory_region_register_iommu_notifier(section->mr, &iommu->n, NULL)) {
+        pciemu_mapcache_disable(dev);
+        return;
+    }
+    iommu->mr = section->mr;
+    iommu->offset =
+        section->offset_within_address_space - section->offset_within_region;
+    iommu->dev = dev;
+    iommu->used = true;
+}
+
+/**
+ * pciemu_mapcache_region_del: Memory listener, a section disappeared
+ *
+ * The mappings of the section are dropped, as well as the notifier of an
+ * IOMMU region.
+ *
+ * @listener: listener of the bus address space (DMAMapCache)
+ * @section: section removed from the bus address space
+ */
+static void pciemu_mapcache_region_del(MemoryListener *listener,
+                                       MemoryRegionSection *section)
+{
+    PCIEMUDevice *dev =
+        container_of(listener, PCIEMUDevice, dma.mapcache.listener);
+    DMAMapCache *mc = &dev->dma.mapcache;
+    hwaddr start = section->offset_within_address_space;
+    hwaddr offset = start - section->offset_within_region;
+    QEMU_LOCK_GUARD(&dev->lock);
+    pciemu_mapcache_invalidate(
+        dev, start,
+        start + int128_get64(int128_sub(section->size, int128_one())));
+    for (int i = 0; i < PCIEMU_MAPCACHE_IOMMU_MAX; ++i) {
+        MapCacheIOMMU *iommu = &mc->iommus[i];
+        if (iommu->used && iommu->mr == section->mr &&
+            iommu->offset == offset) {
+            memory_region_unregister_iommu_notifier(section->mr, &iommu->n);
+            iommu->used = false;
+        }
+    }
+}
+
+/**
+ * pciemu_mapcache_lookup: Entry mapping a whole bus range
+ *
+ * @mc: map cache of the device
+ * @addr: bus address of the range
+ * @len: length of the range in bytes
+ */
+static MapCacheEntry *pciemu_mapcache_lookup(DMAMapCache *mc, dma_addr_t addr,
+                                             dma_addr_t len)
+{
+    for (uint32_t i = 0; i < mc->size; ++i) {
+        MapCacheEntry *e = &mc->entries[i];
+        if (e->valid && addr >= e->addr && len <= e->len &&
+            addr - e->addr <= e->len - len)
+            return e;
+    }
+    return NULL;
+}
+
+/**
+ * pciemu_mapcache_insert: Map a bus range into a new entry
+ *
+ * Evicts the least recently used entry if none is free. Returns NULL if the
+ * range is not backed by RAM as a whole, which is then not cached.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @addr: bus address of the range
+ * @len: length of the range in bytes
+ */
+static MapCacheEntry *pciemu_mapcache_insert(PCIEMUDevice *dev,
+                                             dma_addr_t addr, dma_addr_t len)
+{
+    DMAMapCache *mc = &dev->dma.mapcache;
+    dma_addr_t plen = len;
+    ram_addr_t mr_offset = 0;
+    MemoryRegion *mr = NULL;
+    void *host = pci_dma_map(&dev->pci_dev, addr, &plen,
+                             DMA_DIRECTION_FROM_DEVICE);
+    if (!host)
+        return NULL;
+    /* a short mapping or a bounce buffer (not RAM) is released right away */
+    if (plen == len)
+        mr = memory_region_from_host(host, &mr_offset);
+    if (!mr) {
+        pci_dma_unmap(&dev->pci_dev, host, plen, DMA_DIRECTION_FROM_DEVICE,
+                      0);
+        return NULL;
+    }
+    if (!mc->listening) {
+        /* memory listeners are registered with the BQL */
+        pciemu_mmio_lock_bql(dev);
+        memory_listener_register(&mc->listener, &dev->pci_dev.bus_master_as);
+        mc->listening = true;
+        /* an IOMMU region may not be watched */
+        if (mc->disabled) {
+            pci_dma_unmap(&dev->pci_dev, host, plen,
+                          DMA_DIRECTION_FROM_DEVICE, 0);
+            return NULL;
+        }
+    }
+    MapCacheEntry *e = &mc->entries[0];
+    for (uint32_t i = 0; i < mc->size; ++i) {
+        if (!mc->entries[i].valid) {
+            e = &mc->entries[i];
+            break;
+        }
+        if (mc->entries[i].used < e->used)
+            e = &mc->entries[i];
+    }
+    if (e->valid)
+        pciemu_mapcache_evict(dev, e);
+    e->addr = addr;
+    e->len = len;
+    e->host = host;
+    e->mr = mr;
+    e->mr_offset = mr_offset;
+    e->valid = true;
+    return e;
+}
+
+/* -----------------------------------------------------------------------------
+ *  Public
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_mapcache_rw: Transfer through a cached mapping
+ *
+ * Returns false if the range is not cached and cannot be, the transfer is
+ * then left to the bus address space.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @addr: bus address of the transfer
+ * @buf: buffer inside the device
+ * @len: length of the transfer in bytes
+ * @dir: DMA_DIRECTION_TO_DEVICE (read from bus) or
+ *       DMA_DIRECTION_FROM_DEVICE (write to bus)
+ */
+bool pciemu_mapcache_rw(PCIEMUDevice *dev, dma_addr_t addr, void *buf,
+                        dma_addr_t len, DMADirection dir)
+{
+    DMAMapCache *mc = &dev->dma.mapcache;
+    if (!mc->size || mc->disabled || !len)
+        return false;
+    MapCacheEntry *e = pciemu_mapcache_lookup(mc, addr, len);
+    if (e) {
+        mc->hits++;
+    } else {
+        mc->misses++;
+        e = pciemu_mapcache_insert(dev, addr, len);
+        if (!e)
+            return false;
+    }
+    e->used = ++mc->tick;
+    uint8_t *host = e->host + (addr - e->addr);
+    /* same ordering as pci_dma_rw */
+    smp_mb();
+    if (dir == DMA_DIRECTION_TO_DEVICE) {
+        memcpy(buf, host, len);
+    } else {
+        memcpy(host, buf, len);
+        memory_region_set_dirty(e->mr, e->mr_offset + (addr - e->addr), len);
+    }
+    return true;
+}
+
+/**
+ * pciemu_mapcache_get: Getter of the map-cache-stats property
+ *
+ * @obj: Instance of PCIEMUDevice object being queried
+ * @v: visitor of the property
+ * @name: name of the property
+ * @opaque: unused
+ * @errp: pointer to indicate errors
+ */
+void pciemu_mapcache_get(Object *obj, Visitor *v, const char *name,
+                         void *opaque, Error **errp)
+{
+    PCIEMUDevice *dev = PCIEMU_DEVICE(obj);
+    DMAMapCache *mc = &dev->dma.mapcache;
+    uint64_t entries = 0;
+    for (uint32_t i = 0; i < mc->size; ++i)
+        entries += mc->entries[i].valid;
+    if (!visit_start_struct(v, name, NULL, 0, errp))
+        return;
+    if (visit_type_uint64(v, "entries", &entries, errp) &&
+        visit_type_uint64(v, "hits", &mc->hits, errp) &&
+        visit_type_uint64(v, "misses", &mc->misses, errp) &&
+        visit_type_uint64(v, "invalidations", &mc->invalidations, errp))
+        visit_check_struct(v, errp);
+    visit_end_struct(v, NULL);
+}
+
+/**
+ * pciemu_mapcache_reset: Map cache reset
+ *
+ * Drops the mappings, but keeps the counters.
+ *
+ * @dev: Instance of PCIEMUDevice object being reset
+ */
+void pciemu_mapcache_reset(PCIEMUDevice *dev)
+{
+    pciemu_mapcache_flush(dev);
+}
+
+/**
+ * pciemu_mapcache_init: Map cache initialization
+ *
+ * The memory listener is only registered along with the first entry, so
+ * nothing is left to undo if the device fails to initialize.
+ *
+ * @dev: Instance of PCIEMUDevice object being initialized
+ * @errp: pointer to indicate errors
+ */
+void pciemu_mapcache_init(PCIEMUDevice *dev, Error **errp)
+{
+    DMAMapCache *mc = &dev->dma.mapcache;
+    if (mc->size > PCIEMU_MAPCACHE_ENTRIES_MAX) {
+        error_setg(errp, "map-cache-entries must be at most %d",
+                   PCIEMU_MAPCACHE_ENTRIES_MAX);
+        return;
+    }
+    memset(mc->entries, 0, sizeof(mc->entries));
+    memset(mc->iommus, 0, sizeof(mc->iommus));
+    mc->listener = (MemoryListener){
+        .name = "pciemu-mapcache",
+        .region_add = pciemu_mapcache_region_add,
+        .region_del = pciemu_mapcache_region_del,
+    };
+    mc->listening = false;
+    mc->disabled = false;
+    mc->tick = 0;
+    mc->hits = 0;
+    mc->misses = 0;
+    mc->invalidations = 0;
+}
+
+/**
+ * pciemu_mapcache_fini: Map cache finalization
+ *
+ * Unregistering the listener removes every section, hence the notifiers of
+ * the IOMMU regions.
+ *
+ * @dev: Instance of PCIEMUDevice object being finalized
+ */
+void pciemu_mapcache_fini(PCIEMUDevice *dev)
+{
+    DMAMapCache *mc = &dev->dma.mapcache;
+    pciemu_mapcache_flush(dev);
+    if (mc->listening) {
+        memory_listener_unregister(&mc->listener);
+        mc->listening = false;
+    }
+}
@@ -0,0 +1,75 @@
+/* mapcache.h - Cache of the mappings of guest memory used by the DMAs
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_MAPCACHE_H
+#define PCIEMU_MAPCACHE_H
+
+#include "qemu/osdep.h"
+#include "qapi/visitor.h"
+#include "qom/object.h"
+#include "exec/memory.h"
+#include "hw/pci/pci.h"
+
+/* number of cached mappings (map-cache-entries property), 0 = no cache */
+#define PCIEMU_MAPCACHE_ENTRIES_MAX 64
+/* IOMMU regions of the bus address space being watched */
+#define PCIEMU_MAPCACHE_IOMMU_MAX 4
+
+/* forward declaration (defined in pciemu.h) to avoid circular reference */
+typedef struct PCIEMUDevice PCIEMUDevice;
+
+/* range of guest RAM mapped into the host (writable) */
+typedef struct MapCacheEntry {
+    dma_addr_t addr; /* bus address */
+    dma_addr_t len;
+    uint8_t *host;
+    MemoryRegion *mr; /* RAM behind the mapping, set dirty by the writes */
+    ram_addr_t mr_offset;
+    uint64_t used; /* last use, the least recently used entry is evicted */
+    bool valid;
+} MapCacheEntry;
+
+/* IOMMU region of the bus address space, whose unmaps invalidate entries */
+typedef struct MapCacheIOMMU {
+    IOMMUNotifier n;
+    MemoryRegion *mr;
+    hwaddr offset; /* bus address of the offset 0 of the region */
+    PCIEMUDevice *dev;
+    bool used;
+} MapCacheIOMMU;
+
+typedef struct DMAMapCache {
+    /* properties */
+    uint32_t size;
+    /* state */
+    MapCacheEntry entries[PCIEMU_MAPCACHE_ENTRIES_MAX];
+    MapCacheIOMMU iommus[PCIEMU_MAPCACHE_IOMMU_MAX];
+    MemoryListener listener;
+    bool listening; /* registered along with the first entry */
+    bool disabled; /* an IOMMU region could not be watched */
+    uint64_t tick;
+    /* counters (map-cache-stats property), kept across resets */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+} DMAMapCache;
+
+
+bool pciemu_mapcache_rw(PCIEMUDevice *dev, dma_addr_t addr, void *buf,
+                        dma_addr_t len, DMADirection dir);
+
+void pciemu_mapcache_get(Object *obj, Visitor *v, const char *name,
+                         void *opaque, Error **errp);
+
+void pciemu_mapcache_reset(PCIEMUDevice *dev);
+
+void pciemu_mapcache_init(PCIEMUDevice *dev, Error **errp);
+
+void pciemu_mapcache_fini(PCIEMUDevice *dev);
+
+#endif /* PCIEMU_MAPCACHE_H */
@@ -12,9 +12,18 @@
 #include "exec/target_page.h"
 #include "qapi/error.h"
 #include "qemu/log.h"
+#include "qemu/lockable.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
 #include "qemu/units.h"
+#include "arbiter.h"
+#include "crypto.h"
 #include "mmio.h"
+#include "pciemu.h"
 #include "irq.h"
+#include "rx.h"
+#include "stats.h"
+#include "trace.h"
 #include "pciemu_hw.h"
 
 /* -----------------------------------------------------------------------------
@@ -37,18 +46,56 @@ static inline bool pciemu_mmio_valid_access(hwaddr addr, unsigned int size)
 }
 
 /**
- * pciemu_mmio_read: Callback for read operations
+ * pciemu_mmio_write_traced: Check whether the write is recorded as is
+ *
+ * Descriptor doorbells and queue tails are recorded by the DMA engine as the
+ * registers programmed by the descriptors, once executed (see dma.c), so a
+ * trace can be replayed without the content of the descriptor window.
+ *
+ * @addr: address being written (relative to the Memory Region)
+ */
+static inline bool pciemu_mmio_write_traced(hwaddr addr)
+{
+    if (addr >= PCIEMU_HW_BAR0_DMA_QUEUE_START &&
+        addr <= PCIEMU_HW_BAR0_DMA_QUEUE_END)
+        return (addr - PCIEMU_HW_BAR0_DMA_QUEUE_START) %
+                   PCIEMU_HW_BAR0_DMA_QUEUE_STRIDE !=
+               PCIEMU_HW_DMA_QUEUE_TAIL;
+    return addr != PCIEMU_HW_BAR0_DMA_DESC_DOORBELL;
+}
+
+/**
+ * pciemu_mmio_write_doorbell: Check whether the write hands a command over
+ *
+ * Doorbells (of the registers or of a descriptor) and queue tails, whose
+ * arrival starts the doorbell-to-start stage of the latency stats.
+ *
+ * @addr: address being written (relative to the Memory Region)
+ */
+static inline bool pciemu_mmio_write_doorbell(hwaddr addr)
+{
+    if (addr >= PCIEMU_HW_BAR0_DMA_QUEUE_START &&
+        addr <= PCIEMU_HW_BAR0_DMA_QUEUE_END)
+        return (addr - PCIEMU_HW_BAR0_DMA_QUEUE_START) %
+                   PCIEMU_HW_BAR0_DMA_QUEUE_STRIDE ==
+               PCIEMU_HW_DMA_QUEUE_TAIL;
+    return addr == PCIEMU_HW_BAR0_DMA_DOORBELL_RING ||
+           addr == PCIEMU_HW_BAR0_DMA_DESC_DOORBELL;
+}
+
+/**
+ * pciemu_mmio_dispatch_read: Execute a read of BAR0
  *
  * Read from the memory region and return the correspondent value.
  * Only valid for regions with READ operations (mostly regiters)
  *
- * @opaque: opaque pointer that points to instantiated object
+ * @dev: Instance of PCIEMUDevice object being used (locked)
  * @addr: address being accessed (relative to the Memory Region)
  * @size: read size in bytes (1, 2, 4, or 8)
  */
-static uint64_t pciemu_mmio_read(void *opaque, hwaddr addr, unsigned int size)
+static uint64_t pciemu_mmio_dispatch_read(PCIEMUDevice *dev, hwaddr addr,
+                                          unsigned int size)
 {
-    PCIEMUDevice *dev = opaque;
     uint64_t val = ~0ULL;
     if (!pciemu_mmio_valid_access(addr, size))
         return val;
@@ -65,27 +112,67 @@ static uint64_t pciemu_mmio_read(void *opaque, hwaddr addr, unsigned int size)
     case PCIEMU_HW_BAR0_REG_3:
         val = dev->reg[3];
         break;
+    case PCIEMU_HW_BAR0_RX_HEAD:
+        val = qatomic_read(&dev->rx.head);
+        break;
+    case PCIEMU_HW_BAR0_RX_TAIL:
+        val = dev->rx.tail;
+        break;
+    case PCIEMU_HW_BAR0_DMA_PATTERN_ERR_CNT:
+        val = dev->dma.pattern.err_cnt;
+        break;
+    case PCIEMU_HW_BAR0_DMA_PATTERN_ERR_OFS:
+        val = dev->dma.pattern.err_ofs;
+        break;
+    case PCIEMU_HW_BAR0_DMA_AREA_SIZE:
+        val = dev->dma.buff_size;
+        break;
+    case PCIEMU_HW_BAR0_DMA_STATUS:
+        val = qatomic_read(&dev->dma.status);
+        break;
+    case PCIEMU_HW_BAR0_DMA_ERROR:
+        val = qatomic_read(&dev->dma.error);
+        break;
+    case PCIEMU_HW_BAR0_DMA_DONE_CNT:
+        val = qatomic_read(&dev->dma.done_cnt);
+        break;
+    case PCIEMU_HW_BAR0_DMA_QUEUE_START ... PCIEMU_HW_BAR0_DMA_QUEUE_END:
+        val = pciemu_arbiter_read(dev, addr);
+        break;
+    case PCIEMU_HW_BAR0_CRYPTO_KEY_SLOT ... PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_END:
+        val = pciemu_crypto_read(dev, addr);
+        break;
+    case PCIEMU_HW_BAR0_DMA_ATOMIC_RESULT:
+        val = dev->dma.atomic_result;
+        break;
+    case PCIEMU_HW_BAR0_DMA_SCAN_MATCH_CNT:
+        val = dev->dma.scan_cnt;
+        break;
+    case PCIEMU_HW_BAR0_IRQ_CAUSE ... PCIEMU_HW_BAR0_IRQ_TIMER_NS:
+        val = pciemu_irq_read(dev, addr);
+        break;
     }
+    pciemu_trace_mmio(dev, PCIEMU_TRACE_MMIO_READ, addr, size, val);
     return val;
 }
 
 /**
- * pciemu_mmio_write: Callback for write operations
+ * pciemu_mmio_dispatch_write: Execute a write of BAR0
  *
  * Write to the memory region.
- * For now, it writes to reg0 regardless of the address.
  *
- * @opaque: opaque pointer that points to instantiated object
+ * @dev: Instance of PCIEMUDevice object being used (locked)
  * @addr: address being written (relative to the Memory Region)
  * @val: value to be written
  * @size: write size in bytes (1, 2, 4, or 8)
  */
-static void pciemu_mmio_write(void *opaque, hwaddr addr, uint64_t val,
-                              unsigned size)
+static void pciemu_mmio_dispatch_write(PCIEMUDevice *dev, hwaddr addr,
+                                       uint64_t val, unsigned int size)
 {
-    PCIEMUDevice *dev = opaque;
     if (!pciemu_mmio_valid_access(addr, size))
         return;
+    if (pciemu_mmio_write_traced(addr))
+        pciemu_trace_mmio(dev, PCIEMU_TRACE_MMIO_WRITE, addr, size, val);
     switch (addr) {
     case PCIEMU_HW_BAR0_REG_0:
         dev->reg[0] = val;
@@ -124,14 +211,222 @@ static void pciemu_mmio_write(void *opaque, hwaddr addr, uint64_t val,
     case PCIEMU_HW_BAR0_DMA_DOORBELL_RING:
         pciemu_dma_doorbell_ring(dev);
         break;
+    case PCIEMU_HW_BAR0_DMA_DESC_DOORBELL:
+        pciemu_dma_desc_doorbell_ring(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_RX_CFG_RING_ADDR:
+        pciemu_rx_config_ring_addr(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_RX_CFG_RING_SIZE:
+        pciemu_rx_config_ring_size(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_RX_CFG_PKT_SIZE:
+        pciemu_rx_config_pkt_size(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_RX_CFG_RATE:
+        pciemu_rx_config_rate(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_RX_CFG_BURST:
+        pciemu_rx_config_burst(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_RX_TAIL:
+        pciemu_rx_tail_update(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_RX_CTRL:
+        pciemu_rx_ctrl(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_PATTERN:
+        pciemu_dma_config_pattern(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_PATTERN_SEED:
+        pciemu_dma_config_pattern_seed(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_CRYPTO_KEY_SLOT:
+        pciemu_dma_config_crypto_key_slot(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_CRYPTO_SECTOR_SIZE:
+        pciemu_dma_config_crypto_sector_size(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_CRYPTO_SECTOR:
+        pciemu_dma_config_crypto_sector(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_QUEUE_START ... PCIEMU_HW_BAR0_DMA_QUEUE_END:
+        pciemu_arbiter_write(dev, addr, val);
+        break;
+    case PCIEMU_HW_BAR0_CRYPTO_KEY_SLOT ... PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_END:
+        pciemu_crypto_write(dev, addr, val, size);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_ATOMIC_OPERAND:
+        pciemu_dma_config_atomic_operand(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_ATOMIC_COMPARE:
+        pciemu_dma_config_atomic_compare(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_2D_ROWS:
+        pciemu_dma_config_2d_rows(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_2D_SRC_STRIDE:
+        pciemu_dma_config_2d_src_stride(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_2D_DST_STRIDE:
+        pciemu_dma_config_2d_dst_stride(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_MCAST_CNT:
+        pciemu_dma_config_mcast_cnt(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_RAID_SRC_CNT:
+        pciemu_dma_config_raid_src_cnt(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_RAID_Q_DST:
+        pciemu_dma_config_raid_q_dst(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_SCAN_KEY_LO:
+        pciemu_dma_config_scan_key_lo(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_SCAN_KEY_HI:
+        pciemu_dma_config_scan_key_hi(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_SCAN_CTRL:
+        pciemu_dma_config_scan_ctrl(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_SCAN_MAX:
+        pciemu_dma_config_scan_max(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_SORT_CTRL:
+        pciemu_dma_config_sort_ctrl(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_DMA_CFG_SORT_IDX_DST:
+        pciemu_dma_config_sort_idx_dst(dev, val);
+        break;
+    case PCIEMU_HW_BAR0_IRQ_CAUSE ... PCIEMU_HW_BAR0_IRQ_TIMER_NS:
+        pciemu_irq_write(dev, addr, val);
+        break;
     }
 }
 
+/**
+ * pciemu_mmio_unlock: Release the device lock, and the BQL if taken meanwhile
+ *
+ * @dev: Instance of PCIEMUDevice object being used (locked)
+ * @bql: whether the vCPU held the BQL when it entered BAR0
+ */
+static void pciemu_mmio_unlock(PCIEMUDevice *dev, bool bql)
+{
+    qemu_rec_mutex_unlock(&dev->lock);
+    if (!bql && qemu_mutex_iothread_locked())
+        qemu_mutex_unlock_iothread();
+}
+
+/**
+ * pciemu_mmio_read: Callback for read operations
+ *
+ * BAR0 is dispatched without the BQL (see pciemu_mmio_init).
+ *
+ * @opaque: opaque pointer that points to instantiated object
+ * @addr: address being accessed (relative to the Memory Region)
+ * @size: read size in bytes (1, 2, 4, or 8)
+ */
+static uint64_t pciemu_mmio_read(void *opaque, hwaddr addr, unsigned int size)
+{
+    PCIEMUDevice *dev = opaque;
+    bool bql = qemu_mutex_iothread_locked();
+    uint64_t val;
+    qemu_rec_mutex_lock(&dev->lock);
+    val = pciemu_mmio_dispatch_read(dev, addr, size);
+    pciemu_mmio_unlock(dev, bql);
+    return val;
+}
+
+/**
+ * pciemu_mmio_write: Callback for write operations
+ *
+ * BAR0 is dispatched without the BQL (see pciemu_mmio_init) : the vCPU runs
+ * the write itself, doorbells included, under the device lock. The BQL is
+ * only taken on the way by a DMA which needs it (pciemu_mmio_lock_bql), while
+ * the IRQs and the workers of the thread pool are left to the main loop (see
+ * irq.c, pipeline.c and sort.c).
+ *
+ * @opaque: opaque pointer that points to instantiated object
+ * @addr: address being written (relative to the Memory Region)
+ * @val: value to be written
+ * @size: write size in bytes (1, 2, 4, or 8)
+ */
+static void pciemu_mmio_write(void *opaque, hwaddr addr, uint64_t val,
+                              unsigned size)
+{
+    PCIEMUDevice *dev = opaque;
+    bool bql = qemu_mutex_iothread_locked();
+    /* stamped on arrival, before waiting for the lock or the arbiter */
+    bool doorbell = pciemu_mmio_write_doorbell(addr);
+    int64_t ns = doorbell ? qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) : 0;
+    qemu_rec_mutex_lock(&dev->lock);
+    if (doorbell)
+        pciemu_stats_doorbell(dev, ns);
+    pciemu_mmio_dispatch_write(dev, addr, val, size);
+    pciemu_mmio_unlock(dev, bql);
+}
+
 /* -----------------------------------------------------------------------------
  *  Public
  * -----------------------------------------------------------------------------
  */
 
+/**
+ * pciemu_mmio_lock_bql: Take the BQL from a vCPU holding the device lock
+ *
+ * Nothing to do if the BQL is already held. Otherwise, the device lock is
+ * released first, to take both in the order of the main loop, and the BQL is
+ * kept until the vCPU leaves BAR0. Meanwhile, other vCPUs may access BAR0 :
+ * as for a DMA landing in BAR0, the engine ignores the configuration and the
+ * doorbells until it is IDLE again.
+ * The device lock must be held once (i.e. straight from BAR0, not from a
+ * callback called by the device itself).
+ *
+ * @dev: Instance of PCIEMUDevice object being used (locked)
+ */
+void pciemu_mmio_lock_bql(PCIEMUDevice *dev)
+{
+    if (qemu_mutex_iothread_locked())
+        return;
+    qemu_rec_mutex_unlock(&dev->lock);
+    qemu_mutex_lock_iothread();
+    qemu_rec_mutex_lock(&dev->lock);
+}
+
+/**
+ * pciemu_mmio_dma_prepare: Take the BQL before a DMA which needs it
+ *
+ * A DMA of RAM needs no lock, but the memory core takes the BQL to access
+ * any other memory region (e.g. the BAR of a device, this one included),
+ * which would invert the lock order on a vCPU holding the device lock : the
+ * BQL is taken first then (see pciemu_mmio_lock_bql).
+ *
+ * @dev: Instance of PCIEMUDevice object being used (locked)
+ * @addr: bus address of the transfer
+ * @len: length of the transfer in bytes
+ * @dir: direction of the transfer
+ */
+void pciemu_mmio_dma_prepare(PCIEMUDevice *dev, dma_addr_t addr,
+                             dma_addr_t len, DMADirection dir)
+{
+    AddressSpace *as = &dev->pci_dev.bus_master_as;
+    bool is_write = dir == DMA_DIRECTION_FROM_DEVICE;
+    if (qemu_mutex_iothread_locked())
+        return;
+    RCU_READ_LOCK_GUARD();
+    while (len) {
+        hwaddr xlat, l = len;
+        MemoryRegion *mr = address_space_translate(
+            as, addr, &xlat, &l, is_write, MEMTXATTRS_UNSPECIFIED);
+        if (!memory_access_is_direct(mr, is_write)) {
+            pciemu_mmio_lock_bql(dev);
+            return;
+        }
+        addr += l;
+        len -= l;
+    }
+}
+
 /**
  * pciemu_mmio_reset: MMIO reset
  *
@@ -153,17 +448,30 @@ void pciemu_mmio_reset(PCIEMUDevice *dev)
  * Note that we receive a pointer for a PCIEMUDevice, but, due to the OOP hack
  * done by the QEMU Object Model, we can easily get the parent PCIDevice.
  *
+ * BAR0 opts out of the BQL : accesses of different vCPUs only serialize on
+ * the device lock, set up here as all the activity of the device starts
+ * with BAR0.
+ *
  * @dev: Instance of PCIEMUDevice object being initialized
  * @errp: pointer to indicate errors
  */
 void pciemu_mmio_init(PCIEMUDevice *dev, Error **errp)
 {
+    qemu_rec_mutex_init(&dev->lock);
     /* BAR 0 will have memory region described in mmio (pciemu_mmio_ops) */
     /* Keeping the BAR size as the page size of the guest */
     memory_region_init_io(&dev->mmio, OBJECT(dev), &pciemu_mmio_ops, dev,
                           "pciemu-mmio", qemu_target_page_size());
+    memory_region_clear_global_locking(&dev->mmio);
     pci_register_bar(&dev->pci_dev, 0, PCI_BASE_ADDRESS_SPACE_MEMORY,
                      &dev->mmio);
+    /* BAR 2 is the DMA descriptor window (dev->desc), plain memory that can
+     * be mapped write-combining by the driver, as it is prefetchable */
+    pci_register_bar(&dev->pci_dev, PCIEMU_HW_BAR2,
+                     PCI_BASE_ADDRESS_SPACE_MEMORY |
+                         PCI_BASE_ADDRESS_MEM_PREFETCH |
+                         PCI_BASE_ADDRESS_MEM_TYPE_64,
+                     &dev->desc);
 }
 
 /**
@@ -178,6 +486,7 @@ void pciemu_mmio_init(PCIEMUDevice *dev, Error **errp)
 void pciemu_mmio_fini(PCIEMUDevice *dev)
 {
     pciemu_mmio_reset(dev);
+    qemu_rec_mutex_destroy(&dev->lock);
 }
 
 /**
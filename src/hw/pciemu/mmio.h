@@ -9,11 +9,18 @@
 #ifndef PCIEMU_MMIO_H
 #define PCIEMU_MMIO_H
 
-#include "pciemu.h"
+#include "qemu/osdep.h"
+#include "exec/memory.h"
+#include "hw/pci/pci.h"
 
 /* forward declaration (defined in pciemu.h) to avoid circular reference */
 typedef struct PCIEMUDevice PCIEMUDevice;
 
+void pciemu_mmio_lock_bql(PCIEMUDevice *dev);
+
+void pciemu_mmio_dma_prepare(PCIEMUDevice *dev, dma_addr_t addr,
+                             dma_addr_t len, DMADirection dir);
+
 void pciemu_mmio_reset(PCIEMUDevice *dev);
 
 void pciemu_mmio_init(PCIEMUDevice *dev, Error **errp);
@@ -5,8 +5,16 @@
  *
  * It has basic functionalities :
  *   - MMIO (Memory Mapped I/O) capabilities to access device registers/memory
- *   - DMA to and from a dedicated device buffer area
- *   - IRQ generation to inform the conclusion of DMA
+ *   - DMA to and from a dedicated device buffer area, optionally provided
+ *     by a memory backend (e.g. an mmap'd host file)
+ *   - Cache of the mappings of guest memory used by the DMAs
+ *   - Streams through the device, optionally pipelined on worker threads
+ *   - IRQ generation to inform the conclusion of DMA, optionally delayed
+ *     by a configurable latency distribution
+ *   - RX stream generation into buffers posted by the driver (NIC-like)
+ *   - Record of MMIO and DMA traffic for offline replay
+ *   - Latency histograms of the DMA commands, readable from the host
+ *   - Atomic operations on host memory (PCIe AtomicOps)
  *
  * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
  *
@@ -14,11 +22,21 @@
  *
  */
 
+#include "qemu/osdep.h"
+#include "qemu/lockable.h"
+#include "qapi/error.h"
+#include "hw/qdev-properties.h"
+#include "hw/pci/pcie.h"
 #include "pciemu.h"
 #include "pciemu_hw.h"
 #include "dma.h"
+#include "hostnuma.h"
 #include "irq.h"
+#include "mapcache.h"
 #include "mmio.h"
+#include "rx.h"
+#include "stats.h"
+#include "trace.h"
 
 /* -----------------------------------------------------------------------------
  *  Internal functions
@@ -32,11 +50,45 @@
  */
 static void pciemu_reset(PCIEMUDevice *dev)
 {
+    pciemu_trace_reset(dev);
+    pciemu_stats_reset(dev);
     pciemu_irq_reset(dev);
     pciemu_dma_reset(dev);
+    pciemu_rx_reset(dev);
     pciemu_mmio_reset(dev);
 }
 
+/**
+ * pciemu_pcie_init: PCI Express capability initialization
+ *
+ * The device requests AtomicOps but completes none targeting its BARs, so
+ * no AtomicOp completer support is advertised in the Device Capabilities 2
+ * register (see README). There is no capability to add when the device is
+ * plugged into a conventional PCI bus.
+ *
+ * @dev: Instance of PCIEMUDevice object being initialized
+ * @errp: pointer to indicate errors
+ */
+static void pciemu_pcie_init(PCIEMUDevice *dev, Error **errp)
+{
+    PCIDevice *pci_dev = &dev->pci_dev;
+    if (!pci_is_express(pci_dev))
+        return;
+    if (pcie_endpoint_cap_init(pci_dev, 0) < 0)
+        error_setg(errp, "pciemu: failed to add the PCIe capability");
+}
+
+/**
+ * pciemu_pcie_fini: PCI Express capability finalization
+ *
+ * @dev: Instance of PCIEMUDevice object being finalized
+ */
+static void pciemu_pcie_fini(PCIEMUDevice *dev)
+{
+    if (pci_is_express(&dev->pci_dev))
+        pcie_cap_exit(&dev->pci_dev);
+}
+
 /* -----------------------------------------------------------------------------
  *  Object related functions
  * -----------------------------------------------------------------------------
@@ -56,8 +108,36 @@ static void pciemu_reset(PCIEMUDevice *dev)
 static void pciemu_device_init(PCIDevice *pci_dev, Error **errp)
 {
     PCIEMUDevice *dev = PCIEMU_DEVICE(pci_dev);
+    Error *err = NULL;
+    pciemu_trace_init(dev, &err);
+    if (err) {
+        error_propagate(errp, err);
+        return;
+    }
+    pciemu_stats_init(dev, &err);
+    if (err) {
+        error_propagate(errp, err);
+        pciemu_trace_fini(dev);
+        return;
+    }
+    pciemu_pcie_init(dev, &err);
+    if (err) {
+        error_propagate(errp, err);
+        pciemu_stats_fini(dev);
+        pciemu_trace_fini(dev);
+        return;
+    }
     pciemu_irq_init(dev, errp);
-    pciemu_dma_init(dev, errp);
+    pciemu_dma_init(dev, &err);
+    if (err) {
+        error_propagate(errp, err);
+        pciemu_irq_fini(dev);
+        pciemu_pcie_fini(dev);
+        pciemu_stats_fini(dev);
+        pciemu_trace_fini(dev);
+        return;
+    }
+    pciemu_rx_init(dev, errp);
     pciemu_mmio_init(dev, errp);
 }
 
@@ -76,7 +156,11 @@ static void pciemu_device_fini(PCIDevice *pci_dev)
     PCIEMUDevice *dev = PCIEMU_DEVICE(pci_dev);
     pciemu_irq_fini(dev);
     pciemu_dma_fini(dev);
+    pciemu_rx_fini(dev);
     pciemu_mmio_fini(dev);
+    pciemu_pcie_fini(dev);
+    pciemu_stats_fini(dev);
+    pciemu_trace_fini(dev);
 }
 
 /**
@@ -89,7 +173,9 @@ static void pciemu_device_fini(PCIDevice *pci_dev)
  */
 static void pciemu_device_reset(DeviceState *dev)
 {
-    pciemu_reset(PCIEMU_DEVICE(dev));
+    PCIEMUDevice *pciemu = PCIEMU_DEVICE(dev);
+    QEMU_LOCK_GUARD(&pciemu->lock);
+    pciemu_reset(pciemu);
 }
 
 /* -----------------------------------------------------------------------------
@@ -97,6 +183,44 @@ static void pciemu_device_reset(DeviceState *dev)
  * -----------------------------------------------------------------------------
  */
 
+/**
+ * pciemu_properties: Properties of the PCIEMUDevice
+ *
+ * Properties are set when instantiating the device, for instance :
+ *   -object memory-backend-file,id=mem0,mem-path=/path/file,size=1G,share=on
+ *   -device pciemu,memdev=mem0,trace-file=/path/pciemu.trace
+ *
+ *  - memdev : memory backend holding the device memory (DMA area)
+ *  - trace-file : file recording MMIO and DMA traffic (see trace.c)
+ *  - trace-payload-hash : also record a hash of every DMA payload
+ *  - latency-* : distribution of the DMA completion delay (see latency.c)
+ *  - pipeline-depth : staging buffers of the pipelined streams (see pipeline.c)
+ *  - map-cache-entries : guest memory ranges kept mapped (see mapcache.c)
+ *
+ * host-nodes and policy (see hostnuma.c) are class properties, registered by
+ * pciemu_class_init as they are not plain fields.
+ */
+static Property pciemu_properties[] = {
+    DEFINE_PROP_LINK("memdev", PCIEMUDevice, dma.memdev, TYPE_MEMORY_BACKEND,
+                     HostMemoryBackend *),
+    DEFINE_PROP_STRING("trace-file", PCIEMUDevice, trace.file),
+    DEFINE_PROP_BOOL("trace-payload-hash", PCIEMUDevice, trace.payload_hash,
+                     false),
+    DEFINE_PROP_STRING("latency-dist", PCIEMUDevice, dma.latency.dist),
+    DEFINE_PROP_UINT64("latency-ns", PCIEMUDevice, dma.latency.mean_ns, 0),
+    DEFINE_PROP_UINT64("latency-min-ns", PCIEMUDevice, dma.latency.min_ns, 0),
+    DEFINE_PROP_UINT64("latency-max-ns", PCIEMUDevice, dma.latency.max_ns, 0),
+    DEFINE_PROP_UINT32("latency-sigma-milli", PCIEMUDevice,
+                       dma.latency.sigma_milli, 500),
+    DEFINE_PROP_STRING("latency-hist-file", PCIEMUDevice,
+                       dma.latency.hist_file),
+    DEFINE_PROP_UINT64("latency-seed", PCIEMUDevice, dma.latency.seed, 0),
+    DEFINE_PROP_UINT32("pipeline-depth", PCIEMUDevice, dma.pipeline.depth, 0),
+    DEFINE_PROP_UINT32("map-cache-entries", PCIEMUDevice, dma.mapcache.size,
+                       0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 /**
  * pciemu_class_init: Class initialization
  *
@@ -122,6 +246,18 @@ static void pciemu_class_init(ObjectClass *klass, void *class_data)
     set_bit(DEVICE_CATEGORY_MISC, device_class->categories);
     device_class->desc = PCIEMU_DEVICE_DESC;
     device_class->reset = pciemu_device_reset;
+    device_class_set_props(device_class, pciemu_properties);
+    object_class_property_add(klass, "latency-stats", "PCIEMULatencyStats",
+                              pciemu_stats_get, NULL, NULL, NULL);
+    object_class_property_add(klass, "map-cache-stats", "PCIEMUMapCacheStats",
+                              pciemu_mapcache_get, NULL, NULL, NULL);
+    object_class_property_add(klass, "host-nodes", "int",
+                              pciemu_hostnuma_get_nodes,
+                              pciemu_hostnuma_set_nodes, NULL, NULL);
+    object_class_property_add_enum(klass, "policy", "HostMemPolicy",
+                                   &HostMemPolicy_lookup,
+                                   pciemu_hostnuma_get_policy,
+                                   pciemu_hostnuma_set_policy);
 }
 
 /* -----------------------------------------------------------------------------
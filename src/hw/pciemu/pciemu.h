@@ -9,10 +9,15 @@
 #define PCIEMU_H
 
 #include "qemu/osdep.h"
+#include "qemu/thread.h"
 #include "hw/pci/pci.h"
 #include "pciemu_hw.h"
 #include "dma.h"
 #include "irq.h"
+#include "mmio.h"
+#include "rx.h"
+#include "stats.h"
+#include "trace.h"
 
 #define TYPE_PCIEMU_DEVICE "pciemu"
 #define PCIEMU_DEVICE_DESC "PCIEMU Device"
@@ -39,14 +44,32 @@ typedef struct PCIEMUDevice {
     PCIDevice pci_dev;
     /*< public >*/
 
+    /*
+     * Device lock : BAR0 is dispatched without the BQL (see mmio.c), so the
+     * state below is guarded by this lock, taken by every entry point of the
+     * device. Lock order : BQL first (see pciemu_mmio_lock_bql). Recursive,
+     * as a DMA of the device can land in its own BAR0.
+     */
+    QemuRecMutex lock;
+
     /* IRQs */
     IRQStatus irq;
 
     /* DMAs */
     DMAEngine dma;
 
+    /* RX stream generator */
+    RXGenerator rx;
+
+    /* Record of MMIO and DMA traffic */
+    TraceRecorder trace;
+
+    /* Latency histograms of the DMA commands */
+    StatsRecorder stats;
+
     /* Memory Regions */
     MemoryRegion mmio; /* BAR 0 (registers) */
+    MemoryRegion desc; /* BAR 2 (DMA descriptor window) */
 
     /* Registers in BAR0 */
     uint64_t reg[PCIEMU_HW_BAR0_REG_CNT];
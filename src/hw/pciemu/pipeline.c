@@ -0,0 +1,270 @@
+/* pipeline.c - Pipelined streaming through worker threads
+ *
+ * Without pipeline, a stream (PCIEMU_HW_DMA_CMD_STREAM) is moved by the main
+ * loop, which reads a chunk from the source and only then writes it to the
+ * destination : the bus is either read or written, never both, so a copy
+ * runs at half the speed of a single transfer.
+ *
+ * With pipeline-depth=N, the FIFO (device memory) is split into N staging
+ * buffers and the transfers are run by the workers of the QEMU thread pool :
+ * the read of chunk k+1 into the next staging buffer overlaps the write of
+ * chunk k, so a copy runs close to the speed of a single transfer. The main
+ * loop hands the next transfers to the workers each time one completes. The
+ * pool belongs to the main loop : a stream started by a vCPU (see mmio.c)
+ * has its first transfers handed over by the main loop too.
+ *
+ * A reset drops the transfers already handed to the workers (gen) and waits
+ * for them, so no worker touches the staging buffers (device memory) nor the
+ * device once it is reset or finalized.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/lockable.h"
+#include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "qapi/error.h"
+#include "block/aio-wait.h"
+#include "block/thread-pool.h"
+#include "dma.h"
+#include "hostnuma.h"
+#include "pciemu.h"
+#include "pipeline.h"
+#include "trace.h"
+
+/* -----------------------------------------------------------------------------
+ *  Private
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_pipeline_slot: Staging buffer holding a position of the stream
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @pos: position inside the stream (multiple of the slot size)
+ */
+static inline uint8_t *pciemu_pipeline_slot(PCIEMUDevice *dev, dma_addr_t pos)
+{
+    DMAPipeline *pl = &dev->dma.pipeline;
+    return dev->dma.buff + (pos / pl->slot_size % pl->depth) * pl->slot_size;
+}
+
+/**
+ * pciemu_pipeline_work: Run a transfer (worker thread)
+ *
+ * The transfer is traced once completed, back in the main loop. The worker
+ * runs on the host nodes of the device, if placed (see hostnuma.c).
+ *
+ * @opaque: the transfer (PipelineOp)
+ */
+static int pciemu_pipeline_work(void *opaque)
+{
+    PipelineOp *op = opaque;
+    HostNumaAffinity saved;
+    pciemu_hostnuma_pin(op->dev, &saved);
+    int ret = pci_dma_rw(&op->dev->pci_dev, op->addr, op->buf, op->len,
+                         op->dir, MEMTXATTRS_UNSPECIFIED);
+    pciemu_hostnuma_unpin(&saved);
+    return ret;
+}
+
+static void pciemu_pipeline_done(void *opaque, int ret);
+
+/**
+ * pciemu_pipeline_submit: Hand a transfer to a worker
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @op: transfer (read or write) being handed
+ * @addr: bus address of the transfer
+ * @buf: staging buffer
+ * @len: length of the transfer in bytes
+ * @dir: DMA_DIRECTION_TO_DEVICE (read) or DMA_DIRECTION_FROM_DEVICE (write)
+ */
+static void pciemu_pipeline_submit(PCIEMUDevice *dev, PipelineOp *op,
+                                   dma_addr_t addr, uint8_t *buf,
+                                   dma_addr_t len, DMADirection dir)
+{
+    op->gen = dev->dma.pipeline.gen;
+    op->addr = addr;
+    op->buf = buf;
+    op->len = len;
+    op->dir = dir;
+    op->busy = true;
+    thread_pool_submit_aio(pciemu_pipeline_work, op, pciemu_pipeline_done, op);
+}
+
+/**
+ * pciemu_pipeline_kick: Move the stream forward
+ *
+ * The next chunk is read as soon as a staging buffer is free, and the oldest
+ * chunk read is written as soon as the previous write completed. The stream
+ * ends after its last byte is written, or once the transfers in flight
+ * completed after an error.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static void pciemu_pipeline_kick(PCIEMUDevice *dev)
+{
+    DMAPipeline *pl = &dev->dma.pipeline;
+    if (pl->err || pl->wr == pl->len) {
+        if (pl->read.busy || pl->write.busy)
+            return;
+        pl->active = false;
+        pciemu_dma_stream_end(dev, pl->err ? PCIEMU_HW_DMA_ERR_BUS
+                                           : PCIEMU_HW_DMA_ERR_NONE);
+        return;
+    }
+    if (!pl->read.busy && pl->rd < pl->len &&
+        pl->rd - pl->wr < pl->depth * pl->slot_size) {
+        pciemu_pipeline_submit(dev, &pl->read, pl->src + pl->rd,
+                               pciemu_pipeline_slot(dev, pl->rd),
+                               MIN(pl->slot_size, pl->len - pl->rd),
+                               DMA_DIRECTION_TO_DEVICE);
+    }
+    if (!pl->write.busy && pl->wr < pl->rd) {
+        pciemu_pipeline_submit(dev, &pl->write, pl->dst + pl->wr,
+                               pciemu_pipeline_slot(dev, pl->wr),
+                               MIN(pl->slot_size, pl->rd - pl->wr),
+                               DMA_DIRECTION_FROM_DEVICE);
+    }
+}
+
+/**
+ * pciemu_pipeline_done: Completion of a transfer (main loop)
+ *
+ * @opaque: the transfer (PipelineOp)
+ * @ret: error of the transfer (MEMTX_*)
+ */
+static void pciemu_pipeline_done(void *opaque, int ret)
+{
+    PipelineOp *op = opaque;
+    PCIEMUDevice *dev = op->dev;
+    DMAPipeline *pl = &dev->dma.pipeline;
+    QEMU_LOCK_GUARD(&dev->lock);
+    op->busy = false;
+    /* transfer of an aborted stream */
+    if (op->gen != pl->gen)
+        return;
+    pciemu_trace_dma(dev, op->dir, op->addr, op->buf, op->len);
+    if (ret) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s err=%d\n",
+                      op->dir == DMA_DIRECTION_TO_DEVICE ? "pci_dma_read"
+                                                         : "pci_dma_write",
+                      ret);
+        pl->err = ret;
+    } else if (op->dir == DMA_DIRECTION_TO_DEVICE) {
+        pl->rd += op->len;
+    } else {
+        pl->wr += op->len;
+    }
+    pciemu_pipeline_kick(dev);
+}
+
+/**
+ * pciemu_pipeline_timer_cb: Start a stream in the main loop
+ *
+ * @opaque: opaque pointer that points to instantiated object
+ */
+static void pciemu_pipeline_timer_cb(void *opaque)
+{
+    PCIEMUDevice *dev = opaque;
+    QEMU_LOCK_GUARD(&dev->lock);
+    if (dev->dma.pipeline.active)
+        pciemu_pipeline_kick(dev);
+}
+
+/* -----------------------------------------------------------------------------
+ *  Public
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_pipeline_enabled: Whether streams go through the pipeline
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+bool pciemu_pipeline_enabled(PCIEMUDevice *dev)
+{
+    return dev->dma.pipeline.depth != 0;
+}
+
+/**
+ * pciemu_pipeline_start: Start streaming through the pipeline
+ *
+ * The staging buffers are PCIEMU_DMA_STREAM_CHUNK bytes, or less if the
+ * device memory is too small to hold depth of them. The stream ends with
+ * pciemu_dma_stream_end, never before this returns. Without the BQL, the
+ * first transfers are handed over by the main loop (see above).
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @src: bus address of the source
+ * @dst: bus address of the destination
+ * @len: length of the stream in bytes (not 0)
+ */
+void pciemu_pipeline_start(PCIEMUDevice *dev, dma_addr_t src, dma_addr_t dst,
+                           dma_addr_t len)
+{
+    DMAPipeline *pl = &dev->dma.pipeline;
+    pl->gen++;
+    pl->slot_size =
+        MIN(PCIEMU_DMA_STREAM_CHUNK, dev->dma.buff_size / pl->depth);
+    pl->src = src;
+    pl->dst = dst;
+    pl->len = len;
+    pl->rd = 0;
+    pl->wr = 0;
+    pl->err = 0;
+    pl->active = true;
+    if (!qemu_mutex_iothread_locked()) {
+        timer_mod_ns(&pl->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+        return;
+    }
+    pciemu_pipeline_kick(dev);
+}
+
+/**
+ * pciemu_pipeline_reset: Pipeline reset
+ *
+ * Aborts the stream and waits for its transfers in flight (see above),
+ * polling the main loop which runs their completion.
+ *
+ * @dev: Instance of PCIEMUDevice object being reset
+ */
+void pciemu_pipeline_reset(PCIEMUDevice *dev)
+{
+    DMAPipeline *pl = &dev->dma.pipeline;
+    pl->gen++;
+    pl->active = false;
+    pl->err = 0;
+    timer_del(&pl->timer);
+    AIO_WAIT_WHILE(NULL, pl->read.busy || pl->write.busy);
+}
+
+/**
+ * pciemu_pipeline_init: Pipeline initialization
+ *
+ * @dev: Instance of PCIEMUDevice object being initialized
+ * @errp: pointer to indicate errors
+ */
+void pciemu_pipeline_init(PCIEMUDevice *dev, Error **errp)
+{
+    DMAPipeline *pl = &dev->dma.pipeline;
+    if (pl->depth && (pl->depth < PCIEMU_PIPELINE_DEPTH_MIN ||
+                      pl->depth > PCIEMU_PIPELINE_DEPTH_MAX)) {
+        error_setg(errp, "pipeline-depth must be 0 or between %d and %d",
+                   PCIEMU_PIPELINE_DEPTH_MIN, PCIEMU_PIPELINE_DEPTH_MAX);
+        return;
+    }
+    pl->read.dev = dev;
+    pl->read.busy = false;
+    pl->write.dev = dev;
+    pl->write.busy = false;
+    pl->gen = 0;
+    timer_init_ns(&pl->timer, QEMU_CLOCK_VIRTUAL, pciemu_pipeline_timer_cb,
+                  dev);
+    pciemu_pipeline_reset(dev);
+}
@@ -0,0 +1,63 @@
+/* pipeline.h - Pipelined streaming through worker threads
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_PIPELINE_H
+#define PCIEMU_PIPELINE_H
+
+#include "qemu/osdep.h"
+#include "hw/pci/pci.h"
+#include "qemu/timer.h"
+#include "pciemu_hw.h"
+
+/* number of staging buffers (pipeline-depth property), 0 = no pipeline */
+#define PCIEMU_PIPELINE_DEPTH_MIN 2
+#define PCIEMU_PIPELINE_DEPTH_MAX 16
+
+/* forward declaration (defined in pciemu.h) to avoid circular reference */
+typedef struct PCIEMUDevice PCIEMUDevice;
+
+/* transfer between a staging buffer and the bus, run by a worker thread */
+typedef struct PipelineOp {
+    PCIEMUDevice *dev;
+    uint64_t gen; /* stream the transfer belongs to */
+    dma_addr_t addr;
+    uint8_t *buf;
+    dma_addr_t len;
+    DMADirection dir;
+    bool busy;
+} PipelineOp;
+
+typedef struct DMAPipeline {
+    /* properties */
+    uint32_t depth;
+    /* state */
+    dma_addr_t slot_size; /* staging buffers are slices of the device memory */
+    uint64_t gen;         /* bumped by every stream and reset */
+    dma_addr_t src;
+    dma_addr_t dst;
+    dma_addr_t len;
+    dma_addr_t rd;        /* bytes read from src into the staging buffers */
+    dma_addr_t wr;        /* bytes written from the staging buffers to dst */
+    int err;
+    bool active;
+    PipelineOp read;
+    PipelineOp write;
+    QEMUTimer timer; /* starts a stream from the main loop (see pipeline.c) */
+} DMAPipeline;
+
+
+bool pciemu_pipeline_enabled(PCIEMUDevice *dev);
+
+void pciemu_pipeline_start(PCIEMUDevice *dev, dma_addr_t src, dma_addr_t dst,
+                           dma_addr_t len);
+
+void pciemu_pipeline_reset(PCIEMUDevice *dev);
+
+void pciemu_pipeline_init(PCIEMUDevice *dev, Error **errp);
+
+#endif /* PCIEMU_PIPELINE_H */
@@ -0,0 +1,407 @@
+/* rx.c - Receive-stream generator operations
+ *
+ * The RX generator behaves like the receive side of a NIC : once started,
+ * it autonomously fills the buffers posted by the driver at a configurable
+ * packet size and rate, without any doorbell per transfer.
+ * The pace is given by a QEMU timer and a token bucket.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/lockable.h"
+#include "qemu/log.h"
+#include "qemu/timer.h"
+#include "rx.h"
+#include "irq.h"
+#include "pciemu.h"
+
+/* -----------------------------------------------------------------------------
+ *  Private
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_rx_ring_avail: Number of buffers posted but not yet filled
+ *
+ * @rx: RX generator being used
+ */
+static inline uint32_t pciemu_rx_ring_avail(RXGenerator *rx)
+{
+    if (rx->config.ring_size == 0)
+        return 0;
+    return (rx->tail + rx->config.ring_size - rx->head) % rx->config.ring_size;
+}
+
+/**
+ * pciemu_rx_tokens_refill: Refill the token bucket
+ *
+ * Tokens are accumulated according to the rate and the time elapsed since
+ * the last refill, up to the depth of the bucket (burst).
+ *
+ * @rx: RX generator being used
+ * @now: current time in ns
+ */
+static inline void pciemu_rx_tokens_refill(RXGenerator *rx, int64_t now)
+{
+    uint64_t depth = MAX(rx->config.burst, 1) * NANOSECONDS_PER_SECOND;
+    uint64_t elapsed = now - rx->last_refill_ns;
+    rx->last_refill_ns = now;
+    if (!rx->config.rate)
+        return;
+    /* avoid overflowing when the generator was idle for a long time */
+    if (elapsed >= depth / rx->config.rate) {
+        rx->tokens = depth;
+        return;
+    }
+    rx->tokens = MIN(rx->tokens + elapsed * rx->config.rate, depth);
+}
+
+/**
+ * pciemu_rx_has_token: Check whether a packet can be sent
+ *
+ * @rx: RX generator being used
+ */
+static inline bool pciemu_rx_has_token(RXGenerator *rx)
+{
+    return !rx->config.rate || rx->tokens >= NANOSECONDS_PER_SECOND;
+}
+
+/**
+ * pciemu_rx_next_tick: Time (in ns) until the next run of the generator
+ *
+ * @rx: RX generator being used
+ */
+static inline int64_t pciemu_rx_next_tick(RXGenerator *rx)
+{
+    if (pciemu_rx_has_token(rx))
+        return PCIEMU_RX_TIMER_MIN_NS;
+    uint64_t deficit = NANOSECONDS_PER_SECOND - rx->tokens;
+    return MAX(DIV_ROUND_UP(deficit, rx->config.rate), PCIEMU_RX_TIMER_MIN_NS);
+}
+
+/**
+ * pciemu_rx_fill_one: Fill the buffer pointed by the descriptor at head
+ *
+ * Reads the descriptor, writes the packet into the buffer, writes back the
+ * used length and the DONE flag and finally moves the head forward.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static int pciemu_rx_fill_one(PCIEMUDevice *dev)
+{
+    RXGenerator *rx = &dev->rx;
+    uint8_t desc[PCIEMU_HW_RX_DESC_SIZE];
+    dma_addr_t desc_addr =
+        rx->config.ring_addr + (dma_addr_t)rx->head * PCIEMU_HW_RX_DESC_SIZE;
+    int err = pciemu_dma_rw(dev, desc_addr, desc, sizeof(desc),
+                            DMA_DIRECTION_TO_DEVICE);
+    if (err) {
+        qemu_log_mask(LOG_GUEST_ERROR, "rx desc pci_dma_read err=%d\n", err);
+        return err;
+    }
+
+    dma_addr_t buf = ldq_le_p(desc + PCIEMU_HW_RX_DESC_ADDR);
+    uint32_t len = MIN(ldl_le_p(desc + PCIEMU_HW_RX_DESC_LEN),
+                       rx->config.pkt_size);
+    if (len >= sizeof(rx->seq))
+        stq_le_p(rx->pkt, rx->seq);
+    err = pciemu_dma_rw(dev, buf, rx->pkt, len, DMA_DIRECTION_FROM_DEVICE);
+    if (err) {
+        qemu_log_mask(LOG_GUEST_ERROR, "rx pkt pci_dma_write err=%d\n", err);
+        return err;
+    }
+
+    stl_le_p(desc + PCIEMU_HW_RX_DESC_LEN, len);
+    stl_le_p(desc + PCIEMU_HW_RX_DESC_FLAGS, PCIEMU_HW_RX_DESC_FLAG_DONE);
+    err = pciemu_dma_rw(dev, desc_addr + PCIEMU_HW_RX_DESC_LEN,
+                        desc + PCIEMU_HW_RX_DESC_LEN,
+                        PCIEMU_HW_RX_DESC_SIZE - PCIEMU_HW_RX_DESC_LEN,
+                        DMA_DIRECTION_FROM_DEVICE);
+    if (err) {
+        qemu_log_mask(LOG_GUEST_ERROR, "rx desc pci_dma_write err=%d\n", err);
+        return err;
+    }
+
+    rx->seq++;
+    if (rx->config.rate)
+        rx->tokens -= NANOSECONDS_PER_SECOND;
+    qatomic_set(&rx->head, (rx->head + 1) % rx->config.ring_size);
+    return 0;
+}
+
+/**
+ * pciemu_rx_timer_cb: Run the generator
+ *
+ * Fills as many posted buffers as the token bucket allows and signals the
+ * completions with a single interrupt. The timer is only re-armed while
+ * there are buffers left; otherwise the driver will kick the generator
+ * again when posting new buffers (pciemu_rx_tail_update).
+ *
+ * @opaque: opaque pointer that points to instantiated object
+ */
+static void pciemu_rx_timer_cb(void *opaque)
+{
+    PCIEMUDevice *dev = opaque;
+    RXGenerator *rx = &dev->rx;
+    unsigned int filled = 0;
+    QEMU_LOCK_GUARD(&dev->lock);
+    if (rx->status != RX_STATUS_RUNNING)
+        return;
+
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    pciemu_rx_tokens_refill(rx, now);
+    while (pciemu_rx_ring_avail(rx) && pciemu_rx_has_token(rx)) {
+        if (pciemu_rx_fill_one(dev)) {
+            rx->status = RX_STATUS_STOPPED;
+            break;
+        }
+        filled++;
+    }
+
+    if (filled)
+        pciemu_irq_event(dev, PCIEMU_HW_IRQ_CAUSE_RX_DONE);
+
+    if (rx->status == RX_STATUS_RUNNING && pciemu_rx_ring_avail(rx))
+        timer_mod_ns(&rx->timer, now + pciemu_rx_next_tick(rx));
+}
+
+/**
+ * pciemu_rx_start: Start the generator
+ *
+ * The token bucket starts full, so a burst can be delivered right away.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static void pciemu_rx_start(PCIEMUDevice *dev)
+{
+    RXGenerator *rx = &dev->rx;
+    if (rx->status != RX_STATUS_STOPPED)
+        return;
+    if (!rx->config.ring_size || !rx->config.pkt_size) {
+        qemu_log_mask(LOG_GUEST_ERROR, "rx ring or packet not configured\n");
+        return;
+    }
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    rx->tokens = MAX(rx->config.burst, 1) * NANOSECONDS_PER_SECOND;
+    rx->last_refill_ns = now;
+    rx->status = RX_STATUS_RUNNING;
+    timer_mod_ns(&rx->timer, now);
+}
+
+/**
+ * pciemu_rx_stop: Stop the generator
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+static void pciemu_rx_stop(PCIEMUDevice *dev)
+{
+    RXGenerator *rx = &dev->rx;
+    if (rx->status != RX_STATUS_RUNNING)
+        return;
+    timer_del(&rx->timer);
+    rx->status = RX_STATUS_STOPPED;
+}
+
+/* -----------------------------------------------------------------------------
+ *  Public
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_rx_config_ring_addr: Configure the ring address register
+ *
+ * Bus address of the ring of RX descriptors. Changing the ring also
+ * resets the head and tail indexes.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @addr: bus address of the first descriptor
+ */
+void pciemu_rx_config_ring_addr(PCIEMUDevice *dev, dma_addr_t addr)
+{
+    RXGenerator *rx = &dev->rx;
+    if (rx->status != RX_STATUS_STOPPED)
+        return;
+    rx->config.ring_addr = addr;
+    rx->head = 0;
+    rx->tail = 0;
+}
+
+/**
+ * pciemu_rx_config_ring_size: Configure the ring size register
+ *
+ * Number of descriptors in the ring. As usual, one slot is kept empty to
+ * distinguish a full ring from an empty one.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @size: number of descriptors
+ */
+void pciemu_rx_config_ring_size(PCIEMUDevice *dev, uint32_t size)
+{
+    RXGenerator *rx = &dev->rx;
+    if (rx->status != RX_STATUS_STOPPED)
+        return;
+    if (size > PCIEMU_HW_RX_RING_SIZE_MAX) {
+        qemu_log_mask(LOG_GUEST_ERROR, "rx ring size %u too big\n", size);
+        return;
+    }
+    rx->config.ring_size = size;
+    rx->head = 0;
+    rx->tail = 0;
+}
+
+/**
+ * pciemu_rx_config_pkt_size: Configure the packet size register
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @size: size in bytes of each generated packet
+ */
+void pciemu_rx_config_pkt_size(PCIEMUDevice *dev, uint32_t size)
+{
+    RXGenerator *rx = &dev->rx;
+    if (rx->status != RX_STATUS_STOPPED)
+        return;
+    if (size > PCIEMU_HW_RX_PKT_SIZE_MAX) {
+        qemu_log_mask(LOG_GUEST_ERROR, "rx packet size %u too big\n", size);
+        return;
+    }
+    rx->config.pkt_size = size;
+}
+
+/**
+ * pciemu_rx_config_rate: Configure the rate register
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @rate: packets per second (0 means as fast as buffers are posted)
+ */
+void pciemu_rx_config_rate(PCIEMUDevice *dev, uint64_t rate)
+{
+    RXGenerator *rx = &dev->rx;
+    if (rx->status != RX_STATUS_STOPPED)
+        return;
+    rx->config.rate = rate;
+}
+
+/**
+ * pciemu_rx_config_burst: Configure the burst register
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @burst: depth of the token bucket in packets
+ */
+void pciemu_rx_config_burst(PCIEMUDevice *dev, uint64_t burst)
+{
+    RXGenerator *rx = &dev->rx;
+    if (rx->status != RX_STATUS_STOPPED)
+        return;
+    /* the bucket is scaled by NANOSECONDS_PER_SECOND, keep it in 64 bits */
+    if (burst > PCIEMU_HW_RX_BURST_MAX) {
+        qemu_log_mask(LOG_GUEST_ERROR, "rx burst %" PRIu64 " too big\n",
+                      burst);
+        return;
+    }
+    rx->config.burst = burst;
+}
+
+/**
+ * pciemu_rx_tail_update: Reception of new buffers
+ *
+ * The driver moves the tail forward after posting new buffers. If the
+ * generator was waiting for buffers, it is kicked right away.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @tail: index of the first descriptor not yet posted
+ */
+void pciemu_rx_tail_update(PCIEMUDevice *dev, uint32_t tail)
+{
+    RXGenerator *rx = &dev->rx;
+    if (tail >= rx->config.ring_size) {
+        qemu_log_mask(LOG_GUEST_ERROR, "rx tail %u out of bounds\n", tail);
+        return;
+    }
+    rx->tail = tail;
+    if (rx->status == RX_STATUS_RUNNING && !timer_pending(&rx->timer))
+        timer_mod_ns(&rx->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+}
+
+/**
+ * pciemu_rx_ctrl: Configure the control register
+ *
+ * The control register can take the following values (pciemu_hw.h);
+ *   - PCIEMU_HW_RX_CTRL_START - start generating packets
+ *   - PCIEMU_HW_RX_CTRL_STOP - stop generating packets
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @ctrl: value written to the control register
+ */
+void pciemu_rx_ctrl(PCIEMUDevice *dev, uint64_t ctrl)
+{
+    switch (ctrl) {
+    case PCIEMU_HW_RX_CTRL_START:
+        pciemu_rx_start(dev);
+        break;
+    case PCIEMU_HW_RX_CTRL_STOP:
+        pciemu_rx_stop(dev);
+        break;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR, "rx ctrl %" PRIx64 " unknown\n", ctrl);
+    }
+}
+
+/**
+ * pciemu_rx_reset: RX reset
+ *
+ * Stops the generator and clears its configuration.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_rx_reset(PCIEMUDevice *dev)
+{
+    RXGenerator *rx = &dev->rx;
+    timer_del(&rx->timer);
+    rx->status = RX_STATUS_STOPPED;
+    rx->config.ring_addr = 0;
+    rx->config.ring_size = 0;
+    rx->config.pkt_size = 0;
+    rx->config.rate = 0;
+    rx->config.burst = 0;
+    rx->head = 0;
+    rx->tail = 0;
+    rx->seq = 0;
+    rx->tokens = 0;
+    rx->last_refill_ns = 0;
+
+    /* payload pattern, only the sequence number changes between packets */
+    for (int i = 0; i < PCIEMU_HW_RX_PKT_SIZE_MAX; ++i)
+        rx->pkt[i] = i;
+}
+
+/**
+ * pciemu_rx_init: RX initialization
+ *
+ * Initializes the RX block for the instantiated PCIEMUDevice object.
+ *
+ * @dev: Instance of PCIEMUDevice object being initialized
+ * @errp: pointer to indicate errors
+ */
+void pciemu_rx_init(PCIEMUDevice *dev, Error **errp)
+{
+    timer_init_ns(&dev->rx.timer, QEMU_CLOCK_VIRTUAL, pciemu_rx_timer_cb, dev);
+    pciemu_rx_reset(dev);
+}
+
+/**
+ * pciemu_rx_fini: RX finalization
+ *
+ * Finalizes the RX block for the instantiated PCIEMUDevice object.
+ *
+ * @dev: Instance of PCIEMUDevice object being finalized
+ */
+void pciemu_rx_fini(PCIEMUDevice *dev)
+{
+    pciemu_rx_reset(dev);
+    dev->rx.status = RX_STATUS_OFF;
+}
@@ -0,0 +1,75 @@
+/* rx.h - Receive-stream generator operations
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_RX_H
+#define PCIEMU_RX_H
+
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "hw/pci/pci.h"
+#include "pciemu_hw.h"
+
+/* minimum interval between two runs of the generator (in ns) */
+#define PCIEMU_RX_TIMER_MIN_NS 10000
+
+/* forward declaration (defined in pciemu.h) to avoid circular reference */
+typedef struct PCIEMUDevice PCIEMUDevice;
+
+/* configuration of the RX generator pre-execution */
+typedef struct RXConfig {
+    dma_addr_t ring_addr;
+    uint32_t ring_size;
+    uint32_t pkt_size;
+    uint64_t rate;  /* packets per second, 0 means unlimited */
+    uint64_t burst; /* depth of the token bucket in packets */
+} RXConfig;
+
+/* status of the RX generator */
+typedef enum RXStatus {
+    RX_STATUS_STOPPED,
+    RX_STATUS_RUNNING,
+    RX_STATUS_OFF,
+} RXStatus;
+
+typedef struct RXGenerator {
+    RXConfig config;
+    RXStatus status;
+    /* ring indexes : device fills [head, tail) */
+    uint32_t head;
+    uint32_t tail;
+    /* sequence number written at the start of each packet */
+    uint64_t seq;
+    /* token bucket, in packets scaled by NANOSECONDS_PER_SECOND */
+    uint64_t tokens;
+    int64_t last_refill_ns;
+    QEMUTimer timer;
+    uint8_t pkt[PCIEMU_HW_RX_PKT_SIZE_MAX];
+} RXGenerator;
+
+
+void pciemu_rx_config_ring_addr(PCIEMUDevice *dev, dma_addr_t addr);
+
+void pciemu_rx_config_ring_size(PCIEMUDevice *dev, uint32_t size);
+
+void pciemu_rx_config_pkt_size(PCIEMUDevice *dev, uint32_t size);
+
+void pciemu_rx_config_rate(PCIEMUDevice *dev, uint64_t rate);
+
+void pciemu_rx_config_burst(PCIEMUDevice *dev, uint64_t burst);
+
+void pciemu_rx_tail_update(PCIEMUDevice *dev, uint32_t tail);
+
+void pciemu_rx_ctrl(PCIEMUDevice *dev, uint64_t ctrl);
+
+void pciemu_rx_reset(PCIEMUDevice *dev);
+
+void pciemu_rx_init(PCIEMUDevice *dev, Error **errp);
+
+void pciemu_rx_fini(PCIEMUDevice *dev);
+
+#endif /* PCIEMU_RX_H */
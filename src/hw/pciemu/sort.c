@@ -0,0 +1,523 @@
+/* sort.c - Sort of the DMA command keys on a worker thread
+ *
+ * PCIEMU_HW_DMA_CMD_SORT is a least significant digit (LSD) radix sort : a
+ * single pass over the keys counts every byte (digit) of every key, then
+ * each digit, from the least significant one, scatters the keys (and their
+ * indices) into a scratch array, which keeps the sort stable. A digit shared
+ * by all the keys is skipped, so small values in 64-bit keys only cost the
+ * passes of their significant bytes, and keys already in order are not
+ * moved at all (checked with AVX2 when the host has it).
+ * Only that check is vectorized : the histogram and the scatter passes are
+ * scalar. Both update bins picked by the keys themselves, which AVX2 (no
+ * scatter store, no conflict detection) cannot do faster than one key at a
+ * time, so a sort costs about the same with or without it.
+ *
+ * The keys are read from the guest, sorted and written back by a worker of
+ * the QEMU thread pool, and the main loop completes the command : neither
+ * the vCPU ringing the doorbell nor the main loop moves the keys, whatever
+ * their count. The pool belongs to the main loop, which hands it the sorts
+ * started by a vCPU (see mmio.c). As for the pipeline, the transfers of the
+ * worker are traced once back in the main loop.
+ * A reset drops the sort in progress (gen) and waits for its worker, so no
+ * completion touches the device once it is reset or finalized. The worker
+ * does not write the keys of a sort dropped before it is done.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/lockable.h"
+#include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "block/aio-wait.h"
+#include "block/thread-pool.h"
+#include "dma.h"
+#include "hostnuma.h"
+#include "pciemu.h"
+#include "sort.h"
+#include "trace.h"
+
+/* -----------------------------------------------------------------------------
+ *  Private
+ * -----------------------------------------------------------------------------
+ */
+
+/* sort handed to a worker */
+typedef struct SortJob {
+    PCIEMUDevice *dev;
+    uint64_t gen; /* sort the job belongs to */
+    dma_addr_t src;
+    dma_addr_t dst;
+    dma_addr_t idx_dst;
+    size_t cnt;
+    unsigned int key_size;
+    bool with_idx; /* SORT_CTRL_IDX */
+    /* arrays allocated by the worker */
+    void *keys; /* in host order, sorted once the worker is done */
+    void *tmp;
+    uint32_t *idx; /* original index of each key, NULL without SORT_CTRL_IDX */
+    uint32_t *idx_tmp;
+    uint64_t src_hash; /* payload of the keys read (see trace.c) */
+    unsigned int written; /* transfers written back : keys, then indices */
+} SortJob;
+
+/**
+ * pciemu_sort_key: Key i of an array
+ *
+ * @keys: array of 32-bit or 64-bit keys
+ * @i: index of the key
+ * @key_size: size of a key in bytes
+ */
+static inline uint64_t pciemu_sort_key(const void *keys, size_t i,
+                                       unsigned int key_size)
+{
+    if (key_size == sizeof(uint32_t))
+        return ((const uint32_t *)keys)[i];
+    return ((const uint64_t *)keys)[i];
+}
+
+/**
+ * pciemu_sort_key_set: Set key i of an array
+ *
+ * @keys: array of 32-bit or 64-bit keys
+ * @i: index of the key
+ * @key_size: size of a key in bytes
+ * @key: value of the key
+ */
+static inline void pciemu_sort_key_set(void *keys, size_t i,
+                                       unsigned int key_size, uint64_t key)
+{
+    if (key_size == sizeof(uint32_t))
+        ((uint32_t *)keys)[i] = key;
+    else
+        ((uint64_t *)keys)[i] = key;
+}
+
+/**
+ * pciemu_sort_le: Convert keys between little endian and the host order
+ *
+ * The conversion is the same both ways (nothing to do on little endian
+ * hosts).
+ *
+ * @keys: array of 32-bit or 64-bit keys
+ * @cnt: number of keys
+ * @key_size: size of a key in bytes
+ */
+static void pciemu_sort_le(void *keys, size_t cnt, unsigned int key_size)
+{
+    for (size_t i = 0; i < cnt; ++i) {
+        if (key_size == sizeof(uint32_t))
+            ((uint32_t *)keys)[i] = le32_to_cpu(((uint32_t *)keys)[i]);
+        else
+            ((uint64_t *)keys)[i] = le64_to_cpu(((uint64_t *)keys)[i]);
+    }
+}
+
+/**
+ * pciemu_sort_sorted32_scalar: Whether 32-bit keys are in increasing order
+ *
+ * @keys: array of keys
+ * @n: number of keys
+ */
+static bool pciemu_sort_sorted32_scalar(const uint32_t *keys, size_t n)
+{
+    for (size_t i = 1; i < n; ++i) {
+        if (keys[i - 1] > keys[i])
+            return false;
+    }
+    return true;
+}
+
+/**
+ * pciemu_sort_sorted64_scalar: Whether 64-bit keys are in increasing order
+ *
+ * @keys: array of keys
+ * @n: number of keys
+ */
+static bool pciemu_sort_sorted64_scalar(const uint64_t *keys, size_t n)
+{
+    for (size_t i = 1; i < n; ++i) {
+        if (keys[i - 1] > keys[i])
+            return false;
+    }
+    return true;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include <immintrin.h>
+
+/**
+ * pciemu_sort_sorted32_avx2: Whether 32-bit keys are in increasing order
+ *
+ * Same as pciemu_sort_sorted32_scalar, comparing 8 keys with their next
+ * ones at a time. AVX2 only compares signed words : the sign bit of both
+ * sides is flipped to compare them unsigned.
+ */
+static __attribute__((target("avx2"))) bool
+pciemu_sort_sorted32_avx2(const uint32_t *keys, size_t n)
+{
+    __m256i bias = _mm256_set1_epi32(INT32_MIN);
+    size_t i = 0;
+    for (; i + 8 < n; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(keys + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(keys + i + 1));
+        __m256i gt = _mm256_cmpgt_epi32(_mm256_xor_si256(a, bias),
+                                        _mm256_xor_si256(b, bias));
+        if (_mm256_movemask_epi8(gt))
+            return false;
+    }
+    return pciemu_sort_sorted32_scalar(keys + i, n - i);
+}
+
+/**
+ * pciemu_sort_sorted64_avx2: Whether 64-bit keys are in increasing order
+ *
+ * Same as pciemu_sort_sorted32_avx2, 4 keys at a time.
+ */
+static __attribute__((target("avx2"))) bool
+pciemu_sort_sorted64_avx2(const uint64_t *keys, size_t n)
+{
+    __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+    size_t i = 0;
+    for (; i + 4 < n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(keys + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(keys + i + 1));
+        __m256i gt = _mm256_cmpgt_epi64(_mm256_xor_si256(a, bias),
+                                        _mm256_xor_si256(b, bias));
+        if (_mm256_movemask_epi8(gt))
+            return false;
+    }
+    return pciemu_sort_sorted64_scalar(keys + i, n - i);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+/* kernels, selected in pciemu_sort_init according to the host CPU */
+static bool (*pciemu_sort_sorted32)(const uint32_t *,
+                                    size_t) = pciemu_sort_sorted32_scalar;
+static bool (*pciemu_sort_sorted64)(const uint64_t *,
+                                    size_t) = pciemu_sort_sorted64_scalar;
+
+/**
+ * pciemu_sort_select_kernels: Use the vectorized kernels if possible
+ */
+static void pciemu_sort_select_kernels(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (__builtin_cpu_supports("avx2")) {
+        pciemu_sort_sorted32 = pciemu_sort_sorted32_avx2;
+        pciemu_sort_sorted64 = pciemu_sort_sorted64_avx2;
+    }
+#endif
+}
+
+/**
+ * pciemu_sort_radix: Sort the keys of a job (LSD radix sort)
+ *
+ * The keys and the scratch array (and the indices and theirs) are swapped
+ * by each pass, so job->keys always holds the last pass.
+ *
+ * @job: sort being run
+ */
+static void pciemu_sort_radix(SortJob *job)
+{
+    size_t hist[sizeof(uint64_t)][PCIEMU_SORT_RADIX] = { 0 };
+    size_t pos[PCIEMU_SORT_RADIX];
+    unsigned int ks = job->key_size;
+    size_t n = job->cnt;
+    if (job->idx) {
+        for (size_t i = 0; i < n; ++i)
+            job->idx[i] = i;
+    }
+    if (ks == sizeof(uint32_t) ? pciemu_sort_sorted32(job->keys, n)
+                               : pciemu_sort_sorted64(job->keys, n))
+        return;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t key = pciemu_sort_key(job->keys, i, ks);
+        for (unsigned int d = 0; d < ks; ++d)
+            hist[d][(key >> (d * 8)) & 0xff]++;
+    }
+    uint64_t first = pciemu_sort_key(job->keys, 0, ks);
+    for (unsigned int d = 0; d < ks; ++d) {
+        /* every key has the same digit, the pass would not move them */
+        if (hist[d][(first >> (d * 8)) & 0xff] == n)
+            continue;
+        size_t sum = 0;
+        for (unsigned int b = 0; b < PCIEMU_SORT_RADIX; ++b) {
+            pos[b] = sum;
+            sum += hist[d][b];
+        }
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t key = pciemu_sort_key(job->keys, i, ks);
+            size_t p = pos[(key >> (d * 8)) & 0xff]++;
+            pciemu_sort_key_set(job->tmp, p, ks, key);
+            if (job->idx)
+                job->idx_tmp[p] = job->idx[i];
+        }
+        void *keys = job->keys;
+        job->keys = job->tmp;
+        job->tmp = keys;
+        uint32_t *idx = job->idx;
+        job->idx = job->idx_tmp;
+        job->idx_tmp = idx;
+    }
+}
+
+/**
+ * pciemu_sort_free: Free a job and its arrays
+ *
+ * @job: sort being freed
+ */
+static void pciemu_sort_free(SortJob *job)
+{
+    g_free(job->keys);
+    g_free(job->tmp);
+    g_free(job->idx);
+    g_free(job->idx_tmp);
+    g_free(job);
+}
+
+/**
+ * pciemu_sort_read: Read the keys from the guest (worker thread)
+ *
+ * The arrays of the sort are allocated first. The keys are sorted in place,
+ * so their payload is hashed for the trace right away.
+ * Returns the error of the read (MEMTX_*).
+ *
+ * @job: sort being run
+ */
+static int pciemu_sort_read(SortJob *job)
+{
+    PCIEMUDevice *dev = job->dev;
+    dma_addr_t len = job->cnt * job->key_size;
+    job->keys = g_malloc(len);
+    job->tmp = g_malloc(len);
+    if (job->with_idx) {
+        job->idx = g_new(uint32_t, job->cnt);
+        job->idx_tmp = g_new(uint32_t, job->cnt);
+    }
+    int ret = pci_dma_rw(&dev->pci_dev, job->src, job->keys, len,
+                         DMA_DIRECTION_TO_DEVICE, MEMTXATTRS_UNSPECIFIED);
+    job->src_hash = pciemu_trace_dma_hash(dev, job->keys, len);
+    pciemu_sort_le(job->keys, job->cnt, job->key_size);
+    return ret;
+}
+
+/**
+ * pciemu_sort_write: Write the sorted keys (and indices) to the guest
+ * (worker thread)
+ *
+ * Nothing is written if a reset dropped the sort meanwhile.
+ * Returns the error of the write (MEMTX_*).
+ *
+ * @job: sort being run
+ */
+static int pciemu_sort_write(SortJob *job)
+{
+    PCIEMUDevice *dev = job->dev;
+    if (qatomic_read(&dev->dma.sort.gen) != job->gen)
+        return 0;
+    pciemu_sort_le(job->keys, job->cnt, job->key_size);
+    job->written++;
+    int ret = pci_dma_rw(&dev->pci_dev, job->dst, job->keys,
+                         job->cnt * job->key_size, DMA_DIRECTION_FROM_DEVICE,
+                         MEMTXATTRS_UNSPECIFIED);
+    if (ret || !job->idx)
+        return ret;
+    pciemu_sort_le(job->idx, job->cnt, sizeof(*job->idx));
+    job->written++;
+    return pci_dma_rw(&dev->pci_dev, job->idx_dst, job->idx,
+                      job->cnt * sizeof(*job->idx), DMA_DIRECTION_FROM_DEVICE,
+                      MEMTXATTRS_UNSPECIFIED);
+}
+
+/**
+ * pciemu_sort_work: Read, sort and write back the keys (worker thread)
+ *
+ * The worker runs on the host nodes of the device, if placed (see
+ * hostnuma.c).
+ *
+ * @opaque: the sort (SortJob)
+ */
+static int pciemu_sort_work(void *opaque)
+{
+    SortJob *job = opaque;
+    HostNumaAffinity saved;
+    pciemu_hostnuma_pin(job->dev, &saved);
+    int ret = pciemu_sort_read(job);
+    if (!ret) {
+        pciemu_sort_radix(job);
+        ret = pciemu_sort_write(job);
+    }
+    pciemu_hostnuma_unpin(&saved);
+    return ret;
+}
+
+/**
+ * pciemu_sort_trace: Record the transfers of a sort
+ *
+ * @job: sort done by the worker
+ */
+static void pciemu_sort_trace(SortJob *job)
+{
+    PCIEMUDevice *dev = job->dev;
+    dma_addr_t len = job->cnt * job->key_size;
+    pciemu_trace_dma_hashed(dev, DMA_DIRECTION_TO_DEVICE, job->src, len,
+                            job->src_hash);
+    if (job->written > 0)
+        pciemu_trace_dma(dev, DMA_DIRECTION_FROM_DEVICE, job->dst, job->keys,
+                         len);
+    if (job->written > 1)
+        pciemu_trace_dma(dev, DMA_DIRECTION_FROM_DEVICE, job->idx_dst,
+                         job->idx, job->cnt * sizeof(*job->idx));
+}
+
+/**
+ * pciemu_sort_done: Completion of a sort (main loop)
+ *
+ * @opaque: the sort (SortJob)
+ * @ret: error of the first transfer which failed (MEMTX_*)
+ */
+static void pciemu_sort_done(void *opaque, int ret)
+{
+    SortJob *job = opaque;
+    PCIEMUDevice *dev = job->dev;
+    DMASort *sort = &dev->dma.sort;
+    QEMU_LOCK_GUARD(&dev->lock);
+    sort->busy = false;
+    /* a sort dropped by a reset does not complete */
+    if (job->gen == sort->gen && sort->active) {
+        sort->active = false;
+        pciemu_sort_trace(job);
+        if (ret)
+            qemu_log_mask(LOG_GUEST_ERROR, "%s err=%d\n",
+                          job->written ? "pci_dma_write" : "pci_dma_read",
+                          ret);
+        pciemu_dma_sort_end(dev, ret ? PCIEMU_HW_DMA_ERR_BUS
+                                     : PCIEMU_HW_DMA_ERR_NONE);
+    }
+    pciemu_sort_free(job);
+}
+
+/**
+ * pciemu_sort_submit: Hand a sort to a worker
+ *
+ * @job: sort being handed
+ */
+static void pciemu_sort_submit(SortJob *job)
+{
+    job->dev->dma.sort.busy = true;
+    thread_pool_submit_aio(pciemu_sort_work, job, pciemu_sort_done, job);
+}
+
+/**
+ * pciemu_sort_timer_cb: Hand the sort started by a vCPU to a worker
+ *
+ * @opaque: opaque pointer that points to instantiated object
+ */
+static void pciemu_sort_timer_cb(void *opaque)
+{
+    PCIEMUDevice *dev = opaque;
+    DMASort *sort = &dev->dma.sort;
+    QEMU_LOCK_GUARD(&dev->lock);
+    if (!sort->job)
+        return;
+    pciemu_sort_submit(sort->job);
+    sort->job = NULL;
+}
+
+/* -----------------------------------------------------------------------------
+ *  Public
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_sort_active: Whether a sort is in progress
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+bool pciemu_sort_active(PCIEMUDevice *dev)
+{
+    return dev->dma.sort.active;
+}
+
+/**
+ * pciemu_sort_start: Start sorting keys
+ *
+ * The sort is handed to a worker, which reads the keys. The sort ends with
+ * pciemu_dma_sort_end, never before this returns.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @src: bus address of the keys
+ * @dst: bus address of the sorted keys
+ * @idx_dst: bus address of the indices of the sorted keys (if idx)
+ * @cnt: number of keys (not 0)
+ * @key_size: size of a key in bytes (4 or 8)
+ * @idx: write the indices of the sorted keys too
+ */
+void pciemu_sort_start(PCIEMUDevice *dev, dma_addr_t src, dma_addr_t dst,
+                       dma_addr_t idx_dst, size_t cnt, unsigned int key_size,
+                       bool idx)
+{
+    DMASort *sort = &dev->dma.sort;
+    SortJob *job = g_new0(SortJob, 1);
+    job->dev = dev;
+    job->src = src;
+    job->dst = dst;
+    job->idx_dst = idx_dst;
+    job->cnt = cnt;
+    job->key_size = key_size;
+    job->with_idx = idx;
+    /* read by the worker of the sort, before writing the keys back */
+    qatomic_set(&sort->gen, sort->gen + 1);
+    job->gen = sort->gen;
+    sort->active = true;
+    if (!qemu_mutex_iothread_locked()) {
+        sort->job = job;
+        timer_mod_ns(&sort->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+        return;
+    }
+    pciemu_sort_submit(job);
+}
+
+/**
+ * pciemu_sort_reset: Sort reset
+ *
+ * Drops the sort in progress : freed if not handed to a worker yet, or its
+ * worker is waited for (see above), polling the main loop which runs the
+ * completion.
+ *
+ * @dev: Instance of PCIEMUDevice object being reset
+ */
+void pciemu_sort_reset(PCIEMUDevice *dev)
+{
+    DMASort *sort = &dev->dma.sort;
+    qatomic_set(&sort->gen, sort->gen + 1);
+    sort->active = false;
+    timer_del(&sort->timer);
+    if (sort->job) {
+        pciemu_sort_free(sort->job);
+        sort->job = NULL;
+    }
+    AIO_WAIT_WHILE(NULL, sort->busy);
+}
+
+/**
+ * pciemu_sort_init: Sort initialization
+ *
+ * @dev: Instance of PCIEMUDevice object being initialized
+ */
+void pciemu_sort_init(PCIEMUDevice *dev)
+{
+    dev->dma.sort.gen = 0;
+    dev->dma.sort.busy = false;
+    dev->dma.sort.job = NULL;
+    timer_init_ns(&dev->dma.sort.timer, QEMU_CLOCK_VIRTUAL,
+                  pciemu_sort_timer_cb, dev);
+    pciemu_sort_reset(dev);
+    /* pick the fastest kernels for this host */
+    pciemu_sort_select_kernels();
+}
@@ -0,0 +1,43 @@
+/* sort.h - Sort of the DMA command keys on a worker thread
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_SORT_H
+#define PCIEMU_SORT_H
+
+#include "qemu/osdep.h"
+#include "hw/pci/pci.h"
+#include "qemu/timer.h"
+#include "pciemu_hw.h"
+
+/* keys are sorted one byte (digit) per pass */
+#define PCIEMU_SORT_RADIX 256
+
+/* forward declaration (defined in pciemu.h) to avoid circular reference */
+typedef struct PCIEMUDevice PCIEMUDevice;
+
+typedef struct DMASort {
+    uint64_t gen; /* bumped by every sort and reset, read by the worker */
+    bool active;
+    bool busy;    /* a worker holds a sort, possibly dropped */
+    /* sort started by a vCPU, handed to a worker by the main loop */
+    struct SortJob *job;
+    QEMUTimer timer;
+} DMASort;
+
+
+bool pciemu_sort_active(PCIEMUDevice *dev);
+
+void pciemu_sort_start(PCIEMUDevice *dev, dma_addr_t src, dma_addr_t dst,
+                       dma_addr_t idx_dst, size_t cnt, unsigned int key_size,
+                       bool idx);
+
+void pciemu_sort_reset(PCIEMUDevice *dev);
+
+void pciemu_sort_init(PCIEMUDevice *dev);
+
+#endif /* PCIEMU_SORT_H */
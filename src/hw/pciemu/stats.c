@@ -0,0 +1,330 @@
+/* stats.c - Latency histograms of the stages of a DMA command
+ *
+ * The doorbell, the start and the end of the DMA and the IRQ (msi_notify)
+ * of every command are timestamped on the virtual clock (the clock of the
+ * latency model), and the time spent between them is kept in log-linear
+ * histograms, one per stage :
+ *   - doorbell-to-start : waiting for the engine (device lock, arbiter
+ *     and command in flight), from the arrival of the doorbell write
+ *   - start-to-end : moving the data
+ *   - end-to-irq : completion (e.g. delay of the latency model)
+ *   - doorbell-to-irq : the whole command, as seen by the driver
+ * Commands without IRQ (PCIEMU_HW_DMA_CMD_FLAG_NO_IRQ) only count in the
+ * first two stages.
+ *
+ * The histograms are read from the host with the latency-stats property,
+ * without any guest instrumentation :
+ *   QMP : { "execute": "qom-get",
+ *           "arguments": { "path": "/machine/peripheral/pciemu0",
+ *                          "property": "latency-stats" } }
+ *   HMP : qom-get /machine/peripheral/pciemu0 latency-stats
+ * They are cumulative since the device was realized (not cleared by device
+ * resets), so the activity of an interval is the difference between two
+ * reads.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "pciemu.h"
+#include "stats.h"
+
+/* names of the stages, as reported by the latency-stats property */
+static const char *const pciemu_stats_stage_names[STATS_STAGE_CNT] = {
+    [STATS_STAGE_DOORBELL_TO_START] = "doorbell-to-start",
+    [STATS_STAGE_START_TO_END] = "start-to-end",
+    [STATS_STAGE_END_TO_IRQ] = "end-to-irq",
+    [STATS_STAGE_DOORBELL_TO_IRQ] = "doorbell-to-irq",
+};
+
+/* percentiles reported for each stage, in tenths of percent */
+static const struct {
+    const char *name;
+    uint64_t permille;
+} pciemu_stats_percentiles[] = {
+    { "p50-ns", 500 },
+    { "p90-ns", 900 },
+    { "p99-ns", 990 },
+    { "p999-ns", 999 },
+};
+
+/* -----------------------------------------------------------------------------
+ *  Private
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_stats_bin: Index of the bin holding a latency
+ *
+ * Latencies below PCIEMU_STATS_SUB have their own bin. Above, each power of
+ * two is split in PCIEMU_STATS_SUB linear bins.
+ *
+ * @ns: latency in ns
+ */
+static inline unsigned int pciemu_stats_bin(uint64_t ns)
+{
+    if (ns < PCIEMU_STATS_SUB)
+        return ns;
+    unsigned int shift = 63 - clz64(ns) - PCIEMU_STATS_SUB_BITS;
+    return ((shift + 1) << PCIEMU_STATS_SUB_BITS) +
+           ((ns >> shift) & (PCIEMU_STATS_SUB - 1));
+}
+
+/**
+ * pciemu_stats_bin_max: Highest latency held by a bin (inclusive)
+ *
+ * @bin: index of the bin
+ */
+static inline uint64_t pciemu_stats_bin_max(unsigned int bin)
+{
+    if (bin < PCIEMU_STATS_SUB)
+        return bin;
+    unsigned int shift = (bin >> PCIEMU_STATS_SUB_BITS) - 1;
+    uint64_t sub = PCIEMU_STATS_SUB + (bin & (PCIEMU_STATS_SUB - 1));
+    /* wraps to UINT64_MAX for the last bin */
+    return ((sub + 1) << shift) - 1;
+}
+
+/**
+ * pciemu_stats_record: Add a latency to the histogram of a stage
+ *
+ * Timestamps never go backwards, but a negative delta is clamped anyway.
+ *
+ * @hist: histogram of the stage
+ * @ns: latency in ns
+ */
+static void pciemu_stats_record(StatsHist *hist, int64_t ns)
+{
+    uint64_t v = MAX(ns, 0);
+    if (!hist->count || v < hist->min_ns)
+        hist->min_ns = v;
+    hist->max_ns = MAX(hist->max_ns, v);
+    hist->sum_ns += v;
+    hist->count++;
+    hist->bins[pciemu_stats_bin(v)]++;
+}
+
+/**
+ * pciemu_stats_percentile: Latency below which a fraction of the samples is
+ *
+ * Returns the upper bound of the bin holding the percentile, so it is off by
+ * at most the width of the bin.
+ *
+ * @hist: histogram of the stage (not empty)
+ * @permille: fraction of the samples, in tenths of percent
+ */
+static uint64_t pciemu_stats_percentile(const StatsHist *hist,
+                                        uint64_t permille)
+{
+    uint64_t rank = DIV_ROUND_UP(hist->count * permille, 1000);
+    uint64_t cum = 0;
+    for (unsigned int i = 0; i < PCIEMU_STATS_BINS; ++i) {
+        cum += hist->bins[i];
+        if (cum >= rank && cum)
+            return MIN(pciemu_stats_bin_max(i), hist->max_ns);
+    }
+    return hist->max_ns;
+}
+
+/**
+ * pciemu_stats_visit_hist: Visit the histogram of a stage
+ *
+ * Only the non-empty bins are visited, by their upper bound (le-ns).
+ *
+ * @v: visitor of the property
+ * @name: name of the stage
+ * @hist: histogram of the stage
+ * @errp: pointer to indicate errors
+ */
+static bool pciemu_stats_visit_hist(Visitor *v, const char *name,
+                                    const StatsHist *hist, Error **errp)
+{
+    uint64_t count = hist->count;
+    uint64_t min = hist->min_ns;
+    uint64_t max = hist->max_ns;
+    uint64_t mean = count ? hist->sum_ns / count : 0;
+    bool ok = false;
+
+    if (!visit_start_struct(v, name, NULL, 0, errp))
+        return false;
+    if (!visit_type_uint64(v, "count", &count, errp) ||
+        !visit_type_uint64(v, "min-ns", &min, errp) ||
+        !visit_type_uint64(v, "max-ns", &max, errp) ||
+        !visit_type_uint64(v, "mean-ns", &mean, errp))
+        goto out;
+    for (size_t i = 0; i < ARRAY_SIZE(pciemu_stats_percentiles); ++i) {
+        uint64_t val = count ? pciemu_stats_percentile(
+                                   hist, pciemu_stats_percentiles[i].permille)
+                             : 0;
+        if (!visit_type_uint64(v, pciemu_stats_percentiles[i].name, &val,
+                               errp))
+            goto out;
+    }
+    if (!visit_start_list(v, "bins", NULL, 0, errp))
+        goto out;
+    ok = true;
+    for (unsigned int i = 0; i < PCIEMU_STATS_BINS && ok; ++i) {
+        uint64_t le = pciemu_stats_bin_max(i);
+        uint64_t cnt = hist->bins[i];
+        if (!cnt)
+            continue;
+        if (!visit_start_struct(v, NULL, NULL, 0, errp)) {
+            ok = false;
+            break;
+        }
+        ok = visit_type_uint64(v, "le-ns", &le, errp) &&
+             visit_type_uint64(v, "count", &cnt, errp) &&
+             visit_check_struct(v, errp);
+        visit_end_struct(v, NULL);
+    }
+    ok = ok && visit_check_list(v, errp);
+    visit_end_list(v, NULL);
+    ok = ok && visit_check_struct(v, errp);
+out:
+    visit_end_struct(v, NULL);
+    return ok;
+}
+
+/* -----------------------------------------------------------------------------
+ *  Public
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_stats_doorbell: Timestamp the doorbell of the next command
+ *
+ * The doorbell is stamped when its write arrives (see pciemu_mmio_write),
+ * but only belongs to a command once the engine starts it : the stamp is
+ * kept until then.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @ns: arrival of the doorbell (QEMU_CLOCK_VIRTUAL)
+ */
+void pciemu_stats_doorbell(PCIEMUDevice *dev, int64_t ns)
+{
+    dev->stats.doorbell_ns = ns;
+}
+
+/**
+ * pciemu_stats_event: Timestamp an event of the current DMA command
+ *
+ * Each event closes the stage started by the previous one, the start
+ * closing the one of the doorbell handed by pciemu_stats_doorbell.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @event: event happening now (STATS_EVENT_DMA_START or STATS_EVENT_DMA_END)
+ */
+void pciemu_stats_event(PCIEMUDevice *dev, StatsEvent event)
+{
+    StatsRecorder *stats = &dev->stats;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    stats->stamp[event] = now;
+    switch (event) {
+    case STATS_EVENT_DMA_START:
+        stats->stamp[STATS_EVENT_DOORBELL] = stats->doorbell_ns;
+        /* commands without IRQ do not wait for it */
+        stats->pending =
+            !(dev->dma.config.cmd & PCIEMU_HW_DMA_CMD_FLAG_NO_IRQ);
+        pciemu_stats_record(&stats->hist[STATS_STAGE_DOORBELL_TO_START],
+                            now - stats->doorbell_ns);
+        break;
+    case STATS_EVENT_DMA_END:
+        pciemu_stats_record(&stats->hist[STATS_STAGE_START_TO_END],
+                            now - stats->stamp[STATS_EVENT_DMA_START]);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * pciemu_stats_irq: Timestamp an IRQ
+ *
+ * Only the IRQ of a pending DMA command closes its stages, so the other
+ * vectors (and IRQs raised through the debug registers) are ignored.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @vector: the IRQ vector just raised
+ */
+void pciemu_stats_irq(PCIEMUDevice *dev, unsigned int vector)
+{
+    StatsRecorder *stats = &dev->stats;
+    if (vector != PCIEMU_HW_IRQ_DMA_ENDED_VECTOR || !stats->pending)
+        return;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    stats->stamp[STATS_EVENT_IRQ] = now;
+    stats->pending = false;
+    pciemu_stats_record(&stats->hist[STATS_STAGE_END_TO_IRQ],
+                        now - stats->stamp[STATS_EVENT_DMA_END]);
+    pciemu_stats_record(&stats->hist[STATS_STAGE_DOORBELL_TO_IRQ],
+                        now - stats->stamp[STATS_EVENT_DOORBELL]);
+}
+
+/**
+ * pciemu_stats_get: Getter of the latency-stats property
+ *
+ * Visits a struct with one member per stage (see pciemu_stats_visit_hist).
+ *
+ * @obj: Instance of PCIEMUDevice object being queried
+ * @v: visitor of the property
+ * @name: name of the property
+ * @opaque: unused
+ * @errp: pointer to indicate errors
+ */
+void pciemu_stats_get(Object *obj, Visitor *v, const char *name, void *opaque,
+                      Error **errp)
+{
+    PCIEMUDevice *dev = PCIEMU_DEVICE(obj);
+    if (!visit_start_struct(v, name, NULL, 0, errp))
+        return;
+    for (int i = 0; i < STATS_STAGE_CNT; ++i) {
+        if (!pciemu_stats_visit_hist(v, pciemu_stats_stage_names[i],
+                                     &dev->stats.hist[i], errp))
+            goto out;
+    }
+    visit_check_struct(v, errp);
+out:
+    visit_end_struct(v, NULL);
+}
+
+/**
+ * pciemu_stats_reset: Stats reset
+ *
+ * Drops the command in flight, but keeps the histograms (see above).
+ *
+ * @dev: Instance of PCIEMUDevice object being reset
+ */
+void pciemu_stats_reset(PCIEMUDevice *dev)
+{
+    dev->stats.pending = false;
+}
+
+/**
+ * pciemu_stats_init: Stats initialization
+ *
+ * @dev: Instance of PCIEMUDevice object being initialized
+ * @errp: pointer to indicate errors
+ */
+void pciemu_stats_init(PCIEMUDevice *dev, Error **errp)
+{
+    memset(&dev->stats, 0, sizeof(dev->stats));
+}
+
+/**
+ * pciemu_stats_fini: Stats finalization
+ *
+ * The histograms are fields of the device, only the command in flight is
+ * dropped.
+ *
+ * @dev: Instance of PCIEMUDevice object being finalized
+ */
+void pciemu_stats_fini(PCIEMUDevice *dev)
+{
+    pciemu_stats_reset(dev);
+}
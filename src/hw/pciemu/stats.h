@@ -0,0 +1,75 @@
+/* stats.h - Latency histograms of the stages of a DMA command
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_STATS_H
+#define PCIEMU_STATS_H
+
+#include "qemu/osdep.h"
+#include "qapi/visitor.h"
+#include "qom/object.h"
+
+/* log-linear histogram : 2^SUB_BITS linear bins per power of two, i.e. a
+ * relative error of at most 1 / 2^SUB_BITS, over the whole 64-bit range */
+#define PCIEMU_STATS_SUB_BITS 3
+#define PCIEMU_STATS_SUB (1 << PCIEMU_STATS_SUB_BITS)
+#define PCIEMU_STATS_BINS ((64 - PCIEMU_STATS_SUB_BITS + 1) * PCIEMU_STATS_SUB)
+
+/* forward declaration (defined in pciemu.h) to avoid circular reference */
+typedef struct PCIEMUDevice PCIEMUDevice;
+
+/* events timestamped along a DMA command, in order : the doorbell is the
+ * arrival of its BAR0 write, before it waits for the lock or the arbiter */
+typedef enum StatsEvent {
+    STATS_EVENT_DOORBELL,
+    STATS_EVENT_DMA_START,
+    STATS_EVENT_DMA_END,
+    STATS_EVENT_IRQ,
+    STATS_EVENT_CNT,
+} StatsEvent;
+
+/* stages between the events, each with its own histogram */
+typedef enum StatsStage {
+    STATS_STAGE_DOORBELL_TO_START,
+    STATS_STAGE_START_TO_END,
+    STATS_STAGE_END_TO_IRQ,
+    STATS_STAGE_DOORBELL_TO_IRQ,
+    STATS_STAGE_CNT,
+} StatsStage;
+
+typedef struct StatsHist {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t bins[PCIEMU_STATS_BINS];
+} StatsHist;
+
+typedef struct StatsRecorder {
+    int64_t stamp[STATS_EVENT_CNT];
+    int64_t doorbell_ns; /* arrival of the doorbell of the next command */
+    bool pending; /* a command is waiting for its IRQ */
+    StatsHist hist[STATS_STAGE_CNT];
+} StatsRecorder;
+
+
+void pciemu_stats_doorbell(PCIEMUDevice *dev, int64_t ns);
+
+void pciemu_stats_event(PCIEMUDevice *dev, StatsEvent event);
+
+void pciemu_stats_irq(PCIEMUDevice *dev, unsigned int vector);
+
+void pciemu_stats_get(Object *obj, Visitor *v, const char *name, void *opaque,
+                      Error **errp);
+
+void pciemu_stats_reset(PCIEMUDevice *dev);
+
+void pciemu_stats_init(PCIEMUDevice *dev, Error **errp);
+
+void pciemu_stats_fini(PCIEMUDevice *dev);
+
+#endif /* PCIEMU_STATS_H */
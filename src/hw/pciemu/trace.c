@@ -0,0 +1,197 @@
+/* trace.c - Record of MMIO and DMA traffic
+ *
+ * When the trace-file property is set, every MMIO access, DMA and reset is
+ * appended to the file as a fixed-size record (see pciemu_trace.h).
+ * The trace can then be fed to the replayer (src/tools/replay) to drive the
+ * device model deterministically without booting a guest.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "trace.h"
+#include "pciemu.h"
+
+/* -----------------------------------------------------------------------------
+ *  Private
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_trace_write: Append a record to the trace file
+ *
+ * @trace: recorder being used
+ * @type: type of the record (PCIEMU_TRACE_*)
+ * @addr: address of the record
+ * @len: size of the access or length of the transfer
+ * @val: value of the access or hash of the payload
+ */
+static void pciemu_trace_write(TraceRecorder *trace, uint8_t type,
+                               uint64_t addr, uint64_t len, uint64_t val)
+{
+    PCIEMUTraceRecord rec = {
+        .ts_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL),
+        .addr = addr,
+        .val = val,
+        .len = len,
+        .type = type,
+    };
+    if (fwrite(&rec, sizeof(rec), 1, trace->fp) != 1) {
+        warn_report("pciemu: failed to write trace record, stop recording");
+        fclose(trace->fp);
+        trace->fp = NULL;
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ *  Public
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * pciemu_trace_mmio: Record a MMIO access
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @type: PCIEMU_TRACE_MMIO_READ or PCIEMU_TRACE_MMIO_WRITE
+ * @addr: address being accessed (relative to the Memory Region)
+ * @size: access size in bytes
+ * @val: value read or written
+ */
+void pciemu_trace_mmio(PCIEMUDevice *dev, uint8_t type, hwaddr addr,
+                       unsigned int size, uint64_t val)
+{
+    if (!dev->trace.fp)
+        return;
+    pciemu_trace_write(&dev->trace, type, addr, size, val);
+}
+
+/**
+ * pciemu_trace_dma_hash: Hash of the payload of a DMA, as recorded
+ *
+ * 0 if the payloads are not recorded. Called by the workers too (the
+ * properties do not change once the device is realized), for transfers
+ * whose buffer changes before they are recorded.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @buf: payload of the transfer
+ * @len: length of the transfer in bytes
+ */
+uint64_t pciemu_trace_dma_hash(PCIEMUDevice *dev, const void *buf,
+                               dma_addr_t len)
+{
+    TraceRecorder *trace = &dev->trace;
+    if (!trace->fp || !trace->payload_hash)
+        return 0;
+    return pciemu_trace_hash(buf, len);
+}
+
+/**
+ * pciemu_trace_dma_hashed: Record a DMA whose payload is already hashed
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @dir: direction of the transfer
+ * @addr: bus address of the transfer
+ * @len: length of the transfer in bytes
+ * @hash: hash of the payload (pciemu_trace_dma_hash)
+ */
+void pciemu_trace_dma_hashed(PCIEMUDevice *dev, DMADirection dir,
+                             dma_addr_t addr, dma_addr_t len, uint64_t hash)
+{
+    TraceRecorder *trace = &dev->trace;
+    if (!trace->fp)
+        return;
+    uint8_t type = (dir == DMA_DIRECTION_TO_DEVICE) ? PCIEMU_TRACE_DMA_READ
+                                                    : PCIEMU_TRACE_DMA_WRITE;
+    pciemu_trace_write(trace, type, addr, len, hash);
+}
+
+/**
+ * pciemu_trace_dma: Record a DMA
+ *
+ * The payload is hashed only if the trace-payload-hash property is set,
+ * as this walks through the whole buffer.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ * @dir: direction of the transfer
+ * @addr: bus address of the transfer
+ * @buf: payload of the transfer
+ * @len: length of the transfer in bytes
+ */
+void pciemu_trace_dma(PCIEMUDevice *dev, DMADirection dir, dma_addr_t addr,
+                      const void *buf, dma_addr_t len)
+{
+    if (!dev->trace.fp)
+        return;
+    pciemu_trace_dma_hashed(dev, dir, addr, len,
+                            pciemu_trace_dma_hash(dev, buf, len));
+}
+
+/**
+ * pciemu_trace_reset: Record a device reset
+ *
+ * The trace file is kept open across resets, so the replayer can reset
+ * the device model at the same point.
+ *
+ * @dev: Instance of PCIEMUDevice object being used
+ */
+void pciemu_trace_reset(PCIEMUDevice *dev)
+{
+    if (!dev->trace.fp)
+        return;
+    pciemu_trace_write(&dev->trace, PCIEMU_TRACE_RESET, 0, 0, 0);
+}
+
+/**
+ * pciemu_trace_init: Trace initialization
+ *
+ * Opens the trace file (if any) and writes the header.
+ *
+ * @dev: Instance of PCIEMUDevice object being initialized
+ * @errp: pointer to indicate errors
+ */
+void pciemu_trace_init(PCIEMUDevice *dev, Error **errp)
+{
+    TraceRecorder *trace = &dev->trace;
+    PCIEMUTraceHeader hdr = {
+        .magic = PCIEMU_TRACE_MAGIC,
+        .version = PCIEMU_TRACE_VERSION,
+        .flags = trace->payload_hash ? PCIEMU_TRACE_FLAG_PAYLOAD_HASH : 0,
+    };
+    trace->fp = NULL;
+    if (!trace->file)
+        return;
+    trace->fp = fopen(trace->file, "wb");
+    if (!trace->fp) {
+        error_setg(errp, "failed to open trace file %s: %s", trace->file,
+                   strerror(errno));
+        return;
+    }
+    /* records are small, so batch them in a big stdio buffer */
+    setvbuf(trace->fp, NULL, _IOFBF, PCIEMU_TRACE_BUF_SIZE);
+    if (fwrite(&hdr, sizeof(hdr), 1, trace->fp) != 1) {
+        error_setg(errp, "failed to write trace file %s", trace->file);
+        fclose(trace->fp);
+        trace->fp = NULL;
+    }
+}
+
+/**
+ * pciemu_trace_fini: Trace finalization
+ *
+ * Flushes and closes the trace file.
+ *
+ * @dev: Instance of PCIEMUDevice object being finalized
+ */
+void pciemu_trace_fini(PCIEMUDevice *dev)
+{
+    if (!dev->trace.fp)
+        return;
+    fclose(dev->trace.fp);
+    dev->trace.fp = NULL;
+}
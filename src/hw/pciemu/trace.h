@@ -0,0 +1,50 @@
+/* trace.h - Record of MMIO and DMA traffic
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_TRACE_DEV_H
+#define PCIEMU_TRACE_DEV_H
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "hw/pci/pci.h"
+#include "pciemu_trace.h"
+
+/* size of the stdio buffer of the trace file */
+#define PCIEMU_TRACE_BUF_SIZE (256 * KiB)
+
+/* forward declaration (defined in pciemu.h) to avoid circular reference */
+typedef struct PCIEMUDevice PCIEMUDevice;
+
+typedef struct TraceRecorder {
+    /* properties */
+    char *file;
+    bool payload_hash;
+    /* trace file, NULL when not recording */
+    FILE *fp;
+} TraceRecorder;
+
+
+void pciemu_trace_mmio(PCIEMUDevice *dev, uint8_t type, hwaddr addr,
+                       unsigned int size, uint64_t val);
+
+uint64_t pciemu_trace_dma_hash(PCIEMUDevice *dev, const void *buf,
+                               dma_addr_t len);
+
+void pciemu_trace_dma_hashed(PCIEMUDevice *dev, DMADirection dir,
+                             dma_addr_t addr, dma_addr_t len, uint64_t hash);
+
+void pciemu_trace_dma(PCIEMUDevice *dev, DMADirection dir, dma_addr_t addr,
+                      const void *buf, dma_addr_t len);
+
+void pciemu_trace_reset(PCIEMUDevice *dev);
+
+void pciemu_trace_init(PCIEMUDevice *dev, Error **errp);
+
+void pciemu_trace_fini(PCIEMUDevice *dev);
+
+#endif /* PCIEMU_TRACE_DEV_H */
@@ -0,0 +1,558 @@
+/* pciemu_sim.c - In-process simulator of the pciemu device
+ *
+ * The device model is linked against the QEMU fakes of the unit tests, and
+ * this file provides the QEMU services the device relies on (see
+ * include/sim/pciemu_sim.h). The services receiving the device (bus address
+ * space, MSI) find their simulator from it, while the clock and the timers
+ * belong to the simulator currently being driven through the API.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu.fake.h"
+#include "qemu/bswap.h"
+#include "pciemu.h"
+#include "mmio.h"
+#include "sim/pciemu_sim.h"
+
+DEFINE_FFF_GLOBALS;
+
+/* maximum number of timers the device model may create */
+#define PCIEMU_SIM_TIMER_MAX 16
+
+/* maximum number of jobs the device model may hand to its workers at once */
+#define PCIEMU_SIM_WORK_MAX 8
+
+/* job handed to a worker of the thread pool */
+typedef struct PCIEMUSimWork {
+    ThreadPoolFunc *func;
+    void *arg;
+    BlockCompletionFunc *cb;
+    void *opaque;
+} PCIEMUSimWork;
+
+struct PCIEMUSim {
+    PCIEMUDevice dev;
+    PCIEMUSimConfig cfg;
+    int64_t clock_ns;
+    QEMUTimer *timers[PCIEMU_SIM_TIMER_MAX];
+    unsigned int timer_cnt;
+    PCIEMUSimWork work[PCIEMU_SIM_WORK_MAX];
+    unsigned int work_cnt;
+    uint8_t desc_window[PCIEMU_HW_DESC_WINDOW_SIZE];
+    MemoryRegion mem_mr; /* guest memory window, as seen by the device */
+    /* bounce buffer of the mappings outside of the guest memory window */
+    uint8_t map_bounce[sizeof(uint64_t)];
+    hwaddr map_addr;
+};
+
+/* simulator being driven by the current thread */
+static __thread PCIEMUSim *sim_cur;
+
+static bool pciemu_sim_run_work(PCIEMUSim *sim);
+
+/* any non NULL value tells the device model that an error was set */
+static char sim_error;
+
+/* -----------------------------------------------------------------------------
+ *  QEMU services (override the weak fakes)
+ * -----------------------------------------------------------------------------
+ */
+
+int64_t qemu_clock_get_ns(QEMUClockType type)
+{
+    return sim_cur->clock_ns;
+}
+
+void timer_init_full(QEMUTimer *ts, QEMUTimerListGroup *timer_list_group,
+                     QEMUClockType type, int scale, int attributes,
+                     QEMUTimerCB *cb, void *opaque)
+{
+    memset(ts, 0, sizeof(*ts));
+    ts->cb = cb;
+    ts->opaque = opaque;
+    ts->scale = scale;
+    ts->expire_time = -1;
+    if (sim_cur->timer_cnt == PCIEMU_SIM_TIMER_MAX) {
+        fprintf(stderr, "pciemu-sim: too many timers\n");
+        abort();
+    }
+    sim_cur->timers[sim_cur->timer_cnt++] = ts;
+}
+
+void timer_mod_ns(QEMUTimer *ts, int64_t expire_time)
+{
+    ts->expire_time = MAX(expire_time, 0);
+}
+
+void timer_del(QEMUTimer *ts)
+{
+    ts->expire_time = -1;
+}
+
+bool timer_pending(QEMUTimer *ts)
+{
+    return ts->expire_time >= 0;
+}
+
+MemTxResult address_space_rw(AddressSpace *as, hwaddr addr, MemTxAttrs attrs,
+                             void *buf, hwaddr len, bool is_write)
+{
+    PCIEMUSim *sim = container_of(as, PCIEMUSim, dev.pci_dev.bus_master_as);
+    PCIEMUSimConfig *cfg = &sim->cfg;
+    if (addr < cfg->mem_base || addr - cfg->mem_base > cfg->mem_size ||
+        len > cfg->mem_size - (addr - cfg->mem_base)) {
+        if (cfg->dma_cb &&
+            !cfg->dma_cb(cfg->dma_opaque, addr, buf, len, is_write))
+            return MEMTX_OK;
+        return MEMTX_DECODE_ERROR;
+    }
+    uint8_t *mem = (uint8_t *)cfg->mem + (addr - cfg->mem_base);
+    if (is_write)
+        memcpy(mem, buf, len);
+    else
+        memcpy(buf, mem, len);
+    return MEMTX_OK;
+}
+
+/* the guest memory window is mapped directly. As in QEMU, other addresses
+ * go through a bounce buffer, on which the atomic commands fail (not RAM) */
+void *address_space_map(AddressSpace *as, hwaddr addr, hwaddr *plen,
+                        bool is_write, MemTxAttrs attrs)
+{
+    PCIEMUSim *sim = container_of(as, PCIEMUSim, dev.pci_dev.bus_master_as);
+    PCIEMUSimConfig *cfg = &sim->cfg;
+    if (addr >= cfg->mem_base && addr - cfg->mem_base < cfg->mem_size) {
+        *plen = MIN(*plen, cfg->mem_size - (addr - cfg->mem_base));
+        return (uint8_t *)cfg->mem + (addr - cfg->mem_base);
+    }
+    *plen = MIN(*plen, sizeof(sim->map_bounce));
+    if (!cfg->dma_cb ||
+        cfg->dma_cb(cfg->dma_opaque, addr, sim->map_bounce, *plen, false))
+        return NULL;
+    sim->map_addr = addr;
+    return sim->map_bounce;
+}
+
+void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
+                         bool is_write, hwaddr access_len)
+{
+    PCIEMUSim *sim = container_of(as, PCIEMUSim, dev.pci_dev.bus_master_as);
+    PCIEMUSimConfig *cfg = &sim->cfg;
+    if (buffer == sim->map_bounce && is_write && access_len)
+        cfg->dma_cb(cfg->dma_opaque, sim->map_addr, sim->map_bounce,
+                    access_len, true);
+}
+
+/* the guest memory window is the guest RAM, the bounce buffer is not */
+MemoryRegion *memory_region_from_host(void *ptr, ram_addr_t *offset)
+{
+    PCIEMUSimConfig *cfg = &sim_cur->cfg;
+    uint8_t *host = ptr;
+    if (host < (uint8_t *)cfg->mem ||
+        host >= (uint8_t *)cfg->mem + cfg->mem_size)
+        return NULL;
+    *offset = host - (uint8_t *)cfg->mem;
+    return &sim_cur->mem_mr;
+}
+
+/* the descriptor window (BAR 2) is the only RAM region of the device */
+void *memory_region_get_ram_ptr(MemoryRegion *mr)
+{
+    PCIEMUSim *sim = container_of(mr, PCIEMUSim, dev.desc);
+    return sim->desc_window;
+}
+
+bool msi_enabled(const PCIDevice *pci_dev)
+{
+    return true;
+}
+
+void msi_notify(PCIDevice *pci_dev, unsigned int vector)
+{
+    PCIEMUSim *sim = container_of(pci_dev, PCIEMUSim, dev.pci_dev);
+    if (sim->cfg.irq_cb)
+        sim->cfg.irq_cb(sim->cfg.irq_opaque, vector);
+}
+
+void error_setg_internal(Error **errp, const char *src, int line,
+                         const char *func, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "pciemu-sim: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    if (errp)
+        *errp = (Error *)&sim_error;
+}
+
+void error_propagate(Error **dst_errp, Error *local_err)
+{
+    if (dst_errp && local_err)
+        *dst_errp = local_err;
+}
+
+void warn_report(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "pciemu-sim: warning: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+/* the simulator thread plays the workers too : the job and its completion
+ * run later, from pciemu_sim_step or pciemu_sim_advance */
+BlockAIOCB *thread_pool_submit_aio(ThreadPoolFunc *func, void *arg,
+                                   BlockCompletionFunc *cb, void *opaque)
+{
+    if (sim_cur->work_cnt == PCIEMU_SIM_WORK_MAX) {
+        fprintf(stderr, "pciemu-sim: too many jobs\n");
+        abort();
+    }
+    sim_cur->work[sim_cur->work_cnt++] = (PCIEMUSimWork){
+        .func = func, .arg = arg, .cb = cb, .opaque = opaque
+    };
+    return NULL;
+}
+
+/* waiting for the workers (AIO_WAIT_WHILE) runs the oldest job */
+bool aio_poll(AioContext *ctx, bool blocking)
+{
+    return pciemu_sim_run_work(sim_cur);
+}
+
+/* a simulator is driven by a single thread, which plays the main loop : BAR0
+ * accesses hold the BQL and the device lock is useless */
+bool qemu_mutex_iothread_locked(void)
+{
+    return true;
+}
+
+void qemu_rec_mutex_init(QemuRecMutex *mutex)
+{
+}
+
+void qemu_rec_mutex_destroy(QemuRecMutex *mutex)
+{
+}
+
+void qemu_rec_mutex_lock_impl(QemuRecMutex *mutex, const char *file, int line)
+{
+}
+
+void qemu_rec_mutex_unlock_impl(QemuRecMutex *mutex, const char *file,
+                                int line)
+{
+}
+
+/* -----------------------------------------------------------------------------
+ *  Private
+ * -----------------------------------------------------------------------------
+ */
+
+/* same sequence as pciemu_device_init in pciemu.c */
+static bool pciemu_sim_device_init(PCIEMUSim *sim)
+{
+    PCIEMUDevice *dev = &sim->dev;
+    Error *err = NULL;
+    pciemu_trace_init(dev, &err);
+    if (err)
+        return false;
+    pciemu_stats_init(dev, &err);
+    if (err) {
+        pciemu_trace_fini(dev);
+        return false;
+    }
+    pciemu_irq_init(dev, &err);
+    pciemu_dma_init(dev, &err);
+    if (err) {
+        pciemu_irq_fini(dev);
+        pciemu_stats_fini(dev);
+        pciemu_trace_fini(dev);
+        return false;
+    }
+    pciemu_rx_init(dev, &err);
+    pciemu_mmio_init(dev, &err);
+    return true;
+}
+
+/* run the oldest job handed to a worker, then its completion */
+static bool pciemu_sim_run_work(PCIEMUSim *sim)
+{
+    if (!sim->work_cnt)
+        return false;
+    PCIEMUSimWork work = sim->work[0];
+    memmove(sim->work, sim->work + 1, --sim->work_cnt * sizeof(work));
+    work.cb(work.opaque, work.func(work.arg));
+    return true;
+}
+
+/* -----------------------------------------------------------------------------
+ *  Public
+ * -----------------------------------------------------------------------------
+ */
+
+PCIEMUSim *pciemu_sim_create(const PCIEMUSimConfig *cfg)
+{
+    PCIEMUSim *sim = calloc(1, sizeof(*sim));
+    if (!sim)
+        return NULL;
+    sim->cfg = *cfg;
+    sim->dev.pci_dev.config = calloc(1, PCIE_CONFIG_SPACE_SIZE);
+    if (!sim->dev.pci_dev.config) {
+        free(sim);
+        return NULL;
+    }
+    /* the device model does not modify its string properties */
+    sim->dev.trace.file = (char *)cfg->trace_file;
+    sim->dev.trace.payload_hash = cfg->trace_payload_hash;
+    sim->dev.dma.latency.dist = (char *)cfg->latency_dist;
+    sim->dev.dma.latency.mean_ns = cfg->latency_ns;
+    sim->dev.dma.latency.min_ns = cfg->latency_min_ns;
+    sim->dev.dma.latency.max_ns = cfg->latency_max_ns;
+    sim->dev.dma.latency.sigma_milli = cfg->latency_sigma_milli;
+    sim->dev.dma.latency.hist_file = (char *)cfg->latency_hist_file;
+    sim->dev.dma.latency.seed = cfg->latency_seed;
+    sim_cur = sim;
+    if (!pciemu_sim_device_init(sim)) {
+        free(sim->dev.pci_dev.config);
+        free(sim);
+        return NULL;
+    }
+    return sim;
+}
+
+/* same sequence as pciemu_device_fini in pciemu.c */
+void pciemu_sim_destroy(PCIEMUSim *sim)
+{
+    PCIEMUDevice *dev = &sim->dev;
+    sim_cur = sim;
+    pciemu_irq_fini(dev);
+    pciemu_dma_fini(dev);
+    pciemu_rx_fini(dev);
+    pciemu_mmio_fini(dev);
+    pciemu_stats_fini(dev);
+    pciemu_trace_fini(dev);
+    free(dev->pci_dev.config);
+    free(sim);
+}
+
+/* same sequence as pciemu_reset in pciemu.c */
+void pciemu_sim_reset(PCIEMUSim *sim)
+{
+    PCIEMUDevice *dev = &sim->dev;
+    sim_cur = sim;
+    pciemu_trace_reset(dev);
+    pciemu_stats_reset(dev);
+    pciemu_irq_reset(dev);
+    pciemu_dma_reset(dev);
+    pciemu_rx_reset(dev);
+    pciemu_mmio_reset(dev);
+}
+
+uint64_t pciemu_sim_mmio_read(PCIEMUSim *sim, uint64_t addr, unsigned int size)
+{
+    sim_cur = sim;
+    return pciemu_mmio_ops.read(&sim->dev, addr, size);
+}
+
+void pciemu_sim_mmio_write(PCIEMUSim *sim, uint64_t addr, uint64_t val,
+                           unsigned int size)
+{
+    sim_cur = sim;
+    pciemu_mmio_ops.write(&sim->dev, addr, val, size);
+}
+
+uint8_t *pciemu_sim_device_memory(PCIEMUSim *sim, uint64_t *size)
+{
+    if (size)
+        *size = sim->dev.dma.buff_size;
+    return sim->dev.dma.buff;
+}
+
+uint8_t *pciemu_sim_desc_window(PCIEMUSim *sim)
+{
+    return sim->desc_window;
+}
+
+int64_t pciemu_sim_clock_ns(PCIEMUSim *sim)
+{
+    return sim->clock_ns;
+}
+
+/* fire the next timer expiring up to deadline, moving the clock to it */
+static bool pciemu_sim_fire_next(PCIEMUSim *sim, int64_t deadline)
+{
+    QEMUTimer *next = NULL;
+    for (unsigned int i = 0; i < sim->timer_cnt; ++i) {
+        QEMUTimer *t = sim->timers[i];
+        if (timer_pending(t) && t->expire_time <= deadline &&
+            (!next || t->expire_time < next->expire_time))
+            next = t;
+    }
+    if (!next)
+        return false;
+    sim->clock_ns = MAX(sim->clock_ns, next->expire_time);
+    next->expire_time = -1;
+    next->cb(next->opaque);
+    return true;
+}
+
+int64_t pciemu_sim_deadline_ns(PCIEMUSim *sim)
+{
+    int64_t deadline = -1;
+    if (sim->work_cnt)
+        return sim->clock_ns;
+    for (unsigned int i = 0; i < sim->timer_cnt; ++i) {
+        QEMUTimer *t = sim->timers[i];
+        if (timer_pending(t) && (deadline < 0 || t->expire_time < deadline))
+            deadline = t->expire_time;
+    }
+    return deadline;
+}
+
+void pciemu_sim_advance(PCIEMUSim *sim, int64_t ns)
+{
+    int64_t deadline = sim->clock_ns + ns;
+    sim_cur = sim;
+    while (pciemu_sim_run_work(sim) || pciemu_sim_fire_next(sim, deadline))
+        ;
+    sim->clock_ns = MAX(sim->clock_ns, deadline);
+}
+
+bool pciemu_sim_step(PCIEMUSim *sim)
+{
+    sim_cur = sim;
+    return pciemu_sim_run_work(sim) || pciemu_sim_fire_next(sim, INT64_MAX);
+}
+
+void pciemu_sim_dma_submit(PCIEMUSim *sim, uint64_t cmd, uint64_t src,
+                           uint64_t dst, uint64_t len)
+{
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_SRC, src, 8);
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_DST, dst, 8);
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_LEN, len, 8);
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_CFG_CMD, cmd, 8);
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_DOORBELL_RING, 1, 8);
+}
+
+void pciemu_sim_dma_submit_desc(PCIEMUSim *sim, unsigned int slot,
+                                uint64_t cmd, uint64_t src, uint64_t dst,
+                                uint64_t len)
+{
+    slot %= PCIEMU_HW_DESC_SLOT_CNT;
+    uint8_t *desc = sim->desc_window + slot * PCIEMU_HW_DESC_SLOT_SIZE;
+    stq_le_p(desc + PCIEMU_HW_DESC_SRC, src);
+    stq_le_p(desc + PCIEMU_HW_DESC_DST, dst);
+    stq_le_p(desc + PCIEMU_HW_DESC_LEN, len);
+    stq_le_p(desc + PCIEMU_HW_DESC_CMD, cmd);
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_DESC_DOORBELL, slot, 8);
+}
+
+int pciemu_sim_dma_wait(PCIEMUSim *sim)
+{
+    while (pciemu_sim_mmio_read(sim, PCIEMU_HW_BAR0_DMA_STATUS, 8) ==
+           PCIEMU_HW_DMA_STATUS_EXECUTING) {
+        if (!pciemu_sim_step(sim))
+            return -1;
+    }
+    return pciemu_sim_mmio_read(sim, PCIEMU_HW_BAR0_DMA_ERROR, 8);
+}
+
+int pciemu_sim_dma_to_device(PCIEMUSim *sim, uint64_t bus_addr, uint64_t ofs,
+                             uint64_t len)
+{
+    pciemu_sim_dma_submit(sim, PCIEMU_HW_DMA_DIRECTION_TO_DEVICE, bus_addr,
+                          PCIEMU_HW_DMA_AREA_START + ofs, len);
+    return pciemu_sim_dma_wait(sim);
+}
+
+int pciemu_sim_dma_from_device(PCIEMUSim *sim, uint64_t ofs, uint64_t bus_addr,
+                               uint64_t len)
+{
+    pciemu_sim_dma_submit(sim, PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE,
+                          PCIEMU_HW_DMA_AREA_START + ofs, bus_addr, len);
+    return pciemu_sim_dma_wait(sim);
+}
+
+int pciemu_sim_dma_2d(PCIEMUSim *sim, uint64_t cmd, uint64_t src,
+                      uint64_t src_stride, uint64_t dst, uint64_t dst_stride,
+                      uint64_t len, uint32_t rows)
+{
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_CFG_2D_ROWS, rows, 8);
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_CFG_2D_SRC_STRIDE,
+                          src_stride, 8);
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_CFG_2D_DST_STRIDE,
+                          dst_stride, 8);
+    pciemu_sim_dma_submit(sim, cmd | PCIEMU_HW_DMA_CMD_FLAG_2D, src, dst, len);
+    return pciemu_sim_dma_wait(sim);
+}
+
+int pciemu_sim_dma_multicast(PCIEMUSim *sim, uint64_t cmd, uint64_t src,
+                             uint64_t table, uint32_t cnt, uint64_t len)
+{
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_CFG_MCAST_CNT, cnt, 8);
+    pciemu_sim_dma_submit(sim, cmd, src, table, len);
+    return pciemu_sim_dma_wait(sim);
+}
+
+int pciemu_sim_dma_raid(PCIEMUSim *sim, uint64_t cmd, uint64_t table,
+                        uint32_t cnt, uint64_t p_dst, uint64_t q_dst,
+                        uint64_t len)
+{
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_CFG_RAID_SRC_CNT, cnt, 8);
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_CFG_RAID_Q_DST, q_dst, 8);
+    pciemu_sim_dma_submit(sim, cmd, table, p_dst, len);
+    return pciemu_sim_dma_wait(sim);
+}
+
+int pciemu_sim_dma_scan(PCIEMUSim *sim, uint64_t cmd, uint64_t src,
+                        uint64_t len, const void *key, uint32_t ctrl,
+                        uint64_t dst, uint64_t max, uint64_t *cnt)
+{
+    uint8_t bytes[PCIEMU_HW_DMA_SCAN_KEY_MAX] = { 0 };
+    memcpy(bytes, key, MIN(ctrl & PCIEMU_HW_DMA_SCAN_CTRL_LEN_MASK,
+                           sizeof(bytes)));
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_CFG_SCAN_KEY_LO,
+                          ldq_le_p(bytes), 8);
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_CFG_SCAN_KEY_HI,
+                          ldq_le_p(bytes + 8), 8);
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_CFG_SCAN_CTRL, ctrl, 8);
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_CFG_SCAN_MAX, max, 8);
+    pciemu_sim_dma_submit(sim, cmd, src, dst, len);
+    int err = pciemu_sim_dma_wait(sim);
+    if (!err && cnt)
+        *cnt = pciemu_sim_mmio_read(sim, PCIEMU_HW_BAR0_DMA_SCAN_MATCH_CNT, 8);
+    return err;
+}
+
+int pciemu_sim_dma_sort(PCIEMUSim *sim, uint64_t src, uint64_t dst,
+                        uint64_t idx_dst, uint64_t len, uint32_t ctrl)
+{
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_CFG_SORT_CTRL, ctrl, 8);
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_CFG_SORT_IDX_DST, idx_dst, 8);
+    pciemu_sim_dma_submit(sim, PCIEMU_HW_DMA_CMD_SORT, src, dst, len);
+    return pciemu_sim_dma_wait(sim);
+}
+
+int pciemu_sim_atomic(PCIEMUSim *sim, uint64_t cmd, uint64_t bus_addr,
+                      unsigned int size, uint64_t operand, uint64_t compare,
+                      uint64_t *old)
+{
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_CFG_ATOMIC_OPERAND, operand,
+                          8);
+    pciemu_sim_mmio_write(sim, PCIEMU_HW_BAR0_DMA_CFG_ATOMIC_COMPARE, compare,
+                          8);
+    pciemu_sim_dma_submit(sim, cmd, 0, bus_addr, size);
+    int err = pciemu_sim_dma_wait(sim);
+    if (!err && old)
+        *old = pciemu_sim_mmio_read(sim, PCIEMU_HW_BAR0_DMA_ATOMIC_RESULT, 8);
+    return err;
+}
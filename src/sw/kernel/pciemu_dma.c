@@ -21,11 +21,38 @@ static void pciemu_dma_struct_init(struct pciemu_dma *dma, size_t ofs,
 	dma->direction = drctn;
 }
 
+/* Programs the transfer and rings the doorbell : with the descriptor window,
+ * the whole descriptor is written with a single burst (write-combining) and
+ * only the descriptor doorbell traps, instead of one MMIO exit per register.
+ * The device has a single DMA engine, so slot 0 is always used.
+ */
+static void pciemu_dma_submit(struct pciemu_dev *pciemu_dev, u64 src, u64 dst,
+			      u64 len, u64 cmd)
+{
+	void __iomem *mmio = pciemu_dev->bar.mmio;
+	struct pciemu_dma_desc desc;
+	if (!pciemu_dev->desc) {
+		iowrite32(src, mmio + PCIEMU_HW_BAR0_DMA_CFG_TXDESC_SRC);
+		iowrite32(dst, mmio + PCIEMU_HW_BAR0_DMA_CFG_TXDESC_DST);
+		iowrite32(len, mmio + PCIEMU_HW_BAR0_DMA_CFG_TXDESC_LEN);
+		iowrite32(cmd, mmio + PCIEMU_HW_BAR0_DMA_CFG_CMD);
+		iowrite32(1, mmio + PCIEMU_HW_BAR0_DMA_DOORBELL_RING);
+		return;
+	}
+	desc.src = cpu_to_le64(src);
+	desc.dst = cpu_to_le64(dst);
+	desc.len = cpu_to_le64(len);
+	desc.cmd = cpu_to_le64(cmd);
+	memcpy_toio(pciemu_dev->desc, &desc, sizeof(desc));
+	/* the descriptor must be out of the WC buffers before the doorbell */
+	wmb();
+	iowrite32(0, mmio + PCIEMU_HW_BAR0_DMA_DESC_DOORBELL);
+}
+
 int pciemu_dma_from_host_to_device(struct pciemu_dev *pciemu_dev,
 				   struct page *page, size_t ofs, size_t len)
 {
 	struct pci_dev *pdev = pciemu_dev->pdev;
-	void __iomem *mmio = pciemu_dev->bar.mmio;
 	pciemu_dma_struct_init(&pciemu_dev->dma, ofs, len, DMA_TO_DEVICE);
 	pciemu_dev->dma.dma_handle =
 		dma_map_page(&(pdev->dev), page, pciemu_dev->dma.offset,
@@ -35,15 +62,9 @@ int pciemu_dma_from_host_to_device(struct pciemu_dev *pciemu_dev,
 	dev_dbg(&(pdev->dev), "dma_handle_from = %llx\n",
 		(unsigned long long)pciemu_dev->dma.dma_handle);
 	dev_dbg(&(pdev->dev), "cmd = %x\n", PCIEMU_HW_DMA_DIRECTION_TO_DEVICE);
-	iowrite32((u32)pciemu_dev->dma.dma_handle,
-		  mmio + PCIEMU_HW_BAR0_DMA_CFG_TXDESC_SRC);
-	iowrite32(PCIEMU_HW_DMA_AREA_START,
-		  mmio + PCIEMU_HW_BAR0_DMA_CFG_TXDESC_DST);
-	iowrite32(pciemu_dev->dma.len,
-		  mmio + PCIEMU_HW_BAR0_DMA_CFG_TXDESC_LEN);
-	iowrite32(PCIEMU_HW_DMA_DIRECTION_TO_DEVICE,
-		  mmio + PCIEMU_HW_BAR0_DMA_CFG_CMD);
-	iowrite32(1, mmio + PCIEMU_HW_BAR0_DMA_DOORBELL_RING);
+	pciemu_dma_submit(pciemu_dev, (u32)pciemu_dev->dma.dma_handle,
+			  PCIEMU_HW_DMA_AREA_START, pciemu_dev->dma.len,
+			  PCIEMU_HW_DMA_DIRECTION_TO_DEVICE);
 	dev_dbg(&(pdev->dev), "done host->device...\n");
 	return 0;
 }
@@ -52,7 +73,6 @@ int pciemu_dma_from_device_to_host(struct pciemu_dev *pciemu_dev,
 				   struct page *page, size_t ofs, size_t len)
 {
 	struct pci_dev *pdev = pciemu_dev->pdev;
-	void __iomem *mmio = pciemu_dev->bar.mmio;
 	pciemu_dma_struct_init(&pciemu_dev->dma, ofs, len, DMA_FROM_DEVICE);
 	pciemu_dev->dma.dma_handle =
 		dma_map_page(&(pdev->dev), page, pciemu_dev->dma.offset,
@@ -63,15 +83,9 @@ int pciemu_dma_from_device_to_host(struct pciemu_dev *pciemu_dev,
 		(unsigned long long)pciemu_dev->dma.dma_handle);
 	dev_dbg(&(pdev->dev), "cmd = %x\n",
 		PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE);
-	iowrite32(PCIEMU_HW_DMA_AREA_START,
-		  mmio + PCIEMU_HW_BAR0_DMA_CFG_TXDESC_SRC);
-	iowrite32((u32)pciemu_dev->dma.dma_handle,
-		  mmio + PCIEMU_HW_BAR0_DMA_CFG_TXDESC_DST);
-	iowrite32(pciemu_dev->dma.len,
-		  mmio + PCIEMU_HW_BAR0_DMA_CFG_TXDESC_LEN);
-	iowrite32(PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE,
-		  mmio + PCIEMU_HW_BAR0_DMA_CFG_CMD);
-	iowrite32(1, mmio + PCIEMU_HW_BAR0_DMA_DOORBELL_RING);
+	pciemu_dma_submit(pciemu_dev, PCIEMU_HW_DMA_AREA_START,
+			  (u32)pciemu_dev->dma.dma_handle, pciemu_dev->dma.len,
+			  PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE);
 	dev_dbg(&(pdev->dev), "done device->host...\n\n");
 	return 0;
 }
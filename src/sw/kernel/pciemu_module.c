@@ -105,12 +105,15 @@ static void pciemu_dev_clean(struct pciemu_dev *pciemu_dev)
 	pciemu_dev->bar.len = 0;
 	if (pciemu_dev->bar.mmio)
 		pci_iounmap(pciemu_dev->pdev, pciemu_dev->bar.mmio);
+	if (pciemu_dev->desc)
+		pci_iounmap(pciemu_dev->pdev, pciemu_dev->desc);
 }
 
 static int pciemu_dev_init(struct pciemu_dev *pciemu_dev, struct pci_dev *pdev)
 {
 	const unsigned int bar = PCIEMU_HW_BAR0;
 	pciemu_dev->pdev = pdev;
+	pciemu_dev->desc = NULL;
 
 	/* Initialize struct with BAR 0 info */
 	pciemu_dev->bar.start = pci_resource_start(pdev, bar);
@@ -122,6 +125,13 @@ static int pciemu_dev_init(struct pciemu_dev *pciemu_dev, struct pci_dev *pdev)
 		pciemu_dev_clean(pciemu_dev);
 		return -ENOMEM;
 	}
+
+	/* Descriptors are pushed with a single burst through BAR 2 */
+	if (pci_resource_len(pdev, PCIEMU_HW_BAR2) >= PCIEMU_HW_DESC_WINDOW_SIZE)
+		pciemu_dev->desc = pci_iomap_wc(pdev, PCIEMU_HW_BAR2,
+						PCIEMU_HW_DESC_WINDOW_SIZE);
+	if (!pciemu_dev->desc)
+		dev_info(&(pdev->dev), "no descriptor window, using registers\n");
 	pci_set_drvdata(pdev, pciemu_dev);
 	return 0;
 }
@@ -30,6 +30,14 @@ struct pciemu_dma {
 	struct page *page;
 };
 
+/* DMA descriptor pushed into the descriptor window (see pciemu_hw.h) */
+struct pciemu_dma_desc {
+	__le64 src;
+	__le64 dst;
+	__le64 len;
+	__le64 cmd;
+};
+
 struct pciemu_irq {
 	void __iomem *mmio_ack_irq;
 	int irq_num;
@@ -42,6 +50,10 @@ struct pciemu_dev {
 	 * hold information about all bars.
 	 */
 	struct pciemu_bar bar;
+	/* BAR 2 (DMA descriptor window), mapped write-combining.
+	 * NULL if the device does not have it : registers are used instead.
+	 */
+	void __iomem *desc;
 	/* Only one IRQ is used in this simple device :
 	 *  - IRQ to inform that DMA has finished
 	 * We could also have an array here to describe more IRQs
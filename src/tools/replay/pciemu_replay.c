@@ -0,0 +1,463 @@
+/* pciemu_replay.c - Replay a trace recorded by the pciemu device
+ *
+ * Drives the pciemu device model (src/hw/pciemu) from a trace recorded with
+ * the trace-file property, without booting a guest. This allows profiling
+ * the device code with a captured, deterministic workload.
+ *
+ * The device model is linked against the QEMU fakes of the unit tests, and
+ * this program provides the few QEMU services that matter for the replay :
+ *   - the virtual clock, which follows the timestamps of the trace
+ *   - the timers, fired in order whenever the clock goes past them
+ *   - the bus address space (guest memory). As the trace does not carry the
+ *     payloads, reads return zeros and writes are discarded. The same goes
+ *     for the operands of the atomic commands, mapped rather than read.
+ *
+ * MMIO accesses and resets in the trace are applied to the device, while
+ * the DMA records are compared with the DMAs issued by the device during
+ * the replay. Any difference is reported as a divergence.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu.fake.h"
+#include "pciemu.h"
+#include "mmio.h"
+#include "pciemu_trace.h"
+
+DEFINE_FFF_GLOBALS;
+
+/* LOGs & co*/
+#define KERR "\e[1;31m"
+#define KNORM "\e[0m"
+#define LOGF(fd, ...) fprintf(fd, __VA_ARGS__)
+#define LOG_ERR(...)                \
+    LOGF(stderr, KERR __VA_ARGS__); \
+    LOGF(stderr, KNORM);
+#define LOG(...) LOGF(stdout, __VA_ARGS__)
+
+/* maximum number of timers the device model may create */
+#define REPLAY_TIMER_MAX 16
+
+/* maximum number of jobs the device model may hand to its workers at once */
+#define REPLAY_WORK_MAX 8
+
+/* job handed to a worker of the thread pool */
+struct work {
+    ThreadPoolFunc *func;
+    void *arg;
+    BlockCompletionFunc *cb;
+    void *opaque;
+};
+
+struct context {
+    const char *in;             /* trace being replayed */
+    const char *out;            /* trace recorded during the replay */
+    unsigned int loops;         /* number of times the trace is replayed */
+    uint8_t verbosity;          /* verbosity level for logs */
+    PCIEMUTraceHeader hdr;      /* header of the trace being replayed */
+    PCIEMUTraceRecord *rec;     /* records of the trace being replayed */
+    size_t rec_cnt;             /* number of records */
+    size_t dma_next;            /* next DMA record expected from the device */
+    int64_t clock_ns;           /* virtual clock */
+    QEMUTimer *timers[REPLAY_TIMER_MAX];
+    unsigned int timer_cnt;
+    struct work work[REPLAY_WORK_MAX];
+    unsigned int work_cnt;
+    /* statistics */
+    uint64_t mmio_reads;
+    uint64_t mmio_writes;
+    uint64_t dmas;
+    uint64_t resets;
+    uint64_t read_mismatches;
+    uint64_t dma_divergences;
+    uint64_t hash_mismatches;
+};
+
+static struct context ctx;
+
+/* -----------------------------------------------------------------------------
+ *  QEMU services (override the weak fakes)
+ * -----------------------------------------------------------------------------
+ */
+
+int64_t qemu_clock_get_ns(QEMUClockType type)
+{
+    return ctx.clock_ns;
+}
+
+void timer_init_full(QEMUTimer *ts, QEMUTimerListGroup *timer_list_group,
+                     QEMUClockType type, int scale, int attributes,
+                     QEMUTimerCB *cb, void *opaque)
+{
+    if (ctx.timer_cnt == REPLAY_TIMER_MAX) {
+        LOG_ERR("too many timers\n");
+        exit(-1);
+    }
+    memset(ts, 0, sizeof(*ts));
+    ts->cb = cb;
+    ts->opaque = opaque;
+    ts->scale = scale;
+    ts->expire_time = -1;
+    ctx.timers[ctx.timer_cnt++] = ts;
+}
+
+void timer_mod_ns(QEMUTimer *ts, int64_t expire_time)
+{
+    ts->expire_time = MAX(expire_time, 0);
+}
+
+void timer_del(QEMUTimer *ts)
+{
+    ts->expire_time = -1;
+}
+
+bool timer_pending(QEMUTimer *ts)
+{
+    return ts->expire_time >= 0;
+}
+
+MemTxResult address_space_rw(AddressSpace *as, hwaddr addr, MemTxAttrs attrs,
+                             void *buf, hwaddr len, bool is_write)
+{
+    uint8_t type = is_write ? PCIEMU_TRACE_DMA_WRITE : PCIEMU_TRACE_DMA_READ;
+    PCIEMUTraceRecord *rec = NULL;
+
+    if (!is_write)
+        memset(buf, 0, len);
+    ctx.dmas++;
+
+    /* look for the next DMA in the trace */
+    while (ctx.dma_next < ctx.rec_cnt) {
+        PCIEMUTraceRecord *r = &ctx.rec[ctx.dma_next++];
+        if (r->type == PCIEMU_TRACE_DMA_READ ||
+            r->type == PCIEMU_TRACE_DMA_WRITE) {
+            rec = r;
+            break;
+        }
+    }
+    if (!rec || rec->type != type || rec->addr != addr || rec->len != len) {
+        ctx.dma_divergences++;
+        if (ctx.verbosity)
+            LOG("divergence @%" PRId64 " : DMA %s addr=0x%" PRIx64
+                " len=%" PRIu64 "\n",
+                ctx.clock_ns, is_write ? "write" : "read", addr, len);
+        return MEMTX_OK;
+    }
+    /* only payloads written by the device can match (reads return zeros) */
+    if (is_write && (ctx.hdr.flags & PCIEMU_TRACE_FLAG_PAYLOAD_HASH) &&
+        rec->val != pciemu_trace_hash(buf, len))
+        ctx.hash_mismatches++;
+    return MEMTX_OK;
+}
+
+/* operands of the atomic commands are not traced : they read as zeros too */
+void *address_space_map(AddressSpace *as, hwaddr addr, hwaddr *plen,
+                        bool is_write, MemTxAttrs attrs)
+{
+    static uint64_t operand;
+    operand = 0;
+    *plen = MIN(*plen, sizeof(operand));
+    return &operand;
+}
+
+void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
+                         bool is_write, hwaddr access_len)
+{
+}
+
+/* and they are operands in RAM, as they were when recorded */
+MemoryRegion *memory_region_from_host(void *ptr, ram_addr_t *offset)
+{
+    static MemoryRegion ram;
+    *offset = 0;
+    return &ram;
+}
+
+/* the replay thread plays the workers too : the job and its completion run
+ * later, as the clock moves */
+BlockAIOCB *thread_pool_submit_aio(ThreadPoolFunc *func, void *arg,
+                                   BlockCompletionFunc *cb, void *opaque)
+{
+    if (ctx.work_cnt == REPLAY_WORK_MAX) {
+        LOG_ERR("too many jobs\n");
+        exit(-1);
+    }
+    ctx.work[ctx.work_cnt++] = (struct work){
+        .func = func, .arg = arg, .cb = cb, .opaque = opaque
+    };
+    return NULL;
+}
+
+/* run the oldest job handed to a worker, then its completion */
+static bool work_run(void)
+{
+    if (!ctx.work_cnt)
+        return false;
+    struct work work = ctx.work[0];
+    memmove(ctx.work, ctx.work + 1, --ctx.work_cnt * sizeof(work));
+    work.cb(work.opaque, work.func(work.arg));
+    return true;
+}
+
+/* waiting for the workers (AIO_WAIT_WHILE) runs the oldest job */
+bool aio_poll(AioContext *aio_ctx, bool blocking)
+{
+    return work_run();
+}
+
+/* the replay is single-threaded and plays the main loop : BAR0 accesses
+ * hold the BQL and the device lock is useless */
+bool qemu_mutex_iothread_locked(void)
+{
+    return true;
+}
+
+void qemu_rec_mutex_init(QemuRecMutex *mutex)
+{
+}
+
+void qemu_rec_mutex_destroy(QemuRecMutex *mutex)
+{
+}
+
+void qemu_rec_mutex_lock_impl(QemuRecMutex *mutex, const char *file, int line)
+{
+}
+
+void qemu_rec_mutex_unlock_impl(QemuRecMutex *mutex, const char *file,
+                                int line)
+{
+}
+
+/* -----------------------------------------------------------------------------
+ *  Replay
+ * -----------------------------------------------------------------------------
+ */
+
+static inline void usage(FILE *fd, char **argv)
+{
+    LOGF(fd, "Usage : %s [-h] [-l loops] [-o out] [-v] trace\n", argv[0]);
+    LOGF(fd, " \t -h \n\t\t display this help message\n");
+    LOGF(fd, " \t -l loops \n\t\t number of times the trace is replayed\n");
+    LOGF(fd, " \t -o out \n\t\t record the replay into trace file out\n");
+    LOGF(fd, " \t -v \n\t\t run on verbose mode\n");
+}
+
+/* load the whole trace in memory, so the replay does not measure the I/O */
+static int load_trace(void)
+{
+    FILE *fp = fopen(ctx.in, "rb");
+    long size;
+    if (!fp) {
+        LOG_ERR("fopen failed - file %s\n", ctx.in);
+        return -1;
+    }
+    if (fread(&ctx.hdr, sizeof(ctx.hdr), 1, fp) != 1 ||
+        memcmp(ctx.hdr.magic, PCIEMU_TRACE_MAGIC, sizeof(ctx.hdr.magic)) ||
+        ctx.hdr.version != PCIEMU_TRACE_VERSION) {
+        LOG_ERR("%s is not a pciemu trace (version %d)\n", ctx.in,
+                PCIEMU_TRACE_VERSION);
+        fclose(fp);
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp) - sizeof(ctx.hdr);
+    fseek(fp, sizeof(ctx.hdr), SEEK_SET);
+    ctx.rec_cnt = size / sizeof(PCIEMUTraceRecord);
+    ctx.rec = malloc(MAX(ctx.rec_cnt, 1) * sizeof(PCIEMUTraceRecord));
+    if (!ctx.rec ||
+        fread(ctx.rec, sizeof(PCIEMUTraceRecord), ctx.rec_cnt, fp) !=
+            ctx.rec_cnt) {
+        LOG_ERR("failed to read %zu records from %s\n", ctx.rec_cnt, ctx.in);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* move the virtual clock forward, running the jobs handed to the workers
+ * and firing the timers on the way */
+static void clock_advance(int64_t ns)
+{
+    for (;;) {
+        if (work_run())
+            continue;
+        QEMUTimer *next = NULL;
+        for (unsigned int i = 0; i < ctx.timer_cnt; ++i) {
+            QEMUTimer *t = ctx.timers[i];
+            if (timer_pending(t) && t->expire_time <= ns &&
+                (!next || t->expire_time < next->expire_time))
+                next = t;
+        }
+        if (!next)
+            break;
+        ctx.clock_ns = MAX(ctx.clock_ns, next->expire_time);
+        next->expire_time = -1;
+        next->cb(next->opaque);
+    }
+    ctx.clock_ns = MAX(ctx.clock_ns, ns);
+}
+
+/* same sequence as pciemu_reset in pciemu.c */
+static void device_reset(PCIEMUDevice *dev)
+{
+    pciemu_trace_reset(dev);
+    pciemu_stats_reset(dev);
+    pciemu_irq_reset(dev);
+    pciemu_dma_reset(dev);
+    pciemu_rx_reset(dev);
+    pciemu_mmio_reset(dev);
+}
+
+/* same sequence as pciemu_device_init in pciemu.c */
+static PCIEMUDevice *device_init(void)
+{
+    PCIEMUDevice *dev = calloc(1, sizeof(*dev));
+    Error *err = NULL;
+    if (!dev)
+        return NULL;
+    dev->pci_dev.config = calloc(1, PCIE_CONFIG_SPACE_SIZE);
+    dev->trace.file = (char *)ctx.out;
+    pciemu_trace_init(dev, &err);
+    pciemu_stats_init(dev, &err);
+    pciemu_irq_init(dev, &err);
+    pciemu_dma_init(dev, &err);
+    pciemu_rx_init(dev, &err);
+    pciemu_mmio_init(dev, &err);
+    return dev;
+}
+
+static void device_fini(PCIEMUDevice *dev)
+{
+    pciemu_irq_fini(dev);
+    pciemu_dma_fini(dev);
+    pciemu_rx_fini(dev);
+    pciemu_mmio_fini(dev);
+    pciemu_stats_fini(dev);
+    pciemu_trace_fini(dev);
+    free(dev->pci_dev.config);
+    free(dev);
+}
+
+static void replay(PCIEMUDevice *dev)
+{
+    for (size_t i = 0; i < ctx.rec_cnt; ++i) {
+        PCIEMUTraceRecord *rec = &ctx.rec[i];
+        uint64_t val;
+        switch (rec->type) {
+        case PCIEMU_TRACE_MMIO_READ:
+            clock_advance(rec->ts_ns);
+            val = pciemu_mmio_ops.read(dev, rec->addr, rec->len);
+            ctx.mmio_reads++;
+            if (val != rec->val) {
+                ctx.read_mismatches++;
+                if (ctx.verbosity)
+                    LOG("divergence @%" PRIu64 " : read 0x%" PRIx64
+                        " = 0x%" PRIx64 " (trace 0x%" PRIx64 ")\n",
+                        rec->ts_ns, rec->addr, val, rec->val);
+            }
+            break;
+        case PCIEMU_TRACE_MMIO_WRITE:
+            clock_advance(rec->ts_ns);
+            pciemu_mmio_ops.write(dev, rec->addr, rec->val, rec->len);
+            ctx.mmio_writes++;
+            break;
+        case PCIEMU_TRACE_RESET:
+            clock_advance(rec->ts_ns);
+            device_reset(dev);
+            ctx.resets++;
+            break;
+        default:
+            /* DMAs are checked in address_space_rw */
+            break;
+        }
+    }
+}
+
+static void parse_args(int argc, char **argv)
+{
+    int op;
+    char *endptr;
+
+    ctx.loops = 1;
+    while ((op = getopt(argc, argv, "hl:o:v")) != -1) {
+        switch (op) {
+        case 'l':
+            errno = 0;
+            ctx.loops = strtoul(optarg, &endptr, 10);
+            if (errno != 0 || optarg == endptr || !ctx.loops) {
+                LOG_ERR("strtoul: invalid value (%s) for argument %c\n",
+                        optarg, op);
+                exit(-1);
+            }
+            break;
+        case 'o':
+            ctx.out = optarg;
+            break;
+        case 'v':
+            ctx.verbosity = 1;
+            break;
+        case 'h':
+            usage(stdout, argv);
+            exit(0);
+        default:
+            usage(stderr, argv);
+            exit(-1);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(stderr, argv);
+        exit(-1);
+    }
+    ctx.in = argv[optind];
+}
+
+int main(int argc, char **argv)
+{
+    struct timespec start, end;
+    PCIEMUDevice *dev;
+
+    parse_args(argc, argv);
+    if (load_trace())
+        return -1;
+    dev = device_init();
+    if (!dev) {
+        LOG_ERR("failed to create the device\n");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned int l = 0; l < ctx.loops; ++l) {
+        if (l) {
+            /* start over from a fresh device and clock */
+            for (unsigned int i = 0; i < ctx.timer_cnt; ++i)
+                timer_del(ctx.timers[i]);
+            ctx.clock_ns = 0;
+            device_reset(dev);
+        }
+        ctx.dma_next = 0;
+        replay(dev);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    device_fini(dev);
+
+    double secs = (end.tv_sec - start.tv_sec) +
+                  (end.tv_nsec - start.tv_nsec) / 1e9;
+    LOG("records          : %zu x %u\n", ctx.rec_cnt, ctx.loops);
+    LOG("mmio reads       : %" PRIu64 "\n", ctx.mmio_reads);
+    LOG("mmio writes      : %" PRIu64 "\n", ctx.mmio_writes);
+    LOG("dmas             : %" PRIu64 "\n", ctx.dmas);
+    LOG("resets           : %" PRIu64 "\n", ctx.resets);
+    LOG("read mismatches  : %" PRIu64 "\n", ctx.read_mismatches);
+    LOG("dma divergences  : %" PRIu64 "\n", ctx.dma_divergences);
+    LOG("hash mismatches  : %" PRIu64 "\n", ctx.hash_mismatches);
+    LOG("time             : %.6f s (%.0f records/s)\n", secs,
+        secs > 0 ? ctx.rec_cnt * ctx.loops / secs : 0);
+
+    free(ctx.rec);
+    return (ctx.read_mismatches || ctx.dma_divergences) ? 1 : 0;
+}
@@ -0,0 +1,478 @@
+/* pciemu_vfio_user.c - Out-of-process pciemu device (vfio-user server)
+ *
+ * Runs the pciemu device model (through libpciemu-sim) in its own process,
+ * serving it with the vfio-user protocol over a UNIX socket (libvfio-user).
+ * QEMU then uses the device through its vfio-user-pci client :
+ *
+ *   pciemu_vfio_user -s /tmp/pciemu.sock
+ *   qemu-system-x86_64 -object memory-backend-memfd,id=mem,size=4G,share=on \
+ *                      -machine memory-backend=mem \
+ *                      -device vfio-user-pci,socket=/tmp/pciemu.sock
+ *
+ * The guest memory is shared by the client as file descriptors, which are
+ * mapped here, so DMAs are plain copies. Thus, the guest memory must be
+ * shareable (e.g. memory-backend-memfd with share=on).
+ *
+ * Every socket (-s) serves its own device, so several VMs can share one
+ * process (and one host core, see -c). When a client disconnects, its device
+ * is reset and the socket accepts a new client, so the VM can be restarted
+ * without the device, and the other way around.
+ *
+ * The virtual clock of the devices follows the host monotonic clock, so the
+ * device timers (completion latency, RX stream generator, ...) fire on time.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <linux/pci_regs.h>
+#include <libvfio-user.h>
+#include "sim/pciemu_sim.h"
+
+/* LOGs & co*/
+#define KERR "\e[1;31m"
+#define KNORM "\e[0m"
+#define LOGF(fd, ...) fprintf(fd, __VA_ARGS__)
+#define LOG_ERROR(...)              \
+    LOGF(stderr, KERR __VA_ARGS__); \
+    LOGF(stderr, KNORM);
+#define LOG(...) LOGF(stdout, __VA_ARGS__)
+
+/* maximum number of sockets (devices) served by the process */
+#define SERVER_DEV_MAX 16
+
+/* maximum number of guest memory regions of a client */
+#define SERVER_DMA_REGION_MAX 64
+
+/* size of BAR0, same as the device in QEMU (target page size) */
+#define SERVER_BAR0_SIZE 4096
+
+/* guest memory region shared by the client */
+struct dma_region {
+    uint64_t iova;
+    uint64_t len;
+    uint8_t *vaddr; /* NULL if the client did not share it (fd) */
+};
+
+/* device served on a socket */
+struct device {
+    const char *path;
+    vfu_ctx_t *ctx;
+    PCIEMUSim *sim;
+    bool attached;
+    struct dma_region regions[SERVER_DMA_REGION_MAX];
+    unsigned int region_cnt;
+    /* statistics */
+    uint64_t mmio_accesses;
+    uint64_t dma_failures;
+};
+
+struct context {
+    struct device devs[SERVER_DEV_MAX];
+    unsigned int dev_cnt;
+    int cpu;                    /* host core to run on (-1 : any) */
+    uint8_t verbosity;          /* verbosity level for logs */
+    PCIEMUSimConfig cfg;        /* device configuration (shared) */
+    struct timespec start;      /* origin of the virtual clock */
+};
+
+static struct context ctx = { .cpu = -1 };
+
+static volatile sig_atomic_t quit;
+
+/* -----------------------------------------------------------------------------
+ *  Device callbacks
+ * -----------------------------------------------------------------------------
+ */
+
+/* host monotonic clock, relative to the start of the server */
+static int64_t clock_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - ctx.start.tv_sec) * 1000000000LL +
+           (now.tv_nsec - ctx.start.tv_nsec);
+}
+
+/* catch the virtual clock of the device up with the host clock */
+static void device_sync_clock(struct device *d)
+{
+    int64_t lag = clock_now_ns() - pciemu_sim_clock_ns(d->sim);
+    if (lag > 0)
+        pciemu_sim_advance(d->sim, lag);
+}
+
+static int device_dma(void *opaque, uint64_t addr, void *buf, uint64_t len,
+                      bool is_write)
+{
+    struct device *d = opaque;
+    uint8_t *p = buf;
+    /* a transfer may span several (contiguous) regions */
+    while (len) {
+        struct dma_region *r = NULL;
+        for (unsigned int i = 0; i < d->region_cnt; ++i) {
+            if (addr >= d->regions[i].iova &&
+                addr - d->regions[i].iova < d->regions[i].len) {
+                r = &d->regions[i];
+                break;
+            }
+        }
+        if (!r || !r->vaddr) {
+            d->dma_failures++;
+            if (ctx.verbosity)
+                LOG("%s : DMA to unmapped address 0x%" PRIx64 "\n", d->path,
+                    addr);
+            return -1;
+        }
+        uint64_t ofs = addr - r->iova;
+        uint64_t n = r->len - ofs < len ? r->len - ofs : len;
+        if (is_write)
+            memcpy(r->vaddr + ofs, p, n);
+        else
+            memcpy(p, r->vaddr + ofs, n);
+        addr += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void device_irq(void *opaque, unsigned int vector)
+{
+    struct device *d = opaque;
+    if (vfu_irq_trigger(d->ctx, vector) && ctx.verbosity)
+        LOG("%s : failed to trigger irq %u (%s)\n", d->path, vector,
+            strerror(errno));
+}
+
+static ssize_t device_bar0_access(vfu_ctx_t *vfu_ctx, char *buf, size_t count,
+                                  loff_t offset, bool is_write)
+{
+    struct device *d = vfu_get_private(vfu_ctx);
+    uint64_t val = 0;
+    if (count != 4 && count != 8) {
+        errno = EINVAL;
+        return -1;
+    }
+    device_sync_clock(d);
+    d->mmio_accesses++;
+    if (is_write) {
+        memcpy(&val, buf, count);
+        pciemu_sim_mmio_write(d->sim, offset, val, count);
+    } else {
+        val = pciemu_sim_mmio_read(d->sim, offset, count);
+        memcpy(buf, &val, count);
+    }
+    return count;
+}
+
+/* descriptor window : plain memory, only the descriptor doorbell (BAR0)
+ * reaches the device model. It is not shared with the client, so each access
+ * is still a message : the window saves MMIO exits, not round trips. */
+static ssize_t device_bar2_access(vfu_ctx_t *vfu_ctx, char *buf, size_t count,
+                                  loff_t offset, bool is_write)
+{
+    struct device *d = vfu_get_private(vfu_ctx);
+    uint8_t *window = pciemu_sim_desc_window(d->sim);
+    if (offset < 0 || offset > PCIEMU_HW_DESC_WINDOW_SIZE ||
+        count > PCIEMU_HW_DESC_WINDOW_SIZE - offset) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (is_write)
+        memcpy(window + offset, buf, count);
+    else
+        memcpy(buf, window + offset, count);
+    return count;
+}
+
+static void device_dma_register(vfu_ctx_t *vfu_ctx, vfu_dma_info_t *info)
+{
+    struct device *d = vfu_get_private(vfu_ctx);
+    if (d->region_cnt == SERVER_DMA_REGION_MAX) {
+        LOG_ERROR("%s : too many DMA regions\n", d->path);
+        return;
+    }
+    struct dma_region *r = &d->regions[d->region_cnt++];
+    r->iova = (uint64_t)info->iova.iov_base;
+    r->len = info->iova.iov_len;
+    r->vaddr = info->vaddr;
+    if (ctx.verbosity)
+        LOG("%s : DMA region 0x%" PRIx64 "-0x%" PRIx64 " %s\n", d->path,
+            r->iova, r->iova + r->len - 1,
+            r->vaddr ? "mapped" : "not shared");
+}
+
+static void device_dma_unregister(vfu_ctx_t *vfu_ctx, vfu_dma_info_t *info)
+{
+    struct device *d = vfu_get_private(vfu_ctx);
+    uint64_t iova = (uint64_t)info->iova.iov_base;
+    for (unsigned int i = 0; i < d->region_cnt; ++i) {
+        if (d->regions[i].iova == iova) {
+            d->regions[i] = d->regions[--d->region_cnt];
+            return;
+        }
+    }
+}
+
+static int device_reset(vfu_ctx_t *vfu_ctx, vfu_reset_type_t type)
+{
+    struct device *d = vfu_get_private(vfu_ctx);
+    pciemu_sim_reset(d->sim);
+    return 0;
+}
+
+static void device_log(vfu_ctx_t *vfu_ctx, int level, const char *msg)
+{
+    struct device *d = vfu_get_private(vfu_ctx);
+    LOGF(stderr, "%s : %s\n", d->path, msg);
+}
+
+/* -----------------------------------------------------------------------------
+ *  Server
+ * -----------------------------------------------------------------------------
+ */
+
+static int device_init(struct device *d)
+{
+    PCIEMUSimConfig cfg = ctx.cfg;
+    struct msicap msi = {
+        .hdr.id = PCI_CAP_ID_MSI,
+        .mc.mmc = 1, /* 2^1 vectors : PCIEMU_HW_IRQ_CNT */
+        .mc.c64 = 1,
+    };
+
+    cfg.dma_cb = device_dma;
+    cfg.dma_opaque = d;
+    cfg.irq_cb = device_irq;
+    cfg.irq_opaque = d;
+    d->sim = pciemu_sim_create(&cfg);
+    if (!d->sim)
+        return -1;
+
+    d->ctx = vfu_create_ctx(VFU_TRANS_SOCK, d->path,
+                            LIBVFIO_USER_FLAG_ATTACH_NB, d,
+                            VFU_DEV_TYPE_PCI);
+    if (!d->ctx) {
+        LOG_ERROR("%s : vfu_create_ctx failed (%s)\n", d->path, strerror(errno));
+        return -1;
+    }
+    vfu_setup_log(d->ctx, device_log, ctx.verbosity ? LOG_DEBUG : LOG_ERR);
+    if (vfu_pci_init(d->ctx, VFU_PCI_TYPE_EXPRESS, PCI_HEADER_TYPE_NORMAL, 0)) {
+        LOG_ERROR("%s : vfu_pci_init failed (%s)\n", d->path, strerror(errno));
+        return -1;
+    }
+    vfu_pci_set_id(d->ctx, PCIEMU_HW_VENDOR_ID, PCIEMU_HW_DEVICE_ID, 0, 0);
+    vfu_pci_set_class(d->ctx, 0xff, 0, 0); /* PCI_CLASS_OTHERS */
+    vfu_pci_get_config_space(d->ctx)->hdr.rid = PCIEMU_HW_REVISION;
+    if (vfu_pci_add_capability(d->ctx, 0, 0, &msi) < 0 ||
+        vfu_setup_region(d->ctx, VFU_PCI_DEV_BAR0_REGION_IDX, SERVER_BAR0_SIZE,
+                         device_bar0_access,
+                         VFU_REGION_FLAG_RW | VFU_REGION_FLAG_MEM, NULL, 0, -1,
+                         0) ||
+        vfu_setup_region(d->ctx, VFU_PCI_DEV_BAR2_REGION_IDX,
+                         PCIEMU_HW_DESC_WINDOW_SIZE, device_bar2_access,
+                         VFU_REGION_FLAG_RW | VFU_REGION_FLAG_MEM, NULL, 0, -1,
+                         0) ||
+        vfu_setup_device_dma(d->ctx, device_dma_register,
+                             device_dma_unregister) ||
+        vfu_setup_device_nr_irqs(d->ctx, VFU_DEV_MSI_IRQ, PCIEMU_HW_IRQ_CNT) ||
+        vfu_setup_device_reset_cb(d->ctx, device_reset) ||
+        vfu_realize_ctx(d->ctx)) {
+        LOG_ERROR("%s : device setup failed (%s)\n", d->path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void device_fini(struct device *d)
+{
+    if (d->ctx)
+        vfu_destroy_ctx(d->ctx);
+    if (d->sim)
+        pciemu_sim_destroy(d->sim);
+}
+
+/* handle the pending requests (or the connection) of a client */
+static void device_serve(struct device *d)
+{
+    if (!d->attached) {
+        if (vfu_attach_ctx(d->ctx) == 0) {
+            d->attached = true;
+            LOG("%s : client attached\n", d->path);
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            LOG_ERROR("%s : vfu_attach_ctx failed (%s)\n", d->path,
+                    strerror(errno));
+        }
+        return;
+    }
+    if (vfu_run_ctx(d->ctx) >= 0 || errno == EAGAIN || errno == EBUSY)
+        return;
+    /* the client is gone : wait for the next one with a fresh device */
+    LOG("%s : client detached (%s)\n", d->path, strerror(errno));
+    d->attached = false;
+    d->region_cnt = 0;
+    pciemu_sim_reset(d->sim);
+}
+
+/* time until the next device timer expires, NULL if there is none */
+static struct timespec *next_timeout(struct timespec *ts)
+{
+    int64_t now = clock_now_ns();
+    int64_t wait = -1;
+    for (unsigned int i = 0; i < ctx.dev_cnt; ++i) {
+        int64_t deadline = pciemu_sim_deadline_ns(ctx.devs[i].sim);
+        if (deadline < 0)
+            continue;
+        deadline = deadline > now ? deadline - now : 0;
+        if (wait < 0 || deadline < wait)
+            wait = deadline;
+    }
+    if (wait < 0)
+        return NULL;
+    ts->tv_sec = wait / 1000000000LL;
+    ts->tv_nsec = wait % 1000000000LL;
+    return ts;
+}
+
+static void serve(void)
+{
+    struct pollfd fds[SERVER_DEV_MAX];
+    struct timespec ts;
+
+    while (!quit) {
+        for (unsigned int i = 0; i < ctx.dev_cnt; ++i) {
+            fds[i].fd = vfu_get_poll_fd(ctx.devs[i].ctx);
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        int n = ppoll(fds, ctx.dev_cnt, next_timeout(&ts), NULL);
+        if (n < 0 && errno != EINTR) {
+            LOG_ERROR("ppoll failed (%s)\n", strerror(errno));
+            return;
+        }
+        for (unsigned int i = 0; i < ctx.dev_cnt; ++i) {
+            struct device *d = &ctx.devs[i];
+            device_sync_clock(d);
+            if (n > 0 && fds[i].revents)
+                device_serve(d);
+        }
+    }
+}
+
+static void on_signal(int sig)
+{
+    quit = 1;
+}
+
+static inline void usage(FILE *fd, char **argv)
+{
+    LOGF(fd, "Usage : %s [-h] [-c cpu] [-l dist:ns] [-v] -s socket "
+             "[-s socket ...]\n", argv[0]);
+    LOGF(fd, " \t -h \n\t\t display this help message\n");
+    LOGF(fd, " \t -c cpu \n\t\t run on the given host core\n");
+    LOGF(fd, " \t -l dist:ns \n\t\t completion latency (e.g. fixed:5000)\n");
+    LOGF(fd, " \t -s socket \n\t\t UNIX socket serving one device\n");
+    LOGF(fd, " \t -v \n\t\t run on verbose mode\n");
+}
+
+static void parse_args(int argc, char **argv)
+{
+    int op;
+    char *endptr;
+
+    while ((op = getopt(argc, argv, "hc:l:s:v")) != -1) {
+        switch (op) {
+        case 'c':
+            errno = 0;
+            ctx.cpu = strtol(optarg, &endptr, 10);
+            if (errno != 0 || optarg == endptr || ctx.cpu < 0) {
+                LOG_ERROR("strtol: invalid value (%s) for argument %c\n",
+                        optarg, op);
+                exit(-1);
+            }
+            break;
+        case 'l':
+            endptr = strchr(optarg, ':');
+            if (endptr) {
+                *endptr++ = '\0';
+                ctx.cfg.latency_ns = strtoull(endptr, NULL, 10);
+            }
+            ctx.cfg.latency_dist = optarg;
+            break;
+        case 's':
+            if (ctx.dev_cnt == SERVER_DEV_MAX) {
+                LOG_ERROR("at most %d sockets\n", SERVER_DEV_MAX);
+                exit(-1);
+            }
+            ctx.devs[ctx.dev_cnt++].path = optarg;
+            break;
+        case 'v':
+            ctx.verbosity = 1;
+            break;
+        case 'h':
+            usage(stdout, argv);
+            exit(0);
+        default:
+            usage(stderr, argv);
+            exit(-1);
+        }
+    }
+    if (!ctx.dev_cnt || optind != argc) {
+        usage(stderr, argv);
+        exit(-1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int ret = 0;
+
+    parse_args(argc, argv);
+    if (ctx.cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(ctx.cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set)) {
+            LOG_ERROR("sched_setaffinity failed (%s)\n", strerror(errno));
+            return -1;
+        }
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    clock_gettime(CLOCK_MONOTONIC, &ctx.start);
+
+    for (unsigned int i = 0; i < ctx.dev_cnt; ++i) {
+        if (device_init(&ctx.devs[i])) {
+            ret = -1;
+            goto out;
+        }
+        LOG("%s : waiting for a client\n", ctx.devs[i].path);
+    }
+    serve();
+
+out:
+    for (unsigned int i = 0; i < ctx.dev_cnt; ++i) {
+        struct device *d = &ctx.devs[i];
+        if (d->sim)
+            LOG("%s : %" PRIu64 " mmio accesses, %" PRIu64
+                " DMA failures\n", d->path, d->mmio_accesses,
+                d->dma_failures);
+        device_fini(d);
+    }
+    return ret;
+}
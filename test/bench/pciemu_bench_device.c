@@ -0,0 +1,159 @@
+/* pciemu_bench_device.c - Device instance shared by the microbenchmarks
+ *
+ * The device runs on the QEMU fakes of the unit tests, except for the bus
+ * address space, which is backed by a host buffer so DMAs really move data,
+ * and for the locks and the clock, which are the ones of the host.
+ * The device memory comes from a (faked) memory backend, so transfers bigger
+ * than the inline DMA area can be measured.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu.fake.h"
+#include "pciemu.h"
+#include "mmio.h"
+#include "pciemu_bench.h"
+
+DEFINE_FFF_GLOBALS;
+
+static uint8_t bench_host_mem[PCIEMU_BENCH_MEM_SIZE];
+static uint8_t bench_dev_mem[PCIEMU_BENCH_MEM_SIZE];
+static HostMemoryBackend bench_memdev;
+static PCIEMUDevice bench_dev;
+
+/* not a fake : the fake bookkeeping would be part of the measure */
+MemTxResult address_space_rw(AddressSpace *as, hwaddr addr, MemTxAttrs attrs,
+                             void *buf, hwaddr len, bool is_write)
+{
+    if (addr < PCIEMU_BENCH_BUS_ADDR ||
+        addr - PCIEMU_BENCH_BUS_ADDR > PCIEMU_BENCH_MEM_SIZE ||
+        len > PCIEMU_BENCH_MEM_SIZE - (addr - PCIEMU_BENCH_BUS_ADDR))
+        return MEMTX_DECODE_ERROR;
+    uint8_t *mem = bench_host_mem + (addr - PCIEMU_BENCH_BUS_ADDR);
+    if (is_write)
+        memcpy(mem, buf, len);
+    else
+        memcpy(buf, mem, len);
+    return MEMTX_OK;
+}
+
+void *address_space_map(AddressSpace *as, hwaddr addr, hwaddr *plen,
+                        bool is_write, MemTxAttrs attrs)
+{
+    if (addr < PCIEMU_BENCH_BUS_ADDR ||
+        addr - PCIEMU_BENCH_BUS_ADDR >= PCIEMU_BENCH_MEM_SIZE)
+        return NULL;
+    *plen = MIN(*plen, PCIEMU_BENCH_MEM_SIZE - (addr - PCIEMU_BENCH_BUS_ADDR));
+    return bench_host_mem + (addr - PCIEMU_BENCH_BUS_ADDR);
+}
+
+void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
+                         bool is_write, hwaddr access_len)
+{
+}
+
+/* not fakes either : the device lock and the BQL are real mutexes, so the
+ * benchmarks running several vCPU threads (pciemu_submit.c) measure the
+ * contention. The main thread plays the main loop and holds the BQL. */
+static pthread_mutex_t bench_bql = PTHREAD_MUTEX_INITIALIZER;
+static __thread bool bench_bql_locked;
+
+bool qemu_mutex_iothread_locked(void)
+{
+    return bench_bql_locked;
+}
+
+void qemu_mutex_lock_iothread_impl(const char *file, int line)
+{
+    pthread_mutex_lock(&bench_bql);
+    bench_bql_locked = true;
+}
+
+void qemu_mutex_unlock_iothread(void)
+{
+    bench_bql_locked = false;
+    pthread_mutex_unlock(&bench_bql);
+}
+
+void qemu_rec_mutex_init(QemuRecMutex *mutex)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&mutex->m.lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void qemu_rec_mutex_destroy(QemuRecMutex *mutex)
+{
+    pthread_mutex_destroy(&mutex->m.lock);
+}
+
+void qemu_rec_mutex_lock_impl(QemuRecMutex *mutex, const char *file, int line)
+{
+    pthread_mutex_lock(&mutex->m.lock);
+}
+
+void qemu_rec_mutex_unlock_impl(QemuRecMutex *mutex, const char *file,
+                                int line)
+{
+    pthread_mutex_unlock(&mutex->m.lock);
+}
+
+/* the bus is RAM only, so a vCPU never needs the BQL for a DMA */
+static MemoryRegion bench_ram = { .ram = true };
+
+MemoryRegion *flatview_translate(FlatView *fv, hwaddr addr, hwaddr *xlat,
+                                 hwaddr *plen, bool is_write,
+                                 MemTxAttrs attrs)
+{
+    *xlat = addr;
+    return &bench_ram;
+}
+
+bool memory_region_is_ram_device(MemoryRegion *mr)
+{
+    return false;
+}
+
+/* the host clock stands for the virtual clock (doorbell stamps, stats) */
+int64_t qemu_clock_get_ns(QEMUClockType type)
+{
+    return pciemu_bench_now_ns();
+}
+
+/* same sequence as pciemu_device_init in pciemu.c */
+static void pciemu_bench_device_realize(PCIEMUDevice *dev)
+{
+    Error *err = NULL;
+    dev->pci_dev.config = g_malloc0(PCIE_CONFIG_SPACE_SIZE);
+    pciemu_trace_init(dev, &err);
+    pciemu_stats_init(dev, &err);
+    pciemu_irq_init(dev, &err);
+    pciemu_dma_init(dev, &err);
+    pciemu_rx_init(dev, &err);
+    pciemu_mmio_init(dev, &err);
+}
+
+PCIEMUDevice *pciemu_bench_device_init(void)
+{
+    PCIEMUDevice *dev = &bench_dev;
+    qemu_mutex_lock_iothread();
+    for (size_t i = 0; i < sizeof(bench_host_mem); ++i)
+        bench_host_mem[i] = i;
+    dev->dma.memdev = &bench_memdev;
+    memory_region_get_ram_ptr_fake.return_val = bench_dev_mem;
+    memory_region_size_fake.return_val = sizeof(bench_dev_mem);
+    pciemu_bench_device_realize(dev);
+    return dev;
+}
+
+PCIEMUDevice *pciemu_bench_device_new(void)
+{
+    PCIEMUDevice *dev = g_new0(PCIEMUDevice, 1);
+    pciemu_bench_device_realize(dev);
+    return dev;
+}
@@ -0,0 +1,113 @@
+/* pciemu_dma.c - Microbenchmarks of hw/pciemu/dma.c file
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu.fake.h"
+#include "pciemu_bench.h"
+
+/* include the source file to measure static functions */
+#include "../src/hw/pciemu/dma.c"
+
+static const dma_size_t sizes[] = { 64, 512, 4 * KiB, 64 * KiB, 1 * MiB };
+
+/* bus addresses inside the host memory (see pciemu_bench_device.c) */
+#define BUS_SRC PCIEMU_BENCH_BUS_ADDR
+#define BUS_DST PCIEMU_BENCH_BUS_ADDR
+
+/* configure the transfer descriptor, checking that the command succeeds */
+static void bench_config(PCIEMUDevice *dev, dma_cmd_t cmd, dma_addr_t src,
+                         dma_addr_t dst, dma_size_t len)
+{
+    dev->dma.config.cmd = cmd;
+    dev->dma.config.txdesc.src = src;
+    dev->dma.config.txdesc.dst = dst;
+    dev->dma.config.txdesc.len = len;
+    dma_err_t err = pciemu_dma_execute(dev);
+    if (err != PCIEMU_HW_DMA_ERR_NONE) {
+        fprintf(stderr, "cmd %" PRIx64 " of %" PRIu64 " bytes failed (%" PRIu64
+                ")\n", cmd, len, err);
+        exit(1);
+    }
+}
+
+static void bench_execute(PCIEMUDevice *dev)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(sizes); ++i) {
+        dma_size_t len = sizes[i];
+        bench_config(dev, PCIEMU_HW_DMA_DIRECTION_TO_DEVICE, BUS_SRC,
+                     PCIEMU_HW_DMA_AREA_START, len);
+        BENCH("dma_execute_to_device", len, pciemu_dma_execute(dev));
+        bench_config(dev, PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE,
+                     PCIEMU_HW_DMA_AREA_START, BUS_DST, len);
+        BENCH("dma_execute_from_device", len, pciemu_dma_execute(dev));
+        bench_config(dev, PCIEMU_HW_DMA_CMD_PATTERN_FILL, 0, BUS_DST, len);
+        BENCH("dma_execute_pattern_fill", len, pciemu_dma_execute(dev));
+        /* the host buffer holds the pattern, so nothing mismatches */
+        bench_config(dev, PCIEMU_HW_DMA_CMD_PATTERN_VERIFY, BUS_SRC, 0, len);
+        BENCH("dma_execute_pattern_verify", len, pciemu_dma_execute(dev));
+    }
+}
+
+static void bench_crypto(PCIEMUDevice *dev)
+{
+    /* AES-256-XTS key in slot 0, dm-crypt like 4 KiB sectors */
+    pciemu_crypto_write(dev, PCIEMU_HW_BAR0_CRYPTO_KEY_SLOT, 0, 8);
+    for (hwaddr a = PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_START;
+         a <= PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_END; a += 8)
+        pciemu_crypto_write(dev, a, a * 0x9e3779b97f4a7c15ULL, 8);
+    pciemu_crypto_write(dev, PCIEMU_HW_BAR0_CRYPTO_KEY_CTRL,
+                        PCIEMU_HW_CRYPTO_KEY_XTS_256, 8);
+    dev->dma.config.key_slot = 0;
+    dev->dma.config.sector_size = 4 * KiB;
+    for (size_t i = 0; i < ARRAY_SIZE(sizes); ++i) {
+        dma_size_t len = sizes[i];
+        if (len % dev->dma.config.sector_size)
+            continue;
+        bench_config(dev, PCIEMU_HW_DMA_CMD_ENCRYPT, BUS_SRC, BUS_DST, len);
+        BENCH("dma_execute_encrypt", len, pciemu_dma_execute(dev));
+        bench_config(dev, PCIEMU_HW_DMA_CMD_DECRYPT, BUS_SRC, BUS_DST, len);
+        BENCH("dma_execute_decrypt", len, pciemu_dma_execute(dev));
+    }
+}
+
+static void bench_stream(PCIEMUDevice *dev)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(sizes); ++i) {
+        dma_size_t len = sizes[i];
+        /* streams up to the burst size complete in a single step */
+        bench_config(dev, PCIEMU_HW_DMA_CMD_STREAM, BUS_SRC, BUS_DST, len);
+        BENCH("dma_stream", len, {
+            pciemu_dma_execute(dev);
+            pciemu_dma_stream_step(dev);
+        });
+    }
+}
+
+static void bench_doorbell_ring(PCIEMUDevice *dev)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(sizes); ++i) {
+        dma_size_t len = sizes[i];
+        bench_config(dev, PCIEMU_HW_DMA_DIRECTION_TO_DEVICE, BUS_SRC,
+                     PCIEMU_HW_DMA_AREA_START, len);
+        BENCH("dma_doorbell_ring", len, pciemu_dma_doorbell_ring(dev));
+        bench_config(dev,
+                     PCIEMU_HW_DMA_DIRECTION_TO_DEVICE |
+                         PCIEMU_HW_DMA_CMD_FLAG_NO_IRQ,
+                     BUS_SRC, PCIEMU_HW_DMA_AREA_START, len);
+        BENCH("dma_doorbell_ring_no_irq", len, pciemu_dma_doorbell_ring(dev));
+    }
+}
+
+int main(void)
+{
+    PCIEMUDevice *dev = pciemu_bench_device_init();
+    bench_execute(dev);
+    bench_crypto(dev);
+    bench_stream(dev);
+    bench_doorbell_ring(dev);
+    return 0;
+}
@@ -0,0 +1,51 @@
+/* pciemu_mmio.c - Microbenchmarks of hw/pciemu/mmio.c file
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu.fake.h"
+#include "pciemu_bench.h"
+
+/* include the source file to measure static functions */
+#include "../src/hw/pciemu/mmio.c"
+
+/* keeps the reads from being optimized out */
+static volatile uint64_t sink;
+
+int main(void)
+{
+    PCIEMUDevice *dev = pciemu_bench_device_init();
+    uint64_t val = 0;
+
+    BENCH("mmio_write_reg", 0,
+          pciemu_mmio_write(dev, PCIEMU_HW_BAR0_REG_0, val++, 8));
+    BENCH("mmio_write_dma_cfg", 0,
+          pciemu_mmio_write(dev, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_LEN, 64, 8));
+    BENCH("mmio_write_invalid", 0,
+          pciemu_mmio_write(dev, PCIEMU_HW_BAR0_END + 8, val++, 8));
+    BENCH("mmio_read_reg", 0,
+          sink = pciemu_mmio_read(dev, PCIEMU_HW_BAR0_REG_0, 8));
+    BENCH("mmio_read_dma_status", 0,
+          sink = pciemu_mmio_read(dev, PCIEMU_HW_BAR0_DMA_STATUS, 8));
+
+    /* whole submission of a small transfer, as done by a driver */
+    BENCH("mmio_dma_submit", 64, {
+        pciemu_mmio_write(dev, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_SRC,
+                          PCIEMU_BENCH_BUS_ADDR, 8);
+        pciemu_mmio_write(dev, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_DST,
+                          PCIEMU_HW_DMA_AREA_START, 8);
+        pciemu_mmio_write(dev, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_LEN, 64, 8);
+        pciemu_mmio_write(dev, PCIEMU_HW_BAR0_DMA_CFG_CMD,
+                          PCIEMU_HW_DMA_DIRECTION_TO_DEVICE, 8);
+        pciemu_mmio_write(dev, PCIEMU_HW_BAR0_DMA_DOORBELL_RING, 1, 8);
+    });
+    if (pciemu_mmio_read(dev, PCIEMU_HW_BAR0_DMA_ERROR, 8) !=
+        PCIEMU_HW_DMA_ERR_NONE) {
+        fprintf(stderr, "DMA submission failed\n");
+        return 1;
+    }
+    return 0;
+}
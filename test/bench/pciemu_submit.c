@@ -0,0 +1,122 @@
+/* pciemu_submit.c - Scaling of the DMA submissions of several vCPUs
+ *
+ * Each thread plays a vCPU driving its own device, submitting small
+ * transfers as in the mmio_dma_submit benchmark of pciemu_mmio.c, for
+ * PCIEMU_BENCH_MIN_NS. The submissions of all the threads are reported
+ * together, so ns_per_op is the time between two submissions of the VM :
+ *   - mmio_submit_bql_<n> : every BAR0 access takes the BQL, as the memory
+ *     core does for a region without its own lock. ns_per_op does not drop
+ *     when threads are added.
+ *   - mmio_submit_vcpu_<n> : BAR0 accesses only take the device lock (see
+ *     pciemu_mmio_write). ns_per_op drops with the number of threads, up to
+ *     the number of host CPUs.
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu.fake.h"
+#include "pciemu.h"
+#include "mmio.h"
+#include "pciemu_bench.h"
+
+#define SUBMIT_THREAD_MAX 8
+
+typedef struct SubmitThread {
+    pthread_t thread;
+    PCIEMUDevice *dev;
+    bool bql;
+    uint64_t ops;
+} SubmitThread;
+
+static SubmitThread threads[SUBMIT_THREAD_MAX];
+static bool submit_go;
+static bool submit_stop;
+
+static void submit_write(SubmitThread *t, hwaddr addr, uint64_t val)
+{
+    if (t->bql)
+        qemu_mutex_lock_iothread();
+    pciemu_mmio_ops.write(t->dev, addr, val, 8);
+    if (t->bql)
+        qemu_mutex_unlock_iothread();
+}
+
+/* whole submission of a small transfer, without completion interrupt,
+ * through the callbacks called by the memory core */
+static void submit(SubmitThread *t)
+{
+    submit_write(t, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_SRC, PCIEMU_BENCH_BUS_ADDR);
+    submit_write(t, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_DST,
+                 PCIEMU_HW_DMA_AREA_START);
+    submit_write(t, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_LEN, 64);
+    submit_write(t, PCIEMU_HW_BAR0_DMA_CFG_CMD,
+                 PCIEMU_HW_DMA_DIRECTION_TO_DEVICE |
+                     PCIEMU_HW_DMA_CMD_FLAG_NO_IRQ);
+    submit_write(t, PCIEMU_HW_BAR0_DMA_DOORBELL_RING, 1);
+}
+
+static void *submit_thread(void *opaque)
+{
+    SubmitThread *t = opaque;
+    while (!qatomic_read(&submit_go))
+        ;
+    while (!qatomic_read(&submit_stop)) {
+        submit(t);
+        t->ops++;
+    }
+    return NULL;
+}
+
+static void bench_submit(const char *mode, bool bql, unsigned cnt)
+{
+    char name[64];
+    uint64_t ops = 0;
+    qatomic_set(&submit_go, false);
+    qatomic_set(&submit_stop, false);
+    for (unsigned i = 0; i < cnt; ++i) {
+        threads[i].bql = bql;
+        threads[i].ops = 0;
+        pthread_create(&threads[i].thread, NULL, submit_thread, &threads[i]);
+    }
+    /* the main loop sleeps without the BQL */
+    qemu_mutex_unlock_iothread();
+    uint64_t start = pciemu_bench_now_ns();
+    qatomic_set(&submit_go, true);
+    g_usleep(PCIEMU_BENCH_MIN_NS / 1000);
+    qatomic_set(&submit_stop, true);
+    uint64_t elapsed = pciemu_bench_now_ns() - start;
+    for (unsigned i = 0; i < cnt; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        ops += threads[i].ops;
+    }
+    qemu_mutex_lock_iothread();
+    snprintf(name, sizeof(name), "mmio_submit_%s_%u", mode, cnt);
+    pciemu_bench_report(name, 64, ops, elapsed);
+}
+
+int main(void)
+{
+    unsigned cnt = MIN(sysconf(_SC_NPROCESSORS_ONLN), SUBMIT_THREAD_MAX);
+    /* holds the BQL, as the main loop */
+    pciemu_bench_device_init();
+    for (unsigned i = 0; i < cnt; ++i) {
+        threads[i].dev = pciemu_bench_device_new();
+        /* the guest memory is mapped before the measure */
+        submit(&threads[i]);
+    }
+    for (unsigned n = 1; n <= cnt; n *= 2)
+        bench_submit("bql", true, n);
+    for (unsigned n = 1; n <= cnt; n *= 2)
+        bench_submit("vcpu", false, n);
+    for (unsigned i = 0; i < cnt; ++i) {
+        if (pciemu_mmio_ops.read(threads[i].dev, PCIEMU_HW_BAR0_DMA_ERROR,
+                                 8) != PCIEMU_HW_DMA_ERR_NONE) {
+            fprintf(stderr, "DMA submission failed\n");
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,16 @@
+/* arbiter.fake.c - Arbiter fake functions
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "pciemu_arbiter.fake.h"
+
+DEFINE_FAKE_VALUE_FUNC(uint64_t, pciemu_arbiter_read, PCIEMUDevice *, hwaddr);
+DEFINE_FAKE_VOID_FUNC(pciemu_arbiter_write, PCIEMUDevice *, hwaddr, uint64_t);
+DEFINE_FAKE_VOID_FUNC(pciemu_arbiter_kick, PCIEMUDevice *);
+DEFINE_FAKE_VOID_FUNC(pciemu_arbiter_complete, PCIEMUDevice *, uint64_t);
+DEFINE_FAKE_VOID_FUNC(pciemu_arbiter_reset, PCIEMUDevice *);
+DEFINE_FAKE_VOID_FUNC(pciemu_arbiter_init, PCIEMUDevice *);
@@ -0,0 +1,19 @@
+/* crypto.fake.c - Crypto fake functions
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "pciemu_crypto.fake.h"
+
+DEFINE_FAKE_VALUE_FUNC(uint64_t, pciemu_crypto_read, PCIEMUDevice *, hwaddr);
+DEFINE_FAKE_VOID_FUNC(pciemu_crypto_write, PCIEMUDevice *, hwaddr, uint64_t,
+                      unsigned int);
+DEFINE_FAKE_VALUE_FUNC(bool, pciemu_crypto_key_loaded, PCIEMUDevice *,
+                       uint32_t);
+DEFINE_FAKE_VALUE_FUNC(int, pciemu_crypto_xts, PCIEMUDevice *, uint32_t,
+                       uint64_t, uint32_t, uint8_t *, size_t, bool);
+DEFINE_FAKE_VOID_FUNC(pciemu_crypto_reset, PCIEMUDevice *);
+DEFINE_FAKE_VOID_FUNC(pciemu_crypto_init, PCIEMUDevice *);
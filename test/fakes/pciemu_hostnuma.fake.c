@@ -0,0 +1,24 @@
+/* hostnuma.fake.c - Host NUMA placement fake functions
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "pciemu_hostnuma.fake.h"
+
+DEFINE_FAKE_VOID_FUNC(pciemu_hostnuma_get_nodes, Object *, Visitor *,
+                      const char *, void *, Error **);
+DEFINE_FAKE_VOID_FUNC(pciemu_hostnuma_set_nodes, Object *, Visitor *,
+                      const char *, void *, Error **);
+DEFINE_FAKE_VALUE_FUNC(int, pciemu_hostnuma_get_policy, Object *, Error **);
+DEFINE_FAKE_VOID_FUNC(pciemu_hostnuma_set_policy, Object *, int, Error **);
+DEFINE_FAKE_VALUE_FUNC(bool, pciemu_hostnuma_enabled, PCIEMUDevice *);
+DEFINE_FAKE_VALUE_FUNC(uint8_t *, pciemu_hostnuma_alloc, PCIEMUDevice *,
+                       size_t, Error **);
+DEFINE_FAKE_VOID_FUNC(pciemu_hostnuma_pin, PCIEMUDevice *,
+                      HostNumaAffinity *);
+DEFINE_FAKE_VOID_FUNC(pciemu_hostnuma_unpin, HostNumaAffinity *);
+DEFINE_FAKE_VOID_FUNC(pciemu_hostnuma_init, PCIEMUDevice *, Error **);
+DEFINE_FAKE_VOID_FUNC(pciemu_hostnuma_fini, PCIEMUDevice *);
@@ -11,5 +11,8 @@
 DEFINE_FAKE_VOID_FUNC(pciemu_irq_init, PCIEMUDevice *, Error **);
 DEFINE_FAKE_VOID_FUNC(pciemu_irq_fini, PCIEMUDevice *);
 DEFINE_FAKE_VOID_FUNC(pciemu_irq_reset, PCIEMUDevice *);
+DEFINE_FAKE_VALUE_FUNC(uint64_t, pciemu_irq_read, PCIEMUDevice *, hwaddr);
+DEFINE_FAKE_VOID_FUNC(pciemu_irq_write, PCIEMUDevice *, hwaddr, uint64_t);
+DEFINE_FAKE_VOID_FUNC(pciemu_irq_event, PCIEMUDevice *, uint32_t);
 DEFINE_FAKE_VOID_FUNC(pciemu_irq_raise, PCIEMUDevice *, unsigned int);
 DEFINE_FAKE_VOID_FUNC(pciemu_irq_lower, PCIEMUDevice *, unsigned int);
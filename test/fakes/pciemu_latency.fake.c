@@ -0,0 +1,13 @@
+/* latency.fake.c - Latency model fake functions
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "pciemu_latency.fake.h"
+
+DEFINE_FAKE_VALUE_FUNC(uint64_t, pciemu_latency_sample, LatencyModel *);
+DEFINE_FAKE_VOID_FUNC(pciemu_latency_reset, LatencyModel *);
+DEFINE_FAKE_VOID_FUNC(pciemu_latency_init, LatencyModel *, Error **);
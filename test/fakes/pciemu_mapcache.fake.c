@@ -0,0 +1,17 @@
+/* mapcache.fake.c - Map cache fake functions
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "pciemu_mapcache.fake.h"
+
+DEFINE_FAKE_VALUE_FUNC(bool, pciemu_mapcache_rw, PCIEMUDevice *, dma_addr_t,
+                       void *, dma_addr_t, DMADirection);
+DEFINE_FAKE_VOID_FUNC(pciemu_mapcache_get, Object *, Visitor *, const char *,
+                      void *, Error **);
+DEFINE_FAKE_VOID_FUNC(pciemu_mapcache_reset, PCIEMUDevice *);
+DEFINE_FAKE_VOID_FUNC(pciemu_mapcache_init, PCIEMUDevice *, Error **);
+DEFINE_FAKE_VOID_FUNC(pciemu_mapcache_fini, PCIEMUDevice *);
@@ -11,3 +11,6 @@
 DEFINE_FAKE_VOID_FUNC(pciemu_mmio_init, PCIEMUDevice *, Error **);
 DEFINE_FAKE_VOID_FUNC(pciemu_mmio_fini, PCIEMUDevice *);
 DEFINE_FAKE_VOID_FUNC(pciemu_mmio_reset, PCIEMUDevice *);
+DEFINE_FAKE_VOID_FUNC(pciemu_mmio_lock_bql, PCIEMUDevice *);
+DEFINE_FAKE_VOID_FUNC(pciemu_mmio_dma_prepare, PCIEMUDevice *, dma_addr_t,
+                      dma_addr_t, DMADirection);
@@ -0,0 +1,15 @@
+/* pipeline.fake.c - Pipeline fake functions
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "pciemu_pipeline.fake.h"
+
+DEFINE_FAKE_VALUE_FUNC(bool, pciemu_pipeline_enabled, PCIEMUDevice *);
+DEFINE_FAKE_VOID_FUNC(pciemu_pipeline_start, PCIEMUDevice *, dma_addr_t,
+                      dma_addr_t, dma_addr_t);
+DEFINE_FAKE_VOID_FUNC(pciemu_pipeline_reset, PCIEMUDevice *);
+DEFINE_FAKE_VOID_FUNC(pciemu_pipeline_init, PCIEMUDevice *, Error **);
@@ -0,0 +1,20 @@
+/* rx.fake.c - RX fake functions
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "pciemu_rx.fake.h"
+
+DEFINE_FAKE_VOID_FUNC(pciemu_rx_config_ring_addr, PCIEMUDevice *, dma_addr_t);
+DEFINE_FAKE_VOID_FUNC(pciemu_rx_config_ring_size, PCIEMUDevice *, uint32_t);
+DEFINE_FAKE_VOID_FUNC(pciemu_rx_config_pkt_size, PCIEMUDevice *, uint32_t);
+DEFINE_FAKE_VOID_FUNC(pciemu_rx_config_rate, PCIEMUDevice *, uint64_t);
+DEFINE_FAKE_VOID_FUNC(pciemu_rx_config_burst, PCIEMUDevice *, uint64_t);
+DEFINE_FAKE_VOID_FUNC(pciemu_rx_tail_update, PCIEMUDevice *, uint32_t);
+DEFINE_FAKE_VOID_FUNC(pciemu_rx_ctrl, PCIEMUDevice *, uint64_t);
+DEFINE_FAKE_VOID_FUNC(pciemu_rx_init, PCIEMUDevice *, Error **);
+DEFINE_FAKE_VOID_FUNC(pciemu_rx_fini, PCIEMUDevice *);
+DEFINE_FAKE_VOID_FUNC(pciemu_rx_reset, PCIEMUDevice *);
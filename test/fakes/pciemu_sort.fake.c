@@ -0,0 +1,15 @@
+/* sort.fake.c - Sort fake functions
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "pciemu_sort.fake.h"
+
+DEFINE_FAKE_VALUE_FUNC(bool, pciemu_sort_active, PCIEMUDevice *);
+DEFINE_FAKE_VOID_FUNC(pciemu_sort_start, PCIEMUDevice *, dma_addr_t,
+                      dma_addr_t, dma_addr_t, size_t, unsigned int, bool);
+DEFINE_FAKE_VOID_FUNC(pciemu_sort_reset, PCIEMUDevice *);
+DEFINE_FAKE_VOID_FUNC(pciemu_sort_init, PCIEMUDevice *);
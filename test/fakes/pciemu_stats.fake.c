@@ -0,0 +1,18 @@
+/* stats.fake.c - Latency stats fake functions
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "pciemu_stats.fake.h"
+
+DEFINE_FAKE_VOID_FUNC(pciemu_stats_doorbell, PCIEMUDevice *, int64_t);
+DEFINE_FAKE_VOID_FUNC(pciemu_stats_event, PCIEMUDevice *, StatsEvent);
+DEFINE_FAKE_VOID_FUNC(pciemu_stats_irq, PCIEMUDevice *, unsigned int);
+DEFINE_FAKE_VOID_FUNC(pciemu_stats_get, Object *, Visitor *, const char *,
+                      void *, Error **);
+DEFINE_FAKE_VOID_FUNC(pciemu_stats_reset, PCIEMUDevice *);
+DEFINE_FAKE_VOID_FUNC(pciemu_stats_init, PCIEMUDevice *, Error **);
+DEFINE_FAKE_VOID_FUNC(pciemu_stats_fini, PCIEMUDevice *);
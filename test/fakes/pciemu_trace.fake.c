@@ -0,0 +1,21 @@
+/* trace.fake.c - Trace fake functions
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "pciemu_trace.fake.h"
+
+DEFINE_FAKE_VOID_FUNC(pciemu_trace_mmio, PCIEMUDevice *, uint8_t, hwaddr,
+                      unsigned int, uint64_t);
+DEFINE_FAKE_VALUE_FUNC(uint64_t, pciemu_trace_dma_hash, PCIEMUDevice *,
+                       const void *, dma_addr_t);
+DEFINE_FAKE_VOID_FUNC(pciemu_trace_dma_hashed, PCIEMUDevice *, DMADirection,
+                      dma_addr_t, dma_addr_t, uint64_t);
+DEFINE_FAKE_VOID_FUNC(pciemu_trace_dma, PCIEMUDevice *, DMADirection,
+                      dma_addr_t, const void *, dma_addr_t);
+DEFINE_FAKE_VOID_FUNC(pciemu_trace_reset, PCIEMUDevice *);
+DEFINE_FAKE_VOID_FUNC(pciemu_trace_init, PCIEMUDevice *, Error **);
+DEFINE_FAKE_VOID_FUNC(pciemu_trace_fini, PCIEMUDevice *);
@@ -24,6 +24,16 @@ DEFINE_FAKE_VOID_FUNC(register_module_init, type_init_fn_arg, module_init_type);
 DEFINE_FAKE_VALUE_FUNC(MemTxResult, address_space_rw, AddressSpace *, hwaddr,
                        MemTxAttrs, void *, hwaddr, bool);
 
+/* pci_dma_map and pci_dma_unmap are inlined as well */
+DEFINE_FAKE_VALUE_FUNC(void *, address_space_map, AddressSpace *, hwaddr,
+                       hwaddr *, bool, MemTxAttrs);
+DEFINE_FAKE_VOID_FUNC(address_space_unmap, AddressSpace *, void *, hwaddr,
+                      bool, hwaddr);
+
+/* address_space_translate is inlined as well */
+DEFINE_FAKE_VALUE_FUNC(MemoryRegion *, flatview_translate, FlatView *, hwaddr,
+                       hwaddr *, hwaddr *, bool, MemTxAttrs);
+
 DEFINE_FAKE_VALUE_FUNC(size_t, qemu_target_page_size);
 
 /* from qemu/hw/pci/pci.c */
@@ -41,10 +51,230 @@ DEFINE_FAKE_VOID_FUNC(msi_notify, PCIDevice *, unsigned int);
 
 DEFINE_FAKE_VOID_FUNC(msi_uninit, struct PCIDevice *);
 
+/* from qemu/hw/pci/pcie.c */
+DEFINE_FAKE_VALUE_FUNC(int, pcie_endpoint_cap_init, PCIDevice *, uint8_t);
+
+DEFINE_FAKE_VOID_FUNC(pcie_cap_exit, PCIDevice *);
+
 /* from qemu/softmmu/memory.c */
 DEFINE_FAKE_VOID_FUNC(memory_region_init_io, MemoryRegion *, Object *,
                       const MemoryRegionOps *, void *, const char *, uint64_t);
 
+DEFINE_FAKE_VOID_FUNC(memory_region_init_ram, MemoryRegion *, Object *,
+                      const char *, uint64_t, Error **);
+
+DEFINE_FAKE_VOID_FUNC(memory_region_clear_global_locking, MemoryRegion *);
+
+/* from qemu/util/qemu-timer.c
+ * timer_init_ns is inlined and ends up calling timer_init_full
+ */
+DEFINE_FAKE_VOID_FUNC(timer_init_full, QEMUTimer *, QEMUTimerListGroup *,
+                      QEMUClockType, int, int, QEMUTimerCB *, void *);
+
+DEFINE_FAKE_VOID_FUNC(timer_mod_ns, QEMUTimer *, int64_t);
+
+DEFINE_FAKE_VOID_FUNC(timer_del, QEMUTimer *);
+
+DEFINE_FAKE_VALUE_FUNC(bool, timer_pending, QEMUTimer *);
+
+DEFINE_FAKE_VALUE_FUNC(int64_t, qemu_clock_get_ns, QEMUClockType);
+
+/* from qemu/util/qemu-thread-posix.c
+ * qemu_rec_mutex_lock is a macro calling through qemu_rec_mutex_lock_func
+ */
+DEFINE_FAKE_VOID_FUNC(qemu_rec_mutex_init, QemuRecMutex *);
+
+DEFINE_FAKE_VOID_FUNC(qemu_rec_mutex_destroy, QemuRecMutex *);
+
+DEFINE_FAKE_VOID_FUNC(qemu_rec_mutex_lock_impl, QemuRecMutex *, const char *,
+                      int);
+
+DEFINE_FAKE_VOID_FUNC(qemu_rec_mutex_unlock_impl, QemuRecMutex *,
+                      const char *, int);
+
+QemuRecMutexLockFunc qemu_rec_mutex_lock_func = qemu_rec_mutex_lock_impl;
+
+DEFINE_FAKE_VOID_FUNC(qemu_event_set, QemuEvent *);
+
+/* from qemu/util/rcu.c
+ * rcu_read_lock and rcu_read_unlock are inlined, counting the read-side
+ * critical sections in the reader of the thread
+ */
+QEMU_DEFINE_CO_TLS(struct rcu_reader_data, rcu_reader)
+
+unsigned long rcu_gp_ctr;
+
+QemuEvent rcu_gp_event;
+
+/* from qemu/softmmu/cpus.c
+ * qemu_mutex_lock_iothread is a macro calling qemu_mutex_lock_iothread_impl
+ */
+DEFINE_FAKE_VALUE_FUNC(bool, qemu_mutex_iothread_locked);
+
+DEFINE_FAKE_VOID_FUNC(qemu_mutex_lock_iothread_impl, const char *, int);
+
+DEFINE_FAKE_VOID_FUNC(qemu_mutex_unlock_iothread);
+
+/* from qemu/util/error.c
+ * error_setg is a macro calling error_setg_internal
+ */
+DEFINE_FAKE_VOID_FUNC_VARARG(error_setg_internal, Error **, const char *, int,
+                             const char *, const char *, ...);
+
+DEFINE_FAKE_VOID_FUNC(error_propagate, Error **, Error *);
+
+/* from qemu/util/qemu-error.c */
+DEFINE_FAKE_VOID_FUNC_VARARG(warn_report, const char *, ...);
+
+/* from qemu/hw/core/qdev-properties.c */
+DEFINE_FAKE_VOID_FUNC(device_class_set_props, DeviceClass *, Property *);
+const PropertyInfo qdev_prop_link;
+const PropertyInfo qdev_prop_string;
+const PropertyInfo qdev_prop_bool;
+
+/* from qemu/backends/hostmem.c */
+DEFINE_FAKE_VALUE_FUNC(MemoryRegion *, host_memory_backend_get_memory,
+                       HostMemoryBackend *);
+
+DEFINE_FAKE_VALUE_FUNC(bool, host_memory_backend_is_mapped,
+                       HostMemoryBackend *);
+
+DEFINE_FAKE_VOID_FUNC(host_memory_backend_set_mapped, HostMemoryBackend *,
+                      bool);
+
+/* from qemu/softmmu/physmem.c and qemu/softmmu/memory.c */
+DEFINE_FAKE_VALUE_FUNC(void *, memory_region_get_ram_ptr, MemoryRegion *);
+
+DEFINE_FAKE_VALUE_FUNC(uint64_t, memory_region_size, MemoryRegion *);
+
+DEFINE_FAKE_VALUE_FUNC(MemoryRegion *, memory_region_from_host, void *,
+                       ram_addr_t *);
+
+DEFINE_FAKE_VALUE_FUNC(bool, memory_region_is_ram_device, MemoryRegion *);
+
+DEFINE_FAKE_VOID_FUNC(memory_region_set_dirty, MemoryRegion *, hwaddr,
+                      hwaddr);
+
+DEFINE_FAKE_VOID_FUNC(memory_listener_register, MemoryListener *,
+                      AddressSpace *);
+
+DEFINE_FAKE_VOID_FUNC(memory_listener_unregister, MemoryListener *);
+
+DEFINE_FAKE_VALUE_FUNC(int, memory_region_register_iommu_notifier,
+                       MemoryRegion *, IOMMUNotifier *, Error **);
+
+DEFINE_FAKE_VOID_FUNC(memory_region_unregister_iommu_notifier,
+                      MemoryRegion *, IOMMUNotifier *);
+
+DEFINE_FAKE_VALUE_FUNC(int, memory_region_iommu_attrs_to_index,
+                       IOMMUMemoryRegion *, MemTxAttrs);
+
+/* from qemu/qom/object.c */
+DEFINE_FAKE_VALUE_FUNC(ObjectProperty *, object_class_property_add,
+                       ObjectClass *, const char *, const char *,
+                       ObjectPropertyAccessor *, ObjectPropertyAccessor *,
+                       ObjectPropertyRelease *, void *);
+
+/* from qemu/qapi/qapi-visit-core.c */
+DEFINE_FAKE_VALUE_FUNC(bool, visit_start_struct, Visitor *, const char *,
+                       void **, size_t, Error **);
+
+DEFINE_FAKE_VALUE_FUNC(bool, visit_check_struct, Visitor *, Error **);
+
+DEFINE_FAKE_VOID_FUNC(visit_end_struct, Visitor *, void **);
+
+DEFINE_FAKE_VALUE_FUNC(bool, visit_start_list, Visitor *, const char *,
+                       GenericList **, size_t, Error **);
+
+DEFINE_FAKE_VALUE_FUNC(bool, visit_check_list, Visitor *, Error **);
+
+DEFINE_FAKE_VOID_FUNC(visit_end_list, Visitor *, void **);
+
+DEFINE_FAKE_VALUE_FUNC(bool, visit_type_uint64, Visitor *, const char *,
+                       uint64_t *, Error **);
+
+/* from qemu/util/thread-pool.c */
+DEFINE_FAKE_VALUE_FUNC(BlockAIOCB *, thread_pool_submit_aio, ThreadPoolFunc *,
+                       void *, BlockCompletionFunc *, void *);
+
+/* from qemu/util/aio-wait.c, qemu/util/async.c and qemu/util/aio-posix.c
+ * AIO_WAIT_WHILE is a macro polling the main loop with aio_poll
+ */
+AioWait global_aio_wait;
+
+DEFINE_FAKE_VALUE_FUNC(AioContext *, qemu_get_current_aio_context);
+
+DEFINE_FAKE_VALUE_FUNC(AioContext *, qemu_get_aio_context);
+
+DEFINE_FAKE_VALUE_FUNC(bool, aio_poll, AioContext *, bool);
+
+DEFINE_FAKE_VOID_FUNC(aio_context_acquire, AioContext *);
+
+DEFINE_FAKE_VOID_FUNC(aio_context_release, AioContext *);
+
+/* from qemu/crypto/cipher.c */
+DEFINE_FAKE_VALUE_FUNC(QCryptoCipher *, qcrypto_cipher_new,
+                       QCryptoCipherAlgorithm, QCryptoCipherMode,
+                       const uint8_t *, size_t, Error **);
+
+DEFINE_FAKE_VOID_FUNC(qcrypto_cipher_free, QCryptoCipher *);
+
+DEFINE_FAKE_VALUE_FUNC(int, qcrypto_cipher_setiv, QCryptoCipher *,
+                       const uint8_t *, size_t, Error **);
+
+DEFINE_FAKE_VALUE_FUNC(int, qcrypto_cipher_encrypt, QCryptoCipher *,
+                       const void *, void *, size_t, Error **);
+
+DEFINE_FAKE_VALUE_FUNC(int, qcrypto_cipher_decrypt, QCryptoCipher *,
+                       const void *, void *, size_t, Error **);
+
 /* from qemu/util/log.c */
 int qemu_loglevel = 0;
 DEFINE_FAKE_VOID_FUNC_VARARG(qemu_log, const char *, ...);
+
+/* from qemu/util/error.c
+ * error_setg_errno is a macro calling error_setg_errno_internal
+ */
+DEFINE_FAKE_VOID_FUNC_VARARG(error_setg_errno_internal, Error **,
+                             const char *, int, const char *, int,
+                             const char *, ...);
+
+/* from qemu/qom/object.c */
+DEFINE_FAKE_VALUE_FUNC(ObjectProperty *, object_class_property_add_enum,
+                       ObjectClass *, const char *, const char *,
+                       const QEnumLookup *, enum_get_fn_arg, enum_set_fn_arg);
+
+/* from the generated qapi/qapi-builtin-visit.c and qapi-builtin-types.c */
+DEFINE_FAKE_VALUE_FUNC(bool, visit_type_uint16List, Visitor *, const char *,
+                       uint16List **, Error **);
+
+DEFINE_FAKE_VOID_FUNC(qapi_free_uint16List, uint16List *);
+
+/* from qemu/qapi/qapi-util.c
+ * HostMemPolicy_str is a macro calling qapi_enum_lookup
+ */
+DEFINE_FAKE_VALUE_FUNC(const char *, qapi_enum_lookup, const QEnumLookup *,
+                       int);
+const QEnumLookup HostMemPolicy_lookup;
+
+/* from qemu/hw/core/qdev.c
+ * pci_get_bus is inlined and ends up calling qdev_get_parent_bus
+ */
+DEFINE_FAKE_VALUE_FUNC(BusState *, qdev_get_parent_bus, const DeviceState *);
+
+/* from qemu/hw/pci/pci.c */
+DEFINE_FAKE_VALUE_FUNC(int, pci_bus_numa_node, PCIBus *);
+
+/* from qemu/softmmu/vl.c */
+MachineState *current_machine;
+
+/* from qemu/util/oslib-posix.c */
+DEFINE_FAKE_VALUE_FUNC(void *, qemu_memalign, size_t, size_t);
+
+DEFINE_FAKE_VOID_FUNC(qemu_vfree, void *);
+
+#ifdef CONFIG_NUMA
+/* from libnuma */
+DEFINE_FAKE_VALUE_FUNC(long, mbind, void *, unsigned long, int,
+                       const unsigned long *, unsigned long, unsigned int);
+#endif
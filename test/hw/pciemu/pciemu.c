@@ -10,8 +10,13 @@
 #include "fff/fff.h"
 #include "qemu.fake.h"
 #include "pciemu_dma.fake.h"
+#include "pciemu_hostnuma.fake.h"
 #include "pciemu_irq.fake.h"
+#include "pciemu_mapcache.fake.h"
 #include "pciemu_mmio.fake.h"
+#include "pciemu_rx.fake.h"
+#include "pciemu_stats.fake.h"
+#include "pciemu_trace.fake.h"
 
 #include "../src/hw/pciemu/pciemu.c"
 
@@ -31,7 +36,61 @@ TEST(pciemu_device_init, "Test initialization of PCIEMU device")
     pciemu_device_init(&pci_dev, &e);
     EXPECT_EQ(pciemu_irq_init_fake.call_count, 1, "Should init irq once");
     EXPECT_EQ(pciemu_dma_init_fake.call_count, 1, "Should init dma once");
+    EXPECT_EQ(pciemu_rx_init_fake.call_count, 1, "Should init rx once");
     EXPECT_EQ(pciemu_mmio_init_fake.call_count, 1, "Should init mmio once");
+    EXPECT_EQ(pciemu_trace_init_fake.call_count, 1, "Should init trace once");
+    EXPECT_EQ(pciemu_stats_init_fake.call_count, 1, "Should init stats once");
+}
+
+/* any non-NULL error will do, the fakes never look into it */
+static void pciemu_stats_init_fail(PCIEMUDevice *dev, Error **errp)
+{
+    static char failure;
+    *errp = (Error *)&failure;
+}
+
+TEST(pciemu_device_init_stats, "Test failed initialization of stats")
+{
+    PCIDevice pci_dev = { .name = "pciemu_test" };
+    Error *e = NULL;
+    RESET_FAKE(pciemu_irq_init);
+    RESET_FAKE(pciemu_trace_fini);
+    RESET_FAKE(error_propagate);
+    pciemu_stats_init_fake.custom_fake = pciemu_stats_init_fail;
+    pciemu_device_init(&pci_dev, &e);
+    EXPECT_EQ(error_propagate_fake.call_count, 1, "Should report the error");
+    EXPECT_EQ(pciemu_irq_init_fake.call_count, 0, "Should stop there");
+    EXPECT_EQ(pciemu_trace_fini_fake.call_count, 1,
+              "Should undo the trace initialization");
+    RESET_FAKE(pciemu_stats_init);
+}
+
+TEST(pciemu_device_init_pcie, "Test initialization of the PCIe capability")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    uint8_t config[PCIE_CONFIG_SPACE_SIZE] = { 0 };
+    Error *e = NULL;
+    dev.pci_dev.config = config;
+    pciemu_device_init(&dev.pci_dev, &e);
+    EXPECT_EQ(pcie_endpoint_cap_init_fake.call_count, 0,
+              "Should not add the capability on a conventional PCI bus");
+
+    dev.pci_dev.cap_present = QEMU_PCI_CAP_EXPRESS;
+    pcie_endpoint_cap_init_fake.return_val = 0x40;
+    pciemu_device_init(&dev.pci_dev, &e);
+    EXPECT_EQ(pcie_endpoint_cap_init_fake.call_count, 1,
+              "Should add the capability on a PCIe bus");
+    EXPECT_EQ(pci_get_long(config + 0x40 + PCI_EXP_DEVCAP2) &
+                  (PCI_EXP_DEVCAP2_ATOMIC_COMP32 |
+                   PCI_EXP_DEVCAP2_ATOMIC_COMP64),
+              0, "Should not claim to complete AtomicOps");
+
+    RESET_FAKE(error_setg_internal);
+    pcie_endpoint_cap_init_fake.return_val = -1;
+    pciemu_device_init(&dev.pci_dev, &e);
+    EXPECT_EQ(error_setg_internal_fake.call_count, 1,
+              "Should fail if the capability cannot be added");
+    RESET_FAKE(pcie_endpoint_cap_init);
 }
 
 TEST(pciemu_device_fini, "Test finalization of PCIEMU device")
@@ -40,7 +99,17 @@ TEST(pciemu_device_fini, "Test finalization of PCIEMU device")
     pciemu_device_fini(&pci_dev);
     EXPECT_EQ(pciemu_irq_fini_fake.call_count, 1, "Should fini irq once");
     EXPECT_EQ(pciemu_dma_fini_fake.call_count, 1, "Should fini dma once");
+    EXPECT_EQ(pciemu_rx_fini_fake.call_count, 1, "Should fini rx once");
     EXPECT_EQ(pciemu_mmio_fini_fake.call_count, 1, "Should fini mmio once");
+    EXPECT_EQ(pciemu_trace_fini_fake.call_count, 1, "Should fini trace once");
+    EXPECT_EQ(pciemu_stats_fini_fake.call_count, 1, "Should fini stats once");
+    EXPECT_EQ(pcie_cap_exit_fake.call_count, 0,
+              "Should not remove a capability never added");
+
+    PCIEMUDevice dev = { .pci_dev = { .cap_present = QEMU_PCI_CAP_EXPRESS } };
+    pciemu_device_fini(&dev.pci_dev);
+    EXPECT_EQ(pcie_cap_exit_fake.call_count, 1,
+              "Should remove the PCIe capability");
 }
 
 TEST(pciemu_reset, "Test reset of PCIEMU device")
@@ -49,7 +118,12 @@ TEST(pciemu_reset, "Test reset of PCIEMU device")
     pciemu_reset(&dev);
     EXPECT_EQ(pciemu_irq_reset_fake.call_count, 1, "Should reset irq once");
     EXPECT_EQ(pciemu_dma_reset_fake.call_count, 1, "Should reset dma once");
+    EXPECT_EQ(pciemu_rx_reset_fake.call_count, 1, "Should reset rx once");
     EXPECT_EQ(pciemu_mmio_reset_fake.call_count, 1, "Should reset mmio once");
+    EXPECT_EQ(pciemu_trace_reset_fake.call_count, 1,
+              "Should record the reset once");
+    EXPECT_EQ(pciemu_stats_reset_fake.call_count, 1,
+              "Should reset stats once");
 }
 
 TEST_MAIN()
@@ -0,0 +1,331 @@
+/* pciemu_arbiter.c - Unit tests for hw/pciemu/arbiter.c file
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "unitctest/unitctest.h"
+#include "fff/fff.h"
+#include "qemu.fake.h"
+#include "pciemu_dma.fake.h"
+#include "pciemu_irq.fake.h"
+#include "pciemu_stats.fake.h"
+
+/* include the source file to test static functions */
+#include "../src/hw/pciemu/arbiter.c"
+
+DEFINE_FFF_GLOBALS;
+
+static uint8_t desc_window[PCIEMU_HW_DESC_WINDOW_SIZE];
+
+static hwaddr queue_reg(unsigned int q, hwaddr reg)
+{
+    return PCIEMU_HW_BAR0_DMA_QUEUE_START +
+           q * PCIEMU_HW_BAR0_DMA_QUEUE_STRIDE + reg;
+}
+
+static uint64_t queue_read(PCIEMUDevice *dev, unsigned int q, hwaddr reg)
+{
+    return pciemu_arbiter_read(dev, queue_reg(q, reg));
+}
+
+static void arbiter_test_setup(PCIEMUDevice *dev)
+{
+    memset(desc_window, 0, sizeof(desc_window));
+    dev->dma.desc = desc_window;
+    dev->dma.status = DMA_STATUS_IDLE;
+    pciemu_arbiter_init(dev);
+    RESET_FAKE(pciemu_dma_desc_execute);
+    RESET_FAKE(timer_mod_ns);
+    RESET_FAKE(timer_del);
+    RESET_FAKE(qemu_clock_get_ns);
+    RESET_FAKE(pciemu_stats_doorbell);
+}
+
+/* post cnt descriptors of len bytes to queue q */
+static void arbiter_test_post(PCIEMUDevice *dev, unsigned int q,
+                              unsigned int cnt, uint64_t len)
+{
+    DMAQueue *queue = &dev->dma.arbiter.queues[q];
+    for (unsigned int i = 0; i < cnt; ++i) {
+        unsigned int slot = q * PCIEMU_HW_DMA_QUEUE_SIZE +
+                            (queue->tail + i) % PCIEMU_HW_DMA_QUEUE_SIZE;
+        stq_le_p(desc_window + slot * PCIEMU_HW_DESC_SLOT_SIZE +
+                     PCIEMU_HW_DESC_LEN,
+                 len);
+    }
+    pciemu_arbiter_write(dev, queue_reg(q, PCIEMU_HW_DMA_QUEUE_TAIL),
+                         queue->tail + cnt);
+}
+
+static PCIEMUDevice *sync_dev;
+
+/* engine completing the command before the doorbell returns */
+static void pciemu_dma_desc_execute_sync(PCIEMUDevice *dev,
+                                         const uint8_t *desc)
+{
+    pciemu_arbiter_complete(sync_dev, PCIEMU_HW_DMA_ERR_NONE);
+}
+
+TEST(pciemu_arbiter_registers, "Test configuration of the queues")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    arbiter_test_setup(&dev);
+
+    EXPECT_EQ(queue_read(&dev, 1, PCIEMU_HW_DMA_QUEUE_WEIGHT),
+              1, "Should default to a weight of 1");
+
+    pciemu_arbiter_write(&dev, queue_reg(1, PCIEMU_HW_DMA_QUEUE_PRIO), 2);
+    EXPECT_EQ(queue_read(&dev, 1, PCIEMU_HW_DMA_QUEUE_PRIO),
+              2, "Should set the class");
+    pciemu_arbiter_write(&dev, queue_reg(1, PCIEMU_HW_DMA_QUEUE_PRIO),
+                         PCIEMU_HW_DMA_QUEUE_PRIO_CNT);
+    EXPECT_EQ(queue_read(&dev, 1, PCIEMU_HW_DMA_QUEUE_PRIO),
+              2, "Should ignore an invalid class");
+
+    pciemu_arbiter_write(&dev, queue_reg(1, PCIEMU_HW_DMA_QUEUE_WEIGHT), 0);
+    EXPECT_EQ(queue_read(&dev, 1, PCIEMU_HW_DMA_QUEUE_WEIGHT),
+              1, "Should clamp the weight to 1");
+    pciemu_arbiter_write(&dev, queue_reg(1, PCIEMU_HW_DMA_QUEUE_WEIGHT), 1000);
+    EXPECT_EQ(queue_read(&dev, 1, PCIEMU_HW_DMA_QUEUE_WEIGHT),
+              PCIEMU_HW_DMA_QUEUE_WEIGHT_MAX, "Should clamp the weight to max");
+
+    pciemu_arbiter_write(&dev, queue_reg(1, PCIEMU_HW_DMA_QUEUE_RATE), 1000);
+    pciemu_arbiter_write(&dev, queue_reg(1, PCIEMU_HW_DMA_QUEUE_BURST), 4096);
+    EXPECT_EQ(queue_read(&dev, 1, PCIEMU_HW_DMA_QUEUE_RATE),
+              1000, "Should set the rate");
+    EXPECT_EQ(queue_read(&dev, 1, PCIEMU_HW_DMA_QUEUE_BURST),
+              4096, "Should set the burst");
+    EXPECT_EQ(dev.dma.arbiter.queues[1].tokens, 4096,
+              "Should fill the token bucket");
+    EXPECT_EQ(dev.dma.arbiter.queues[0].rate, 0,
+              "Should not touch the other queues");
+}
+
+TEST(pciemu_arbiter_tail, "Test descriptors posted to a queue")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    arbiter_test_setup(&dev);
+
+    pciemu_arbiter_write(&dev, queue_reg(2, PCIEMU_HW_DMA_QUEUE_TAIL),
+                         PCIEMU_HW_DMA_QUEUE_SIZE + 1);
+    EXPECT_EQ(queue_read(&dev, 2, PCIEMU_HW_DMA_QUEUE_TAIL),
+              0, "Should reject a tail beyond the ring");
+    EXPECT_EQ(pciemu_dma_desc_execute_fake.call_count, 0,
+              "Should not execute anything");
+
+    dev.stats.doorbell_ns = 500;
+    arbiter_test_post(&dev, 2, 2, 64);
+    EXPECT_EQ(pciemu_dma_desc_execute_fake.call_count, 1,
+              "Should execute a single command at a time");
+    EXPECT_EQ(pciemu_stats_doorbell_fake.arg1_val, 500,
+              "Should stamp the command with the arrival of the tail");
+    EXPECT_EQ(queue_read(&dev, 2, PCIEMU_HW_DMA_QUEUE_HEAD),
+              1, "Should fetch the descriptor");
+    EXPECT_EQ(dev.dma.arbiter.active, 2, "Should remember the queue");
+
+    dev.dma.status = DMA_STATUS_EXECUTING;
+    pciemu_arbiter_complete(&dev, PCIEMU_HW_DMA_ERR_BOUNDS);
+    EXPECT_EQ(pciemu_dma_desc_execute_fake.call_count, 1,
+              "Should wait for the engine to be IDLE");
+    EXPECT_EQ(queue_read(&dev, 2, PCIEMU_HW_DMA_QUEUE_DONE_CNT),
+              1, "Should count the completion");
+    EXPECT_EQ(queue_read(&dev, 2, PCIEMU_HW_DMA_QUEUE_ERROR),
+              PCIEMU_HW_DMA_ERR_BOUNDS, "Should report the error");
+
+    dev.dma.status = DMA_STATUS_IDLE;
+    dev.stats.doorbell_ns = 900;
+    pciemu_arbiter_complete(&dev, PCIEMU_HW_DMA_ERR_NONE);
+    EXPECT_EQ(queue_read(&dev, 2, PCIEMU_HW_DMA_QUEUE_DONE_CNT),
+              1, "Should not count commands out of the queues");
+    EXPECT_EQ(pciemu_dma_desc_execute_fake.call_count, 2,
+              "Should execute the next command");
+    EXPECT_EQ(queue_read(&dev, 2, PCIEMU_HW_DMA_QUEUE_HEAD),
+              2, "Should fetch the next descriptor");
+    EXPECT_EQ(pciemu_stats_doorbell_fake.call_count, 2,
+              "Should stamp every command");
+    EXPECT_EQ(pciemu_stats_doorbell_fake.arg1_val, 500,
+              "Should count the time waiting in the queue");
+}
+
+TEST(pciemu_arbiter_queue_irq, "Test the QUEUE cause of a draining queue")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    arbiter_test_setup(&dev);
+    RESET_FAKE(pciemu_irq_event);
+    dev.irq.queue_threshold = 1;
+
+    arbiter_test_post(&dev, 1, 3, 64);
+    pciemu_arbiter_complete(&dev, PCIEMU_HW_DMA_ERR_NONE);
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 0,
+              "Should not signal while above the threshold");
+
+    pciemu_arbiter_complete(&dev, PCIEMU_HW_DMA_ERR_NONE);
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 1,
+              "Should signal once at the threshold");
+    EXPECT_EQ(pciemu_irq_event_fake.arg1_val, PCIEMU_HW_IRQ_CAUSE_QUEUE,
+              "Should signal the QUEUE cause");
+
+    pciemu_arbiter_complete(&dev, PCIEMU_HW_DMA_ERR_NONE);
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 2,
+              "Should signal again below the threshold");
+}
+
+TEST(pciemu_arbiter_prio, "Test strict priority between the classes")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAArbiter *arb = &dev.dma.arbiter;
+    arbiter_test_setup(&dev);
+
+    pciemu_arbiter_write(&dev, queue_reg(0, PCIEMU_HW_DMA_QUEUE_PRIO), 3);
+    arbiter_test_post(&dev, 0, 4, 4096);
+    EXPECT_EQ(arb->active, 0, "Should run the only queue with descriptors");
+    arbiter_test_post(&dev, 1, 2, 64);
+    EXPECT_EQ(arb->active, 0, "Should not preempt the command executing");
+
+    pciemu_arbiter_complete(&dev, PCIEMU_HW_DMA_ERR_NONE);
+    EXPECT_EQ(arb->active, 1, "Should run the higher class first");
+    pciemu_arbiter_complete(&dev, PCIEMU_HW_DMA_ERR_NONE);
+    EXPECT_EQ(arb->active, 1, "Should drain the higher class first");
+    pciemu_arbiter_complete(&dev, PCIEMU_HW_DMA_ERR_NONE);
+    EXPECT_EQ(arb->active, 0, "Should run the lower class once drained");
+}
+
+TEST(pciemu_arbiter_wrr, "Test weighted round-robin inside a class")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAArbiter *arb = &dev.dma.arbiter;
+    int expect[] = { 0, 0, 0, 1, 0, 0, 0, 1 };
+    arbiter_test_setup(&dev);
+
+    pciemu_arbiter_write(&dev, queue_reg(0, PCIEMU_HW_DMA_QUEUE_WEIGHT), 3);
+    arbiter_test_post(&dev, 0, 8, 64);
+    arbiter_test_post(&dev, 1, 8, 64);
+    for (size_t i = 0; i < ARRAY_SIZE(expect); ++i) {
+        EXPECT_EQ(arb->active, expect[i], "Should follow the weights");
+        pciemu_arbiter_complete(&dev, PCIEMU_HW_DMA_ERR_NONE);
+    }
+}
+
+TEST(pciemu_arbiter_rate, "Test rate limit of a queue")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAArbiter *arb = &dev.dma.arbiter;
+    arbiter_test_setup(&dev);
+
+    pciemu_arbiter_write(&dev, queue_reg(0, PCIEMU_HW_DMA_QUEUE_BURST), 4096);
+    pciemu_arbiter_write(&dev, queue_reg(0, PCIEMU_HW_DMA_QUEUE_RATE), 1000);
+    arbiter_test_post(&dev, 0, 3, 4096);
+    EXPECT_EQ(arb->queues[0].tokens, 0, "Should take the length out");
+    pciemu_arbiter_complete(&dev, PCIEMU_HW_DMA_ERR_NONE);
+    EXPECT_EQ(pciemu_dma_desc_execute_fake.call_count, 2,
+              "Should run while the bucket is not in debt");
+    pciemu_arbiter_complete(&dev, PCIEMU_HW_DMA_ERR_NONE);
+    EXPECT_EQ(pciemu_dma_desc_execute_fake.call_count, 2,
+              "Should hold the queue while in debt");
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 1, "Should arm the timer");
+    EXPECT_EQ(timer_mod_ns_fake.arg1_val, 4096000001LL,
+              "Should wake up once the debt is paid");
+
+    /* an unlimited queue is not held back by the throttled one */
+    arbiter_test_post(&dev, 1, 1, 1 << 20);
+    EXPECT_EQ(arb->active, 1, "Should run the unlimited queue");
+    pciemu_arbiter_complete(&dev, PCIEMU_HW_DMA_ERR_NONE);
+
+    qemu_clock_get_ns_fake.return_val = 4096000001LL;
+    pciemu_arbiter_timer_cb(&dev);
+    EXPECT_EQ(pciemu_dma_desc_execute_fake.call_count, 4,
+              "Should run the queue again");
+    EXPECT_EQ(arb->active, 0, "Should run the throttled queue");
+}
+
+TEST(pciemu_arbiter_rate_2d, "Test rate limit of 2D transfers")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAArbiter *arb = &dev.dma.arbiter;
+    uint8_t *desc = desc_window + 2 * PCIEMU_HW_DMA_QUEUE_SIZE *
+                                      PCIEMU_HW_DESC_SLOT_SIZE;
+    arbiter_test_setup(&dev);
+
+    pciemu_arbiter_write(&dev, queue_reg(2, PCIEMU_HW_DMA_QUEUE_BURST), 4096);
+    pciemu_arbiter_write(&dev, queue_reg(2, PCIEMU_HW_DMA_QUEUE_RATE), 1000);
+    stq_le_p(desc + PCIEMU_HW_DESC_CMD,
+             PCIEMU_HW_DMA_DIRECTION_TO_DEVICE | PCIEMU_HW_DMA_CMD_FLAG_2D);
+    stl_le_p(desc + PCIEMU_HW_DESC_2D_ROWS, 4);
+    arbiter_test_post(&dev, 2, 1, 1024);
+    EXPECT_EQ(arb->queues[2].tokens, 0, "Should take every row out");
+}
+
+TEST(pciemu_arbiter_rate_multi, "Test rate limit of multi-buffer commands")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAArbiter *arb = &dev.dma.arbiter;
+    uint8_t *desc = desc_window + PCIEMU_HW_DMA_QUEUE_SIZE *
+                                      PCIEMU_HW_DESC_SLOT_SIZE;
+    arbiter_test_setup(&dev);
+
+    pciemu_arbiter_write(&dev, queue_reg(1, PCIEMU_HW_DMA_QUEUE_BURST), 4096);
+    pciemu_arbiter_write(&dev, queue_reg(1, PCIEMU_HW_DMA_QUEUE_RATE), 1000);
+    stq_le_p(desc + PCIEMU_HW_DESC_CMD, PCIEMU_HW_DMA_CMD_MULTICAST);
+    stl_le_p(desc + PCIEMU_HW_DESC_MCAST_CNT, 8);
+    arbiter_test_post(&dev, 1, 1, 512);
+    EXPECT_EQ(arb->queues[1].tokens, 0, "Should take every copy out");
+
+    stq_le_p(desc + PCIEMU_HW_DESC_SLOT_SIZE + PCIEMU_HW_DESC_CMD,
+             PCIEMU_HW_DMA_CMD_PQ);
+    stl_le_p(desc + PCIEMU_HW_DESC_SLOT_SIZE + PCIEMU_HW_DESC_RAID_SRC_CNT, 4);
+    pciemu_arbiter_complete(&dev, PCIEMU_HW_DMA_ERR_NONE);
+    arb->queues[1].tokens = 4096;
+    arbiter_test_post(&dev, 1, 1, 1024);
+    EXPECT_EQ(arb->queues[1].tokens, 0, "Should take every source out");
+}
+
+TEST(pciemu_arbiter_kick, "Test commands completing synchronously")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    arbiter_test_setup(&dev);
+    sync_dev = &dev;
+    pciemu_dma_desc_execute_fake.custom_fake = pciemu_dma_desc_execute_sync;
+
+    arbiter_test_post(&dev, 3, PCIEMU_HW_DMA_QUEUE_SIZE, 64);
+    EXPECT_EQ(pciemu_dma_desc_execute_fake.call_count,
+              PCIEMU_HW_DMA_QUEUE_SIZE, "Should run the whole ring");
+    EXPECT_EQ(queue_read(&dev, 3, PCIEMU_HW_DMA_QUEUE_DONE_CNT),
+              PCIEMU_HW_DMA_QUEUE_SIZE, "Should complete every command");
+    EXPECT_FALSE(dev.dma.arbiter.kicking, "Should be done kicking");
+    RESET_FAKE(pciemu_dma_desc_execute);
+}
+
+TEST(pciemu_arbiter_reset, "Test reset of the arbiter")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAArbiter *arb = &dev.dma.arbiter;
+    arbiter_test_setup(&dev);
+
+    pciemu_arbiter_write(&dev, queue_reg(1, PCIEMU_HW_DMA_QUEUE_PRIO), 1);
+    pciemu_arbiter_write(&dev, queue_reg(1, PCIEMU_HW_DMA_QUEUE_RATE), 1000);
+    arbiter_test_post(&dev, 1, 4, 64);
+    pciemu_arbiter_reset(&dev);
+    EXPECT_EQ(timer_del_fake.call_count, 1, "Should stop the timer");
+    EXPECT_EQ(arb->active, -1, "Should forget the command executing");
+    EXPECT_EQ(arb->queues[1].prio, 0, "Should restore the class");
+    EXPECT_EQ(arb->queues[1].rate, 0, "Should remove the rate limit");
+    EXPECT_EQ(arb->queues[1].tail, 0, "Should drop the descriptors posted");
+}
+
+TEST(pciemu_arbiter_init, "Test initialization of the arbiter")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    RESET_FAKE(timer_init_full);
+    pciemu_arbiter_init(&dev);
+    EXPECT_EQ(timer_init_full_fake.call_count, 1, "Should init the timer");
+    EXPECT_EQ(dev.dma.arbiter.active, -1, "Should be idle");
+    for (unsigned int q = 0; q < PCIEMU_HW_DMA_QUEUE_CNT; ++q) {
+        EXPECT_EQ(dev.dma.arbiter.queues[q].weight, 1,
+                  "Should default to a weight of 1");
+    }
+}
+
+TEST_MAIN()
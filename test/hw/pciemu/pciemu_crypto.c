@@ -0,0 +1,227 @@
+/* pciemu_crypto.c - Unit tests for hw/pciemu/crypto.c file
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "unitctest/unitctest.h"
+#include "fff/fff.h"
+#include "qemu.fake.h"
+
+/* include the source file to test static functions */
+#include "../src/hw/pciemu/crypto.c"
+
+DEFINE_FFF_GLOBALS;
+
+static QCryptoCipher cipher;
+
+static void crypto_test_load(PCIEMUDevice *dev, uint32_t slot,
+                             const uint8_t *key, uint32_t size)
+{
+    pciemu_crypto_write(dev, PCIEMU_HW_BAR0_CRYPTO_KEY_SLOT, slot, 8);
+    for (uint32_t i = 0; i < size; i += 8)
+        pciemu_crypto_write(dev, PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_START + i,
+                            ldq_le_p(key + i), 8);
+    pciemu_crypto_write(dev, PCIEMU_HW_BAR0_CRYPTO_KEY_CTRL, size, 8);
+}
+
+TEST(pciemu_crypto_key_window, "Test access to the key slot window")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    uint8_t key[PCIEMU_HW_CRYPTO_KEY_XTS_128];
+    for (unsigned int i = 0; i < sizeof(key); ++i)
+        key[i] = i;
+    pciemu_crypto_init(&dev);
+
+    pciemu_crypto_write(&dev, PCIEMU_HW_BAR0_CRYPTO_KEY_SLOT, 5, 8);
+    EXPECT_EQ(pciemu_crypto_read(&dev, PCIEMU_HW_BAR0_CRYPTO_KEY_SLOT), 5,
+              "Should select the slot");
+    pciemu_crypto_write(&dev, PCIEMU_HW_BAR0_CRYPTO_KEY_SLOT,
+                        PCIEMU_HW_CRYPTO_KEY_SLOT_CNT, 8);
+    EXPECT_EQ(pciemu_crypto_read(&dev, PCIEMU_HW_BAR0_CRYPTO_KEY_SLOT), 5,
+              "Should ignore a slot out of range");
+
+    pciemu_crypto_write(&dev, PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_START + 8,
+                        0x0706050403020100, 8);
+    EXPECT_EQ(ldq_le_p(dev.dma.crypto.key + 8), 0x0706050403020100,
+              "Should stage the key");
+    pciemu_crypto_write(&dev, PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_START + 8,
+                        0xffffffff0b0a0908, 4);
+    EXPECT_EQ(ldq_le_p(dev.dma.crypto.key + 8), 0x070605040b0a0908,
+              "Should only stage the bytes of a 4-byte write");
+    pciemu_crypto_write(&dev, PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_END, 0x0f0e0d0c,
+                        4);
+    EXPECT_EQ(ldl_le_p(dev.dma.crypto.key + PCIEMU_HW_CRYPTO_KEY_DATA_SIZE - 4),
+              0x0f0e0d0c, "Should stage the last word of the key");
+    pciemu_crypto_write(&dev, PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_END, ~0ULL, 8);
+    EXPECT_EQ(ldl_le_p(dev.dma.crypto.key + PCIEMU_HW_CRYPTO_KEY_DATA_SIZE - 4),
+              0x0f0e0d0c, "Should ignore a write beyond the key");
+    EXPECT_EQ(pciemu_crypto_read(&dev, PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_START),
+              0, "Should not read the key back");
+    pciemu_crypto_write(&dev, PCIEMU_HW_BAR0_CRYPTO_KEY_CTRL, 48, 8);
+    EXPECT_EQ(ldq_le_p(dev.dma.crypto.key + 8), 0,
+              "Should wipe the staged key");
+    EXPECT_FALSE(pciemu_crypto_key_loaded(&dev, 5),
+                 "Should not load a key of an invalid size");
+
+    crypto_test_load(&dev, 5, key, sizeof(key));
+    EXPECT_TRUE(pciemu_crypto_key_loaded(&dev, 5), "Should load the key");
+    EXPECT_FALSE(pciemu_crypto_key_loaded(&dev, 4),
+                 "Should not load the other slots");
+    EXPECT_FALSE(pciemu_crypto_key_loaded(&dev, PCIEMU_HW_CRYPTO_KEY_SLOT_CNT),
+                 "Should not report a slot out of range as loaded");
+    EXPECT_EQ(pciemu_crypto_read(&dev, PCIEMU_HW_BAR0_CRYPTO_KEY_CTRL),
+              PCIEMU_HW_CRYPTO_KEY_XTS_128, "Should read the size of the key");
+    EXPECT_EQ(ldq_le_p(dev.dma.crypto.key), 0, "Should wipe the staged key");
+
+    pciemu_crypto_write(&dev, PCIEMU_HW_BAR0_CRYPTO_KEY_CTRL,
+                        PCIEMU_HW_CRYPTO_KEY_CLEAR, 8);
+    EXPECT_FALSE(pciemu_crypto_key_loaded(&dev, 5), "Should clear the slot");
+    EXPECT_EQ(pciemu_crypto_read(&dev, PCIEMU_HW_BAR0_CRYPTO_KEY_CTRL),
+              PCIEMU_HW_CRYPTO_KEY_CLEAR, "Should read an empty slot");
+}
+
+TEST(pciemu_crypto_qcrypto, "Test encryption with the QEMU crypto API")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    uint8_t key[PCIEMU_HW_CRYPTO_KEY_XTS_256] = { 0 };
+    uint8_t buf[3 * PCIEMU_HW_CRYPTO_SECTOR_SIZE_MIN];
+    pciemu_crypto_init(&dev);
+    pciemu_crypto_load = pciemu_crypto_load_qcrypto;
+    pciemu_crypto_xts_sectors = pciemu_crypto_xts_qcrypto;
+    RESET_FAKE(qcrypto_cipher_new);
+    RESET_FAKE(qcrypto_cipher_free);
+    RESET_FAKE(qcrypto_cipher_setiv);
+    RESET_FAKE(qcrypto_cipher_encrypt);
+    RESET_FAKE(qcrypto_cipher_decrypt);
+
+    crypto_test_load(&dev, 2, key, sizeof(key));
+    EXPECT_FALSE(pciemu_crypto_key_loaded(&dev, 2),
+                 "Should not load a key refused by the crypto library");
+
+    qcrypto_cipher_new_fake.return_val = &cipher;
+    crypto_test_load(&dev, 2, key, sizeof(key));
+    EXPECT_TRUE(pciemu_crypto_key_loaded(&dev, 2), "Should load the key");
+    EXPECT_EQ(qcrypto_cipher_new_fake.arg0_val, QCRYPTO_CIPHER_ALG_AES_256,
+              "Should use AES-256 for a 512-bit key");
+    EXPECT_EQ(qcrypto_cipher_new_fake.arg1_val, QCRYPTO_CIPHER_MODE_XTS,
+              "Should use the XTS mode");
+    EXPECT_EQ(qcrypto_cipher_new_fake.arg3_val, sizeof(key),
+              "Should pass both keys");
+
+    EXPECT_EQ(pciemu_crypto_xts(&dev, 2, 7, PCIEMU_HW_CRYPTO_SECTOR_SIZE_MIN,
+                                buf, sizeof(buf), true),
+              0, "Should succeed");
+    EXPECT_EQ(qcrypto_cipher_setiv_fake.call_count, 3,
+              "Should set the tweak of every sector");
+    EXPECT_EQ(qcrypto_cipher_encrypt_fake.call_count, 3,
+              "Should encrypt every sector");
+    EXPECT_EQ(qcrypto_cipher_encrypt_fake.arg1_val,
+              buf + 2 * PCIEMU_HW_CRYPTO_SECTOR_SIZE_MIN,
+              "Should encrypt the last sector in place");
+    EXPECT_EQ(qcrypto_cipher_encrypt_fake.arg3_val,
+              PCIEMU_HW_CRYPTO_SECTOR_SIZE_MIN, "Should encrypt a sector");
+
+    pciemu_crypto_xts(&dev, 2, 7, PCIEMU_HW_CRYPTO_SECTOR_SIZE_MIN, buf,
+                      sizeof(buf), false);
+    EXPECT_EQ(qcrypto_cipher_decrypt_fake.call_count, 3,
+              "Should decrypt every sector");
+
+    qcrypto_cipher_decrypt_fake.return_val = -1;
+    EXPECT_EQ(pciemu_crypto_xts(&dev, 2, 7, PCIEMU_HW_CRYPTO_SECTOR_SIZE_MIN,
+                                buf, sizeof(buf), false),
+              -1, "Should fail : crypto library error");
+
+    RESET_FAKE(qcrypto_cipher_free);
+    pciemu_crypto_reset(&dev);
+    EXPECT_EQ(qcrypto_cipher_free_fake.arg0_history[2], &cipher,
+              "Should free the cipher of the slot");
+    EXPECT_FALSE(pciemu_crypto_key_loaded(&dev, 2), "Should clear the slot");
+    EXPECT_EQ(dev.dma.crypto.slots[2].cipher, NULL, "Should drop the cipher");
+    RESET_FAKE(qcrypto_cipher_new);
+    RESET_FAKE(qcrypto_cipher_decrypt);
+    pciemu_crypto_select_kernels();
+}
+
+#ifdef CONFIG_AVX2_OPT
+TEST(pciemu_crypto_aesni, "Test encryption with the AES instructions")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    /* IEEE 1619 vectors 1 (zero keys) and 2 */
+    uint8_t key[PCIEMU_HW_CRYPTO_KEY_XTS_256] = { 0 };
+    uint8_t buf[PCIEMU_HW_CRYPTO_SECTOR_SIZE_MAX];
+    const uint8_t vec1[32] = {
+        0x91, 0x7c, 0xf6, 0x9e, 0xbd, 0x68, 0xb2, 0xec, 0x9b, 0x9f, 0xe9,
+        0xa3, 0xea, 0xdd, 0xa6, 0x92, 0xcd, 0x43, 0xd2, 0xf5, 0x95, 0x98,
+        0xed, 0x85, 0x8c, 0x02, 0xc2, 0x65, 0x2f, 0xbf, 0x92, 0x2e
+    };
+    const uint8_t vec2[32] = {
+        0xc4, 0x54, 0x18, 0x5e, 0x6a, 0x16, 0x93, 0x6e, 0x39, 0x33, 0x40,
+        0x38, 0xac, 0xef, 0x83, 0x8b, 0xfb, 0x18, 0x6f, 0xff, 0x74, 0x80,
+        0xad, 0xc4, 0x28, 0x93, 0x82, 0xec, 0xd6, 0xd3, 0x94, 0xf0
+    };
+    if (!__builtin_cpu_supports("aes"))
+        return;
+    pciemu_crypto_init(&dev);
+
+    crypto_test_load(&dev, 0, key, PCIEMU_HW_CRYPTO_KEY_XTS_128);
+    memset(buf, 0, sizeof(vec1));
+    pciemu_crypto_xts(&dev, 0, 0, sizeof(vec1), buf, sizeof(vec1), true);
+    EXPECT_EQ(memcmp(buf, vec1, sizeof(vec1)), 0,
+              "Should match the IEEE 1619 vector 1");
+
+    memset(key, 0x11, 16);
+    memset(key + 16, 0x22, 16);
+    crypto_test_load(&dev, 1, key, PCIEMU_HW_CRYPTO_KEY_XTS_128);
+    memset(buf, 0x44, sizeof(vec2));
+    pciemu_crypto_xts(&dev, 1, 0x3333333333, sizeof(vec2), buf, sizeof(vec2),
+                      true);
+    EXPECT_EQ(memcmp(buf, vec2, sizeof(vec2)), 0,
+              "Should match the IEEE 1619 vector 2");
+    pciemu_crypto_xts(&dev, 1, 0x3333333333, sizeof(vec2), buf, sizeof(vec2),
+                      false);
+    EXPECT_EQ(buf[0], 0x44, "Should decrypt the IEEE 1619 vector 2");
+    EXPECT_EQ(buf[sizeof(vec2) - 1], 0x44,
+              "Should decrypt the IEEE 1619 vector 2");
+
+    for (unsigned int i = 0; i < sizeof(key); ++i)
+        key[i] = i * 7;
+    crypto_test_load(&dev, 2, key, PCIEMU_HW_CRYPTO_KEY_XTS_256);
+    for (unsigned int i = 0; i < sizeof(buf); ++i)
+        buf[i] = i;
+    pciemu_crypto_xts(&dev, 2, 42, PCIEMU_HW_CRYPTO_SECTOR_SIZE_MIN, buf,
+                      sizeof(buf), true);
+    EXPECT_NEQ(buf[sizeof(buf) - 1], (uint8_t)(sizeof(buf) - 1),
+               "Should encrypt the last sector");
+    EXPECT_NEQ(memcmp(buf, buf + PCIEMU_HW_CRYPTO_SECTOR_SIZE_MIN,
+                      PCIEMU_CRYPTO_BLOCK_SIZE),
+               0, "Should use a different tweak for every sector");
+    pciemu_crypto_xts(&dev, 2, 42, PCIEMU_HW_CRYPTO_SECTOR_SIZE_MIN, buf,
+                      sizeof(buf), false);
+    bool same = true;
+    for (unsigned int i = 0; i < sizeof(buf); ++i)
+        same &= buf[i] == (uint8_t)i;
+    EXPECT_TRUE(same, "Should decrypt back to the plaintext");
+}
+#endif /* CONFIG_AVX2_OPT */
+
+TEST(pciemu_crypto_reset, "Test reset of the key slots")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    uint8_t key[PCIEMU_HW_CRYPTO_KEY_XTS_256] = { 1 };
+    pciemu_crypto_init(&dev);
+    qcrypto_cipher_new_fake.return_val = &cipher;
+    crypto_test_load(&dev, 3, key, sizeof(key));
+    pciemu_crypto_write(&dev, PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_START, 0xff, 8);
+    pciemu_crypto_reset(&dev);
+    EXPECT_FALSE(pciemu_crypto_key_loaded(&dev, 3), "Should clear the slots");
+    EXPECT_EQ(dev.dma.crypto.slot, 0, "Should select the first slot");
+    EXPECT_EQ(dev.dma.crypto.key[0], 0, "Should wipe the staged key");
+    EXPECT_EQ(dev.dma.crypto.slots[3].rounds, 0,
+              "Should wipe the round keys");
+    RESET_FAKE(qcrypto_cipher_new);
+}
+
+TEST_MAIN()
@@ -9,8 +9,17 @@
 #include "unitctest/unitctest.h"
 #include "fff/fff.h"
 #include "qemu.fake.h"
+#include "pciemu_arbiter.fake.h"
+#include "pciemu_crypto.fake.h"
+#include "pciemu_hostnuma.fake.h"
 #include "pciemu_irq.fake.h"
+#include "pciemu_latency.fake.h"
+#include "pciemu_mapcache.fake.h"
 #include "pciemu_mmio.fake.h"
+#include "pciemu_pipeline.fake.h"
+#include "pciemu_sort.fake.h"
+#include "pciemu_stats.fake.h"
+#include "pciemu_trace.fake.h"
 
 /* include the source file to test static functions */
 #include "../src/hw/pciemu/dma.c"
@@ -33,26 +42,53 @@ TEST(pciemu_dma_addr_mask, "Test masking of DMA address")
 
 TEST(pciemu_dma_inside_device_boundaries, "Test DMA area boundaries")
 {
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    dev.dma.buff_size = PCIEMU_HW_DMA_AREA_SIZE;
     dma_addr_t addr = PCIEMU_HW_DMA_AREA_START;
-    EXPECT_TRUE(pciemu_dma_inside_device_boundaries(addr), "Inside area");
+    EXPECT_TRUE(pciemu_dma_inside_device_boundaries(&dev, addr), "Inside area");
 
     addr = PCIEMU_HW_DMA_AREA_START + PCIEMU_HW_DMA_AREA_SIZE;
-    EXPECT_TRUE(pciemu_dma_inside_device_boundaries(addr), "Inside area");
+    EXPECT_TRUE(pciemu_dma_inside_device_boundaries(&dev, addr), "Inside area");
 
     addr = PCIEMU_HW_DMA_AREA_START + PCIEMU_HW_DMA_AREA_SIZE + 1;
-    EXPECT_FALSE(pciemu_dma_inside_device_boundaries(addr), "Outside area");
+    EXPECT_FALSE(pciemu_dma_inside_device_boundaries(&dev, addr),
+                 "Outside area");
+
+    dev.dma.buff_size = 4 * PCIEMU_HW_DMA_AREA_SIZE;
+    EXPECT_TRUE(pciemu_dma_inside_device_boundaries(&dev, addr),
+                "Inside a bigger area (memdev)");
+}
+
+TEST(pciemu_dma_inside_device_length, "Test DMA area boundaries with length")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    dev.dma.buff_size = PCIEMU_HW_DMA_AREA_SIZE;
+    EXPECT_TRUE(pciemu_dma_inside_device_length(&dev, 0,
+                                                PCIEMU_HW_DMA_AREA_SIZE),
+                "Whole area");
+    EXPECT_TRUE(pciemu_dma_inside_device_length(&dev, PCIEMU_HW_DMA_AREA_SIZE,
+                                                0),
+                "Empty transfer at the end of the area");
+    EXPECT_FALSE(pciemu_dma_inside_device_length(&dev, 16,
+                                                 PCIEMU_HW_DMA_AREA_SIZE - 15),
+                 "Crossing the end of the area");
+    EXPECT_FALSE(pciemu_dma_inside_device_length(&dev, 16, ~0ULL),
+                 "Should not overflow");
 }
 
 TEST(pciemu_dma_execute, "Test execution of DMA")
 {
     PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
     dev.dma.config.mask = DMA_BIT_MASK(PCIEMU_HW_DMA_ADDR_CAPABILITY);
+    dev.dma.buff = dev.dma.buff_inline;
+    dev.dma.buff_size = PCIEMU_HW_DMA_AREA_SIZE;
 
     dev.dma.config.cmd = PCIEMU_HW_DMA_DIRECTION_TO_DEVICE;
     dma_addr_t src = 0xbeefbeef;
     dev.dma.config.txdesc.src = src;
     dev.dma.config.txdesc.dst = PCIEMU_HW_DMA_AREA_START;
-    pciemu_dma_execute(&dev);
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
     EXPECT_EQ(address_space_rw_fake.call_count, 1,
               "Should call pci_dma_read once");
     EXPECT_EQ(address_space_rw_fake.arg5_val, false,
@@ -61,17 +97,17 @@ TEST(pciemu_dma_execute, "Test execution of DMA")
               "Should perform pci_dma_read from address in txdesc.src");
     EXPECT_EQ(address_space_rw_fake.arg3_val, &dev.dma.buff[0],
               "Should perform pci_dma_read to start of dedicated area");
-    EXPECT_EQ(pciemu_irq_raise_fake.call_count, 1, "Should raise irq once");
-    EXPECT_EQ(pciemu_irq_raise_fake.arg1_val, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR,
-              "Should raise the correct irq");
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 0,
+              "Should leave the irq to the completion");
 
-    RESET_FAKE(pciemu_irq_raise);
+    RESET_FAKE(pciemu_irq_event);
     RESET_FAKE(address_space_rw);
     dev.dma.config.cmd = PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE;
     dma_addr_t dst = 0xaaaabbbb;
     dev.dma.config.txdesc.dst = dst;
     dev.dma.config.txdesc.src = PCIEMU_HW_DMA_AREA_START;
-    pciemu_dma_execute(&dev);
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
     EXPECT_EQ(address_space_rw_fake.call_count, 1,
               "Should call pci_dma_write once");
     EXPECT_EQ(address_space_rw_fake.arg1_val, dst,
@@ -80,41 +116,1268 @@ TEST(pciemu_dma_execute, "Test execution of DMA")
               "Should perform pci_dma_read from start of dedicated area");
     EXPECT_EQ(address_space_rw_fake.arg5_val, true,
               "Should perform pci_dma_write");
-    EXPECT_EQ(pciemu_irq_raise_fake.call_count, 1, "Should raise irq once");
-    EXPECT_EQ(pciemu_irq_raise_fake.arg1_val, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR,
-              "Should raise the correct irq");
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 0,
+              "Should leave the irq to the completion");
 
-    RESET_FAKE(pciemu_irq_raise);
+    RESET_FAKE(pciemu_irq_event);
     RESET_FAKE(address_space_rw);
     dev.dma.config.cmd = 0;
-    pciemu_dma_execute(&dev);
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_CMD,
+              "Should fail : wrong cmd");
     EXPECT_EQ(address_space_rw_fake.call_count, 0,
               "Should NOT perform pci_dma_write : wrong cmd");
-    EXPECT_EQ(pciemu_irq_raise_fake.call_count, 0, "Should NOT raise irq");
+
+    dev.dma.config.cmd = PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE |
+                         PCIEMU_HW_DMA_CMD_FLAG_NO_IRQ;
+    dev.dma.config.txdesc.src = PCIEMU_HW_DMA_AREA_START +
+                                PCIEMU_HW_DMA_AREA_SIZE + 1;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BOUNDS,
+              "Should fail : out of bounds");
+    EXPECT_EQ(address_space_rw_fake.call_count, 0,
+              "Should NOT perform pci_dma_write : out of bounds");
+
+    dev.dma.config.txdesc.src = PCIEMU_HW_DMA_AREA_START + 16;
+    dev.dma.config.txdesc.len = PCIEMU_HW_DMA_AREA_SIZE;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BOUNDS,
+              "Should fail : len out of bounds");
+    EXPECT_EQ(address_space_rw_fake.call_count, 0,
+              "Should NOT perform pci_dma_write : len out of bounds");
+    dev.dma.config.txdesc.len = 0;
+
+    dev.dma.config.txdesc.src = PCIEMU_HW_DMA_AREA_START;
+    address_space_rw_fake.return_val = MEMTX_DECODE_ERROR;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BUS,
+              "Should fail : bus error (flags ignored)");
+    RESET_FAKE(address_space_rw);
+}
+
+TEST(pciemu_dma_pattern_word, "Test generation of pattern words")
+{
+    EXPECT_EQ(pciemu_dma_pattern_word(PCIEMU_HW_DMA_PATTERN_COUNTER, 10, 5),
+              15, "Counter word should be seed + i");
+    EXPECT_EQ(pciemu_dma_pattern_word(PCIEMU_HW_DMA_PATTERN_HASH, 10, 5),
+              pciemu_dma_pattern_word(PCIEMU_HW_DMA_PATTERN_HASH, 10, 5),
+              "Hash word should only depend on seed and index");
+    EXPECT_NEQ(pciemu_dma_pattern_word(PCIEMU_HW_DMA_PATTERN_HASH, 10, 5),
+               pciemu_dma_pattern_word(PCIEMU_HW_DMA_PATTERN_HASH, 11, 5),
+               "Hash word should depend on the seed");
+    EXPECT_EQ(pciemu_dma_pattern_word(PCIEMU_HW_DMA_PATTERN_HASH, 10,
+                                      (1ULL << 32) + 5),
+              pciemu_dma_pattern_word(PCIEMU_HW_DMA_PATTERN_HASH, 10, 5),
+              "Pattern should repeat every 2^32 words");
+}
+
+TEST(pciemu_dma_pattern_kernels, "Test pattern fill and verify kernels")
+{
+    uint32_t buf[37];
+    size_t first = 0;
+    pciemu_dma_pattern_select_kernels();
+    for (dma_pattern_t t = PCIEMU_HW_DMA_PATTERN_COUNTER;
+         t <= PCIEMU_HW_DMA_PATTERN_HASH; ++t) {
+        pciemu_dma_pattern_fill(buf, 37, t, 0xabcd, 3);
+        EXPECT_EQ(le32_to_cpu(buf[36]), pciemu_dma_pattern_word(t, 0xabcd, 39),
+                  "Should fill the whole buffer");
+        EXPECT_EQ(pciemu_dma_pattern_verify(buf, 37, t, 0xabcd, 3, &first), 0,
+                  "Should not find any mismatch");
+
+        ((uint8_t *)buf)[4 * 20 + 1] ^= 0x10;
+        ((uint8_t *)buf)[4 * 33] ^= 0x01;
+        EXPECT_EQ(pciemu_dma_pattern_verify(buf, 37, t, 0xabcd, 3, &first), 2,
+                  "Should count mismatching words");
+        EXPECT_EQ(first, 4 * 20 + 1, "Should report first mismatching byte");
+        EXPECT_EQ(pciemu_dma_pattern_verify_scalar(buf, 37, t, 0xabcd, 3,
+                                                   &first),
+                  2, "Scalar and vectorized kernels should agree");
+    }
+}
+
+TEST(pciemu_dma_execute_pattern, "Test execution of pattern commands")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    dev.dma.config.mask = DMA_BIT_MASK(PCIEMU_HW_DMA_ADDR_CAPABILITY);
+    RESET_FAKE(address_space_rw);
+
+    dev.dma.config.cmd = PCIEMU_HW_DMA_CMD_PATTERN_FILL;
+    dev.dma.config.pattern = PCIEMU_HW_DMA_PATTERN_HASH;
+    dev.dma.config.txdesc.dst = 0xaaaa0000;
+    dev.dma.config.txdesc.len = 2 * PCIEMU_DMA_BOUNCE_SIZE + 6;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
+    EXPECT_EQ(address_space_rw_fake.call_count, 3,
+              "Should write the pattern chunk by chunk");
+    EXPECT_EQ(address_space_rw_fake.arg1_val,
+              0xaaaa0000 + 2 * PCIEMU_DMA_BOUNCE_SIZE,
+              "Should write the last chunk at the right offset");
+    EXPECT_EQ(address_space_rw_fake.arg4_val, 6,
+              "Should write only the remaining bytes");
+    EXPECT_EQ(address_space_rw_fake.arg5_val, true,
+              "Should perform pci_dma_write");
+
+    /* the fake does not touch the bounce buffer : it still holds the last
+     * chunk of the pattern, which is not what the first chunk expects */
+    RESET_FAKE(address_space_rw);
+    dev.dma.config.cmd = PCIEMU_HW_DMA_CMD_PATTERN_VERIFY;
+    dev.dma.config.txdesc.src = 0xbbbb0000;
+    dev.dma.config.txdesc.len = 16;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
+    EXPECT_EQ(address_space_rw_fake.call_count, 1, "Should read once");
+    EXPECT_EQ(address_space_rw_fake.arg5_val, false,
+              "Should perform pci_dma_read");
+    EXPECT_EQ(dev.dma.pattern.err_cnt, 4, "Should count mismatching words");
+    EXPECT_NEQ(dev.dma.pattern.err_ofs, PCIEMU_HW_DMA_PATTERN_ERR_OFS_NONE,
+               "Should report the first mismatch");
+
+    pciemu_dma_pattern_fill_scalar(dev.dma.bounce, 4, dev.dma.config.pattern,
+                                   dev.dma.config.seed, 0);
+    pciemu_dma_execute(&dev);
+    EXPECT_EQ(dev.dma.pattern.err_cnt, 0, "Should not find any mismatch");
+    EXPECT_EQ(dev.dma.pattern.err_ofs, PCIEMU_HW_DMA_PATTERN_ERR_OFS_NONE,
+              "Should not report any mismatch");
+
+    address_space_rw_fake.return_val = MEMTX_DECODE_ERROR;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BUS,
+              "Should fail : bus error");
+    RESET_FAKE(address_space_rw);
+
+    dev.dma.config.pattern = PCIEMU_HW_DMA_PATTERN_HASH + 1;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_PATTERN,
+              "Should fail : unknown pattern");
+    dev.dma.config.cmd = PCIEMU_HW_DMA_CMD_PATTERN_FILL;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_PATTERN,
+              "Should fail : unknown pattern");
+    EXPECT_EQ(address_space_rw_fake.call_count, 0,
+              "Should not transfer anything");
+}
+
+TEST(pciemu_dma_execute_sync_len, "Test length of the commands run at once")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAConfig *config = &dev.dma.config;
+    config->mask = DMA_BIT_MASK(PCIEMU_HW_DMA_ADDR_CAPABILITY);
+    config->pattern = PCIEMU_HW_DMA_PATTERN_COUNTER;
+    RESET_FAKE(address_space_rw);
+
+    config->cmd = PCIEMU_HW_DMA_CMD_PATTERN_FILL;
+    config->txdesc.len = PCIEMU_HW_DMA_SYNC_LEN_MAX;
+    EXPECT_EQ(pciemu_dma_sync_len(&dev, config->cmd),
+              PCIEMU_HW_DMA_SYNC_LEN_MAX, "Should count the length");
+    config->txdesc.len = PCIEMU_HW_DMA_SYNC_LEN_MAX + 1;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BOUNDS,
+              "Should fail : too long");
+    config->txdesc.len = ~0ULL;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BOUNDS,
+              "Should fail : too long");
+
+    config->cmd = PCIEMU_HW_DMA_CMD_MULTICAST;
+    config->txdesc.len = PCIEMU_HW_DMA_SYNC_LEN_MAX / 4;
+    config->mcast_cnt = 4;
+    EXPECT_EQ(pciemu_dma_sync_len(&dev, config->cmd),
+              PCIEMU_HW_DMA_SYNC_LEN_MAX, "Should count every destination");
+    config->mcast_cnt = 5;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BOUNDS,
+              "Should fail : too many bytes to the destinations");
+
+    config->cmd = PCIEMU_HW_DMA_CMD_PQ;
+    config->raid_cnt = 5;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BOUNDS,
+              "Should fail : too many bytes from the sources");
+    EXPECT_EQ(address_space_rw_fake.call_count, 0,
+              "Should not transfer anything");
+
+    config->cmd = PCIEMU_HW_DMA_CMD_STREAM;
+    config->txdesc.len = ~0ULL;
+    EXPECT_EQ(pciemu_dma_sync_len(&dev, config->cmd), 0,
+              "Should not limit the streams");
+}
+
+TEST(pciemu_dma_execute_crypto, "Test execution of encryption commands")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    dev.dma.config.mask = DMA_BIT_MASK(PCIEMU_HW_DMA_ADDR_CAPABILITY);
+    RESET_FAKE(address_space_rw);
+    RESET_FAKE(pciemu_crypto_key_loaded);
+    RESET_FAKE(pciemu_crypto_xts);
+
+    dev.dma.config.cmd = PCIEMU_HW_DMA_CMD_ENCRYPT;
+    dev.dma.config.key_slot = 3;
+    dev.dma.config.sector_size = 768;
+    dev.dma.config.sector = 100;
+    dev.dma.config.txdesc.src = 0xaaaa0000;
+    dev.dma.config.txdesc.dst = 0xbbbb0000;
+    dev.dma.config.txdesc.len = 2 * PCIEMU_DMA_BOUNCE_SIZE + 4096;
+    pciemu_crypto_key_loaded_fake.return_val = true;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_CRYPTO,
+              "Should fail : sector size not a power of 2");
+    dev.dma.config.sector_size = PCIEMU_HW_CRYPTO_SECTOR_SIZE_MAX * 2;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_CRYPTO,
+              "Should fail : sector size too large");
+    dev.dma.config.sector_size = 4096;
+    dev.dma.config.txdesc.len += 512;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_CRYPTO,
+              "Should fail : len not a multiple of the sector size");
+    dev.dma.config.txdesc.len -= 512;
+    pciemu_crypto_key_loaded_fake.return_val = false;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_CRYPTO,
+              "Should fail : empty key slot");
+    EXPECT_EQ(pciemu_crypto_key_loaded_fake.arg1_val, 3,
+              "Should check the configured key slot");
+    EXPECT_EQ(address_space_rw_fake.call_count, 0, "Should not transfer");
+
+    pciemu_crypto_key_loaded_fake.return_val = true;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
+    EXPECT_EQ(address_space_rw_fake.call_count, 6,
+              "Should read and write chunk by chunk");
+    EXPECT_EQ(address_space_rw_fake.arg1_history[4],
+              0xaaaa0000 + 2 * PCIEMU_DMA_BOUNCE_SIZE,
+              "Should read the last chunk at the right offset");
+    EXPECT_EQ(address_space_rw_fake.arg1_val,
+              0xbbbb0000 + 2 * PCIEMU_DMA_BOUNCE_SIZE,
+              "Should write the last chunk at the right offset");
+    EXPECT_EQ(address_space_rw_fake.arg4_val, 4096,
+              "Should write only the remaining bytes");
+    EXPECT_EQ(pciemu_crypto_xts_fake.call_count, 3,
+              "Should encrypt chunk by chunk");
+    EXPECT_EQ(pciemu_crypto_xts_fake.arg1_val, 3, "Should use the key slot");
+    EXPECT_EQ(pciemu_crypto_xts_fake.arg2_history[1],
+              100 + PCIEMU_DMA_BOUNCE_SIZE / 4096,
+              "Should number the sectors from the configured one");
+    EXPECT_EQ(pciemu_crypto_xts_fake.arg3_val, 4096,
+              "Should use the sector size");
+    EXPECT_EQ(pciemu_crypto_xts_fake.arg5_val, 4096,
+              "Should encrypt only the remaining bytes");
+    EXPECT_TRUE(pciemu_crypto_xts_fake.arg6_val, "Should encrypt");
+
+    RESET_FAKE(address_space_rw);
+    RESET_FAKE(pciemu_crypto_xts);
+    dev.dma.config.cmd = PCIEMU_HW_DMA_CMD_DECRYPT;
+    dev.dma.config.txdesc.len = 4096;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
+    EXPECT_FALSE(pciemu_crypto_xts_fake.arg6_val, "Should decrypt");
+
+    pciemu_crypto_xts_fake.return_val = -1;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_CRYPTO,
+              "Should fail : cipher error");
+    pciemu_crypto_xts_fake.return_val = 0;
+    address_space_rw_fake.return_val = MEMTX_DECODE_ERROR;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BUS,
+              "Should fail : bus error");
+    RESET_FAKE(address_space_rw);
+    RESET_FAKE(pciemu_crypto_key_loaded);
+    RESET_FAKE(pciemu_crypto_xts);
+}
+
+TEST(pciemu_dma_execute_atomic, "Test execution of atomic commands")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    uint64_t operand = cpu_to_le64(10);
+    dev.dma.config.mask = DMA_BIT_MASK(PCIEMU_HW_DMA_ADDR_CAPABILITY);
+    RESET_FAKE(address_space_rw);
+    RESET_FAKE(address_space_map);
+    RESET_FAKE(address_space_unmap);
+
+    dev.dma.config.cmd = PCIEMU_HW_DMA_CMD_ATOMIC_FETCH_ADD;
+    dev.dma.config.operand = 5;
+    dev.dma.config.txdesc.dst = 0xaaaa0000;
+    dev.dma.config.txdesc.len = 3;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_ATOMIC,
+              "Should fail : operand neither 4 nor 8 bytes");
+    dev.dma.config.txdesc.len = 8;
+    dev.dma.config.txdesc.dst = 0xaaaa0004;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_ATOMIC,
+              "Should fail : operand not naturally aligned");
+    EXPECT_EQ(address_space_map_fake.call_count, 0, "Should not map");
+    dev.dma.config.txdesc.dst = 0xaaaa0000;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BUS,
+              "Should fail : operand not mapped");
+
+    address_space_map_fake.return_val = &operand;
+    RESET_FAKE(memory_region_from_host);
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BUS,
+              "Should fail : operand not in RAM (bounce buffer)");
+    EXPECT_EQ(le64_to_cpu(operand), 10, "Should not modify the operand");
+    EXPECT_EQ(address_space_unmap_fake.arg4_val, 0,
+              "Should release the bounce buffer unwritten");
+
+    memory_region_from_host_fake.return_val = &dev.desc;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
+    EXPECT_EQ(address_space_map_fake.arg1_val, 0xaaaa0000,
+              "Should map the operand");
+    EXPECT_EQ(memory_region_from_host_fake.arg0_val, &operand,
+              "Should check the mapping is RAM");
+    EXPECT_EQ(le64_to_cpu(operand), 15, "Should add to the operand");
+    EXPECT_EQ(dev.dma.atomic_result, 10, "Should return the original value");
+    EXPECT_EQ(address_space_unmap_fake.arg4_val, 8,
+              "Should unmap the operand as written");
+    EXPECT_EQ(address_space_rw_fake.call_count, 0,
+              "Should not write the original value without src");
+
+    dev.dma.config.cmd = PCIEMU_HW_DMA_CMD_ATOMIC_CAS;
+    dev.dma.config.operand = 0x100000000;
+    dev.dma.config.compare = 14;
+    pciemu_dma_execute(&dev);
+    EXPECT_EQ(le64_to_cpu(operand), 15, "Should not swap a different value");
+    dev.dma.config.compare = 15;
+    pciemu_dma_execute(&dev);
+    EXPECT_EQ(le64_to_cpu(operand), 0x100000000, "Should swap an equal value");
+    EXPECT_EQ(dev.dma.atomic_result, 15, "Should return the original value");
+
+    dev.dma.config.cmd = PCIEMU_HW_DMA_CMD_ATOMIC_SWAP;
+    dev.dma.config.operand = 0xdeadbeef;
+    dev.dma.config.txdesc.src = 0xbbbb0000;
+    dev.dma.config.txdesc.len = 4;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
+    EXPECT_EQ(le64_to_cpu(operand), 0x1deadbeef,
+              "Should swap only the 4 bytes of the operand");
+    EXPECT_EQ(dev.dma.atomic_result, 0, "Should return the original value");
+    EXPECT_EQ(address_space_rw_fake.call_count, 1,
+              "Should write the original value");
+    EXPECT_EQ(address_space_rw_fake.arg1_val, 0xbbbb0000,
+              "Should write the original value to src");
+    EXPECT_EQ(address_space_rw_fake.arg4_val, 4,
+              "Should write as many bytes as the operand");
+    EXPECT_EQ(address_space_rw_fake.arg5_val, true,
+              "Should perform pci_dma_write");
+
+    address_space_rw_fake.return_val = MEMTX_DECODE_ERROR;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BUS,
+              "Should fail : bus error");
+    RESET_FAKE(address_space_rw);
+    RESET_FAKE(address_space_map);
+    RESET_FAKE(address_space_unmap);
+    RESET_FAKE(memory_region_from_host);
+}
+
+TEST(pciemu_dma_execute_2d, "Test execution of 2D transfers")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAConfig *cfg = &dev.dma.config;
+    RESET_FAKE(address_space_rw);
+    cfg->mask = DMA_BIT_MASK(PCIEMU_HW_DMA_ADDR_CAPABILITY);
+    dev.dma.buff = dev.dma.buff_inline;
+    dev.dma.buff_size = PCIEMU_HW_DMA_AREA_SIZE;
+
+    /* gather a 16x8 tile out of a 1024-byte wide image */
+    cfg->cmd = PCIEMU_HW_DMA_DIRECTION_TO_DEVICE | PCIEMU_HW_DMA_CMD_FLAG_2D;
+    cfg->txdesc.src = 0xaaaa0000;
+    cfg->txdesc.dst = PCIEMU_HW_DMA_AREA_START + 32;
+    cfg->txdesc.len = 16;
+    cfg->rows = 8;
+    cfg->src_stride = 1024;
+    cfg->dst_stride = 16;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
+    EXPECT_EQ(address_space_rw_fake.call_count, 8, "Should transfer each row");
+    EXPECT_EQ(address_space_rw_fake.arg1_history[7], 0xaaaa0000 + 7 * 1024,
+              "Should step the bus address by the source stride");
+    EXPECT_EQ(address_space_rw_fake.arg3_history[7], &dev.dma.buff[32 + 7 * 16],
+              "Should step the device memory by the destination stride");
+    EXPECT_EQ(address_space_rw_fake.arg4_val, 16, "Should transfer len per row");
+    EXPECT_EQ(address_space_rw_fake.arg5_val, false,
+              "Should perform pci_dma_read");
+
+    /* scatter a column of 4-byte words back to the host */
+    RESET_FAKE(address_space_rw);
+    cfg->cmd = PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE | PCIEMU_HW_DMA_CMD_FLAG_2D;
+    cfg->txdesc.src = PCIEMU_HW_DMA_AREA_START;
+    cfg->txdesc.dst = 0xbbbb0000;
+    cfg->txdesc.len = 4;
+    cfg->rows = 4;
+    cfg->src_stride = 4;
+    cfg->dst_stride = 256;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
+    EXPECT_EQ(address_space_rw_fake.call_count, 4, "Should transfer each row");
+    EXPECT_EQ(address_space_rw_fake.arg1_val, 0xbbbb0000 + 3 * 256,
+              "Should step the bus address by the destination stride");
+    EXPECT_EQ(address_space_rw_fake.arg3_val, &dev.dma.buff[3 * 4],
+              "Should step the device memory by the source stride");
+    EXPECT_EQ(address_space_rw_fake.arg5_val, true,
+              "Should perform pci_dma_write");
+
+    RESET_FAKE(address_space_rw);
+    cfg->dst_stride = 4;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
+    EXPECT_EQ(address_space_rw_fake.call_count, 1,
+              "Should coalesce contiguous rows");
+    EXPECT_EQ(address_space_rw_fake.arg4_val, 16,
+              "Should transfer all the rows at once");
+
+    RESET_FAKE(address_space_rw);
+    cfg->rows = 0;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed without rows");
+    EXPECT_EQ(address_space_rw_fake.call_count, 0, "Should not transfer");
+
+    cfg->txdesc.len = 16;
+    cfg->src_stride = 1024;
+    cfg->rows = 4;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed : last row ends in the area");
+    RESET_FAKE(address_space_rw);
+    cfg->rows = 5;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BOUNDS,
+              "Should fail : last row out of bounds");
+    cfg->src_stride = 0;
+    cfg->rows = PCIEMU_HW_DMA_2D_ROWS_MAX + 1;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BOUNDS,
+              "Should fail : too many rows");
+    EXPECT_EQ(address_space_rw_fake.call_count, 0,
+              "Should NOT transfer : out of bounds");
+
+    cfg->cmd = PCIEMU_HW_DMA_CMD_PATTERN_FILL | PCIEMU_HW_DMA_CMD_FLAG_2D;
+    cfg->rows = 2;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_CMD,
+              "Should fail : 2D pattern command");
+
+    cfg->cmd = PCIEMU_HW_DMA_DIRECTION_FROM_DEVICE | PCIEMU_HW_DMA_CMD_FLAG_2D;
+    cfg->dst_stride = 256;
+    address_space_rw_fake.return_val = MEMTX_DECODE_ERROR;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BUS,
+              "Should fail : bus error");
+    EXPECT_EQ(address_space_rw_fake.call_count, 1,
+              "Should stop at the first failing row");
+    RESET_FAKE(address_space_rw);
+}
+
+/* destination table of the multicast tests, returned by the first read */
+static uint64_t mcast_table[3];
+
+static MemTxResult address_space_rw_mcast(AddressSpace *as, hwaddr addr,
+                                          MemTxAttrs attrs, void *buf,
+                                          hwaddr len, bool is_write)
+{
+    if (address_space_rw_fake.call_count == 1)
+        memcpy(buf, mcast_table, MIN(len, sizeof(mcast_table)));
+    return MEMTX_OK;
+}
+
+TEST(pciemu_dma_execute_multicast, "Test execution of multicast commands")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAConfig *cfg = &dev.dma.config;
+    RESET_FAKE(address_space_rw);
+    cfg->mask = DMA_BIT_MASK(PCIEMU_HW_DMA_ADDR_CAPABILITY);
+    dev.dma.buff = dev.dma.buff_inline;
+    dev.dma.buff_size = PCIEMU_HW_DMA_AREA_SIZE;
+    mcast_table[0] = cpu_to_le64(0xaaaa0000);
+    mcast_table[1] = cpu_to_le64(0xbbbb0000);
+    mcast_table[2] = cpu_to_le64(0xcccc0000);
+    address_space_rw_fake.custom_fake = address_space_rw_mcast;
+
+    cfg->cmd = PCIEMU_HW_DMA_CMD_MULTICAST;
+    cfg->txdesc.src = 0x12340000;
+    cfg->txdesc.dst = 0x56780000;
+    cfg->txdesc.len = PCIEMU_DMA_BOUNCE_SIZE + 16;
+    cfg->mcast_cnt = 3;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
+    EXPECT_EQ(address_space_rw_fake.call_count, 1 + 2 * (1 + 3),
+              "Should read the table, then each chunk once for 3 writes");
+    EXPECT_EQ(address_space_rw_fake.arg1_history[0], 0x56780000,
+              "Should read the table at txdesc.dst");
+    EXPECT_EQ(address_space_rw_fake.arg4_history[0], 3 * sizeof(uint64_t),
+              "Should read as many entries as destinations");
+    EXPECT_EQ(address_space_rw_fake.arg1_history[1], 0x12340000,
+              "Should read the source");
+    EXPECT_EQ(address_space_rw_fake.arg5_history[1], false,
+              "Should perform pci_dma_read");
+    EXPECT_EQ(address_space_rw_fake.arg1_history[3], 0xbbbb0000,
+              "Should write the destinations in order");
+    EXPECT_EQ(address_space_rw_fake.arg5_history[3], true,
+              "Should perform pci_dma_write");
+    EXPECT_EQ(address_space_rw_fake.arg1_history[5], 0x12340000 +
+                                                         PCIEMU_DMA_BOUNCE_SIZE,
+              "Should read the next chunk after the first one is written");
+    EXPECT_EQ(address_space_rw_fake.arg1_val, 0xcccc0000 +
+                                                  PCIEMU_DMA_BOUNCE_SIZE,
+              "Should write the last chunk to the last destination");
+    EXPECT_EQ(address_space_rw_fake.arg4_val, 16,
+              "Should write the rest of the source");
+
+    RESET_FAKE(address_space_rw);
+    address_space_rw_fake.custom_fake = address_space_rw_mcast;
+    cfg->cmd = PCIEMU_HW_DMA_CMD_MULTICAST_FROM_DEVICE;
+    cfg->txdesc.src = PCIEMU_HW_DMA_AREA_START + 64;
+    cfg->txdesc.len = 32;
+    cfg->mcast_cnt = 2;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
+    EXPECT_EQ(address_space_rw_fake.call_count, 1 + 2,
+              "Should read the table, then write each destination");
+    EXPECT_EQ(address_space_rw_fake.arg1_val, 0xbbbb0000,
+              "Should write the last destination");
+    EXPECT_EQ(address_space_rw_fake.arg3_val, &dev.dma.buff[64],
+              "Should write from the device memory");
+
+    RESET_FAKE(address_space_rw);
+    cfg->txdesc.len = PCIEMU_HW_DMA_AREA_SIZE;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BOUNDS,
+              "Should fail : len out of bounds");
+    cfg->txdesc.len = 32;
+    cfg->mcast_cnt = 0;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BOUNDS,
+              "Should fail : no destination");
+    cfg->mcast_cnt = PCIEMU_HW_DMA_MCAST_DST_MAX + 1;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BOUNDS,
+              "Should fail : too many destinations");
+    EXPECT_EQ(address_space_rw_fake.call_count, 0,
+              "Should NOT transfer : out of bounds");
+
+    cfg->mcast_cnt = PCIEMU_HW_DMA_MCAST_DST_MAX;
+    address_space_rw_fake.return_val = MEMTX_DECODE_ERROR;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BUS,
+              "Should fail : table not readable");
+    EXPECT_EQ(address_space_rw_fake.call_count, 1,
+              "Should stop at the table");
+    RESET_FAKE(address_space_rw);
+}
+
+/* reference multiplication by {02} over GF(2^8) */
+static uint8_t raid_test_mul2(uint8_t x)
+{
+    return (x << 1) ^ (x & 0x80 ? 0x1d : 0);
+}
+
+TEST(pciemu_dma_raid_kernels, "Test xor and P+Q kernels")
+{
+    uint8_t d[77], p[77], q[77], p_ref[77], q_ref[77];
+    pciemu_dma_raid_select_kernels();
+    EXPECT_EQ(pciemu_dma_raid_mul2(0x8040201008040201ULL),
+              0x1d80402010080402ULL, "Should reduce the overflowing byte");
+    for (size_t i = 0; i < sizeof(d); ++i) {
+        d[i] = i * 37 + 5;
+        p[i] = p_ref[i] = i * 11;
+        q[i] = q_ref[i] = 0xff - i * 3;
+    }
+    pciemu_dma_raid_pq(p, q, d, sizeof(d));
+    for (size_t i = 0; i < sizeof(d); ++i) {
+        p_ref[i] ^= d[i];
+        q_ref[i] = raid_test_mul2(q_ref[i]) ^ d[i];
+    }
+    EXPECT_EQ(memcmp(p, p_ref, sizeof(p)), 0, "Should fold the source into P");
+    EXPECT_EQ(memcmp(q, q_ref, sizeof(q)), 0, "Should fold the source into Q");
+    pciemu_dma_raid_pq_scalar(p_ref, q_ref, d, sizeof(d));
+    pciemu_dma_raid_pq(p, q, d, sizeof(d));
+    EXPECT_EQ(memcmp(q, q_ref, sizeof(q)), 0,
+              "Scalar and vectorized kernels should agree");
+    pciemu_dma_raid_xor(p, d, sizeof(d));
+    pciemu_dma_raid_xor_scalar(p_ref, d, sizeof(d));
+    EXPECT_EQ(memcmp(p, p_ref, sizeof(p)), 0,
+              "Scalar and vectorized kernels should agree");
+}
+
+/* guest memory of the parity tests : a table of 3 sources, P and Q */
+#define RAID_TEST_TABLE 0x50000000
+#define RAID_TEST_SRC 0xa0000000
+#define RAID_TEST_P 0xb0000000
+#define RAID_TEST_Q 0xc0000000
+static uint64_t raid_table[3];
+static uint8_t raid_src[3][40];
+static uint8_t raid_p[40];
+static uint8_t raid_q[40];
+
+static MemTxResult address_space_rw_raid(AddressSpace *as, hwaddr addr,
+                                         MemTxAttrs attrs, void *buf,
+                                         hwaddr len, bool is_write)
+{
+    if (addr == RAID_TEST_TABLE)
+        memcpy(buf, raid_table, len);
+    else if (addr == RAID_TEST_P)
+        memcpy(raid_p, buf, len);
+    else if (addr == RAID_TEST_Q)
+        memcpy(raid_q, buf, len);
+    else
+        memcpy(buf, raid_src[(addr - RAID_TEST_SRC) >> 16], len);
+    return MEMTX_OK;
+}
+
+TEST(pciemu_dma_execute_raid, "Test execution of parity commands")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAConfig *cfg = &dev.dma.config;
+    RESET_FAKE(address_space_rw);
+    address_space_rw_fake.custom_fake = address_space_rw_raid;
+    cfg->mask = DMA_BIT_MASK(PCIEMU_HW_DMA_ADDR_CAPABILITY);
+    for (int i = 0; i < 3; ++i) {
+        raid_table[i] = cpu_to_le64(RAID_TEST_SRC + (i << 16));
+        for (int j = 0; j < 40; ++j)
+            raid_src[i][j] = (i + 1) * 71 + j * 13;
+    }
+
+    cfg->cmd = PCIEMU_HW_DMA_CMD_PQ;
+    cfg->txdesc.src = RAID_TEST_TABLE;
+    cfg->txdesc.dst = RAID_TEST_P;
+    cfg->txdesc.len = 40;
+    cfg->q_dst = RAID_TEST_Q;
+    cfg->raid_cnt = 3;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
+    EXPECT_EQ(address_space_rw_fake.call_count, 1 + 3 + 2,
+              "Should read the table and each source once, write P and Q");
+    EXPECT_EQ(address_space_rw_fake.arg4_history[0], 3 * sizeof(uint64_t),
+              "Should read as many entries as sources");
+    bool p_ok = true, q_ok = true;
+    for (int j = 0; j < 40; ++j) {
+        uint8_t d0 = raid_src[0][j], d1 = raid_src[1][j], d2 = raid_src[2][j];
+        p_ok &= raid_p[j] == (d0 ^ d1 ^ d2);
+        q_ok &= raid_q[j] ==
+                (d0 ^ raid_test_mul2(d1) ^ raid_test_mul2(raid_test_mul2(d2)));
+    }
+    EXPECT_TRUE(p_ok, "Should write the xor of the sources to P");
+    EXPECT_TRUE(q_ok, "Should write the syndrome of the sources to Q");
+
+    RESET_FAKE(address_space_rw);
+    address_space_rw_fake.custom_fake = address_space_rw_raid;
+    memset(raid_q, 0, sizeof(raid_q));
+    cfg->cmd = PCIEMU_HW_DMA_CMD_XOR;
+    cfg->raid_cnt = 2;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
+    EXPECT_EQ(address_space_rw_fake.call_count, 1 + 2 + 1,
+              "Should read the table and each source once, write P");
+    EXPECT_EQ(raid_p[7], raid_src[0][7] ^ raid_src[1][7],
+              "Should write the xor of the sources to P");
+    EXPECT_EQ(raid_q[7], 0, "Should not write Q");
+
+    RESET_FAKE(address_space_rw);
+    cfg->raid_cnt = 0;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BOUNDS,
+              "Should fail : no source");
+    cfg->raid_cnt = PCIEMU_HW_DMA_RAID_SRC_MAX + 1;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BOUNDS,
+              "Should fail : too many sources");
+    EXPECT_EQ(address_space_rw_fake.call_count, 0,
+              "Should NOT transfer : out of bounds");
+
+    cfg->raid_cnt = 2;
+    address_space_rw_fake.return_val = MEMTX_DECODE_ERROR;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BUS,
+              "Should fail : table not readable");
+    RESET_FAKE(address_space_rw);
+}
+
+TEST(pciemu_dma_scan_kernels, "Test scan kernels")
+{
+    uint8_t buf[131];
+    uint64_t hits[8];
+    size_t cnt, from, from_ref;
+    DMAScanKey str = { .bytes = "abc", .len = 3 };
+    DMAScanKey set = { .bytes = ",\n", .len = 2, .set = true };
+    pciemu_dma_scan_select_kernels();
+    for (size_t i = 0; i < sizeof(buf); ++i)
+        buf[i] = 'a' + i % 2;
+    memcpy(buf + 5, "abc", 3);
+    memcpy(buf + 40, "abc", 3);
+    memcpy(buf + 128, "abc", 3);
+    buf[8] = ',';
+    buf[64] = '\n';
+
+    from = 0;
+    cnt = pciemu_dma_scan(buf, sizeof(buf), &from, &str, hits, 8);
+    EXPECT_EQ(cnt, 3, "Should find every occurrence");
+    EXPECT_EQ(hits[0], 5, "Should find the first occurrence");
+    EXPECT_EQ(hits[1], 40, "Should find the second occurrence");
+    EXPECT_EQ(hits[2], 128, "Should find an occurrence ending the buffer");
+    EXPECT_EQ(from, sizeof(buf) - 2, "Should stop once no match fits");
+
+    from = 0;
+    cnt = pciemu_dma_scan(buf, sizeof(buf) - 1, &from, &str, hits, 8);
+    EXPECT_EQ(cnt, 2, "Should not find an occurrence crossing the end");
+
+    buf[130] = ',';
+    from = 0;
+    cnt = pciemu_dma_scan(buf, sizeof(buf), &from, &set, hits, 8);
+    EXPECT_EQ(cnt, 3, "Should find every delimiter");
+    EXPECT_EQ(hits[0], 8, "Should find the first delimiter");
+    EXPECT_EQ(hits[1], 64, "Should find any delimiter of the set");
+    EXPECT_EQ(hits[2], 130, "Should find a delimiter ending the buffer");
+
+    buf[130] = 'c';
+    from = from_ref = 0;
+    cnt = pciemu_dma_scan(buf, sizeof(buf), &from, &str, hits, 2);
+    EXPECT_EQ(cnt, 2, "Should stop at max matches");
+    cnt = pciemu_dma_scan_scalar(buf, sizeof(buf), &from_ref, &str, hits, 2);
+    EXPECT_EQ(from, from_ref, "Scalar and vectorized kernels should agree");
+    cnt = pciemu_dma_scan(buf, sizeof(buf), &from, &str, hits, 2);
+    EXPECT_EQ(cnt, 1, "Should resume where it stopped");
+    EXPECT_EQ(hits[0], 128, "Should resume where it stopped");
+}
+
+/* guest memory of the scan tests : a source spanning two chunks and the
+ * result buffer */
+#define SCAN_TEST_SRC 0x50000000
+#define SCAN_TEST_DST 0xb0000000
+static uint8_t scan_src[PCIEMU_DMA_BOUNCE_SIZE + 128];
+static uint64_t scan_res[4];
+
+static MemTxResult address_space_rw_scan(AddressSpace *as, hwaddr addr,
+                                         MemTxAttrs attrs, void *buf,
+                                         hwaddr len, bool is_write)
+{
+    if (is_write)
+        memcpy((uint8_t *)scan_res + addr - SCAN_TEST_DST, buf, len);
+    else
+        memcpy(buf, scan_src + addr - SCAN_TEST_SRC, len);
+    return MEMTX_OK;
+}
+
+TEST(pciemu_dma_execute_scan, "Test execution of scan commands")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAConfig *cfg = &dev.dma.config;
+    RESET_FAKE(address_space_rw);
+    address_space_rw_fake.custom_fake = address_space_rw_scan;
+    cfg->mask = DMA_BIT_MASK(PCIEMU_HW_DMA_ADDR_CAPABILITY);
+    dev.dma.buff = dev.dma.buff_inline;
+    dev.dma.buff_size = PCIEMU_HW_DMA_AREA_SIZE;
+    memset(scan_src, '.', sizeof(scan_src));
+    memcpy(scan_src + 10, "XYZ", 3);
+    memcpy(scan_src + PCIEMU_DMA_BOUNCE_SIZE - 2, "XYZ", 3);
+    memcpy(scan_src + PCIEMU_DMA_BOUNCE_SIZE + 64, "XYZ", 3);
+
+    cfg->cmd = PCIEMU_HW_DMA_CMD_SCAN;
+    cfg->txdesc.src = SCAN_TEST_SRC;
+    cfg->txdesc.dst = SCAN_TEST_DST;
+    cfg->txdesc.len = sizeof(scan_src);
+    cfg->scan_key[0] = ldq_le_p("XYZ\0\0\0\0");
+    cfg->scan_ctrl = 3;
+    cfg->scan_max = ARRAY_SIZE(scan_res);
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
+    EXPECT_EQ(dev.dma.scan_cnt, 3, "Should count every match");
+    EXPECT_EQ(address_space_rw_fake.call_count, 2 * 2,
+              "Should read each chunk once, then write its matches");
+    EXPECT_EQ(le64_to_cpu(scan_res[0]), 10, "Should write the offsets");
+    EXPECT_EQ(le64_to_cpu(scan_res[1]), PCIEMU_DMA_BOUNCE_SIZE - 2,
+              "Should find a match crossing two chunks once");
+    EXPECT_EQ(le64_to_cpu(scan_res[2]), PCIEMU_DMA_BOUNCE_SIZE + 64,
+              "Should write the offsets from the start of the source");
+
+    RESET_FAKE(address_space_rw);
+    address_space_rw_fake.custom_fake = address_space_rw_scan;
+    memset(scan_res, 0, sizeof(scan_res));
+    cfg->scan_max = 2;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
+    EXPECT_EQ(dev.dma.scan_cnt, 3, "Should count the matches not written");
+    EXPECT_EQ(scan_res[2], 0, "Should not write beyond the capacity");
+
+    RESET_FAKE(address_space_rw);
+    memcpy(dev.dma.buff + 32, "a,b;c", 5);
+    cfg->cmd = PCIEMU_HW_DMA_CMD_SCAN_FROM_DEVICE;
+    cfg->txdesc.src = PCIEMU_HW_DMA_AREA_START + 32;
+    cfg->txdesc.len = 5;
+    cfg->scan_key[0] = ldq_le_p(",;\0\0\0\0\0");
+    cfg->scan_ctrl = 2 | PCIEMU_HW_DMA_SCAN_CTRL_SET;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
+    EXPECT_EQ(dev.dma.scan_cnt, 2, "Should find each delimiter");
+    EXPECT_EQ(address_space_rw_fake.call_count, 1,
+              "Should search the device memory in place");
+    EXPECT_EQ(address_space_rw_fake.arg4_val, 2 * sizeof(uint64_t),
+              "Should write the matches at once");
+    cfg->txdesc.src = PCIEMU_HW_DMA_AREA_START + PCIEMU_HW_DMA_AREA_SIZE - 2;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BOUNDS,
+              "Should fail : source out of bounds");
+
+    RESET_FAKE(address_space_rw);
+    dev.dma.scan_cnt = 10;
+    cfg->scan_ctrl = 0;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_SCAN,
+              "Should fail : empty key");
+    EXPECT_EQ(dev.dma.scan_cnt, 0, "Should clear the match count");
+    cfg->scan_ctrl = PCIEMU_HW_DMA_SCAN_KEY_MAX + 1;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_SCAN,
+              "Should fail : key too long");
+    EXPECT_EQ(address_space_rw_fake.call_count, 0,
+              "Should NOT transfer : invalid key");
+
+    cfg->cmd = PCIEMU_HW_DMA_CMD_SCAN;
+    cfg->scan_ctrl = 3;
+    address_space_rw_fake.return_val = MEMTX_DECODE_ERROR;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_BUS,
+              "Should fail : source not readable");
+    RESET_FAKE(address_space_rw);
 }
 
 TEST(pciemu_dma_doorbell_ring, "Test reception of DMA doorbell")
 {
     PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
     RESET_FAKE(address_space_rw);
-    RESET_FAKE(pciemu_irq_raise);
+    RESET_FAKE(pciemu_irq_event);
+    RESET_FAKE(pciemu_stats_event);
     dev.dma.config.mask = DMA_BIT_MASK(PCIEMU_HW_DMA_ADDR_CAPABILITY);
+    dev.dma.buff = dev.dma.buff_inline;
+    dev.dma.buff_size = PCIEMU_HW_DMA_AREA_SIZE;
     dev.dma.config.cmd = PCIEMU_HW_DMA_DIRECTION_TO_DEVICE;
     dev.dma.config.txdesc.dst = PCIEMU_HW_DMA_AREA_START;
     dev.dma.status = DMA_STATUS_IDLE;
     pciemu_dma_doorbell_ring(&dev);
     EXPECT_EQ(dev.dma.status, DMA_STATUS_IDLE,
               "Should return with IDLE status");
+    EXPECT_EQ(pciemu_stats_event_fake.call_count, 2,
+              "Should timestamp the start and the end");
+    EXPECT_EQ(pciemu_stats_event_fake.arg1_history[0], STATS_EVENT_DMA_START,
+              "Should timestamp the start first (doorbell stamped by MMIO)");
+    EXPECT_EQ(pciemu_stats_event_fake.arg1_history[1], STATS_EVENT_DMA_END,
+              "Should timestamp the end last");
     EXPECT_EQ(address_space_rw_fake.call_count, 1,
               "Should call pci_dma_read once (proxy in pciemu_dma_execute)");
-    EXPECT_EQ(pciemu_irq_raise_fake.call_count, 1, "Should raise irq once");
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 1, "Should raise irq once");
+    EXPECT_EQ(dev.dma.done_cnt, 1, "Should count the completion");
+    EXPECT_EQ(dev.dma.error, PCIEMU_HW_DMA_ERR_NONE, "Should not report error");
 
-    RESET_FAKE(pciemu_irq_raise);
+    RESET_FAKE(pciemu_irq_event);
     dev.dma.status = DMA_STATUS_EXECUTING;
     pciemu_dma_doorbell_ring(&dev);
     EXPECT_EQ(dev.dma.status, DMA_STATUS_EXECUTING,
               "Should do nothing and return with EXECUTING status");
-    EXPECT_EQ(pciemu_irq_raise_fake.call_count, 0, "Should not raise irq");
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 0, "Should not raise irq");
+    EXPECT_EQ(dev.dma.done_cnt, 1, "Should not count a completion");
+
+    RESET_FAKE(pciemu_irq_event);
+    RESET_FAKE(pciemu_latency_sample);
+    pciemu_latency_sample_fake.return_val = 5000;
+    dev.dma.status = DMA_STATUS_IDLE;
+    dev.dma.config.txdesc.dst = PCIEMU_HW_DMA_AREA_START +
+                                PCIEMU_HW_DMA_AREA_SIZE + 1;
+    pciemu_dma_doorbell_ring(&dev);
+    EXPECT_EQ(dev.dma.status, DMA_STATUS_IDLE,
+              "Should return with IDLE status when rejected");
+    EXPECT_EQ(pciemu_latency_sample_fake.call_count, 0,
+              "Should complete a rejected transfer right away");
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 1, "Should raise irq once");
+    EXPECT_EQ(dev.dma.done_cnt, 2, "Should count the completion");
+    EXPECT_EQ(dev.dma.error, PCIEMU_HW_DMA_ERR_BOUNDS,
+              "Should report the rejection");
+    EXPECT_EQ(pciemu_irq_event_fake.arg1_val,
+              PCIEMU_HW_IRQ_CAUSE_DMA_DONE | PCIEMU_HW_IRQ_CAUSE_DMA_ERROR,
+              "Should signal the DMA error cause with the completion");
+
+    RESET_FAKE(pciemu_irq_event);
+    RESET_FAKE(pciemu_latency_sample);
+    dev.dma.config.cmd = PCIEMU_HW_DMA_DIRECTION_TO_DEVICE |
+                         PCIEMU_HW_DMA_CMD_FLAG_NO_IRQ;
+    dev.dma.config.txdesc.dst = PCIEMU_HW_DMA_AREA_START;
+    pciemu_dma_doorbell_ring(&dev);
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 0,
+              "Should not raise irq : NO_IRQ flag");
+    EXPECT_EQ(dev.dma.done_cnt, 3, "Should count the completion");
+    EXPECT_EQ(dev.dma.error, PCIEMU_HW_DMA_ERR_NONE,
+              "Should clear the previous error");
+}
+
+TEST(pciemu_dma_desc_doorbell_ring, "Test reception of a descriptor doorbell")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    static uint8_t window[PCIEMU_HW_DESC_WINDOW_SIZE];
+    uint8_t *desc = &window[2 * PCIEMU_HW_DESC_SLOT_SIZE];
+    RESET_FAKE(address_space_rw);
+    RESET_FAKE(pciemu_irq_event);
+    RESET_FAKE(pciemu_trace_mmio);
+    dev.dma.config.mask = DMA_BIT_MASK(PCIEMU_HW_DMA_ADDR_CAPABILITY);
+    dev.dma.buff = dev.dma.buff_inline;
+    dev.dma.buff_size = PCIEMU_HW_DMA_AREA_SIZE;
+    dev.dma.desc = window;
+    dev.dma.status = DMA_STATUS_IDLE;
+    stq_le_p(desc + PCIEMU_HW_DESC_SRC, 0xaaaa0000);
+    stq_le_p(desc + PCIEMU_HW_DESC_DST, PCIEMU_HW_DMA_AREA_START);
+    stq_le_p(desc + PCIEMU_HW_DESC_LEN, 64);
+    stq_le_p(desc + PCIEMU_HW_DESC_CMD, PCIEMU_HW_DMA_DIRECTION_TO_DEVICE);
+    stl_le_p(desc + PCIEMU_HW_DESC_PATTERN, PCIEMU_HW_DMA_PATTERN_HASH);
+    pciemu_dma_desc_doorbell_ring(&dev, 2);
+    EXPECT_EQ(dev.dma.config.txdesc.src, 0xaaaa0000, "Should load src");
+    EXPECT_EQ(dev.dma.config.txdesc.dst, PCIEMU_HW_DMA_AREA_START,
+              "Should load dst");
+    EXPECT_EQ(dev.dma.config.txdesc.len, 64, "Should load len");
+    EXPECT_EQ(dev.dma.config.cmd, PCIEMU_HW_DMA_DIRECTION_TO_DEVICE,
+              "Should load the command");
+    EXPECT_EQ(dev.dma.config.pattern, 0,
+              "Should ignore the pattern of a 32-byte descriptor");
+    EXPECT_EQ(address_space_rw_fake.call_count, 1, "Should ring the doorbell");
+    EXPECT_EQ(dev.dma.done_cnt, 1, "Should complete the command");
+    EXPECT_EQ(pciemu_trace_mmio_fake.call_count, 5,
+              "Should trace the registers programmed and the doorbell");
+    EXPECT_EQ(pciemu_trace_mmio_fake.arg2_history[0],
+              PCIEMU_HW_BAR0_DMA_CFG_TXDESC_SRC, "Should trace src first");
+    EXPECT_EQ(pciemu_trace_mmio_fake.arg2_val,
+              PCIEMU_HW_BAR0_DMA_DOORBELL_RING, "Should trace the doorbell last");
+
+    RESET_FAKE(pciemu_trace_mmio);
+    stq_le_p(desc + PCIEMU_HW_DESC_CMD, PCIEMU_HW_DMA_CMD_PATTERN_FILL);
+    stl_le_p(desc + PCIEMU_HW_DESC_PATTERN_SEED, 0x1234);
+    pciemu_dma_desc_doorbell_ring(&dev, 2);
+    EXPECT_EQ(dev.dma.config.pattern, PCIEMU_HW_DMA_PATTERN_HASH,
+              "Should load the pattern of a pattern command");
+    EXPECT_EQ(dev.dma.config.seed, 0x1234, "Should load the seed");
+    EXPECT_EQ(pciemu_trace_mmio_fake.call_count, 7,
+              "Should trace the pattern registers too");
+    EXPECT_EQ(dev.dma.done_cnt, 2, "Should complete the command");
+
+    RESET_FAKE(pciemu_trace_mmio);
+    stq_le_p(desc + PCIEMU_HW_DESC_CMD, PCIEMU_HW_DMA_CMD_ENCRYPT);
+    stl_le_p(desc + PCIEMU_HW_DESC_CRYPTO_KEY_SLOT, 5);
+    stl_le_p(desc + PCIEMU_HW_DESC_CRYPTO_SECTOR_SIZE, 512);
+    stq_le_p(desc + PCIEMU_HW_DESC_CRYPTO_SECTOR, 0x123456789);
+    pciemu_dma_desc_doorbell_ring(&dev, 2);
+    EXPECT_EQ(dev.dma.config.key_slot, 5, "Should load the key slot");
+    EXPECT_EQ(dev.dma.config.sector_size, 512, "Should load the sector size");
+    EXPECT_EQ(dev.dma.config.sector, 0x123456789, "Should load the sector");
+    EXPECT_EQ(pciemu_trace_mmio_fake.call_count, 8,
+              "Should trace the encryption registers too");
+    EXPECT_EQ(dev.dma.error, PCIEMU_HW_DMA_ERR_CRYPTO,
+              "Should report a length shorter than a sector");
+    EXPECT_EQ(dev.dma.done_cnt, 3, "Should complete the command");
+
+    RESET_FAKE(pciemu_trace_mmio);
+    stq_le_p(desc + PCIEMU_HW_DESC_CMD, PCIEMU_HW_DMA_CMD_ATOMIC_CAS);
+    stq_le_p(desc + PCIEMU_HW_DESC_ATOMIC_OPERAND, 0x1111);
+    stq_le_p(desc + PCIEMU_HW_DESC_ATOMIC_COMPARE, 0x2222);
+    pciemu_dma_desc_doorbell_ring(&dev, 2);
+    EXPECT_EQ(dev.dma.config.operand, 0x1111, "Should load the operand");
+    EXPECT_EQ(dev.dma.config.compare, 0x2222, "Should load the compare value");
+    EXPECT_EQ(pciemu_trace_mmio_fake.call_count, 7,
+              "Should trace the atomic registers too");
+    EXPECT_EQ(dev.dma.error, PCIEMU_HW_DMA_ERR_ATOMIC,
+              "Should report an operand neither 4 nor 8 bytes");
+    EXPECT_EQ(dev.dma.done_cnt, 4, "Should complete the command");
+
+    RESET_FAKE(pciemu_trace_mmio);
+    RESET_FAKE(address_space_rw);
+    stq_le_p(desc + PCIEMU_HW_DESC_CMD,
+             PCIEMU_HW_DMA_DIRECTION_TO_DEVICE | PCIEMU_HW_DMA_CMD_FLAG_2D);
+    stl_le_p(desc + PCIEMU_HW_DESC_2D_ROWS, 2);
+    stq_le_p(desc + PCIEMU_HW_DESC_2D_SRC_STRIDE, 0x1000);
+    stq_le_p(desc + PCIEMU_HW_DESC_2D_DST_STRIDE, 64);
+    pciemu_dma_desc_doorbell_ring(&dev, 2);
+    EXPECT_EQ(dev.dma.config.rows, 2, "Should load the rows");
+    EXPECT_EQ(dev.dma.config.src_stride, 0x1000,
+              "Should load the source stride");
+    EXPECT_EQ(dev.dma.config.dst_stride, 64,
+              "Should load the destination stride");
+    EXPECT_EQ(pciemu_trace_mmio_fake.call_count, 8,
+              "Should trace the 2D registers too");
+    EXPECT_EQ(address_space_rw_fake.call_count, 2, "Should transfer each row");
+    EXPECT_EQ(dev.dma.error, PCIEMU_HW_DMA_ERR_NONE, "Should succeed");
+    EXPECT_EQ(dev.dma.done_cnt, 5, "Should complete the command");
+
+    RESET_FAKE(pciemu_trace_mmio);
+    stq_le_p(desc + PCIEMU_HW_DESC_CMD, PCIEMU_HW_DMA_CMD_MULTICAST);
+    stl_le_p(desc + PCIEMU_HW_DESC_MCAST_CNT, 4);
+    pciemu_dma_desc_doorbell_ring(&dev, 2);
+    EXPECT_EQ(dev.dma.config.mcast_cnt, 4, "Should load the destination count");
+    EXPECT_EQ(pciemu_trace_mmio_fake.call_count, 6,
+              "Should trace the multicast register too");
+    EXPECT_EQ(dev.dma.done_cnt, 6, "Should complete the command");
+
+    RESET_FAKE(pciemu_trace_mmio);
+    stq_le_p(desc + PCIEMU_HW_DESC_CMD, PCIEMU_HW_DMA_CMD_PQ);
+    stl_le_p(desc + PCIEMU_HW_DESC_RAID_SRC_CNT, 5);
+    stq_le_p(desc + PCIEMU_HW_DESC_RAID_Q_DST, 0xcccc0000);
+    pciemu_dma_desc_doorbell_ring(&dev, 2);
+    EXPECT_EQ(dev.dma.config.raid_cnt, 5, "Should load the source count");
+    EXPECT_EQ(dev.dma.config.q_dst, 0xcccc0000, "Should load the Q address");
+    EXPECT_EQ(pciemu_trace_mmio_fake.call_count, 7,
+              "Should trace the parity registers too");
+    EXPECT_EQ(dev.dma.done_cnt, 7, "Should complete the command");
+
+    RESET_FAKE(pciemu_trace_mmio);
+    stq_le_p(desc + PCIEMU_HW_DESC_CMD, PCIEMU_HW_DMA_CMD_SCAN);
+    stq_le_p(desc + PCIEMU_HW_DESC_SCAN_KEY_LO, 0x0a2c);
+    stq_le_p(desc + PCIEMU_HW_DESC_SCAN_KEY_HI, 0x1122);
+    stl_le_p(desc + PCIEMU_HW_DESC_SCAN_CTRL, 2 | PCIEMU_HW_DMA_SCAN_CTRL_SET);
+    stq_le_p(desc + PCIEMU_HW_DESC_SCAN_MAX, 100);
+    pciemu_dma_desc_doorbell_ring(&dev, 2);
+    EXPECT_EQ(dev.dma.config.scan_key[0], 0x0a2c, "Should load the key");
+    EXPECT_EQ(dev.dma.config.scan_key[1], 0x1122, "Should load the key");
+    EXPECT_EQ(dev.dma.config.scan_ctrl, 2 | PCIEMU_HW_DMA_SCAN_CTRL_SET,
+              "Should load the scan control");
+    EXPECT_EQ(dev.dma.config.scan_max, 100, "Should load the capacity");
+    EXPECT_EQ(pciemu_trace_mmio_fake.call_count, 9,
+              "Should trace the scan registers too");
+    EXPECT_EQ(dev.dma.done_cnt, 8, "Should complete the command");
+
+    RESET_FAKE(pciemu_trace_mmio);
+    stq_le_p(desc + PCIEMU_HW_DESC_CMD, PCIEMU_HW_DMA_CMD_SORT);
+    stl_le_p(desc + PCIEMU_HW_DESC_SORT_CTRL, PCIEMU_HW_DMA_SORT_CTRL_IDX);
+    stq_le_p(desc + PCIEMU_HW_DESC_SORT_IDX_DST, 0xcccc0000);
+    pciemu_dma_desc_doorbell_ring(&dev, 2);
+    EXPECT_EQ(dev.dma.config.sort_ctrl, PCIEMU_HW_DMA_SORT_CTRL_IDX,
+              "Should load the sort control");
+    EXPECT_EQ(dev.dma.config.sort_idx_dst, 0xcccc0000,
+              "Should load the index address");
+    EXPECT_EQ(pciemu_trace_mmio_fake.call_count, 7,
+              "Should trace the sort registers too");
+    EXPECT_EQ(dev.dma.done_cnt, 9, "Should complete the command");
+
+    dev.dma.status = DMA_STATUS_EXECUTING;
+    stq_le_p(desc + PCIEMU_HW_DESC_LEN, 128);
+    pciemu_dma_desc_doorbell_ring(&dev, 2);
+    EXPECT_EQ(dev.dma.config.txdesc.len, 64,
+              "Should not load a descriptor while EXECUTING");
+    EXPECT_EQ(dev.dma.done_cnt, 9, "Should not count a completion");
+
+    RESET_FAKE(pciemu_trace_mmio);
+    dev.dma.status = DMA_STATUS_IDLE;
+    pciemu_dma_desc_doorbell_ring(&dev, PCIEMU_HW_DESC_SLOT_CNT);
+    EXPECT_EQ(pciemu_trace_mmio_fake.call_count, 0,
+              "Should ignore a slot out of the window");
+    EXPECT_EQ(dev.dma.done_cnt, 9, "Should not ring the doorbell");
+    RESET_FAKE(address_space_rw);
+}
+
+TEST(pciemu_dma_complete_delayed, "Test delayed completion of DMA")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    RESET_FAKE(pciemu_irq_event);
+    RESET_FAKE(timer_mod_ns);
+    RESET_FAKE(pciemu_latency_sample);
+    pciemu_latency_sample_fake.return_val = 5000;
+    qemu_clock_get_ns_fake.return_val = 1000;
+    dev.dma.config.mask = DMA_BIT_MASK(PCIEMU_HW_DMA_ADDR_CAPABILITY);
+    dev.dma.buff = dev.dma.buff_inline;
+    dev.dma.buff_size = PCIEMU_HW_DMA_AREA_SIZE;
+    dev.dma.config.cmd = PCIEMU_HW_DMA_DIRECTION_TO_DEVICE;
+    dev.dma.config.txdesc.dst = PCIEMU_HW_DMA_AREA_START;
+    dev.dma.status = DMA_STATUS_IDLE;
+    pciemu_dma_doorbell_ring(&dev);
+    EXPECT_EQ(dev.dma.status, DMA_STATUS_EXECUTING,
+              "Should stay EXECUTING until the completion");
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 0, "Should not raise irq yet");
+    EXPECT_EQ(dev.dma.done_cnt, 0, "Should not count the completion yet");
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 1, "Should arm the timer");
+    EXPECT_EQ(timer_mod_ns_fake.arg1_val, 6000,
+              "Should complete after the sampled latency");
+
+    RESET_FAKE(pciemu_arbiter_complete);
+    pciemu_dma_complete(&dev);
+    EXPECT_EQ(dev.dma.status, DMA_STATUS_IDLE, "Should return to IDLE");
+    EXPECT_EQ(pciemu_arbiter_complete_fake.call_count, 1,
+              "Should hand the engine back to the arbiter");
+    EXPECT_EQ(pciemu_arbiter_complete_fake.arg1_val, PCIEMU_HW_DMA_ERR_NONE,
+              "Should give the error of the command");
+    EXPECT_EQ(dev.dma.done_cnt, 1, "Should count the completion");
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 1, "Should raise irq once");
+    EXPECT_EQ(pciemu_irq_event_fake.arg1_val, PCIEMU_HW_IRQ_CAUSE_DMA_DONE,
+              "Should signal the DMA done cause");
+    RESET_FAKE(pciemu_latency_sample);
+    RESET_FAKE(qemu_clock_get_ns);
+}
+
+TEST(pciemu_dma_stream, "Test streaming through the FIFO")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    RESET_FAKE(address_space_rw);
+    RESET_FAKE(pciemu_irq_event);
+    RESET_FAKE(pciemu_stats_event);
+    RESET_FAKE(timer_mod_ns);
+    dev.dma.config.mask = DMA_BIT_MASK(PCIEMU_HW_DMA_ADDR_CAPABILITY);
+    dev.dma.buff = dev.dma.buff_inline;
+    dev.dma.buff_size = PCIEMU_HW_DMA_AREA_SIZE;
+    dev.dma.config.cmd = PCIEMU_HW_DMA_CMD_STREAM;
+    dev.dma.config.txdesc.src = 0xaaaa0000;
+    dev.dma.config.txdesc.dst = 0xbbbb0000;
+    dev.dma.config.txdesc.len = 3 * PCIEMU_HW_DMA_AREA_SIZE + 10;
+    dev.dma.status = DMA_STATUS_IDLE;
+    pciemu_dma_doorbell_ring(&dev);
+    EXPECT_EQ(dev.dma.status, DMA_STATUS_EXECUTING,
+              "Should stay EXECUTING during the stream");
+    EXPECT_EQ(address_space_rw_fake.call_count, 0,
+              "Should leave the stream to the timer");
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 1, "Should arm the stream timer");
+    EXPECT_EQ(pciemu_stats_event_fake.call_count, 1,
+              "Should not timestamp the end before the stream is over");
+
+    pciemu_dma_stream_step(&dev);
+    EXPECT_EQ(address_space_rw_fake.call_count, 8,
+              "Should read and write 4 chunks (the FIFO is the area)");
+    EXPECT_EQ(address_space_rw_fake.arg1_val,
+              0xbbbb0000 + 3 * PCIEMU_HW_DMA_AREA_SIZE,
+              "Should write the last chunk at the right offset");
+    EXPECT_EQ(address_space_rw_fake.arg3_val, &dev.dma.buff[0],
+              "Should wrap around the FIFO");
+    EXPECT_EQ(address_space_rw_fake.arg4_val, 10,
+              "Should write only the remaining bytes");
+    EXPECT_EQ(dev.dma.status, DMA_STATUS_IDLE, "Should return to IDLE");
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 1, "Should complete once");
+    EXPECT_EQ(dev.dma.done_cnt, 1, "Should count the completion");
+    EXPECT_EQ(pciemu_stats_event_fake.arg1_val, STATS_EVENT_DMA_END,
+              "Should timestamp the end of the stream");
+
+    RESET_FAKE(address_space_rw);
+    RESET_FAKE(pciemu_irq_event);
+    RESET_FAKE(timer_mod_ns);
+    dev.dma.config.txdesc.len = PCIEMU_DMA_STREAM_BURST + 1;
+    pciemu_dma_doorbell_ring(&dev);
+    pciemu_dma_stream_step(&dev);
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 2,
+              "Should give the hand back after a burst");
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 0, "Should not complete yet");
+    pciemu_dma_stream_step(&dev);
+    EXPECT_EQ(address_space_rw_fake.arg4_val, 1,
+              "Should write the remaining byte");
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 1, "Should complete once");
+
+    RESET_FAKE(pciemu_irq_event);
+    address_space_rw_fake.return_val = MEMTX_DECODE_ERROR;
+    pciemu_dma_doorbell_ring(&dev);
+    pciemu_dma_stream_step(&dev);
+    EXPECT_FALSE(dev.dma.stream.active, "Should stop the stream");
+    EXPECT_EQ(dev.dma.error, PCIEMU_HW_DMA_ERR_BUS, "Should report the error");
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 1, "Should complete once");
+    RESET_FAKE(address_space_rw);
+}
+
+TEST(pciemu_dma_stream_pipeline, "Test streaming through the pipeline")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    RESET_FAKE(pciemu_irq_event);
+    RESET_FAKE(pciemu_pipeline_start);
+    RESET_FAKE(pciemu_stats_event);
+    RESET_FAKE(timer_mod_ns);
+    pciemu_pipeline_enabled_fake.return_val = true;
+    dev.dma.config.mask = DMA_BIT_MASK(PCIEMU_HW_DMA_ADDR_CAPABILITY);
+    dev.dma.config.cmd = PCIEMU_HW_DMA_CMD_STREAM;
+    dev.dma.config.txdesc.src = 0xaaaa0000;
+    dev.dma.config.txdesc.dst = 0xbbbb0000;
+    dev.dma.config.txdesc.len = 4 * PCIEMU_DMA_STREAM_CHUNK;
+    dev.dma.status = DMA_STATUS_IDLE;
+    pciemu_dma_doorbell_ring(&dev);
+    EXPECT_EQ(pciemu_pipeline_start_fake.call_count, 1,
+              "Should hand the stream to the pipeline");
+    EXPECT_EQ(pciemu_pipeline_start_fake.arg1_val, 0xaaaa0000,
+              "Should stream from the source");
+    EXPECT_EQ(pciemu_pipeline_start_fake.arg2_val, 0xbbbb0000,
+              "Should stream to the destination");
+    EXPECT_EQ(pciemu_pipeline_start_fake.arg3_val, 4 * PCIEMU_DMA_STREAM_CHUNK,
+              "Should stream the whole length");
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 0, "Should not arm the timer");
+    EXPECT_TRUE(dev.dma.stream.active, "Should wait for the pipeline");
+
+    pciemu_dma_stream_end(&dev, PCIEMU_HW_DMA_ERR_NONE);
+    EXPECT_FALSE(dev.dma.stream.active, "Should end the stream");
+    EXPECT_EQ(dev.dma.status, DMA_STATUS_IDLE, "Should return to IDLE");
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 1, "Should complete once");
+    EXPECT_EQ(pciemu_stats_event_fake.arg1_history[1], STATS_EVENT_DMA_END,
+              "Should timestamp the end of the stream");
+
+    dev.dma.config.txdesc.len = 0;
+    pciemu_dma_doorbell_ring(&dev);
+    EXPECT_EQ(pciemu_pipeline_start_fake.call_count, 1,
+              "Should not hand an empty stream to the pipeline");
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 1,
+              "Should leave an empty stream to the timer");
+    pciemu_dma_stream_step(&dev);
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 2, "Should complete once");
+    pciemu_pipeline_enabled_fake.return_val = false;
+}
+
+TEST(pciemu_dma_sort, "Test sorting keys on a worker")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAConfig *cfg = &dev.dma.config;
+    RESET_FAKE(pciemu_irq_event);
+    RESET_FAKE(pciemu_sort_start);
+    RESET_FAKE(pciemu_stats_event);
+    RESET_FAKE(timer_mod_ns);
+    cfg->mask = DMA_BIT_MASK(PCIEMU_HW_DMA_ADDR_CAPABILITY);
+    cfg->cmd = PCIEMU_HW_DMA_CMD_SORT;
+    cfg->txdesc.src = 0xaaaa0000;
+    cfg->txdesc.dst = 0xbbbb0000;
+    cfg->txdesc.len = 1000 * sizeof(uint64_t);
+    cfg->sort_ctrl =
+        PCIEMU_HW_DMA_SORT_CTRL_KEY64 | PCIEMU_HW_DMA_SORT_CTRL_IDX;
+    cfg->sort_idx_dst = 0xcccc0000;
+    dev.dma.status = DMA_STATUS_IDLE;
+    pciemu_sort_active_fake.return_val = true;
+    pciemu_dma_doorbell_ring(&dev);
+    EXPECT_EQ(pciemu_sort_start_fake.call_count, 1,
+              "Should hand the keys to a worker");
+    EXPECT_EQ(pciemu_sort_start_fake.arg1_val, 0xaaaa0000,
+              "Should sort the source");
+    EXPECT_EQ(pciemu_sort_start_fake.arg2_val, 0xbbbb0000,
+              "Should write the keys to the destination");
+    EXPECT_EQ(pciemu_sort_start_fake.arg3_val, 0xcccc0000,
+              "Should write the indices to SORT_IDX_DST");
+    EXPECT_EQ(pciemu_sort_start_fake.arg4_val, 1000, "Should count the keys");
+    EXPECT_EQ(pciemu_sort_start_fake.arg5_val, sizeof(uint64_t),
+              "Should sort 64-bit keys");
+    EXPECT_TRUE(pciemu_sort_start_fake.arg6_val, "Should write the indices");
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 0,
+              "Should not complete before the worker");
+    EXPECT_EQ(pciemu_stats_event_fake.call_count, 1,
+              "Should not timestamp the end before the worker");
+    EXPECT_EQ(dev.dma.status, DMA_STATUS_EXECUTING, "Should be EXECUTING");
+
+    pciemu_sort_active_fake.return_val = false;
+    pciemu_dma_sort_end(&dev, PCIEMU_HW_DMA_ERR_NONE);
+    EXPECT_EQ(dev.dma.status, DMA_STATUS_IDLE, "Should return to IDLE");
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 1, "Should complete once");
+    EXPECT_EQ(pciemu_stats_event_fake.arg1_history[1], STATS_EVENT_DMA_END,
+              "Should timestamp the end of the sort");
+
+    cfg->sort_ctrl = 0;
+    cfg->txdesc.len = 6;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_SORT,
+              "Should fail : length not a multiple of the key size");
+    cfg->txdesc.len = (PCIEMU_HW_DMA_SORT_KEY_CNT_MAX + 1) * sizeof(uint32_t);
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_SORT,
+              "Should fail : too many keys");
+    cfg->txdesc.len = 0;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed : nothing to sort");
+    EXPECT_EQ(pciemu_sort_start_fake.call_count, 1,
+              "Should not start an invalid or empty sort");
+
+    cfg->txdesc.len = 64;
+    EXPECT_EQ(pciemu_dma_execute(&dev), PCIEMU_HW_DMA_ERR_NONE,
+              "Should leave the keys to the worker");
+    EXPECT_EQ(pciemu_sort_start_fake.arg4_val, 16, "Should count 32-bit keys");
+    EXPECT_FALSE(pciemu_sort_start_fake.arg6_val,
+                 "Should not write the indices");
+    RESET_FAKE(pciemu_sort_start);
+}
+
+TEST(pciemu_dma_rw, "Test DMA transfers to and from the bus")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    uint8_t buf[16];
+    RESET_FAKE(address_space_rw);
+    RESET_FAKE(pciemu_trace_dma);
+    pciemu_dma_rw(&dev, 0xcafe0000, buf, sizeof(buf), DMA_DIRECTION_TO_DEVICE);
+    EXPECT_EQ(address_space_rw_fake.call_count, 1, "Should access the bus");
+    EXPECT_EQ(address_space_rw_fake.arg1_val, 0xcafe0000,
+              "Should access the bus address");
+    EXPECT_EQ(address_space_rw_fake.arg5_val, false, "Should read the bus");
+    EXPECT_EQ(pciemu_trace_dma_fake.call_count, 1, "Should record the DMA");
+    EXPECT_EQ(pciemu_trace_dma_fake.arg1_val, DMA_DIRECTION_TO_DEVICE,
+              "Should record the direction");
+    EXPECT_EQ(pciemu_trace_dma_fake.arg4_val, sizeof(buf),
+              "Should record the length");
+
+    pciemu_dma_rw(&dev, 0xcafe0000, buf, sizeof(buf),
+                  DMA_DIRECTION_FROM_DEVICE);
+    EXPECT_EQ(address_space_rw_fake.arg5_val, true, "Should write the bus");
+    EXPECT_EQ(pciemu_trace_dma_fake.arg1_val, DMA_DIRECTION_FROM_DEVICE,
+              "Should record the direction");
+
+    RESET_FAKE(address_space_rw);
+    RESET_FAKE(pciemu_mapcache_rw);
+    pciemu_mapcache_rw_fake.return_val = true;
+    pciemu_dma_rw(&dev, 0xcafe0000, buf, sizeof(buf), DMA_DIRECTION_TO_DEVICE);
+    EXPECT_EQ(pciemu_mapcache_rw_fake.call_count, 1, "Should try the cache");
+    EXPECT_EQ(address_space_rw_fake.call_count, 0,
+              "Should not access the bus through a cached mapping");
+    EXPECT_EQ(pciemu_trace_dma_fake.call_count, 3,
+              "Should record the DMA anyway");
+    RESET_FAKE(pciemu_mapcache_rw);
+    RESET_FAKE(address_space_rw);
 }
 
 TEST(pciemu_dma_config_txdesc_src, "Test configuration of DMA txdesc src")
@@ -172,11 +1435,184 @@ TEST(pciemu_dma_config_cmd, "Test configuration of DMA cmd")
     pciemu_dma_config_cmd(&dev, cmd);
     EXPECT_NEQ(dev.dma.config.cmd, cmd, "Should not set the value");
 }
+
+TEST(pciemu_dma_config_pattern, "Test configuration of DMA pattern")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    dev.dma.status = DMA_STATUS_IDLE;
+    pciemu_dma_config_pattern(&dev, PCIEMU_HW_DMA_PATTERN_HASH);
+    pciemu_dma_config_pattern_seed(&dev, 0x1234);
+    EXPECT_EQ(dev.dma.config.pattern, PCIEMU_HW_DMA_PATTERN_HASH,
+              "Should set the value");
+    EXPECT_EQ(dev.dma.config.seed, 0x1234, "Should set the value");
+
+    dev.dma.status = DMA_STATUS_EXECUTING;
+    pciemu_dma_config_pattern(&dev, PCIEMU_HW_DMA_PATTERN_COUNTER);
+    pciemu_dma_config_pattern_seed(&dev, 0x5678);
+    EXPECT_NEQ(dev.dma.config.pattern, PCIEMU_HW_DMA_PATTERN_COUNTER,
+               "Should not set the value");
+    EXPECT_NEQ(dev.dma.config.seed, 0x5678, "Should not set the value");
+}
+
+TEST(pciemu_dma_config_crypto, "Test configuration of DMA encryption")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    dev.dma.status = DMA_STATUS_IDLE;
+    pciemu_dma_config_crypto_key_slot(&dev, 7);
+    pciemu_dma_config_crypto_sector_size(&dev, 4096);
+    pciemu_dma_config_crypto_sector(&dev, 0x123456789);
+    EXPECT_EQ(dev.dma.config.key_slot, 7, "Should set the value");
+    EXPECT_EQ(dev.dma.config.sector_size, 4096, "Should set the value");
+    EXPECT_EQ(dev.dma.config.sector, 0x123456789, "Should set the value");
+
+    dev.dma.status = DMA_STATUS_EXECUTING;
+    pciemu_dma_config_crypto_key_slot(&dev, 1);
+    pciemu_dma_config_crypto_sector_size(&dev, 512);
+    pciemu_dma_config_crypto_sector(&dev, 1);
+    EXPECT_NEQ(dev.dma.config.key_slot, 1, "Should not set the value");
+    EXPECT_NEQ(dev.dma.config.sector_size, 512, "Should not set the value");
+    EXPECT_NEQ(dev.dma.config.sector, 1, "Should not set the value");
+}
+
+TEST(pciemu_dma_config_atomic, "Test configuration of DMA atomic operands")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    dev.dma.status = DMA_STATUS_IDLE;
+    pciemu_dma_config_atomic_operand(&dev, 0x123456789);
+    pciemu_dma_config_atomic_compare(&dev, 0x987654321);
+    EXPECT_EQ(dev.dma.config.operand, 0x123456789, "Should set the value");
+    EXPECT_EQ(dev.dma.config.compare, 0x987654321, "Should set the value");
+
+    dev.dma.status = DMA_STATUS_EXECUTING;
+    pciemu_dma_config_atomic_operand(&dev, 1);
+    pciemu_dma_config_atomic_compare(&dev, 1);
+    EXPECT_NEQ(dev.dma.config.operand, 1, "Should not set the value");
+    EXPECT_NEQ(dev.dma.config.compare, 1, "Should not set the value");
+}
+
+TEST(pciemu_dma_config_2d, "Test configuration of 2D transfers")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    dev.dma.status = DMA_STATUS_IDLE;
+    pciemu_dma_config_2d_rows(&dev, 8);
+    pciemu_dma_config_2d_src_stride(&dev, 1024);
+    pciemu_dma_config_2d_dst_stride(&dev, 16);
+    EXPECT_EQ(dev.dma.config.rows, 8, "Should set the value");
+    EXPECT_EQ(dev.dma.config.src_stride, 1024, "Should set the value");
+    EXPECT_EQ(dev.dma.config.dst_stride, 16, "Should set the value");
+
+    dev.dma.status = DMA_STATUS_EXECUTING;
+    pciemu_dma_config_2d_rows(&dev, 1);
+    pciemu_dma_config_2d_src_stride(&dev, 1);
+    pciemu_dma_config_2d_dst_stride(&dev, 1);
+    EXPECT_NEQ(dev.dma.config.rows, 1, "Should not set the value");
+    EXPECT_NEQ(dev.dma.config.src_stride, 1, "Should not set the value");
+    EXPECT_NEQ(dev.dma.config.dst_stride, 1, "Should not set the value");
+}
+
+TEST(pciemu_dma_config_mcast, "Test configuration of multicast commands")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    dev.dma.status = DMA_STATUS_IDLE;
+    pciemu_dma_config_mcast_cnt(&dev, 8);
+    EXPECT_EQ(dev.dma.config.mcast_cnt, 8, "Should set the value");
+
+    dev.dma.status = DMA_STATUS_EXECUTING;
+    pciemu_dma_config_mcast_cnt(&dev, 2);
+    EXPECT_NEQ(dev.dma.config.mcast_cnt, 2, "Should not set the value");
+}
+
+TEST(pciemu_dma_config_raid, "Test configuration of parity commands")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    dev.dma.status = DMA_STATUS_IDLE;
+    pciemu_dma_config_raid_src_cnt(&dev, 8);
+    pciemu_dma_config_raid_q_dst(&dev, 0xcccc0000);
+    EXPECT_EQ(dev.dma.config.raid_cnt, 8, "Should set the value");
+    EXPECT_EQ(dev.dma.config.q_dst, 0xcccc0000, "Should set the value");
+
+    dev.dma.status = DMA_STATUS_EXECUTING;
+    pciemu_dma_config_raid_src_cnt(&dev, 2);
+    pciemu_dma_config_raid_q_dst(&dev, 1);
+    EXPECT_NEQ(dev.dma.config.raid_cnt, 2, "Should not set the value");
+    EXPECT_NEQ(dev.dma.config.q_dst, 1, "Should not set the value");
+}
+
+TEST(pciemu_dma_config_scan, "Test configuration of scan commands")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    dev.dma.status = DMA_STATUS_IDLE;
+    pciemu_dma_config_scan_key_lo(&dev, 0x0a2c);
+    pciemu_dma_config_scan_key_hi(&dev, 0x1122);
+    pciemu_dma_config_scan_ctrl(&dev, 2 | PCIEMU_HW_DMA_SCAN_CTRL_SET);
+    pciemu_dma_config_scan_max(&dev, 100);
+    EXPECT_EQ(dev.dma.config.scan_key[0], 0x0a2c, "Should set the value");
+    EXPECT_EQ(dev.dma.config.scan_key[1], 0x1122, "Should set the value");
+    EXPECT_EQ(dev.dma.config.scan_ctrl, 2 | PCIEMU_HW_DMA_SCAN_CTRL_SET,
+              "Should set the value");
+    EXPECT_EQ(dev.dma.config.scan_max, 100, "Should set the value");
+
+    dev.dma.status = DMA_STATUS_EXECUTING;
+    pciemu_dma_config_scan_key_lo(&dev, 1);
+    pciemu_dma_config_scan_key_hi(&dev, 1);
+    pciemu_dma_config_scan_ctrl(&dev, 1);
+    pciemu_dma_config_scan_max(&dev, 1);
+    EXPECT_NEQ(dev.dma.config.scan_key[0], 1, "Should not set the value");
+    EXPECT_NEQ(dev.dma.config.scan_key[1], 1, "Should not set the value");
+    EXPECT_NEQ(dev.dma.config.scan_ctrl, 1, "Should not set the value");
+    EXPECT_NEQ(dev.dma.config.scan_max, 1, "Should not set the value");
+}
+
+TEST(pciemu_dma_config_sort, "Test configuration of the sort command")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    dev.dma.status = DMA_STATUS_IDLE;
+    pciemu_dma_config_sort_ctrl(&dev, PCIEMU_HW_DMA_SORT_CTRL_KEY64);
+    pciemu_dma_config_sort_idx_dst(&dev, 0xcccc0000);
+    EXPECT_EQ(dev.dma.config.sort_ctrl, PCIEMU_HW_DMA_SORT_CTRL_KEY64,
+              "Should set the value");
+    EXPECT_EQ(dev.dma.config.sort_idx_dst, 0xcccc0000, "Should set the value");
+
+    dev.dma.status = DMA_STATUS_EXECUTING;
+    pciemu_dma_config_sort_ctrl(&dev, 0);
+    pciemu_dma_config_sort_idx_dst(&dev, 1);
+    EXPECT_NEQ(dev.dma.config.sort_ctrl, 0, "Should not set the value");
+    EXPECT_NEQ(dev.dma.config.sort_idx_dst, 1, "Should not set the value");
+}
+
 TEST(pciemu_dma_reset, "Test reset of DMA")
 {
     PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    dev.dma.error = PCIEMU_HW_DMA_ERR_BUS;
+    dev.dma.done_cnt = 10;
+    dev.dma.atomic_result = 10;
+    dev.dma.scan_cnt = 10;
+    dev.dma.stream.active = true;
+    RESET_FAKE(pciemu_pipeline_reset);
+    RESET_FAKE(pciemu_sort_reset);
+    RESET_FAKE(pciemu_arbiter_reset);
+    RESET_FAKE(pciemu_crypto_reset);
     pciemu_dma_reset(&dev);
+    EXPECT_FALSE(dev.dma.stream.active, "Should stop the stream");
+    EXPECT_EQ(pciemu_pipeline_reset_fake.call_count, 1,
+              "Should abort the pipelined stream");
+    EXPECT_EQ(pciemu_sort_reset_fake.call_count, 1,
+              "Should drop the sort in progress");
+    EXPECT_EQ(pciemu_arbiter_reset_fake.call_count, 1,
+              "Should drop the queued commands");
+    EXPECT_EQ(pciemu_crypto_reset_fake.call_count, 1,
+              "Should clear the key slots");
+    EXPECT_EQ(dev.dma.config.sector_size, PCIEMU_HW_CRYPTO_SECTOR_SIZE_MIN,
+              "Should default to the smallest sector size");
+    EXPECT_EQ(dev.dma.config.rows, 1, "Should default to a single row");
+    EXPECT_EQ(dev.dma.config.mcast_cnt, 1,
+              "Should default to a single destination");
+    EXPECT_EQ(dev.dma.config.raid_cnt, 1, "Should default to a single source");
     EXPECT_EQ(dev.dma.status, DMA_STATUS_IDLE, "Should have IDLE status");
+    EXPECT_EQ(dev.dma.error, PCIEMU_HW_DMA_ERR_NONE, "Should clear the error");
+    EXPECT_EQ(dev.dma.done_cnt, 0, "Should clear the completion counter");
+    EXPECT_EQ(dev.dma.atomic_result, 0, "Should clear the atomic result");
+    EXPECT_EQ(dev.dma.scan_cnt, 0, "Should clear the match count");
     EXPECT_EQ(dev.dma.config.txdesc.src, 0, "Should be initialized to zero");
     EXPECT_EQ(dev.dma.config.txdesc.dst, 0, "Should be initialized to zero");
     EXPECT_EQ(dev.dma.config.txdesc.len, 0, "Should be initialized to zero");
@@ -193,6 +1629,146 @@ TEST(pciemu_dma_init, "Test initialization of DMA")
     EXPECT_EQ(dev.dma.config.txdesc.dst, 0, "Should be initialized to zero");
     EXPECT_EQ(dev.dma.config.txdesc.len, 0, "Should be initialized to zero");
     EXPECT_EQ(dev.dma.config.cmd, 0, "Should be initialized to zero");
+    EXPECT_EQ(dev.dma.buff, dev.dma.buff_inline,
+              "Should use the inline device memory without memdev");
+    EXPECT_EQ(dev.dma.buff_size, PCIEMU_HW_DMA_AREA_SIZE,
+              "Should use the default device memory size without memdev");
+
+    RESET_FAKE(timer_init_full);
+    RESET_FAKE(pciemu_latency_init);
+    RESET_FAKE(pciemu_pipeline_init);
+    RESET_FAKE(pciemu_arbiter_init);
+    RESET_FAKE(pciemu_crypto_init);
+    RESET_FAKE(pciemu_sort_init);
+    pciemu_dma_init(&dev, &e);
+    EXPECT_EQ(pciemu_arbiter_init_fake.call_count, 1,
+              "Should init the arbiter");
+    EXPECT_EQ(pciemu_crypto_init_fake.call_count, 1,
+              "Should init the key slots");
+    EXPECT_EQ(pciemu_sort_init_fake.call_count, 1, "Should init the sort");
+    EXPECT_EQ(pciemu_latency_init_fake.call_count, 1,
+              "Should init the latency model");
+    EXPECT_EQ(pciemu_pipeline_init_fake.call_count, 1,
+              "Should init the pipeline");
+    EXPECT_EQ(timer_init_full_fake.call_count, 2,
+              "Should init the completion and stream timers");
+
+    RESET_FAKE(memory_region_init_ram);
+    RESET_FAKE(memory_region_get_ram_ptr);
+    static uint8_t window[PCIEMU_HW_DESC_WINDOW_SIZE];
+    memory_region_get_ram_ptr_fake.return_val = window;
+    pciemu_dma_init(&dev, &e);
+    EXPECT_EQ(memory_region_init_ram_fake.arg0_val, &dev.desc,
+              "Should allocate the descriptor window");
+    EXPECT_EQ(memory_region_init_ram_fake.arg3_val, PCIEMU_HW_DESC_WINDOW_SIZE,
+              "Should allocate the whole descriptor window");
+    EXPECT_EQ(dev.dma.desc, window, "Should keep the descriptor window");
+    RESET_FAKE(memory_region_get_ram_ptr);
+}
+
+TEST(pciemu_dma_init_memdev, "Test initialization of DMA with a memdev")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    HostMemoryBackend *memdev = (HostMemoryBackend *)0x1234;
+    static uint8_t mem[8 * PCIEMU_HW_DMA_AREA_SIZE];
+    Error *e = NULL;
+    RESET_FAKE(host_memory_backend_set_mapped);
+    memory_region_get_ram_ptr_fake.return_val = mem;
+    memory_region_size_fake.return_val = sizeof(mem);
+    host_memory_backend_is_mapped_fake.return_val = false;
+    dev.dma.memdev = memdev;
+    mem[0] = 0xaa;
+    pciemu_dma_init(&dev, &e);
+    EXPECT_EQ(dev.dma.buff, mem, "Should use the memory of the backend");
+    EXPECT_EQ(dev.dma.buff_size, sizeof(mem), "Should use the backend size");
+    EXPECT_EQ(host_memory_backend_set_mapped_fake.arg1_val, true,
+              "Should mark the backend as mapped");
+    EXPECT_EQ(mem[0], 0xaa, "Should keep the content of the backend");
+
+    pciemu_dma_fini(&dev);
+    EXPECT_EQ(host_memory_backend_set_mapped_fake.arg1_val, false,
+              "Should release the backend");
+
+    RESET_FAKE(error_setg_internal);
+    dev.dma.buff = NULL;
+    host_memory_backend_is_mapped_fake.return_val = true;
+    pciemu_dma_init(&dev, &e);
+    EXPECT_EQ(error_setg_internal_fake.call_count, 1,
+              "Should fail if the backend is already in use");
+    EXPECT_EQ(dev.dma.buff, NULL, "Should not use the backend");
+}
+
+TEST(pciemu_dma_init_hostnuma, "Test initialization of DMA on host nodes")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    static uint8_t mem[PCIEMU_HW_DMA_AREA_SIZE];
+    Error *e = NULL;
+    RESET_FAKE(pciemu_hostnuma_init);
+    RESET_FAKE(pciemu_hostnuma_alloc);
+    RESET_FAKE(pciemu_hostnuma_fini);
+    pciemu_hostnuma_enabled_fake.return_val = true;
+    pciemu_hostnuma_alloc_fake.return_val = mem;
+    mem[0] = 0xaa;
+    pciemu_dma_init(&dev, &e);
+    EXPECT_EQ(pciemu_hostnuma_init_fake.call_count, 1,
+              "Should check the host placement");
+    EXPECT_EQ(pciemu_hostnuma_alloc_fake.arg1_val, PCIEMU_HW_DMA_AREA_SIZE,
+              "Should allocate the default device memory size");
+    EXPECT_EQ(dev.dma.buff, mem, "Should use the memory on the host nodes");
+    EXPECT_EQ(mem[0], 0, "Should clear the device memory");
+
+    pciemu_dma_fini(&dev);
+    EXPECT_EQ(pciemu_hostnuma_fini_fake.call_count, 1,
+              "Should free the memory on the host nodes");
+
+    dev.dma.buff = NULL;
+    pciemu_hostnuma_alloc_fake.return_val = NULL;
+    pciemu_dma_init(&dev, &e);
+    EXPECT_EQ(dev.dma.buff, NULL, "Should fail without device memory");
+    RESET_FAKE(pciemu_hostnuma_enabled);
+    RESET_FAKE(pciemu_hostnuma_alloc);
+}
+
+/* any non-NULL error will do, the fakes never look into it */
+static void pciemu_mapcache_init_fail(PCIEMUDevice *dev, Error **errp)
+{
+    static char failure;
+    *errp = (Error *)&failure;
+}
+
+TEST(pciemu_dma_init_unwind, "Test failed initialization of DMA")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    Error *e = NULL;
+    RESET_FAKE(pciemu_pipeline_reset);
+    RESET_FAKE(pciemu_mapcache_fini);
+    RESET_FAKE(pciemu_hostnuma_init);
+    RESET_FAKE(pciemu_hostnuma_fini);
+    RESET_FAKE(error_propagate);
+    pciemu_mapcache_init_fake.custom_fake = pciemu_mapcache_init_fail;
+    pciemu_dma_init(&dev, &e);
+    EXPECT_EQ(error_propagate_fake.call_count, 1, "Should report the error");
+    EXPECT_EQ(pciemu_hostnuma_init_fake.call_count, 0, "Should stop there");
+    EXPECT_EQ(pciemu_pipeline_reset_fake.call_count, 1,
+              "Should stop the pipeline");
+    EXPECT_EQ(pciemu_mapcache_fini_fake.call_count, 0,
+              "Should not undo the failed step");
+    RESET_FAKE(pciemu_mapcache_init);
+
+    RESET_FAKE(pciemu_pipeline_reset);
+    RESET_FAKE(error_propagate);
+    pciemu_hostnuma_enabled_fake.return_val = true;
+    pciemu_hostnuma_alloc_fake.return_val = NULL;
+    pciemu_dma_init(&dev, &e);
+    EXPECT_EQ(error_propagate_fake.call_count, 1, "Should report the error");
+    EXPECT_EQ(pciemu_hostnuma_fini_fake.call_count, 1,
+              "Should undo the host placement");
+    EXPECT_EQ(pciemu_mapcache_fini_fake.call_count, 1,
+              "Should unregister the map cache");
+    EXPECT_EQ(pciemu_pipeline_reset_fake.call_count, 1,
+              "Should stop the pipeline");
+    RESET_FAKE(pciemu_hostnuma_enabled);
+    RESET_FAKE(pciemu_hostnuma_alloc);
 }
 
 TEST(pciemu_dma_fini, "Test finalization of DMA")
@@ -0,0 +1,270 @@
+/* pciemu_hostnuma.c - Unit tests for hw/pciemu/hostnuma.c file
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "unitctest/unitctest.h"
+#include "fff/fff.h"
+#include "qemu.fake.h"
+
+/* include the source file to test static functions */
+#include "../src/hw/pciemu/hostnuma.c"
+
+DEFINE_FFF_GLOBALS;
+
+/* list given to the setter and nodes seen by the getter */
+static uint16List hostnuma_test_list[2];
+static uint16_t hostnuma_test_seen[4];
+static size_t hostnuma_test_seen_cnt;
+
+static bool hostnuma_test_visit_in(Visitor *v, const char *name,
+                                   uint16List **obj, Error **errp)
+{
+    *obj = hostnuma_test_list;
+    return true;
+}
+
+static bool hostnuma_test_visit_out(Visitor *v, const char *name,
+                                    uint16List **obj, Error **errp)
+{
+    hostnuma_test_seen_cnt = 0;
+    for (uint16List *l = *obj; l; l = l->next)
+        hostnuma_test_seen[hostnuma_test_seen_cnt++] = l->value;
+    return true;
+}
+
+static void *hostnuma_test_memalign(size_t alignment, size_t size)
+{
+    void *p = NULL;
+    return posix_memalign(&p, alignment, size) ? NULL : p;
+}
+
+static void hostnuma_test_vfree(void *ptr)
+{
+    free(ptr);
+}
+
+#ifdef CONFIG_LINUX
+TEST(pciemu_hostnuma_parse_cpus, "Test parsing of the CPU lists")
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    EXPECT_TRUE(pciemu_hostnuma_parse_cpus("0-3,8,10-11\n", &cpus),
+                "Should parse ranges and single CPUs");
+    EXPECT_EQ(CPU_COUNT(&cpus), 7, "Should add every CPU of the list");
+    EXPECT_TRUE(CPU_ISSET(3, &cpus) && CPU_ISSET(8, &cpus) &&
+                    CPU_ISSET(11, &cpus) && !CPU_ISSET(9, &cpus),
+                "Should add the CPUs of the list only");
+
+    CPU_ZERO(&cpus);
+    EXPECT_TRUE(pciemu_hostnuma_parse_cpus("\n", &cpus),
+                "Should accept a node without CPU");
+    EXPECT_EQ(CPU_COUNT(&cpus), 0, "Should add no CPU");
+    EXPECT_FALSE(pciemu_hostnuma_parse_cpus("3-1\n", &cpus),
+                 "Should reject a reversed range");
+    EXPECT_FALSE(pciemu_hostnuma_parse_cpus("0;1\n", &cpus),
+                 "Should reject a bad separator");
+}
+#endif
+
+TEST(pciemu_hostnuma_nodes, "Test the host-nodes property")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    Error *e = NULL;
+    RESET_FAKE(object_dynamic_cast_assert);
+    RESET_FAKE(error_setg_internal);
+    object_dynamic_cast_assert_fake.return_val = (Object *)&dev;
+    visit_type_uint16List_fake.custom_fake = hostnuma_test_visit_in;
+    hostnuma_test_list[0] = (uint16List){ .next = &hostnuma_test_list[1],
+                                          .value = 1 };
+    hostnuma_test_list[1] = (uint16List){ .next = NULL, .value = 3 };
+    pciemu_hostnuma_set_nodes(OBJECT(&dev), NULL, "host-nodes", NULL, &e);
+    EXPECT_TRUE(test_bit(1, dev.dma.numa.host_nodes) &&
+                    test_bit(3, dev.dma.numa.host_nodes) &&
+                    !test_bit(2, dev.dma.numa.host_nodes),
+                "Should set the nodes of the list");
+    EXPECT_EQ(pciemu_hostnuma_last_node(&dev.dma.numa), 3,
+              "Should find the highest node");
+
+    visit_type_uint16List_fake.custom_fake = hostnuma_test_visit_out;
+    pciemu_hostnuma_get_nodes(OBJECT(&dev), NULL, "host-nodes", NULL, &e);
+    EXPECT_EQ(hostnuma_test_seen_cnt, 2, "Should list the nodes set");
+    EXPECT_TRUE(hostnuma_test_seen[0] == 1 && hostnuma_test_seen[1] == 3,
+                "Should list the nodes in order");
+
+    visit_type_uint16List_fake.custom_fake = hostnuma_test_visit_in;
+    hostnuma_test_list[0].value = 5;
+    hostnuma_test_list[1].value = MAX_NODES;
+    pciemu_hostnuma_set_nodes(OBJECT(&dev), NULL, "host-nodes", NULL, &e);
+    EXPECT_EQ(error_setg_internal_fake.call_count, 1,
+              "Should reject a node out of range");
+    EXPECT_FALSE(test_bit(5, dev.dma.numa.host_nodes),
+                 "Should set no node of an invalid list");
+    RESET_FAKE(visit_type_uint16List);
+    RESET_FAKE(object_dynamic_cast_assert);
+}
+
+TEST(pciemu_hostnuma_policy, "Test the policy property")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    RESET_FAKE(object_dynamic_cast_assert);
+    object_dynamic_cast_assert_fake.return_val = (Object *)&dev;
+    EXPECT_FALSE(pciemu_hostnuma_enabled(&dev), "Should be off by default");
+    pciemu_hostnuma_set_policy(OBJECT(&dev), HOST_MEM_POLICY_BIND, NULL);
+    EXPECT_EQ(pciemu_hostnuma_get_policy(OBJECT(&dev), NULL),
+              HOST_MEM_POLICY_BIND, "Should read back the policy");
+    EXPECT_TRUE(pciemu_hostnuma_enabled(&dev), "Should be on with a policy");
+    RESET_FAKE(object_dynamic_cast_assert);
+}
+
+TEST(pciemu_hostnuma_init, "Test initialization of the placement")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAHostNuma *numa = &dev.dma.numa;
+    Error *e = NULL;
+    RESET_FAKE(error_setg_internal);
+    pciemu_hostnuma_init(&dev, &e);
+    EXPECT_EQ(error_setg_internal_fake.call_count, 0,
+              "Should accept no placement");
+    EXPECT_FALSE(pciemu_hostnuma_enabled(&dev), "Should not be placed");
+
+    numa->policy = HOST_MEM_POLICY_BIND;
+    pciemu_hostnuma_init(&dev, &e);
+    EXPECT_EQ(error_setg_internal_fake.call_count, 1,
+              "Should require host-nodes with a policy");
+
+    RESET_FAKE(error_setg_internal);
+    numa->policy = HOST_MEM_POLICY_DEFAULT;
+    set_bit(0, numa->host_nodes);
+    pciemu_hostnuma_init(&dev, &e);
+    EXPECT_EQ(error_setg_internal_fake.call_count, 1,
+              "Should require a policy with host-nodes");
+
+    RESET_FAKE(error_setg_internal);
+    numa->policy = HOST_MEM_POLICY_BIND;
+    pciemu_hostnuma_init(&dev, &e);
+#ifdef CONFIG_NUMA
+    EXPECT_EQ(error_setg_internal_fake.call_count, 0,
+              "Should accept the node 0");
+#else
+    EXPECT_EQ(error_setg_internal_fake.call_count, 1,
+              "Should fail without NUMA support");
+#endif
+
+#ifdef CONFIG_NUMA
+    RESET_FAKE(error_setg_internal);
+    set_bit(MAX_NODES - 1, numa->host_nodes);
+    pciemu_hostnuma_init(&dev, &e);
+    EXPECT_EQ(error_setg_internal_fake.call_count, 1,
+              "Should reject a node missing on the host");
+#endif
+}
+
+TEST(pciemu_hostnuma_follow_guest, "Test placement from the VM topology")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAHostNuma *numa = &dev.dma.numa;
+    static HostMemoryBackend memdev;
+    static NumaState numa_state;
+    static MachineState ms = { .numa_state = &numa_state };
+    Error *e = NULL;
+    numa_state.num_nodes = 2;
+    numa_state.nodes[1].node_memdev = &memdev;
+    memdev.policy = HOST_MEM_POLICY_INTERLEAVE;
+    set_bit(0, memdev.host_nodes);
+    current_machine = &ms;
+    RESET_FAKE(pci_bus_numa_node);
+    RESET_FAKE(error_setg_internal);
+
+    pci_bus_numa_node_fake.return_val = NUMA_NODE_UNASSIGNED;
+    pciemu_hostnuma_init(&dev, &e);
+    EXPECT_FALSE(pciemu_hostnuma_enabled(&dev),
+                 "Should not be placed on a bus without node");
+
+    pci_bus_numa_node_fake.return_val = 1;
+    pciemu_hostnuma_init(&dev, &e);
+    EXPECT_EQ(numa->policy, HOST_MEM_POLICY_INTERLEAVE,
+              "Should take the policy of the guest node");
+    EXPECT_TRUE(test_bit(0, numa->host_nodes),
+                "Should take the host nodes of the guest node");
+
+    memset(numa, 0, sizeof(*numa));
+    set_bit(0, numa->host_nodes);
+    numa->policy = HOST_MEM_POLICY_PREFERRED;
+    RESET_FAKE(pci_bus_numa_node);
+    pciemu_hostnuma_init(&dev, &e);
+    EXPECT_EQ(pci_bus_numa_node_fake.call_count, 0,
+              "Should not follow the VM with an explicit placement");
+    EXPECT_EQ(numa->policy, HOST_MEM_POLICY_PREFERRED,
+              "Should keep the explicit policy");
+    current_machine = NULL;
+}
+
+TEST(pciemu_hostnuma_alloc, "Test allocation of memory on host nodes")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAHostNuma *numa = &dev.dma.numa;
+    Error *e = NULL;
+    RESET_FAKE(qemu_memalign);
+    RESET_FAKE(qemu_vfree);
+    qemu_memalign_fake.custom_fake = hostnuma_test_memalign;
+    qemu_vfree_fake.custom_fake = hostnuma_test_vfree;
+    numa->policy = HOST_MEM_POLICY_BIND;
+    set_bit(2, numa->host_nodes);
+#ifdef CONFIG_NUMA
+    RESET_FAKE(mbind);
+#endif
+    uint8_t *buff = pciemu_hostnuma_alloc(&dev, 4096, &e);
+    EXPECT_TRUE(buff != NULL, "Should allocate the memory");
+    EXPECT_EQ(qemu_memalign_fake.arg0_val, qemu_real_host_page_size(),
+              "Should align the memory on pages");
+    EXPECT_EQ(buff[4095], 0, "Should clear the memory");
+#ifdef CONFIG_NUMA
+    EXPECT_EQ(mbind_fake.arg2_val, MPOL_BIND, "Should bind the memory");
+    EXPECT_EQ(mbind_fake.arg3_val, numa->host_nodes,
+              "Should bind to the host nodes");
+    EXPECT_EQ(mbind_fake.arg4_val, 4, "Should pass one more node to mbind");
+#endif
+    pciemu_hostnuma_fini(&dev);
+    EXPECT_EQ(qemu_vfree_fake.arg0_val, buff, "Should free the memory");
+    EXPECT_EQ(numa->buff, NULL, "Should forget the memory");
+
+#ifdef CONFIG_NUMA
+    RESET_FAKE(error_setg_errno_internal);
+    mbind_fake.return_val = -1;
+    buff = pciemu_hostnuma_alloc(&dev, 4096, &e);
+    EXPECT_EQ(buff, NULL, "Should fail if the memory cannot be bound");
+    EXPECT_EQ(error_setg_errno_internal_fake.call_count, 1,
+              "Should report the error");
+    EXPECT_EQ(qemu_vfree_fake.call_count, 2, "Should free the memory");
+    RESET_FAKE(mbind);
+#endif
+    RESET_FAKE(qemu_memalign);
+    RESET_FAKE(qemu_vfree);
+}
+
+#ifdef CONFIG_LINUX
+TEST(pciemu_hostnuma_pin, "Test pinning of the workers")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    HostNumaAffinity saved;
+    cpu_set_t cpus;
+    pciemu_hostnuma_pin(&dev, &saved);
+    EXPECT_FALSE(saved.pinned, "Should not pin without host nodes");
+
+    /* the CPUs the test runs on, so the affinity does not really change */
+    pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    dev.dma.numa.cpus = cpus;
+    pciemu_hostnuma_pin(&dev, &saved);
+    EXPECT_TRUE(saved.pinned, "Should pin to the CPUs of the nodes");
+    EXPECT_TRUE(CPU_EQUAL(&saved.cpus, &cpus),
+                "Should save the affinity of the thread");
+    pciemu_hostnuma_unpin(&saved);
+    EXPECT_FALSE(saved.pinned, "Should restore the affinity");
+}
+#endif
+
+TEST_MAIN()
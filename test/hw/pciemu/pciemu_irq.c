@@ -9,6 +9,7 @@
 #include "unitctest/unitctest.h"
 #include "fff/fff.h"
 #include "qemu.fake.h"
+#include "pciemu_stats.fake.h"
 
 #include "../src/hw/pciemu/irq.c"
 
@@ -45,6 +46,7 @@ TEST(pciemu_irq_init_intx, "Test IRQ initialization in PIN mode")
 TEST(pciemu_irq_raise_intx, "Test IRQ raise in PIN mode")
 {
     PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    qemu_mutex_iothread_locked_fake.return_val = true; /* main loop */
     pciemu_irq_raise_intx(&dev);
     EXPECT_EQ(pci_set_irq_fake.call_count, 1, "Should call once");
     EXPECT_EQ(pci_set_irq_fake.arg1_val, 1,
@@ -56,6 +58,7 @@ TEST(pciemu_irq_raise_intx, "Test IRQ raise in PIN mode")
 TEST(pciemu_irq_raise_msi, "Test IRQ raise in MSI mode")
 {
     PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    qemu_mutex_iothread_locked_fake.return_val = true; /* main loop */
     unsigned int vector = PCIEMU_IRQ_MAX_VECTORS + 1;
     pciemu_irq_raise_msi(&dev, vector);
     EXPECT_EQ(msi_notify_fake.call_count, 0,
@@ -77,9 +80,182 @@ TEST(pciemu_irq_raise_msi, "Test IRQ raise in MSI mode")
               "Should notify with correct vector");
 }
 
+TEST(pciemu_irq_raise, "Test IRQ raise")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    qemu_mutex_iothread_locked_fake.return_val = true; /* main loop */
+    RESET_FAKE(msi_enabled);
+    RESET_FAKE(msi_notify);
+    RESET_FAKE(pci_set_irq);
+    RESET_FAKE(pciemu_stats_irq);
+    msi_enabled_fake.return_val = true;
+    pciemu_irq_raise(&dev, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR);
+    EXPECT_EQ(msi_notify_fake.call_count, 1, "Should notify once");
+    EXPECT_EQ(pci_set_irq_fake.call_count, 0, "Should not use the pin");
+    EXPECT_EQ(pciemu_stats_irq_fake.call_count, 1,
+              "Should timestamp the IRQ once");
+    EXPECT_EQ(pciemu_stats_irq_fake.arg1_val, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR,
+              "Should timestamp the vector raised");
+
+    msi_enabled_fake.return_val = false;
+    pciemu_irq_raise(&dev, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR);
+    EXPECT_EQ(pci_set_irq_fake.call_count, 1, "Should fallback to the pin");
+    EXPECT_EQ(pciemu_stats_irq_fake.call_count, 2,
+              "Should timestamp the IRQ in PIN mode too");
+}
+
+TEST(pciemu_irq_event, "Test IRQ causes")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    qemu_mutex_iothread_locked_fake.return_val = true; /* main loop */
+    RESET_FAKE(msi_enabled);
+    RESET_FAKE(msi_notify);
+    RESET_FAKE(pciemu_stats_irq);
+    msi_enabled_fake.return_val = true;
+    dev.irq.mask = PCIEMU_HW_IRQ_MASK_DEFAULT;
+    pciemu_irq_event(&dev, PCIEMU_HW_IRQ_CAUSE_DMA_DONE);
+    EXPECT_EQ(dev.irq.cause, PCIEMU_HW_IRQ_CAUSE_DMA_DONE,
+              "Should set the cause");
+    EXPECT_EQ(msi_notify_fake.call_count, 1, "Should notify once");
+    EXPECT_EQ(msi_notify_fake.arg1_val, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR,
+              "Should notify the DMA vector");
+    EXPECT_EQ(pciemu_stats_irq_fake.call_count, 1,
+              "Should timestamp the IRQ of the DMA command");
+
+    pciemu_irq_event(&dev, PCIEMU_HW_IRQ_CAUSE_QUEUE |
+                               PCIEMU_HW_IRQ_CAUSE_TIMER);
+    EXPECT_EQ(dev.irq.cause,
+              PCIEMU_HW_IRQ_CAUSE_DMA_DONE | PCIEMU_HW_IRQ_CAUSE_QUEUE |
+                  PCIEMU_HW_IRQ_CAUSE_TIMER,
+              "Should set the masked causes too");
+    EXPECT_EQ(msi_notify_fake.call_count, 1, "Should not notify masked causes");
+
+    RESET_FAKE(pciemu_stats_irq);
+    dev.irq.mask = 0;
+    pciemu_irq_event(&dev, PCIEMU_HW_IRQ_CAUSE_RX_DONE |
+                               PCIEMU_HW_IRQ_CAUSE_DMA_ERROR);
+    EXPECT_EQ(msi_notify_fake.call_count, 3, "Should notify both vectors");
+    EXPECT_EQ(msi_notify_fake.arg1_history[1], PCIEMU_HW_IRQ_RX_DONE_VECTOR,
+              "Should notify the RX vector");
+    EXPECT_EQ(msi_notify_fake.arg1_history[2], PCIEMU_HW_IRQ_DMA_ENDED_VECTOR,
+              "Should notify the DMA vector");
+    EXPECT_EQ(pciemu_stats_irq_fake.call_count, 0,
+              "Should only timestamp the IRQ of the DMA command");
+}
+
+TEST(pciemu_irq_cause_intx, "Test clearing IRQ causes in PIN mode")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    qemu_mutex_iothread_locked_fake.return_val = true; /* main loop */
+    RESET_FAKE(msi_enabled);
+    RESET_FAKE(pci_set_irq);
+    msi_enabled_fake.return_val = false;
+    dev.irq.mask = PCIEMU_HW_IRQ_MASK_DEFAULT;
+    pciemu_irq_event(&dev, PCIEMU_HW_IRQ_CAUSE_DMA_DONE |
+                               PCIEMU_HW_IRQ_CAUSE_RX_DONE);
+    EXPECT_EQ(dev.irq.status.pin.raised, true, "Should assert the pin");
+
+    pciemu_irq_write(&dev, PCIEMU_HW_BAR0_IRQ_CAUSE,
+                     PCIEMU_HW_IRQ_CAUSE_DMA_DONE);
+    EXPECT_EQ(pciemu_irq_read(&dev, PCIEMU_HW_BAR0_IRQ_CAUSE),
+              PCIEMU_HW_IRQ_CAUSE_RX_DONE, "Should only clear the 1s written");
+    EXPECT_EQ(dev.irq.status.pin.raised, true,
+              "Should keep the pin while an unmasked cause is set");
+
+    pciemu_irq_write(&dev, PCIEMU_HW_BAR0_IRQ_MASK, PCIEMU_HW_IRQ_CAUSE_ALL);
+    EXPECT_EQ(dev.irq.status.pin.raised, false,
+              "Should deassert the pin once every cause is masked");
+
+    RESET_FAKE(pci_set_irq);
+    pciemu_irq_write(&dev, PCIEMU_HW_BAR0_IRQ_MASK, 0);
+    EXPECT_EQ(pci_set_irq_fake.call_count, 1,
+              "Should raise the causes set while masked");
+    EXPECT_EQ(pci_set_irq_fake.arg1_val, 1, "Should assert the pin");
+
+    pciemu_irq_write(&dev, PCIEMU_HW_BAR0_IRQ_CAUSE, PCIEMU_HW_IRQ_CAUSE_ALL);
+    EXPECT_EQ(dev.irq.cause, 0, "Should clear every cause");
+    EXPECT_EQ(dev.irq.status.pin.raised, false, "Should deassert the pin");
+}
+
+TEST(pciemu_irq_write, "Test IRQ cause registers")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    RESET_FAKE(timer_del);
+    RESET_FAKE(timer_mod_ns);
+    RESET_FAKE(qemu_clock_get_ns);
+    pciemu_irq_write(&dev, PCIEMU_HW_BAR0_IRQ_MASK, ~0ULL);
+    EXPECT_EQ(pciemu_irq_read(&dev, PCIEMU_HW_BAR0_IRQ_MASK),
+              PCIEMU_HW_IRQ_CAUSE_ALL, "Should only keep the known causes");
+
+    pciemu_irq_write(&dev, PCIEMU_HW_BAR0_IRQ_QUEUE_THRESHOLD, 4);
+    EXPECT_EQ(pciemu_irq_read(&dev, PCIEMU_HW_BAR0_IRQ_QUEUE_THRESHOLD), 4,
+              "Should set the threshold");
+    pciemu_irq_write(&dev, PCIEMU_HW_BAR0_IRQ_QUEUE_THRESHOLD, 1000);
+    EXPECT_EQ(pciemu_irq_read(&dev, PCIEMU_HW_BAR0_IRQ_QUEUE_THRESHOLD),
+              PCIEMU_HW_DMA_QUEUE_SIZE, "Should clamp to the queue size");
+
+    qemu_clock_get_ns_fake.return_val = 1000;
+    pciemu_irq_write(&dev, PCIEMU_HW_BAR0_IRQ_TIMER_NS, 50000);
+    EXPECT_EQ(pciemu_irq_read(&dev, PCIEMU_HW_BAR0_IRQ_TIMER_NS), 50000,
+              "Should set the period");
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 1, "Should arm the timer");
+    EXPECT_EQ(timer_mod_ns_fake.arg1_val, 51000,
+              "Should expire after the period");
+
+    pciemu_irq_write(&dev, PCIEMU_HW_BAR0_IRQ_TIMER_NS, 0);
+    EXPECT_EQ(timer_del_fake.call_count, 2, "Should stop the timer");
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 1, "Should not re-arm the timer");
+
+    EXPECT_EQ(pciemu_irq_read(&dev, PCIEMU_HW_BAR0_IRQ_CAUSE - 8), ~0ULL,
+              "Should return all 1s outside of the registers");
+}
+
+TEST(pciemu_irq_timer_min, "Test minimum period of the TIMER cause")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    RESET_FAKE(timer_mod_ns);
+    RESET_FAKE(timer_del);
+    pciemu_irq_write(&dev, PCIEMU_HW_BAR0_IRQ_TIMER_NS, 1);
+    EXPECT_EQ(pciemu_irq_read(&dev, PCIEMU_HW_BAR0_IRQ_TIMER_NS), 0,
+              "Should ignore a period below the minimum");
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 0, "Should not arm the timer");
+
+    pciemu_irq_write(&dev, PCIEMU_HW_BAR0_IRQ_TIMER_NS,
+                     PCIEMU_HW_IRQ_TIMER_NS_MIN);
+    EXPECT_EQ(pciemu_irq_read(&dev, PCIEMU_HW_BAR0_IRQ_TIMER_NS),
+              PCIEMU_HW_IRQ_TIMER_NS_MIN, "Should accept the minimum");
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 1, "Should arm the timer");
+
+    pciemu_irq_write(&dev, PCIEMU_HW_BAR0_IRQ_TIMER_NS,
+                     PCIEMU_HW_IRQ_TIMER_NS_MIN - 1);
+    EXPECT_EQ(pciemu_irq_read(&dev, PCIEMU_HW_BAR0_IRQ_TIMER_NS),
+              PCIEMU_HW_IRQ_TIMER_NS_MIN, "Should keep the current period");
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 1, "Should not re-arm the timer");
+    EXPECT_EQ(timer_del_fake.call_count, 1, "Should not stop the timer");
+}
+
+TEST(pciemu_irq_timer_cb, "Test expiration of the TIMER cause")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    qemu_mutex_iothread_locked_fake.return_val = true; /* main loop */
+    RESET_FAKE(msi_enabled);
+    RESET_FAKE(msi_notify);
+    RESET_FAKE(timer_mod_ns);
+    msi_enabled_fake.return_val = true;
+    dev.irq.timer_ns = 10000;
+    pciemu_irq_timer_cb(&dev);
+    EXPECT_EQ(dev.irq.cause, PCIEMU_HW_IRQ_CAUSE_TIMER,
+              "Should set the TIMER cause");
+    EXPECT_EQ(msi_notify_fake.call_count, 1, "Should notify once");
+    EXPECT_EQ(msi_notify_fake.arg1_val, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR,
+              "Should notify the DMA vector");
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 1, "Should re-arm the timer");
+}
+
 TEST(pciemu_irq_lower_intx, "Test lowering IRQ in PIN mode")
 {
     PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    qemu_mutex_iothread_locked_fake.return_val = true; /* main loop */
     RESET_FAKE(pci_set_irq);
     pciemu_irq_lower_intx(&dev);
     EXPECT_EQ(pci_set_irq_fake.call_count, 1, "Should call once");
@@ -107,11 +283,59 @@ TEST(pciemu_irq_lower_msi, "Test lowering IRQ in MSI mode")
 TEST(pciemu_irq_reset, "Test reset of IRQ")
 {
     PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    qemu_mutex_iothread_locked_fake.return_val = true; /* main loop */
+    dev.irq.cause = PCIEMU_HW_IRQ_CAUSE_ALL;
+    dev.irq.mask = 0;
     pciemu_irq_reset(&dev);
     EXPECT_EQ(
         msi_enabled_fake.call_count,
         PCIEMU_HW_IRQ_VECTOR_END - PCIEMU_HW_IRQ_VECTOR_START + 1,
         "Should call pci_irq_lower for each vector (msi_enabled is proxy)");
+    EXPECT_EQ(dev.irq.mask, PCIEMU_HW_IRQ_MASK_DEFAULT,
+              "Should restore the default mask");
+    EXPECT_EQ(timer_del_fake.arg0_history[0], &dev.irq.timer,
+              "Should stop the TIMER cause");
+    EXPECT_EQ(timer_del_fake.arg0_history[1], &dev.irq.signal,
+              "Should drop the signals left by the vCPUs");
+}
+
+TEST(pciemu_irq_signal, "Test IRQs raised by the vCPUs, without the BQL")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    RESET_FAKE(qemu_mutex_iothread_locked);
+    RESET_FAKE(msi_enabled);
+    RESET_FAKE(msi_notify);
+    RESET_FAKE(pci_set_irq);
+    RESET_FAKE(timer_mod_ns);
+    msi_enabled_fake.return_val = true;
+    pciemu_irq_raise(&dev, PCIEMU_HW_IRQ_RX_DONE_VECTOR);
+    pciemu_irq_raise(&dev, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR);
+    EXPECT_EQ(msi_notify_fake.call_count, 0,
+              "Should not notify without the BQL");
+    EXPECT_EQ(timer_mod_ns_fake.arg0_val, &dev.irq.signal,
+              "Should leave the notifications to the main loop");
+
+    msi_enabled_fake.return_val = false;
+    pciemu_irq_raise(&dev, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR);
+    pciemu_irq_lower(&dev, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR);
+    pciemu_irq_raise(&dev, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR);
+    EXPECT_EQ(pci_set_irq_fake.call_count, 0,
+              "Should not set the pin without the BQL");
+
+    msi_enabled_fake.return_val = true;
+    qemu_mutex_iothread_locked_fake.return_val = true;
+    pciemu_irq_signal_cb(&dev);
+    EXPECT_EQ(msi_notify_fake.call_count, 2, "Should notify both vectors");
+    EXPECT_EQ(msi_notify_fake.arg1_history[0], PCIEMU_HW_IRQ_DMA_ENDED_VECTOR,
+              "Should notify the DMA vector");
+    EXPECT_EQ(msi_notify_fake.arg1_history[1], PCIEMU_HW_IRQ_RX_DONE_VECTOR,
+              "Should notify the RX vector");
+    EXPECT_EQ(pci_set_irq_fake.call_count, 1, "Should set the pin once");
+    EXPECT_EQ(pci_set_irq_fake.arg1_val, 1, "Should set its last level");
+
+    pciemu_irq_signal_cb(&dev);
+    EXPECT_EQ(msi_notify_fake.call_count, 2, "Should notify only once");
+    EXPECT_EQ(pci_set_irq_fake.call_count, 1, "Should set the pin only once");
 }
 
 TEST(pciemu_irq_init, "Test initialization of IRQ")
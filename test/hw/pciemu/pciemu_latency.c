@@ -0,0 +1,192 @@
+/* pciemu_latency.c - Unit tests for hw/pciemu/latency.c file
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "unitctest/unitctest.h"
+#include "fff/fff.h"
+#include "qemu.fake.h"
+
+/* include the source file to test static functions */
+#include "../src/hw/pciemu/latency.c"
+
+DEFINE_FFF_GLOBALS;
+
+#define TEST_LATENCY_SAMPLES 100000
+
+/* write a histogram file, returning its path in path */
+static void hist_write(char *path, const char *content)
+{
+    int fd = mkstemp(path);
+    FILE *fp = fdopen(fd, "w");
+    fputs(content, fp);
+    fclose(fp);
+}
+
+TEST(pciemu_latency_none, "Test immediate completions")
+{
+    LatencyModel lat = { 0 };
+    Error *e = NULL;
+    pciemu_latency_init(&lat, &e);
+    EXPECT_EQ(lat.type, LATENCY_DIST_NONE, "Should default to none");
+    EXPECT_EQ(pciemu_latency_sample(&lat), 0, "Should not delay");
+    lat.min_ns = 100;
+    EXPECT_EQ(pciemu_latency_sample(&lat), 0, "Should ignore the bounds");
+}
+
+TEST(pciemu_latency_fixed, "Test fixed latency")
+{
+    LatencyModel lat = { .dist = "fixed", .mean_ns = 1500 };
+    Error *e = NULL;
+    pciemu_latency_init(&lat, &e);
+    EXPECT_EQ(lat.type, LATENCY_DIST_FIXED, "Should parse the distribution");
+    EXPECT_EQ(pciemu_latency_sample(&lat), 1500, "Should return mean_ns");
+    lat.max_ns = 1000;
+    EXPECT_EQ(pciemu_latency_sample(&lat), 1000, "Should clamp to max_ns");
+}
+
+TEST(pciemu_latency_uniform, "Test uniform latency")
+{
+    LatencyModel lat = { .dist = "uniform", .min_ns = 100, .max_ns = 200 };
+    Error *e = NULL;
+    uint64_t sum = 0, lo = UINT64_MAX, hi = 0;
+    pciemu_latency_init(&lat, &e);
+    for (int i = 0; i < TEST_LATENCY_SAMPLES; ++i) {
+        uint64_t ns = pciemu_latency_sample(&lat);
+        lo = MIN(lo, ns);
+        hi = MAX(hi, ns);
+        sum += ns;
+    }
+    EXPECT_EQ(lo, 100, "Should reach the lower bound");
+    EXPECT_EQ(hi, 200, "Should reach the upper bound");
+    EXPECT_TRUE(sum / TEST_LATENCY_SAMPLES >= 148 &&
+                    sum / TEST_LATENCY_SAMPLES <= 152,
+                "Should be centered in the range");
+}
+
+TEST(pciemu_latency_uniform_full, "Test uniform latency over 64 bits")
+{
+    LatencyModel lat = { .dist = "uniform", .max_ns = UINT64_MAX };
+    Error *e = NULL;
+    uint64_t hi = 0;
+    pciemu_latency_init(&lat, &e);
+    for (int i = 0; i < 64; ++i)
+        hi = MAX(hi, pciemu_latency_sample(&lat));
+    EXPECT_TRUE(hi > UINT64_MAX / 2, "Should draw from the whole range");
+}
+
+TEST(pciemu_latency_lognormal, "Test lognormal latency")
+{
+    LatencyModel lat = { .dist = "lognormal", .mean_ns = 10000,
+                         .sigma_milli = 500 };
+    Error *e = NULL;
+    uint64_t sum = 0, above = 0;
+    pciemu_latency_init(&lat, &e);
+    for (int i = 0; i < TEST_LATENCY_SAMPLES; ++i) {
+        uint64_t ns = pciemu_latency_sample(&lat);
+        sum += ns;
+        above += ns > 10000;
+    }
+    EXPECT_TRUE(sum / TEST_LATENCY_SAMPLES >= 9800 &&
+                    sum / TEST_LATENCY_SAMPLES <= 10200,
+                "Should have a mean of mean_ns");
+    EXPECT_TRUE(above < TEST_LATENCY_SAMPLES / 2,
+                "Should be right skewed (median below the mean)");
+}
+
+TEST(pciemu_latency_lognormal_sat, "Test saturation of lognormal latency")
+{
+    LatencyModel lat = { .dist = "lognormal", .mean_ns = UINT64_MAX / 2,
+                         .sigma_milli = 1000 };
+    Error *e = NULL;
+    uint64_t hi = 0;
+    pciemu_latency_init(&lat, &e);
+    for (int i = 0; i < 64; ++i)
+        hi = MAX(hi, pciemu_latency_sample(&lat));
+    EXPECT_EQ(hi, UINT64_MAX, "Should saturate instead of overflowing");
+}
+
+TEST(pciemu_latency_hist, "Test empirical histogram latency")
+{
+    char path[] = "/tmp/pciemu_latency_XXXXXX";
+    LatencyModel lat = { .dist = "histogram", .hist_file = path };
+    Error *e = NULL;
+    uint64_t cnt_1000 = 0, cnt_9000 = 0;
+    hist_write(path, "# latency weight\n1000 9\n\n5000 0\n9000 1\n");
+    pciemu_latency_init(&lat, &e);
+    unlink(path);
+    EXPECT_EQ(lat.type, LATENCY_DIST_HIST, "Should load the histogram");
+    EXPECT_EQ(lat.hist_cnt, 2, "Should skip comments and empty bins");
+    for (int i = 0; i < TEST_LATENCY_SAMPLES; ++i) {
+        uint64_t ns = pciemu_latency_sample(&lat);
+        cnt_1000 += ns == 1000;
+        cnt_9000 += ns == 9000;
+    }
+    EXPECT_EQ(cnt_1000 + cnt_9000, TEST_LATENCY_SAMPLES,
+              "Should only return the latencies of the histogram");
+    EXPECT_TRUE(cnt_9000 > TEST_LATENCY_SAMPLES / 12 &&
+                    cnt_9000 < TEST_LATENCY_SAMPLES / 8,
+                "Should follow the weights");
+}
+
+TEST(pciemu_latency_reset, "Test reproducibility of the latencies")
+{
+    LatencyModel lat = { .dist = "uniform", .max_ns = 1000000, .seed = 42 };
+    Error *e = NULL;
+    uint64_t first[8];
+    pciemu_latency_init(&lat, &e);
+    for (int i = 0; i < 8; ++i)
+        first[i] = pciemu_latency_sample(&lat);
+    pciemu_latency_reset(&lat);
+    for (int i = 0; i < 8; ++i)
+        EXPECT_EQ(pciemu_latency_sample(&lat), first[i],
+                  "Should restart the sequence");
+    lat.seed = 43;
+    pciemu_latency_reset(&lat);
+    EXPECT_NEQ(pciemu_latency_sample(&lat), first[0],
+               "Should depend on the seed");
+}
+
+TEST(pciemu_latency_init, "Test initialization errors of the latency model")
+{
+    char path[] = "/tmp/pciemu_latency_XXXXXX";
+    LatencyModel lat = { .dist = "gaussian" };
+    Error *e = NULL;
+    RESET_FAKE(error_setg_internal);
+    pciemu_latency_init(&lat, &e);
+    EXPECT_EQ(error_setg_internal_fake.call_count, 1,
+              "Should reject unknown distributions");
+
+    RESET_FAKE(error_setg_internal);
+    lat.dist = "histogram";
+    pciemu_latency_init(&lat, &e);
+    EXPECT_EQ(error_setg_internal_fake.call_count, 1,
+              "Should require a histogram file");
+
+    RESET_FAKE(error_setg_internal);
+    hist_write(path, "1000 1\noops\n");
+    lat.hist_file = path;
+    pciemu_latency_init(&lat, &e);
+    unlink(path);
+    EXPECT_EQ(error_setg_internal_fake.call_count, 1,
+              "Should reject malformed lines");
+    EXPECT_EQ(lat.type, LATENCY_DIST_NONE, "Should not delay completions");
+
+    RESET_FAKE(error_setg_internal);
+    lat = (LatencyModel){ .dist = "uniform", .min_ns = 200, .max_ns = 100 };
+    pciemu_latency_init(&lat, &e);
+    EXPECT_EQ(error_setg_internal_fake.call_count, 1,
+              "Should reject inverted bounds");
+    EXPECT_EQ(lat.type, LATENCY_DIST_NONE, "Should not delay completions");
+
+    RESET_FAKE(error_setg_internal);
+    lat.max_ns = 0;
+    pciemu_latency_init(&lat, &e);
+    EXPECT_EQ(error_setg_internal_fake.call_count, 0,
+              "Should accept a lower bound alone");
+}
+
+TEST_MAIN()
@@ -0,0 +1,301 @@
+/* pciemu_mapcache.c - Unit tests for hw/pciemu/mapcache.c file
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "unitctest/unitctest.h"
+#include "fff/fff.h"
+#include "qemu.fake.h"
+#include "pciemu_mmio.fake.h"
+
+/* include the source file to test static functions */
+#include "../src/hw/pciemu/mapcache.c"
+
+DEFINE_FFF_GLOBALS;
+
+/* guest RAM at bus address GUEST_BASE */
+#define GUEST_BASE 0x100000
+static uint8_t guest[4096];
+static MemoryRegion guest_mr;
+
+static void *mapcache_test_map(AddressSpace *as, hwaddr addr, hwaddr *plen,
+                               bool is_write, MemTxAttrs attrs)
+{
+    if (addr < GUEST_BASE || addr - GUEST_BASE >= sizeof(guest))
+        return NULL;
+    *plen = MIN(*plen, sizeof(guest) - (addr - GUEST_BASE));
+    return &guest[addr - GUEST_BASE];
+}
+
+static MemoryRegion *mapcache_test_from_host(void *ptr, ram_addr_t *offset)
+{
+    *offset = (uint8_t *)ptr - guest;
+    return &guest_mr;
+}
+
+static void mapcache_test_setup(PCIEMUDevice *dev, uint32_t size)
+{
+    Error *e = NULL;
+    dev->dma.mapcache.size = size;
+    pciemu_mapcache_init(dev, &e);
+    for (size_t i = 0; i < sizeof(guest); ++i)
+        guest[i] = i;
+    RESET_FAKE(address_space_map);
+    RESET_FAKE(address_space_unmap);
+    RESET_FAKE(memory_region_from_host);
+    RESET_FAKE(memory_region_set_dirty);
+    RESET_FAKE(memory_listener_register);
+    RESET_FAKE(memory_listener_unregister);
+    RESET_FAKE(pciemu_mmio_lock_bql);
+    address_space_map_fake.custom_fake = mapcache_test_map;
+    memory_region_from_host_fake.custom_fake = mapcache_test_from_host;
+}
+
+TEST(pciemu_mapcache_rw, "Test transfers through cached mappings")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAMapCache *mc = &dev.dma.mapcache;
+    uint8_t buf[64];
+    mapcache_test_setup(&dev, 0);
+    EXPECT_FALSE(pciemu_mapcache_rw(&dev, GUEST_BASE, buf, sizeof(buf),
+                                    DMA_DIRECTION_TO_DEVICE),
+                 "Should be off by default");
+    EXPECT_EQ(address_space_map_fake.call_count, 0, "Should not map");
+
+    mapcache_test_setup(&dev, 4);
+    EXPECT_TRUE(pciemu_mapcache_rw(&dev, GUEST_BASE + 256, buf, sizeof(buf),
+                                   DMA_DIRECTION_TO_DEVICE),
+                "Should map guest RAM");
+    EXPECT_EQ(buf[1], 1, "Should read the guest memory");
+    EXPECT_EQ(address_space_map_fake.call_count, 1, "Should map once");
+    EXPECT_TRUE(address_space_map_fake.arg3_val, "Should map writable");
+    EXPECT_EQ(memory_listener_register_fake.call_count, 1,
+              "Should watch the bus address space with the first entry");
+    EXPECT_EQ(pciemu_mmio_lock_bql_fake.call_count, 1,
+              "Should register the listener with the BQL");
+    EXPECT_EQ(mc->misses, 1, "Should count the miss");
+
+    buf[0] = 0xaa;
+    EXPECT_TRUE(pciemu_mapcache_rw(&dev, GUEST_BASE + 258, buf, 8,
+                                   DMA_DIRECTION_FROM_DEVICE),
+                "Should write inside the cached range");
+    EXPECT_EQ(guest[258], 0xaa, "Should write the guest memory");
+    EXPECT_EQ(address_space_map_fake.call_count, 1, "Should not map again");
+    EXPECT_EQ(mc->hits, 1, "Should count the hit");
+    EXPECT_EQ(memory_region_set_dirty_fake.call_count, 1,
+              "Should set the RAM dirty");
+    EXPECT_EQ(memory_region_set_dirty_fake.arg1_val, 258,
+              "Should set the written range dirty");
+    EXPECT_EQ(memory_region_set_dirty_fake.arg2_val, 8,
+              "Should set the written length dirty");
+
+    pciemu_mapcache_rw(&dev, GUEST_BASE + 300, buf, sizeof(buf),
+                       DMA_DIRECTION_TO_DEVICE);
+    EXPECT_EQ(address_space_map_fake.call_count, 2,
+              "Should map a range going past the cached one");
+    EXPECT_EQ(memory_listener_register_fake.call_count, 1,
+              "Should register the listener once");
+}
+
+TEST(pciemu_mapcache_uncached, "Test ranges which are not cached")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAMapCache *mc = &dev.dma.mapcache;
+    uint8_t buf[64];
+    mapcache_test_setup(&dev, 4);
+    EXPECT_FALSE(pciemu_mapcache_rw(&dev, GUEST_BASE + sizeof(guest) - 8, buf,
+                                    sizeof(buf), DMA_DIRECTION_TO_DEVICE),
+                 "Should not cache a short mapping");
+    EXPECT_EQ(address_space_unmap_fake.call_count, 1, "Should unmap it");
+    EXPECT_EQ(address_space_unmap_fake.arg4_val, 0,
+              "Should not set anything dirty");
+
+    memory_region_from_host_fake.custom_fake = NULL;
+    EXPECT_FALSE(pciemu_mapcache_rw(&dev, GUEST_BASE, buf, sizeof(buf),
+                                    DMA_DIRECTION_TO_DEVICE),
+                 "Should not cache a bounce buffer");
+    EXPECT_EQ(address_space_unmap_fake.call_count, 2, "Should unmap it");
+
+    EXPECT_FALSE(pciemu_mapcache_rw(&dev, 0, buf, sizeof(buf),
+                                    DMA_DIRECTION_TO_DEVICE),
+                 "Should not cache what cannot be mapped");
+    EXPECT_EQ(mc->misses, 3, "Should count the misses");
+    EXPECT_EQ(memory_listener_register_fake.call_count, 0,
+              "Should not watch the bus address space without entry");
+}
+
+TEST(pciemu_mapcache_evict, "Test eviction of the least recently used")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    uint8_t buf[16];
+    mapcache_test_setup(&dev, 2);
+    pciemu_mapcache_rw(&dev, GUEST_BASE, buf, sizeof(buf),
+                       DMA_DIRECTION_TO_DEVICE);
+    pciemu_mapcache_rw(&dev, GUEST_BASE + 64, buf, sizeof(buf),
+                       DMA_DIRECTION_TO_DEVICE);
+    pciemu_mapcache_rw(&dev, GUEST_BASE, buf, sizeof(buf),
+                       DMA_DIRECTION_TO_DEVICE);
+    EXPECT_EQ(address_space_unmap_fake.call_count, 0, "Should fit both");
+
+    pciemu_mapcache_rw(&dev, GUEST_BASE + 128, buf, sizeof(buf),
+                       DMA_DIRECTION_TO_DEVICE);
+    EXPECT_EQ(address_space_unmap_fake.call_count, 1, "Should evict one");
+    EXPECT_EQ(address_space_unmap_fake.arg1_val, &guest[64],
+              "Should evict the least recently used");
+    EXPECT_TRUE(pciemu_mapcache_lookup(&dev.dma.mapcache, GUEST_BASE,
+                                       sizeof(buf)) != NULL,
+                "Should keep the most recently used");
+}
+
+TEST(pciemu_mapcache_listener, "Test invalidation by the memory listener")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAMapCache *mc = &dev.dma.mapcache;
+    uint8_t buf[16];
+    mapcache_test_setup(&dev, 4);
+    pciemu_mapcache_rw(&dev, GUEST_BASE, buf, sizeof(buf),
+                       DMA_DIRECTION_TO_DEVICE);
+    pciemu_mapcache_rw(&dev, GUEST_BASE + 1024, buf, sizeof(buf),
+                       DMA_DIRECTION_TO_DEVICE);
+
+    MemoryRegionSection section = { .mr = &guest_mr,
+                                    .size = int128_make64(1024),
+                                    .offset_within_address_space =
+                                        GUEST_BASE + 512 };
+    mc->listener.region_del(&mc->listener, &section);
+    EXPECT_EQ(mc->invalidations, 1, "Should drop the overlapping entry");
+    EXPECT_EQ(address_space_unmap_fake.arg1_val, &guest[1024],
+              "Should unmap the overlapping entry");
+    EXPECT_TRUE(pciemu_mapcache_lookup(mc, GUEST_BASE, sizeof(buf)) != NULL,
+                "Should keep the other entries");
+
+    mc->listener.region_add(&mc->listener, &section);
+    EXPECT_EQ(memory_region_register_iommu_notifier_fake.call_count, 0,
+              "Should only watch the IOMMU regions");
+}
+
+TEST(pciemu_mapcache_iommu, "Test invalidation by the IOMMU notifiers")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAMapCache *mc = &dev.dma.mapcache;
+    MemoryRegion iommu_mr = { .is_iommu = true };
+    uint8_t buf[16];
+    mapcache_test_setup(&dev, 4);
+    RESET_FAKE(memory_region_register_iommu_notifier);
+    RESET_FAKE(memory_region_unregister_iommu_notifier);
+    MemoryRegionSection section = { .mr = &iommu_mr,
+                                    .size = int128_2_64(),
+                                    .offset_within_region = 0,
+                                    .offset_within_address_space = 0 };
+    mc->listener.region_add(&mc->listener, &section);
+    EXPECT_EQ(memory_region_register_iommu_notifier_fake.call_count, 1,
+              "Should watch the IOMMU region");
+    IOMMUNotifier *n = memory_region_register_iommu_notifier_fake.arg1_val;
+    EXPECT_EQ(n->notifier_flags, IOMMU_NOTIFIER_UNMAP,
+              "Should only be notified of the unmaps");
+    EXPECT_EQ(n->end, UINT64_MAX, "Should watch the whole region");
+
+    pciemu_mapcache_rw(&dev, GUEST_BASE, buf, sizeof(buf),
+                       DMA_DIRECTION_TO_DEVICE);
+    IOMMUTLBEntry iotlb = { .iova = GUEST_BASE + 4096, .addr_mask = 0xfff };
+    n->notify(n, &iotlb);
+    EXPECT_EQ(mc->invalidations, 0, "Should keep the entries of other pages");
+    iotlb.iova = GUEST_BASE;
+    n->notify(n, &iotlb);
+    EXPECT_EQ(mc->invalidations, 1, "Should drop the entries unmapped");
+
+    mc->listener.region_del(&mc->listener, &section);
+    EXPECT_EQ(memory_region_unregister_iommu_notifier_fake.call_count, 1,
+              "Should stop watching the IOMMU region");
+    EXPECT_FALSE(mc->iommus[0].used, "Should free the notifier");
+
+    memory_region_register_iommu_notifier_fake.return_val = -EINVAL;
+    mc->listener.region_add(&mc->listener, &section);
+    EXPECT_TRUE(mc->disabled, "Should stop caching if it cannot watch");
+    EXPECT_FALSE(pciemu_mapcache_rw(&dev, GUEST_BASE, buf, sizeof(buf),
+                                    DMA_DIRECTION_TO_DEVICE),
+                 "Should leave the transfers to the address space");
+    RESET_FAKE(memory_region_register_iommu_notifier);
+}
+
+TEST(pciemu_mapcache_get, "Test the map-cache-stats property")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    uint8_t buf[16];
+    mapcache_test_setup(&dev, 4);
+    pciemu_mapcache_rw(&dev, GUEST_BASE, buf, sizeof(buf),
+                       DMA_DIRECTION_TO_DEVICE);
+    RESET_FAKE(visit_start_struct);
+    RESET_FAKE(visit_type_uint64);
+    RESET_FAKE(visit_check_struct);
+    RESET_FAKE(visit_end_struct);
+    visit_start_struct_fake.return_val = true;
+    visit_type_uint64_fake.return_val = true;
+    pciemu_mapcache_get(OBJECT(&dev), NULL, "map-cache-stats", NULL, NULL);
+    EXPECT_EQ(visit_type_uint64_fake.call_count, 4, "Should visit 4 counters");
+    EXPECT_EQ(visit_check_struct_fake.call_count, 1, "Should check the struct");
+    EXPECT_EQ(visit_end_struct_fake.call_count, 1, "Should end the struct");
+}
+
+TEST(pciemu_mapcache_reset, "Test reset of the map cache")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAMapCache *mc = &dev.dma.mapcache;
+    uint8_t buf[16];
+    mapcache_test_setup(&dev, 4);
+    pciemu_mapcache_rw(&dev, GUEST_BASE, buf, sizeof(buf),
+                       DMA_DIRECTION_TO_DEVICE);
+    pciemu_mapcache_rw(&dev, GUEST_BASE + 64, buf, sizeof(buf),
+                       DMA_DIRECTION_TO_DEVICE);
+    pciemu_mapcache_reset(&dev);
+    EXPECT_EQ(address_space_unmap_fake.call_count, 2, "Should unmap all");
+    EXPECT_EQ(mc->misses, 2, "Should keep the counters");
+    EXPECT_EQ(mc->invalidations, 0, "Should not count invalidations");
+    pciemu_mapcache_rw(&dev, GUEST_BASE, buf, sizeof(buf),
+                       DMA_DIRECTION_TO_DEVICE);
+    EXPECT_EQ(mc->misses, 3, "Should map again");
+}
+
+TEST(pciemu_mapcache_init, "Test initialization of the map cache")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    Error *e = NULL;
+    RESET_FAKE(error_setg_internal);
+    dev.dma.mapcache.size = PCIEMU_MAPCACHE_ENTRIES_MAX + 1;
+    pciemu_mapcache_init(&dev, &e);
+    EXPECT_EQ(error_setg_internal_fake.call_count, 1,
+              "Should reject too many entries");
+
+    RESET_FAKE(error_setg_internal);
+    RESET_FAKE(memory_listener_register);
+    dev.dma.mapcache.size = PCIEMU_MAPCACHE_ENTRIES_MAX;
+    pciemu_mapcache_init(&dev, &e);
+    EXPECT_EQ(error_setg_internal_fake.call_count, 0, "Should accept the max");
+    EXPECT_EQ(memory_listener_register_fake.call_count, 0,
+              "Should not register the listener yet");
+    EXPECT_TRUE(dev.dma.mapcache.listener.region_del ==
+                    pciemu_mapcache_region_del,
+                "Should set the callbacks of the listener");
+}
+
+TEST(pciemu_mapcache_fini, "Test finalization of the map cache")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    uint8_t buf[16];
+    mapcache_test_setup(&dev, 4);
+    pciemu_mapcache_fini(&dev);
+    EXPECT_EQ(memory_listener_unregister_fake.call_count, 0,
+              "Should not unregister a listener never registered");
+
+    pciemu_mapcache_rw(&dev, GUEST_BASE, buf, sizeof(buf),
+                       DMA_DIRECTION_TO_DEVICE);
+    pciemu_mapcache_fini(&dev);
+    EXPECT_EQ(address_space_unmap_fake.call_count, 1, "Should unmap all");
+    EXPECT_EQ(memory_listener_unregister_fake.call_count, 1,
+              "Should unregister the listener");
+}
+
+TEST_MAIN()
@@ -9,8 +9,13 @@
 #include "unitctest/unitctest.h"
 #include "fff/fff.h"
 #include "qemu.fake.h"
+#include "pciemu_arbiter.fake.h"
+#include "pciemu_crypto.fake.h"
 #include "pciemu_dma.fake.h"
 #include "pciemu_irq.fake.h"
+#include "pciemu_rx.fake.h"
+#include "pciemu_stats.fake.h"
+#include "pciemu_trace.fake.h"
 
 #include "../src/hw/pciemu/mmio.c"
 
@@ -29,7 +34,7 @@ TEST(pciemu_mmio_valid_access, "Test the check on wheter MMIO access is valid")
     EXPECT_FALSE(pciemu_mmio_valid_access(addr, size), "addr is outside range");
 }
 
-TEST(pciemu_mmio_read, "Test MMIO read operations")
+TEST(pciemu_mmio_dispatch_read, "Test MMIO read operations")
 {
     PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
     unsigned int size = sizeof(uint64_t);
@@ -45,15 +50,101 @@ TEST(pciemu_mmio_read, "Test MMIO read operations")
     }
 
     for (int i = 0; i < PCIEMU_HW_BAR0_REG_CNT; ++i) {
-        reg_val = pciemu_mmio_read(&dev, reg_addr[i], size);
+        reg_val = pciemu_mmio_dispatch_read(&dev, reg_addr[i], size);
         EXPECT_EQ(reg_val, expect_reg[i], "Should read value properly");
     }
 
-    reg_val = pciemu_mmio_read(&dev, PCIEMU_HW_BAR0_END, size);
+    reg_val = pciemu_mmio_dispatch_read(&dev, PCIEMU_HW_BAR0_DMA_DOORBELL_RING,
+                                        size);
     EXPECT_EQ(reg_val, ~0ULL, "Should not return any register value");
+
+    reg_val = pciemu_mmio_dispatch_read(&dev, PCIEMU_HW_BAR0_END + 8, size);
+    EXPECT_EQ(reg_val, ~0ULL, "Should not read outside of BAR0 registers");
+
+    dev.rx.head = 3;
+    dev.rx.tail = 7;
+    reg_val = pciemu_mmio_dispatch_read(&dev, PCIEMU_HW_BAR0_RX_HEAD, size);
+    EXPECT_EQ(reg_val, 3, "Should read the RX head");
+    reg_val = pciemu_mmio_dispatch_read(&dev, PCIEMU_HW_BAR0_RX_TAIL, size);
+    EXPECT_EQ(reg_val, 7, "Should read the RX tail");
+
+    dev.dma.pattern.err_cnt = 2;
+    dev.dma.pattern.err_ofs = 0x40;
+    reg_val = pciemu_mmio_dispatch_read(&dev,
+                                        PCIEMU_HW_BAR0_DMA_PATTERN_ERR_CNT,
+                                        size);
+    EXPECT_EQ(reg_val, 2, "Should read the pattern error count");
+    reg_val = pciemu_mmio_dispatch_read(&dev,
+                                        PCIEMU_HW_BAR0_DMA_PATTERN_ERR_OFS,
+                                        size);
+    EXPECT_EQ(reg_val, 0x40, "Should read the pattern error offset");
+
+    dev.dma.buff_size = 0x100000;
+    reg_val = pciemu_mmio_dispatch_read(&dev, PCIEMU_HW_BAR0_DMA_AREA_SIZE,
+                                        size);
+    EXPECT_EQ(reg_val, 0x100000, "Should read the DMA area size");
+
+    dev.dma.status = DMA_STATUS_EXECUTING;
+    dev.dma.error = PCIEMU_HW_DMA_ERR_BOUNDS;
+    dev.dma.done_cnt = 42;
+    reg_val = pciemu_mmio_dispatch_read(&dev, PCIEMU_HW_BAR0_DMA_STATUS, size);
+    EXPECT_EQ(reg_val, PCIEMU_HW_DMA_STATUS_EXECUTING,
+              "Should read the DMA status");
+    reg_val = pciemu_mmio_dispatch_read(&dev, PCIEMU_HW_BAR0_DMA_ERROR, size);
+    EXPECT_EQ(reg_val, PCIEMU_HW_DMA_ERR_BOUNDS, "Should read the DMA error");
+    reg_val = pciemu_mmio_dispatch_read(&dev, PCIEMU_HW_BAR0_DMA_DONE_CNT,
+                                        size);
+    EXPECT_EQ(reg_val, 42, "Should read the DMA completion counter");
+
+    dev.dma.atomic_result = 0x123456789;
+    reg_val = pciemu_mmio_dispatch_read(&dev, PCIEMU_HW_BAR0_DMA_ATOMIC_RESULT,
+                                        size);
+    EXPECT_EQ(reg_val, 0x123456789,
+              "Should read the original value of the last atomic command");
+    dev.dma.scan_cnt = 17;
+    reg_val = pciemu_mmio_dispatch_read(&dev, PCIEMU_HW_BAR0_DMA_SCAN_MATCH_CNT,
+                                        size);
+    EXPECT_EQ(reg_val, 17, "Should read the matches of the last scan command");
+
+    hwaddr queue = PCIEMU_HW_BAR0_DMA_QUEUE_START +
+                   2 * PCIEMU_HW_BAR0_DMA_QUEUE_STRIDE;
+    RESET_FAKE(pciemu_arbiter_read);
+    pciemu_arbiter_read_fake.return_val = 5;
+    reg_val = pciemu_mmio_dispatch_read(&dev, queue + PCIEMU_HW_DMA_QUEUE_HEAD,
+                                        size);
+    EXPECT_EQ(pciemu_arbiter_read_fake.arg1_val,
+              queue + PCIEMU_HW_DMA_QUEUE_HEAD,
+              "Should read the queue register");
+    EXPECT_EQ(reg_val, 5, "Should read the value of the arbiter");
+    pciemu_mmio_dispatch_read(&dev, PCIEMU_HW_BAR0_DMA_QUEUE_END, size);
+    EXPECT_EQ(pciemu_arbiter_read_fake.call_count, 2,
+              "Should read the last queue register");
+
+    RESET_FAKE(pciemu_crypto_read);
+    pciemu_crypto_read_fake.return_val = PCIEMU_HW_CRYPTO_KEY_XTS_256;
+    reg_val = pciemu_mmio_dispatch_read(&dev, PCIEMU_HW_BAR0_CRYPTO_KEY_CTRL,
+                                        size);
+    EXPECT_EQ(pciemu_crypto_read_fake.arg1_val, PCIEMU_HW_BAR0_CRYPTO_KEY_CTRL,
+              "Should read the key register");
+    EXPECT_EQ(reg_val, PCIEMU_HW_CRYPTO_KEY_XTS_256,
+              "Should read the value of the key slots");
+    pciemu_mmio_dispatch_read(&dev, PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_END, size);
+    EXPECT_EQ(pciemu_crypto_read_fake.call_count, 2,
+              "Should read the last key register");
+
+    RESET_FAKE(pciemu_irq_read);
+    pciemu_irq_read_fake.return_val = PCIEMU_HW_IRQ_CAUSE_DMA_DONE;
+    reg_val = pciemu_mmio_dispatch_read(&dev, PCIEMU_HW_BAR0_IRQ_CAUSE, size);
+    EXPECT_EQ(pciemu_irq_read_fake.arg1_val, PCIEMU_HW_BAR0_IRQ_CAUSE,
+              "Should read the cause register");
+    EXPECT_EQ(reg_val, PCIEMU_HW_IRQ_CAUSE_DMA_DONE,
+              "Should read the value of the causes");
+    pciemu_mmio_dispatch_read(&dev, PCIEMU_HW_BAR0_IRQ_TIMER_NS, size);
+    EXPECT_EQ(pciemu_irq_read_fake.call_count, 2,
+              "Should read the last IRQ register");
 }
 
-TEST(pciemu_mmio_write, "Test MMIO write operations")
+TEST(pciemu_mmio_dispatch_write, "Test MMIO write operations")
 {
     PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
     uint64_t val = 0;
@@ -65,45 +156,431 @@ TEST(pciemu_mmio_write, "Test MMIO write operations")
 
     for (int i = 0; i < PCIEMU_HW_BAR0_REG_CNT; ++i) {
         val = 0xbb + i;
-        pciemu_mmio_write(&dev, reg_addr[i], val, size);
+        pciemu_mmio_dispatch_write(&dev, reg_addr[i], val, size);
         EXPECT_EQ(dev.reg[i], val, "Should set value properly");
     }
 
-    pciemu_mmio_write(&dev, PCIEMU_HW_BAR0_IRQ_0_RAISE, val, size);
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_IRQ_0_RAISE, val, size);
     EXPECT_EQ(pciemu_irq_raise_fake.call_count, 1, "Should call once");
     EXPECT_EQ(pciemu_irq_raise_fake.arg1_val, 0,
               "Should raise correct irq num");
 
-    pciemu_mmio_write(&dev, PCIEMU_HW_BAR0_IRQ_0_LOWER, val, size);
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_IRQ_0_LOWER, val, size);
     EXPECT_EQ(pciemu_irq_lower_fake.call_count, 1, "Should call once");
     EXPECT_EQ(pciemu_irq_lower_fake.arg1_val, 0,
               "Should raise correct irq num");
 
-    pciemu_mmio_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_SRC, val, size);
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_SRC, val,
+                               size);
     EXPECT_EQ(pciemu_dma_config_txdesc_src_fake.call_count, 1,
               "Should call once");
     EXPECT_EQ(pciemu_dma_config_txdesc_src_fake.arg1_val, val,
               "Should call with correct arguments");
 
-    pciemu_mmio_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_DST, val, size);
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_DST, val,
+                               size);
     EXPECT_EQ(pciemu_dma_config_txdesc_dst_fake.call_count, 1,
               "Should call once");
     EXPECT_EQ(pciemu_dma_config_txdesc_dst_fake.arg1_val, val,
               "Should call with correct arguments");
 
-    pciemu_mmio_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_LEN, val, size);
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_TXDESC_LEN, val,
+                               size);
     EXPECT_EQ(pciemu_dma_config_txdesc_len_fake.call_count, 1,
               "Should call once");
     EXPECT_EQ(pciemu_dma_config_txdesc_len_fake.arg1_val, val,
               "Should call with correct arguments");
 
-    pciemu_mmio_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_CMD, val, size);
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_CMD, val, size);
     EXPECT_EQ(pciemu_dma_config_cmd_fake.call_count, 1, "Should call once");
     EXPECT_EQ(pciemu_dma_config_cmd_fake.arg1_val, val,
               "Should call with correct arguments");
 
-    pciemu_mmio_write(&dev, PCIEMU_HW_BAR0_DMA_DOORBELL_RING, val, size);
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_DOORBELL_RING, val,
+                               size);
     EXPECT_EQ(pciemu_dma_doorbell_ring_fake.call_count, 1, "Should call once");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_DESC_DOORBELL, 3, size);
+    EXPECT_EQ(pciemu_dma_desc_doorbell_ring_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_desc_doorbell_ring_fake.arg1_val, 3,
+              "Should call with the slot");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_RX_CFG_RING_ADDR, val,
+                               size);
+    EXPECT_EQ(pciemu_rx_config_ring_addr_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_rx_config_ring_addr_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_RX_CFG_RING_SIZE, val,
+                               size);
+    EXPECT_EQ(pciemu_rx_config_ring_size_fake.call_count, 1,
+              "Should call once");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_RX_CFG_PKT_SIZE, val, size);
+    EXPECT_EQ(pciemu_rx_config_pkt_size_fake.call_count, 1,
+              "Should call once");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_RX_CFG_RATE, val, size);
+    EXPECT_EQ(pciemu_rx_config_rate_fake.call_count, 1, "Should call once");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_RX_CFG_BURST, val, size);
+    EXPECT_EQ(pciemu_rx_config_burst_fake.call_count, 1, "Should call once");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_RX_TAIL, val, size);
+    EXPECT_EQ(pciemu_rx_tail_update_fake.call_count, 1, "Should call once");
+    EXPECT_EQ(pciemu_rx_tail_update_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_RX_CTRL, val, size);
+    EXPECT_EQ(pciemu_rx_ctrl_fake.call_count, 1, "Should call once");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_PATTERN, val, size);
+    EXPECT_EQ(pciemu_dma_config_pattern_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_config_pattern_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_PATTERN_SEED, val,
+                               size);
+    EXPECT_EQ(pciemu_dma_config_pattern_seed_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_config_pattern_seed_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    hwaddr queue = PCIEMU_HW_BAR0_DMA_QUEUE_START +
+                   PCIEMU_HW_BAR0_DMA_QUEUE_STRIDE;
+    pciemu_mmio_dispatch_write(&dev, queue + PCIEMU_HW_DMA_QUEUE_TAIL, 4, size);
+    EXPECT_EQ(pciemu_arbiter_write_fake.call_count, 1, "Should call once");
+    EXPECT_EQ(pciemu_arbiter_write_fake.arg1_val,
+              queue + PCIEMU_HW_DMA_QUEUE_TAIL,
+              "Should call with the queue register");
+    EXPECT_EQ(pciemu_arbiter_write_fake.arg2_val, 4,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_CRYPTO_KEY_SLOT, 2,
+                               size);
+    EXPECT_EQ(pciemu_dma_config_crypto_key_slot_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_config_crypto_key_slot_fake.arg1_val, 2,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_CRYPTO_SECTOR_SIZE,
+                               4096, size);
+    EXPECT_EQ(pciemu_dma_config_crypto_sector_size_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_config_crypto_sector_size_fake.arg1_val, 4096,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_CRYPTO_SECTOR, val,
+                               size);
+    EXPECT_EQ(pciemu_dma_config_crypto_sector_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_config_crypto_sector_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_ATOMIC_OPERAND, val,
+                               size);
+    EXPECT_EQ(pciemu_dma_config_atomic_operand_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_config_atomic_operand_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_ATOMIC_COMPARE, val,
+                               size);
+    EXPECT_EQ(pciemu_dma_config_atomic_compare_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_config_atomic_compare_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_2D_ROWS, val, size);
+    EXPECT_EQ(pciemu_dma_config_2d_rows_fake.call_count, 1, "Should call once");
+    EXPECT_EQ(pciemu_dma_config_2d_rows_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_2D_SRC_STRIDE, val,
+                               size);
+    EXPECT_EQ(pciemu_dma_config_2d_src_stride_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_config_2d_src_stride_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_2D_DST_STRIDE, val,
+                               size);
+    EXPECT_EQ(pciemu_dma_config_2d_dst_stride_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_config_2d_dst_stride_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_MCAST_CNT, val,
+                               size);
+    EXPECT_EQ(pciemu_dma_config_mcast_cnt_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_config_mcast_cnt_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_RAID_SRC_CNT, val,
+                               size);
+    EXPECT_EQ(pciemu_dma_config_raid_src_cnt_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_config_raid_src_cnt_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_RAID_Q_DST, val,
+                               size);
+    EXPECT_EQ(pciemu_dma_config_raid_q_dst_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_config_raid_q_dst_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_SCAN_KEY_LO, val,
+                               size);
+    EXPECT_EQ(pciemu_dma_config_scan_key_lo_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_config_scan_key_lo_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_SCAN_KEY_HI, val,
+                               size);
+    EXPECT_EQ(pciemu_dma_config_scan_key_hi_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_config_scan_key_hi_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_SCAN_CTRL, val,
+                               size);
+    EXPECT_EQ(pciemu_dma_config_scan_ctrl_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_config_scan_ctrl_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_SCAN_MAX, val,
+                               size);
+    EXPECT_EQ(pciemu_dma_config_scan_max_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_config_scan_max_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_SORT_CTRL, val, size);
+    EXPECT_EQ(pciemu_dma_config_sort_ctrl_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_config_sort_ctrl_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_SORT_IDX_DST, val,
+                               size);
+    EXPECT_EQ(pciemu_dma_config_sort_idx_dst_fake.call_count, 1,
+              "Should call once");
+    EXPECT_EQ(pciemu_dma_config_sort_idx_dst_fake.arg1_val, val,
+              "Should call with correct arguments");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_START + 8,
+                               val, size);
+    EXPECT_EQ(pciemu_crypto_write_fake.call_count, 1, "Should call once");
+    EXPECT_EQ(pciemu_crypto_write_fake.arg1_val,
+              PCIEMU_HW_BAR0_CRYPTO_KEY_DATA_START + 8,
+              "Should call with the key register");
+    EXPECT_EQ(pciemu_crypto_write_fake.arg2_val, val,
+              "Should call with correct arguments");
+    EXPECT_EQ(pciemu_crypto_write_fake.arg3_val, size,
+              "Should call with the size of the write");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_IRQ_MASK, val, size);
+    EXPECT_EQ(pciemu_irq_write_fake.call_count, 1, "Should call once");
+    EXPECT_EQ(pciemu_irq_write_fake.arg1_val, PCIEMU_HW_BAR0_IRQ_MASK,
+              "Should call with the mask register");
+    EXPECT_EQ(pciemu_irq_write_fake.arg2_val, val,
+              "Should call with correct arguments");
+}
+
+TEST(pciemu_mmio_trace, "Test record of MMIO operations")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    unsigned int size = sizeof(uint64_t);
+    RESET_FAKE(pciemu_trace_mmio);
+    dev.reg[1] = 0xcafe;
+    pciemu_mmio_dispatch_read(&dev, PCIEMU_HW_BAR0_REG_1, size);
+    EXPECT_EQ(pciemu_trace_mmio_fake.call_count, 1, "Should record the read");
+    EXPECT_EQ(pciemu_trace_mmio_fake.arg1_val, PCIEMU_TRACE_MMIO_READ,
+              "Should record a read");
+    EXPECT_EQ(pciemu_trace_mmio_fake.arg2_val, PCIEMU_HW_BAR0_REG_1,
+              "Should record the address");
+    EXPECT_EQ(pciemu_trace_mmio_fake.arg4_val, 0xcafe,
+              "Should record the value read");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_REG_2, 0xbeef, size);
+    EXPECT_EQ(pciemu_trace_mmio_fake.call_count, 2, "Should record the write");
+    EXPECT_EQ(pciemu_trace_mmio_fake.arg1_val, PCIEMU_TRACE_MMIO_WRITE,
+              "Should record a write");
+    EXPECT_EQ(pciemu_trace_mmio_fake.arg3_val, size,
+              "Should record the size");
+    EXPECT_EQ(pciemu_trace_mmio_fake.arg4_val, 0xbeef,
+              "Should record the value written");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_END + 8, 0xbeef, size);
+    EXPECT_EQ(pciemu_trace_mmio_fake.call_count, 2,
+              "Should not record invalid accesses");
+
+    pciemu_mmio_dispatch_write(&dev, PCIEMU_HW_BAR0_DMA_DESC_DOORBELL, 0, size);
+    EXPECT_EQ(pciemu_trace_mmio_fake.call_count, 2,
+              "Should leave the descriptor doorbell to the DMA engine");
+
+    hwaddr queue = PCIEMU_HW_BAR0_DMA_QUEUE_START +
+                   3 * PCIEMU_HW_BAR0_DMA_QUEUE_STRIDE;
+    pciemu_mmio_dispatch_write(&dev, queue + PCIEMU_HW_DMA_QUEUE_TAIL, 1, size);
+    EXPECT_EQ(pciemu_trace_mmio_fake.call_count, 2,
+              "Should leave the queue tails to the arbiter");
+    pciemu_mmio_dispatch_write(&dev, queue + PCIEMU_HW_DMA_QUEUE_PRIO, 1, size);
+    EXPECT_EQ(pciemu_trace_mmio_fake.call_count, 3,
+              "Should record the queue configuration");
+}
+
+/* custom fake of a doorbell whose DMA took the BQL on the way */
+static void pciemu_dma_doorbell_ring_bql(PCIEMUDevice *dev)
+{
+    qemu_mutex_iothread_locked_fake.return_val = true;
+}
+
+TEST(pciemu_mmio_write, "Test writes of the vCPUs outside of the BQL")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    unsigned int size = sizeof(uint64_t);
+    RESET_FAKE(qemu_mutex_iothread_locked);
+    RESET_FAKE(qemu_mutex_lock_iothread_impl);
+    RESET_FAKE(qemu_mutex_unlock_iothread);
+    RESET_FAKE(qemu_rec_mutex_lock_impl);
+    RESET_FAKE(qemu_rec_mutex_unlock_impl);
+    RESET_FAKE(timer_mod_ns);
+    RESET_FAKE(pciemu_dma_doorbell_ring);
+    RESET_FAKE(pciemu_dma_config_cmd);
+    RESET_FAKE(pciemu_stats_doorbell);
+    RESET_FAKE(qemu_clock_get_ns);
+
+    pciemu_mmio_write(&dev, PCIEMU_HW_BAR0_DMA_CFG_CMD, 1, size);
+    EXPECT_EQ(pciemu_dma_config_cmd_fake.call_count, 1,
+              "Should write the configuration straight away");
+    EXPECT_EQ(qemu_rec_mutex_lock_impl_fake.call_count, 1,
+              "Should take the device lock");
+    EXPECT_EQ(qemu_rec_mutex_unlock_impl_fake.call_count, 1,
+              "Should release the device lock");
+    EXPECT_EQ(pciemu_stats_doorbell_fake.call_count, 0,
+              "Should stamp the doorbells only");
+
+    qemu_clock_get_ns_fake.return_val = 1000;
+    pciemu_mmio_write(&dev, PCIEMU_HW_BAR0_DMA_DOORBELL_RING, 1, size);
+    EXPECT_EQ(pciemu_dma_doorbell_ring_fake.call_count, 1,
+              "Should ring on the vCPU");
+    EXPECT_EQ(pciemu_stats_doorbell_fake.arg1_val, 1000,
+              "Should stamp the doorbell when it arrived");
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 0,
+              "Should not go through the main loop");
+    EXPECT_EQ(qemu_mutex_lock_iothread_impl_fake.call_count, 0,
+              "Should not wait for the BQL");
+    EXPECT_EQ(qemu_mutex_unlock_iothread_fake.call_count, 0,
+              "Should not release a BQL it does not hold");
+
+    pciemu_dma_doorbell_ring_fake.custom_fake = pciemu_dma_doorbell_ring_bql;
+    pciemu_mmio_write(&dev, PCIEMU_HW_BAR0_DMA_DOORBELL_RING, 1, size);
+    EXPECT_EQ(qemu_mutex_unlock_iothread_fake.call_count, 1,
+              "Should release the BQL taken by the DMA");
+    pciemu_mmio_write(&dev, PCIEMU_HW_BAR0_DMA_DOORBELL_RING, 1, size);
+    EXPECT_EQ(qemu_mutex_unlock_iothread_fake.call_count, 1,
+              "Should keep the BQL held by the caller");
+    EXPECT_EQ(qemu_rec_mutex_lock_impl_fake.call_count,
+              qemu_rec_mutex_unlock_impl_fake.call_count,
+              "Should release the device lock every time");
+    RESET_FAKE(pciemu_dma_doorbell_ring);
+    RESET_FAKE(qemu_mutex_iothread_locked);
+    RESET_FAKE(qemu_clock_get_ns);
+}
+
+TEST(pciemu_mmio_read, "Test reads of the vCPUs outside of the BQL")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    unsigned int size = sizeof(uint64_t);
+    RESET_FAKE(qemu_mutex_iothread_locked);
+    RESET_FAKE(qemu_mutex_lock_iothread_impl);
+    RESET_FAKE(qemu_mutex_unlock_iothread);
+    RESET_FAKE(qemu_rec_mutex_lock_impl);
+    RESET_FAKE(qemu_rec_mutex_unlock_impl);
+    dev.reg[0] = 0xcafe;
+
+    EXPECT_EQ(pciemu_mmio_read(&dev, PCIEMU_HW_BAR0_REG_0, size), 0xcafe,
+              "Should read the register");
+    EXPECT_EQ(qemu_rec_mutex_lock_impl_fake.call_count, 1,
+              "Should take the device lock");
+    EXPECT_EQ(qemu_rec_mutex_unlock_impl_fake.call_count, 1,
+              "Should release the device lock");
+    EXPECT_EQ(qemu_mutex_lock_iothread_impl_fake.call_count, 0,
+              "Should not wait for the BQL");
+}
+
+TEST(pciemu_mmio_lock_bql, "Test BQL taken by a vCPU holding the device")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    RESET_FAKE(qemu_mutex_iothread_locked);
+    RESET_FAKE(qemu_mutex_lock_iothread_impl);
+    RESET_FAKE(qemu_rec_mutex_lock_impl);
+    RESET_FAKE(qemu_rec_mutex_unlock_impl);
+
+    qemu_mutex_iothread_locked_fake.return_val = true;
+    pciemu_mmio_lock_bql(&dev);
+    EXPECT_EQ(qemu_mutex_lock_iothread_impl_fake.call_count, 0,
+              "Should not take the BQL twice");
+    EXPECT_EQ(qemu_rec_mutex_unlock_impl_fake.call_count, 0,
+              "Should keep the device lock");
+
+    qemu_mutex_iothread_locked_fake.return_val = false;
+    pciemu_mmio_lock_bql(&dev);
+    EXPECT_EQ(qemu_mutex_lock_iothread_impl_fake.call_count, 1,
+              "Should take the BQL");
+    EXPECT_EQ(qemu_rec_mutex_unlock_impl_fake.call_count, 1,
+              "Should release the device lock first");
+    EXPECT_EQ(qemu_rec_mutex_lock_impl_fake.call_count, 1,
+              "Should take the device lock back");
+    RESET_FAKE(qemu_mutex_iothread_locked);
+}
+
+/* bus of 4 KiB pages : RAM below 1 MiB, MMIO above */
+static MemoryRegion mmio_test_ram = { .ram = true };
+static MemoryRegion mmio_test_io;
+
+static MemoryRegion *flatview_translate_pages(FlatView *fv, hwaddr addr,
+                                              hwaddr *xlat, hwaddr *plen,
+                                              bool is_write, MemTxAttrs attrs)
+{
+    *xlat = addr;
+    *plen = MIN(*plen, 0x1000 - (addr & 0xfff));
+    return addr < 0x100000 ? &mmio_test_ram : &mmio_test_io;
+}
+
+TEST(pciemu_mmio_dma_prepare, "Test BQL taken before a DMA needing it")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMADirection dir = DMA_DIRECTION_FROM_DEVICE;
+    RESET_FAKE(qemu_mutex_iothread_locked);
+    RESET_FAKE(qemu_mutex_lock_iothread_impl);
+    RESET_FAKE(flatview_translate);
+    RESET_FAKE(memory_region_is_ram_device);
+    flatview_translate_fake.custom_fake = flatview_translate_pages;
+
+    pciemu_mmio_dma_prepare(&dev, 0x800, 0x2000, dir);
+    EXPECT_EQ(flatview_translate_fake.call_count, 3,
+              "Should translate every page of the range");
+    EXPECT_EQ(qemu_mutex_lock_iothread_impl_fake.call_count, 0,
+              "Should not take the BQL for RAM");
+
+    pciemu_mmio_dma_prepare(&dev, 0x100000 - 0x800, 0x1000, dir);
+    EXPECT_EQ(qemu_mutex_lock_iothread_impl_fake.call_count, 1,
+              "Should take the BQL for a range ending in MMIO");
+
+    RESET_FAKE(flatview_translate);
+    qemu_mutex_iothread_locked_fake.return_val = true;
+    pciemu_mmio_dma_prepare(&dev, 0x100000, 0x1000, dir);
+    EXPECT_EQ(flatview_translate_fake.call_count, 0,
+              "Should not translate under the BQL");
+    RESET_FAKE(qemu_mutex_iothread_locked);
 }
 
 TEST(pciemu_mmio_reset, "Test reset of MMIO")
@@ -124,12 +601,25 @@ TEST(pciemu_device_init, "Test initialization of MMIO")
     Error *e = NULL;
     pciemu_mmio_init(&dev, &e);
     EXPECT_EQ(memory_region_init_io_fake.call_count, 1, "Should call once");
+    EXPECT_EQ(memory_region_clear_global_locking_fake.arg0_val, &dev.mmio,
+              "Should dispatch BAR0 outside of the BQL");
+    EXPECT_EQ(qemu_rec_mutex_init_fake.arg0_val, &dev.lock,
+              "Should set the device lock up");
 
-    EXPECT_EQ(pci_register_bar_fake.call_count, 1, "Should call once");
-    EXPECT_EQ(pci_register_bar_fake.arg1_val, 0,
+    EXPECT_EQ(pci_register_bar_fake.call_count, 2, "Should call twice");
+    EXPECT_EQ(pci_register_bar_fake.arg1_history[0], 0,
               "Should use BAR0 as region_num");
-    EXPECT_EQ(pci_register_bar_fake.arg2_val, PCI_BASE_ADDRESS_SPACE_MEMORY,
+    EXPECT_EQ(pci_register_bar_fake.arg2_history[0],
+              PCI_BASE_ADDRESS_SPACE_MEMORY,
               "Should use PCI_BASE_ADDRESS_SPACE_MEMORY as type");
+    EXPECT_EQ(pci_register_bar_fake.arg1_history[1], PCIEMU_HW_BAR2,
+              "Should use BAR2 for the descriptor window");
+    EXPECT_EQ(pci_register_bar_fake.arg2_history[1],
+              PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_PREFETCH |
+                  PCI_BASE_ADDRESS_MEM_TYPE_64,
+              "Should make the descriptor window prefetchable");
+    EXPECT_EQ(pci_register_bar_fake.arg3_history[1], &dev.desc,
+              "Should map the descriptor window");
 }
 
 TEST(pciemu_device_fini, "Test finalization of MMIO")
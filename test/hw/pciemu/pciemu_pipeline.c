@@ -0,0 +1,262 @@
+/* pciemu_pipeline.c - Unit tests for hw/pciemu/pipeline.c file
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "unitctest/unitctest.h"
+#include "fff/fff.h"
+#include "qemu.fake.h"
+#include "pciemu_dma.fake.h"
+#include "pciemu_hostnuma.fake.h"
+#include "pciemu_trace.fake.h"
+
+/* include the source file to test static functions */
+#include "../src/hw/pciemu/pipeline.c"
+
+DEFINE_FFF_GLOBALS;
+
+/* the inline device memory holds 2 staging buffers of 2 KiB */
+#define SLOT (PCIEMU_HW_DMA_AREA_SIZE / 2)
+
+static void pipeline_test_setup(PCIEMUDevice *dev)
+{
+    Error *e = NULL;
+    dev->dma.buff = dev->dma.buff_inline;
+    dev->dma.buff_size = PCIEMU_HW_DMA_AREA_SIZE;
+    dev->dma.pipeline.depth = 2;
+    pciemu_pipeline_init(dev, &e);
+    RESET_FAKE(thread_pool_submit_aio);
+    RESET_FAKE(pciemu_dma_stream_end);
+    RESET_FAKE(pciemu_trace_dma);
+    /* started by the main loop, unless a test says otherwise */
+    qemu_mutex_iothread_locked_fake.return_val = true;
+}
+
+/* main loop polled by a reset : the workers complete their transfers */
+static PCIEMUDevice *pipeline_test_dev;
+
+static bool aio_poll_pipeline(AioContext *ctx, bool blocking)
+{
+    DMAPipeline *pl = &pipeline_test_dev->dma.pipeline;
+    pciemu_pipeline_done(pl->read.busy ? &pl->read : &pl->write, MEMTX_OK);
+    return true;
+}
+
+TEST(pciemu_pipeline_enabled, "Test enabling the pipeline")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    EXPECT_FALSE(pciemu_pipeline_enabled(&dev), "Should be off by default");
+    dev.dma.pipeline.depth = 2;
+    EXPECT_TRUE(pciemu_pipeline_enabled(&dev), "Should be on with a depth");
+}
+
+TEST(pciemu_pipeline_work, "Test transfers run by the workers")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    PipelineOp op = { .dev = &dev, .addr = 0xaaaa0000,
+                      .buf = dev.dma.buff_inline, .len = SLOT,
+                      .dir = DMA_DIRECTION_FROM_DEVICE };
+    RESET_FAKE(address_space_rw);
+    RESET_FAKE(pciemu_hostnuma_pin);
+    RESET_FAKE(pciemu_hostnuma_unpin);
+    address_space_rw_fake.return_val = MEMTX_DECODE_ERROR;
+    int ret = pciemu_pipeline_work(&op);
+    EXPECT_EQ(address_space_rw_fake.call_count, 1, "Should run the transfer");
+    EXPECT_EQ(pciemu_hostnuma_pin_fake.call_count, 1,
+              "Should run on the host nodes of the device");
+    EXPECT_EQ(pciemu_hostnuma_unpin_fake.arg0_val,
+              pciemu_hostnuma_pin_fake.arg1_val,
+              "Should restore the affinity of the worker");
+    EXPECT_EQ(address_space_rw_fake.arg1_val, 0xaaaa0000,
+              "Should transfer at the bus address");
+    EXPECT_EQ(address_space_rw_fake.arg4_val, SLOT,
+              "Should transfer the whole chunk");
+    EXPECT_TRUE(address_space_rw_fake.arg5_val, "Should write to the bus");
+    EXPECT_EQ(ret, MEMTX_DECODE_ERROR, "Should return the error");
+    RESET_FAKE(address_space_rw);
+}
+
+TEST(pciemu_pipeline_stream, "Test overlapping reads and writes")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAPipeline *pl = &dev.dma.pipeline;
+    pipeline_test_setup(&dev);
+
+    pciemu_pipeline_start(&dev, 0xaaaa0000, 0xbbbb0000, 3 * SLOT + 10);
+    EXPECT_EQ(pl->slot_size, SLOT, "Should split the device memory");
+    EXPECT_EQ(thread_pool_submit_aio_fake.call_count, 1,
+              "Should only read the first chunk");
+    EXPECT_EQ(pl->read.addr, 0xaaaa0000, "Should read from the source");
+    EXPECT_EQ(pl->read.buf, &dev.dma.buff[0], "Should use the first buffer");
+
+    pciemu_pipeline_done(&pl->read, MEMTX_OK);
+    EXPECT_EQ(thread_pool_submit_aio_fake.call_count, 3,
+              "Should read the next chunk while writing the first one");
+    EXPECT_EQ(pl->read.buf, &dev.dma.buff[SLOT], "Should read in the next");
+    EXPECT_EQ(pl->write.addr, 0xbbbb0000, "Should write to the destination");
+    EXPECT_EQ(pl->write.buf, &dev.dma.buff[0], "Should write the first");
+
+    pciemu_pipeline_done(&pl->read, MEMTX_OK);
+    EXPECT_EQ(thread_pool_submit_aio_fake.call_count, 3,
+              "Should not read while every buffer is full");
+
+    pciemu_pipeline_done(&pl->write, MEMTX_OK);
+    EXPECT_EQ(thread_pool_submit_aio_fake.call_count, 5,
+              "Should read into the buffer just written");
+    EXPECT_EQ(pl->read.buf, &dev.dma.buff[0], "Should wrap around");
+    EXPECT_EQ(pl->write.addr, 0xbbbb0000 + SLOT,
+              "Should write the second chunk");
+
+    pciemu_pipeline_done(&pl->write, MEMTX_OK);
+    pciemu_pipeline_done(&pl->read, MEMTX_OK);
+    pciemu_pipeline_done(&pl->read, MEMTX_OK);
+    EXPECT_EQ(pl->rd, 3 * SLOT + 10, "Should have read everything");
+    EXPECT_EQ(pl->read.len, 10, "Should read only the remaining bytes");
+    pciemu_pipeline_done(&pl->write, MEMTX_OK);
+    EXPECT_EQ(pciemu_dma_stream_end_fake.call_count, 0,
+              "Should not end before the last byte is written");
+    pciemu_pipeline_done(&pl->write, MEMTX_OK);
+    EXPECT_EQ(pl->write.addr, 0xbbbb0000 + 3 * SLOT,
+              "Should write the last chunk at the right offset");
+    EXPECT_EQ(pl->write.len, 10, "Should write only the remaining bytes");
+    EXPECT_EQ(pciemu_dma_stream_end_fake.call_count, 1, "Should end once");
+    EXPECT_EQ(pciemu_dma_stream_end_fake.arg1_val, PCIEMU_HW_DMA_ERR_NONE,
+              "Should end without error");
+    EXPECT_FALSE(pl->active, "Should not be active anymore");
+    EXPECT_EQ(thread_pool_submit_aio_fake.call_count, 8,
+              "Should read and write 4 chunks");
+    EXPECT_EQ(pciemu_trace_dma_fake.call_count, 8,
+              "Should trace every transfer");
+}
+
+TEST(pciemu_pipeline_error, "Test errors of the transfers")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAPipeline *pl = &dev.dma.pipeline;
+    pipeline_test_setup(&dev);
+
+    pciemu_pipeline_start(&dev, 0xaaaa0000, 0xbbbb0000, 4 * SLOT);
+    pciemu_pipeline_done(&pl->read, MEMTX_DECODE_ERROR);
+    EXPECT_EQ(thread_pool_submit_aio_fake.call_count, 1,
+              "Should not go on after an error");
+    EXPECT_EQ(pciemu_dma_stream_end_fake.call_count, 1, "Should end once");
+    EXPECT_EQ(pciemu_dma_stream_end_fake.arg1_val, PCIEMU_HW_DMA_ERR_BUS,
+              "Should end with the error");
+
+    RESET_FAKE(thread_pool_submit_aio);
+    RESET_FAKE(pciemu_dma_stream_end);
+    pciemu_pipeline_start(&dev, 0xaaaa0000, 0xbbbb0000, 4 * SLOT);
+    pciemu_pipeline_done(&pl->read, MEMTX_OK);
+    pciemu_pipeline_done(&pl->write, MEMTX_DECODE_ERROR);
+    EXPECT_EQ(pciemu_dma_stream_end_fake.call_count, 0,
+              "Should wait for the read in flight");
+    pciemu_pipeline_done(&pl->read, MEMTX_OK);
+    EXPECT_EQ(thread_pool_submit_aio_fake.call_count, 3,
+              "Should not go on after an error");
+    EXPECT_EQ(pciemu_dma_stream_end_fake.call_count, 1, "Should end once");
+    EXPECT_EQ(pciemu_dma_stream_end_fake.arg1_val, PCIEMU_HW_DMA_ERR_BUS,
+              "Should end with the error");
+}
+
+TEST(pciemu_pipeline_reset, "Test reset of the pipeline")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAPipeline *pl = &dev.dma.pipeline;
+    pipeline_test_setup(&dev);
+
+    pciemu_pipeline_start(&dev, 0xaaaa0000, 0xbbbb0000, 4 * SLOT);
+    pciemu_pipeline_done(&pl->read, MEMTX_OK);
+    RESET_FAKE(aio_poll);
+    RESET_FAKE(pciemu_trace_dma);
+    aio_poll_fake.custom_fake = aio_poll_pipeline;
+    pipeline_test_dev = &dev;
+    pciemu_pipeline_reset(&dev);
+    EXPECT_FALSE(pl->active, "Should abort the stream");
+    EXPECT_EQ(aio_poll_fake.call_count, 2,
+              "Should wait for the read and the write in flight");
+    EXPECT_FALSE(pl->read.busy || pl->write.busy,
+                 "Should leave no transfer behind");
+    EXPECT_EQ(pciemu_trace_dma_fake.call_count, 0,
+              "Should drop the transfers of the aborted stream");
+    EXPECT_EQ(pciemu_dma_stream_end_fake.call_count, 0,
+              "Should not end the aborted stream");
+
+    RESET_FAKE(aio_poll);
+    RESET_FAKE(thread_pool_submit_aio);
+    pciemu_pipeline_start(&dev, 0xcccc0000, 0xdddd0000, SLOT);
+    EXPECT_EQ(thread_pool_submit_aio_fake.call_count, 1,
+              "Should start the next stream right away");
+    EXPECT_EQ(pl->read.addr, 0xcccc0000, "Should read the new source");
+    pciemu_pipeline_done(&pl->read, MEMTX_OK);
+    pciemu_pipeline_done(&pl->write, MEMTX_OK);
+    EXPECT_EQ(pciemu_dma_stream_end_fake.call_count, 1,
+              "Should end the new stream only");
+
+    pciemu_pipeline_reset(&dev);
+    EXPECT_EQ(aio_poll_fake.call_count, 0, "Should not wait without transfer");
+}
+
+TEST(pciemu_pipeline_start_vcpu, "Test streams started by a vCPU")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    DMAPipeline *pl = &dev.dma.pipeline;
+    pipeline_test_setup(&dev);
+    RESET_FAKE(timer_mod_ns);
+    RESET_FAKE(timer_del);
+    qemu_mutex_iothread_locked_fake.return_val = false;
+
+    pciemu_pipeline_start(&dev, 0xaaaa0000, 0xbbbb0000, 4 * SLOT);
+    EXPECT_EQ(thread_pool_submit_aio_fake.call_count, 0,
+              "Should not reach the thread pool from a vCPU");
+    EXPECT_EQ(timer_mod_ns_fake.arg0_val, &pl->timer,
+              "Should leave the first transfers to the main loop");
+    qemu_mutex_iothread_locked_fake.return_val = true;
+    pciemu_pipeline_timer_cb(&dev);
+    EXPECT_EQ(thread_pool_submit_aio_fake.call_count, 1,
+              "Should hand the first read over in the main loop");
+    EXPECT_EQ(pl->read.addr, 0xaaaa0000, "Should read from the source");
+
+    pciemu_pipeline_done(&pl->read, MEMTX_ERROR);
+    EXPECT_FALSE(pl->active, "Should end the stream");
+    RESET_FAKE(thread_pool_submit_aio);
+    qemu_mutex_iothread_locked_fake.return_val = false;
+    pciemu_pipeline_start(&dev, 0xaaaa0000, 0xbbbb0000, 4 * SLOT);
+    pciemu_pipeline_reset(&dev);
+    EXPECT_EQ(timer_del_fake.arg0_val, &pl->timer,
+              "Should not start an aborted stream");
+    pciemu_pipeline_timer_cb(&dev);
+    EXPECT_EQ(thread_pool_submit_aio_fake.call_count, 0,
+              "Should not start an aborted stream");
+    RESET_FAKE(qemu_mutex_iothread_locked);
+}
+
+TEST(pciemu_pipeline_init, "Test initialization of the pipeline")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    Error *e = NULL;
+    uint32_t depths[] = { 0, PCIEMU_PIPELINE_DEPTH_MIN,
+                          PCIEMU_PIPELINE_DEPTH_MAX };
+    for (size_t i = 0; i < ARRAY_SIZE(depths); ++i) {
+        RESET_FAKE(error_setg_internal);
+        dev.dma.pipeline.depth = depths[i];
+        pciemu_pipeline_init(&dev, &e);
+        EXPECT_EQ(error_setg_internal_fake.call_count, 0,
+                  "Should accept the depth");
+        EXPECT_EQ(dev.dma.pipeline.read.dev, &dev, "Should set the device");
+        EXPECT_FALSE(dev.dma.pipeline.active, "Should not be active");
+    }
+
+    uint32_t bad[] = { 1, PCIEMU_PIPELINE_DEPTH_MAX + 1 };
+    for (size_t i = 0; i < ARRAY_SIZE(bad); ++i) {
+        RESET_FAKE(error_setg_internal);
+        dev.dma.pipeline.depth = bad[i];
+        pciemu_pipeline_init(&dev, &e);
+        EXPECT_EQ(error_setg_internal_fake.call_count, 1,
+                  "Should reject the depth");
+    }
+}
+
+TEST_MAIN()
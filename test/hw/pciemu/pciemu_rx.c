@@ -0,0 +1,259 @@
+/* pciemu_rx.c - Unit tests for hw/pciemu/rx.c file
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "unitctest/unitctest.h"
+#include "fff/fff.h"
+#include "qemu.fake.h"
+#include "pciemu_dma.fake.h"
+#include "pciemu_irq.fake.h"
+
+/* include the source file to test static functions */
+#include "../src/hw/pciemu/rx.c"
+
+DEFINE_FFF_GLOBALS;
+
+#define TEST_RX_BUF_ADDR 0xcafe0000
+#define TEST_RX_BUF_LEN 256
+
+/* custom fake returning a posted descriptor on every read */
+static int pciemu_dma_rw_desc(PCIEMUDevice *dev, dma_addr_t addr, void *buf,
+                              dma_addr_t len, DMADirection dir)
+{
+    if (dir == DMA_DIRECTION_TO_DEVICE && len == PCIEMU_HW_RX_DESC_SIZE) {
+        memset(buf, 0, len);
+        stq_le_p((uint8_t *)buf + PCIEMU_HW_RX_DESC_ADDR, TEST_RX_BUF_ADDR);
+        stl_le_p((uint8_t *)buf + PCIEMU_HW_RX_DESC_LEN, TEST_RX_BUF_LEN);
+    }
+    return 0;
+}
+
+TEST(pciemu_rx_ring_avail, "Test number of posted buffers")
+{
+    RXGenerator rx = { .config = { .ring_size = 8 } };
+    rx.head = 0;
+    rx.tail = 0;
+    EXPECT_EQ(pciemu_rx_ring_avail(&rx), 0, "Empty ring");
+    rx.tail = 5;
+    EXPECT_EQ(pciemu_rx_ring_avail(&rx), 5, "Five buffers posted");
+    rx.head = 6;
+    rx.tail = 2;
+    EXPECT_EQ(pciemu_rx_ring_avail(&rx), 4, "Should handle wrap around");
+    rx.config.ring_size = 0;
+    EXPECT_EQ(pciemu_rx_ring_avail(&rx), 0, "Ring not configured");
+}
+
+TEST(pciemu_rx_tokens_refill, "Test refill of the token bucket")
+{
+    RXGenerator rx = { .config = { .rate = 1000, .burst = 4 } };
+    rx.last_refill_ns = 0;
+    pciemu_rx_tokens_refill(&rx, 1000000);
+    EXPECT_EQ(rx.tokens, NANOSECONDS_PER_SECOND,
+              "Should earn one packet per ms at 1000 pps");
+    EXPECT_EQ(rx.last_refill_ns, 1000000, "Should update refill time");
+
+    pciemu_rx_tokens_refill(&rx, 1000000 + NANOSECONDS_PER_SECOND);
+    EXPECT_EQ(rx.tokens, 4 * NANOSECONDS_PER_SECOND,
+              "Should not go above the bucket depth");
+
+    rx.config.rate = 0;
+    rx.tokens = 0;
+    pciemu_rx_tokens_refill(&rx, 3 * NANOSECONDS_PER_SECOND);
+    EXPECT_TRUE(pciemu_rx_has_token(&rx), "Unlimited rate has tokens");
+}
+
+TEST(pciemu_rx_next_tick, "Test time until next run of the generator")
+{
+    RXGenerator rx = { .config = { .rate = 1000, .burst = 1 } };
+    rx.tokens = 0;
+    EXPECT_EQ(pciemu_rx_next_tick(&rx), 1000000,
+              "Should wait for a full token (1 ms at 1000 pps)");
+    rx.tokens = NANOSECONDS_PER_SECOND;
+    EXPECT_EQ(pciemu_rx_next_tick(&rx), PCIEMU_RX_TIMER_MIN_NS,
+              "Should use the minimum interval when a token is available");
+    rx.config.rate = NANOSECONDS_PER_SECOND;
+    rx.tokens = 0;
+    EXPECT_EQ(pciemu_rx_next_tick(&rx), PCIEMU_RX_TIMER_MIN_NS,
+              "Should never go below the minimum interval");
+}
+
+TEST(pciemu_rx_fill_one, "Test filling of a single buffer")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    RESET_FAKE(pciemu_dma_rw);
+    pciemu_dma_rw_fake.custom_fake = pciemu_dma_rw_desc;
+    dev.rx.config.ring_addr = 0xbeef0000;
+    dev.rx.config.ring_size = 4;
+    dev.rx.config.pkt_size = 64;
+    dev.rx.head = 3;
+    dev.rx.tail = 1;
+    EXPECT_EQ(pciemu_rx_fill_one(&dev), 0, "Should fill the buffer");
+    EXPECT_EQ(pciemu_dma_rw_fake.call_count, 3,
+              "Should read the desc, write the packet and write the desc");
+    EXPECT_EQ(pciemu_dma_rw_fake.arg1_history[0],
+              0xbeef0000 + 3 * PCIEMU_HW_RX_DESC_SIZE,
+              "Should read the descriptor at head");
+    EXPECT_EQ(pciemu_dma_rw_fake.arg1_history[1], TEST_RX_BUF_ADDR,
+              "Should write the packet to the posted buffer");
+    EXPECT_EQ(pciemu_dma_rw_fake.arg3_history[1], 64,
+              "Should write pkt_size bytes");
+    EXPECT_EQ(pciemu_dma_rw_fake.arg4_history[2],
+              DMA_DIRECTION_FROM_DEVICE,
+              "Should write back the descriptor");
+    EXPECT_EQ(dev.rx.head, 0, "Should move head forward (wrap around)");
+    EXPECT_EQ(dev.rx.seq, 1, "Should increment the sequence number");
+
+    RESET_FAKE(pciemu_dma_rw);
+    pciemu_dma_rw_fake.custom_fake = pciemu_dma_rw_desc;
+    dev.rx.config.pkt_size = 1024;
+    pciemu_rx_fill_one(&dev);
+    EXPECT_EQ(pciemu_dma_rw_fake.arg3_history[1], TEST_RX_BUF_LEN,
+              "Should not overflow the posted buffer");
+    RESET_FAKE(pciemu_dma_rw);
+}
+
+TEST(pciemu_rx_timer_cb, "Test run of the generator")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    RESET_FAKE(pciemu_dma_rw);
+    RESET_FAKE(pciemu_irq_event);
+    RESET_FAKE(timer_mod_ns);
+    pciemu_dma_rw_fake.custom_fake = pciemu_dma_rw_desc;
+    dev.rx.status = RX_STATUS_RUNNING;
+    dev.rx.config.ring_size = 8;
+    dev.rx.config.pkt_size = 64;
+    dev.rx.config.rate = 0;
+    dev.rx.head = 0;
+    dev.rx.tail = 5;
+    pciemu_rx_timer_cb(&dev);
+    EXPECT_EQ(dev.rx.head, 5, "Should fill all posted buffers");
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 1, "Should raise irq once");
+    EXPECT_EQ(pciemu_irq_event_fake.arg1_val, PCIEMU_HW_IRQ_CAUSE_RX_DONE,
+              "Should signal the RX done cause");
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 0,
+              "Should wait for new buffers instead of re-arming");
+
+    RESET_FAKE(pciemu_irq_event);
+    dev.rx.config.rate = 1000;
+    dev.rx.config.burst = 2;
+    dev.rx.tokens = 2 * NANOSECONDS_PER_SECOND;
+    dev.rx.last_refill_ns = 0;
+    dev.rx.tail = 1;
+    pciemu_rx_timer_cb(&dev);
+    EXPECT_EQ(dev.rx.head, 7, "Should fill only as many as the tokens allow");
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 1,
+              "Should re-arm while there are buffers left");
+
+    RESET_FAKE(pciemu_irq_event);
+    dev.rx.status = RX_STATUS_STOPPED;
+    pciemu_rx_timer_cb(&dev);
+    EXPECT_EQ(pciemu_irq_event_fake.call_count, 0, "Should do nothing");
+    RESET_FAKE(pciemu_dma_rw);
+}
+
+TEST(pciemu_rx_ctrl, "Test start and stop of the generator")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    RESET_FAKE(timer_mod_ns);
+    RESET_FAKE(timer_del);
+    dev.rx.status = RX_STATUS_STOPPED;
+    pciemu_rx_ctrl(&dev, PCIEMU_HW_RX_CTRL_START);
+    EXPECT_EQ(dev.rx.status, RX_STATUS_STOPPED,
+              "Should not start without a configured ring");
+
+    dev.rx.config.ring_size = 8;
+    dev.rx.config.pkt_size = 64;
+    dev.rx.config.burst = 4;
+    pciemu_rx_ctrl(&dev, PCIEMU_HW_RX_CTRL_START);
+    EXPECT_EQ(dev.rx.status, RX_STATUS_RUNNING, "Should be running");
+    EXPECT_EQ(dev.rx.tokens, 4 * NANOSECONDS_PER_SECOND,
+              "Should start with a full bucket");
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 1, "Should arm the timer");
+
+    pciemu_rx_ctrl(&dev, PCIEMU_HW_RX_CTRL_STOP);
+    EXPECT_EQ(dev.rx.status, RX_STATUS_STOPPED, "Should be stopped");
+    EXPECT_EQ(timer_del_fake.call_count, 1, "Should disarm the timer");
+}
+
+TEST(pciemu_rx_config, "Test configuration of the generator")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    dev.rx.status = RX_STATUS_STOPPED;
+    pciemu_rx_config_ring_addr(&dev, 0xbeef0000);
+    pciemu_rx_config_ring_size(&dev, 16);
+    pciemu_rx_config_pkt_size(&dev, 1500);
+    pciemu_rx_config_rate(&dev, 1000);
+    pciemu_rx_config_burst(&dev, 8);
+    EXPECT_EQ(dev.rx.config.ring_addr, 0xbeef0000, "Should set the value");
+    EXPECT_EQ(dev.rx.config.ring_size, 16, "Should set the value");
+    EXPECT_EQ(dev.rx.config.pkt_size, 1500, "Should set the value");
+    EXPECT_EQ(dev.rx.config.rate, 1000, "Should set the value");
+    EXPECT_EQ(dev.rx.config.burst, 8, "Should set the value");
+
+    pciemu_rx_config_ring_size(&dev, PCIEMU_HW_RX_RING_SIZE_MAX + 1);
+    EXPECT_EQ(dev.rx.config.ring_size, 16, "Should reject a too big ring");
+    pciemu_rx_config_pkt_size(&dev, PCIEMU_HW_RX_PKT_SIZE_MAX + 1);
+    EXPECT_EQ(dev.rx.config.pkt_size, 1500, "Should reject a too big pkt");
+    pciemu_rx_config_burst(&dev, PCIEMU_HW_RX_BURST_MAX + 1);
+    EXPECT_EQ(dev.rx.config.burst, 8, "Should reject a too big burst");
+
+    dev.rx.status = RX_STATUS_RUNNING;
+    pciemu_rx_config_pkt_size(&dev, 64);
+    EXPECT_EQ(dev.rx.config.pkt_size, 1500, "Should not set the value");
+}
+
+TEST(pciemu_rx_tail_update, "Test posting of new buffers")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    RESET_FAKE(timer_mod_ns);
+    RESET_FAKE(timer_pending);
+    dev.rx.config.ring_size = 8;
+    dev.rx.status = RX_STATUS_STOPPED;
+    pciemu_rx_tail_update(&dev, 3);
+    EXPECT_EQ(dev.rx.tail, 3, "Should set the tail");
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 0, "Should not kick if stopped");
+
+    dev.rx.status = RX_STATUS_RUNNING;
+    pciemu_rx_tail_update(&dev, 5);
+    EXPECT_EQ(timer_mod_ns_fake.call_count, 1, "Should kick the generator");
+
+    pciemu_rx_tail_update(&dev, 8);
+    EXPECT_EQ(dev.rx.tail, 5, "Should reject a tail out of bounds");
+}
+
+TEST(pciemu_rx_reset, "Test reset of RX")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    dev.rx.status = RX_STATUS_RUNNING;
+    dev.rx.config.ring_size = 8;
+    dev.rx.head = 2;
+    dev.rx.seq = 42;
+    pciemu_rx_reset(&dev);
+    EXPECT_EQ(dev.rx.status, RX_STATUS_STOPPED, "Should have STOPPED status");
+    EXPECT_EQ(dev.rx.config.ring_size, 0, "Should be initialized to zero");
+    EXPECT_EQ(dev.rx.head, 0, "Should be initialized to zero");
+    EXPECT_EQ(dev.rx.seq, 0, "Should be initialized to zero");
+}
+
+TEST(pciemu_rx_init, "Test initialization of RX")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    Error *e = NULL;
+    RESET_FAKE(timer_init_full);
+    pciemu_rx_init(&dev, &e);
+    EXPECT_EQ(timer_init_full_fake.call_count, 1, "Should init the timer");
+    EXPECT_EQ(dev.rx.status, RX_STATUS_STOPPED, "Should have STOPPED status");
+}
+
+TEST(pciemu_rx_fini, "Test finalization of RX")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    pciemu_rx_fini(&dev);
+    EXPECT_EQ(dev.rx.status, RX_STATUS_OFF, "Should have OFF status");
+}
+
+TEST_MAIN()
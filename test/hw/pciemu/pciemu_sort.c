@@ -0,0 +1,338 @@
+/* pciemu_sort.c - Unit tests for hw/pciemu/sort.c file
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "unitctest/unitctest.h"
+#include "fff/fff.h"
+#include "qemu.fake.h"
+#include "pciemu_dma.fake.h"
+#include "pciemu_hostnuma.fake.h"
+#include "pciemu_trace.fake.h"
+
+/* include the source file to test static functions */
+#include "../src/hw/pciemu/sort.c"
+
+DEFINE_FFF_GLOBALS;
+
+/* guest memory of the sort tests : keys, sorted keys and indices */
+#define SORT_TEST_SRC 0xa0000000
+#define SORT_TEST_DST 0xb0000000
+#define SORT_TEST_IDX 0xc0000000
+#define SORT_TEST_CNT 1000
+static uint64_t sort_src[SORT_TEST_CNT];
+static uint64_t sort_dst[SORT_TEST_CNT];
+static uint32_t sort_idx[SORT_TEST_CNT];
+
+static MemTxResult address_space_rw_sort(AddressSpace *as, hwaddr addr,
+                                         MemTxAttrs attrs, void *buf,
+                                         hwaddr len, bool is_write)
+{
+    if (addr == SORT_TEST_SRC)
+        memcpy(buf, sort_src, len);
+    else if (addr == SORT_TEST_DST)
+        memcpy(sort_dst, buf, len);
+    else
+        memcpy(sort_idx, buf, len);
+    return 0;
+}
+
+/* sort of cnt keys of key_size bytes from SORT_TEST_SRC, run to its end */
+static void sort_test_run(PCIEMUDevice *dev, size_t cnt,
+                          unsigned int key_size, bool idx)
+{
+    RESET_FAKE(address_space_rw);
+    RESET_FAKE(pciemu_dma_sort_end);
+    RESET_FAKE(thread_pool_submit_aio);
+    address_space_rw_fake.custom_fake = address_space_rw_sort;
+    qemu_mutex_iothread_locked_fake.return_val = true; /* main loop */
+    pciemu_sort_start(dev, SORT_TEST_SRC, SORT_TEST_DST, SORT_TEST_IDX, cnt,
+                      key_size, idx);
+    void *job = thread_pool_submit_aio_fake.arg1_val;
+    pciemu_sort_done(job, pciemu_sort_work(job));
+}
+
+/* main loop polled by a reset : the worker completes its sort */
+static bool aio_poll_sort(AioContext *ctx, bool blocking)
+{
+    void *job = thread_pool_submit_aio_fake.arg1_val;
+    pciemu_sort_done(job, pciemu_sort_work(job));
+    return true;
+}
+
+TEST(pciemu_sort_kernels, "Test kernels checking the order of keys")
+{
+    uint32_t k32[37];
+    uint64_t k64[37];
+    pciemu_sort_select_kernels();
+    for (size_t i = 0; i < ARRAY_SIZE(k32); ++i) {
+        k32[i] = 0x7ffffff0 + i;
+        k64[i] = 0x7ffffffffffffff0ULL + i;
+    }
+    EXPECT_TRUE(pciemu_sort_sorted32(k32, ARRAY_SIZE(k32)),
+                "Should compare the keys unsigned");
+    EXPECT_TRUE(pciemu_sort_sorted64(k64, ARRAY_SIZE(k64)),
+                "Should compare the keys unsigned");
+    EXPECT_TRUE(pciemu_sort_sorted32(k32, 0), "Should accept no key");
+    EXPECT_TRUE(pciemu_sort_sorted64(k64, 1), "Should accept a single key");
+    for (size_t i = 1; i < ARRAY_SIZE(k32); ++i) {
+        uint32_t save32 = k32[i];
+        uint64_t save64 = k64[i];
+        k32[i] = 0;
+        k64[i] = 0;
+        bool ok = !pciemu_sort_sorted32(k32, ARRAY_SIZE(k32)) &&
+                  !pciemu_sort_sorted64(k64, ARRAY_SIZE(k64));
+        EXPECT_TRUE(ok, "Should find a key out of order anywhere");
+        k32[i] = save32;
+        k64[i] = save64;
+    }
+    EXPECT_EQ(pciemu_sort_sorted32(k32, ARRAY_SIZE(k32)),
+              pciemu_sort_sorted32_scalar(k32, ARRAY_SIZE(k32)),
+              "Scalar and vectorized kernels should agree");
+}
+
+TEST(pciemu_sort_radix, "Test radix sort of keys")
+{
+    uint32_t keys[SORT_TEST_CNT], tmp[SORT_TEST_CNT];
+    uint32_t idx[SORT_TEST_CNT], idx_tmp[SORT_TEST_CNT];
+    SortJob job = { .cnt = SORT_TEST_CNT, .key_size = sizeof(uint32_t),
+                    .keys = keys, .tmp = tmp, .idx = idx,
+                    .idx_tmp = idx_tmp };
+    uint32_t seed = 1;
+    for (size_t i = 0; i < SORT_TEST_CNT; ++i) {
+        seed = seed * 1103515245 + 12345;
+        /* few distinct keys, to check the stability */
+        keys[i] = seed & 0xff00ff3f;
+    }
+    uint32_t ref[SORT_TEST_CNT];
+    memcpy(ref, keys, sizeof(keys));
+    pciemu_sort_radix(&job);
+    const uint32_t *out = job.keys;
+    bool sorted = true, stable = true, perm = true;
+    for (size_t i = 0; i < SORT_TEST_CNT; ++i) {
+        perm &= out[i] == ref[job.idx[i]];
+        if (i) {
+            sorted &= out[i - 1] <= out[i];
+            stable &= out[i - 1] != out[i] || job.idx[i - 1] < job.idx[i];
+        }
+    }
+    EXPECT_TRUE(sorted, "Should sort the keys");
+    EXPECT_TRUE(stable, "Should keep the order of equal keys");
+    EXPECT_TRUE(perm, "Should give the original index of each key");
+
+    memcpy(keys, out, sizeof(keys));
+    job.keys = keys;
+    job.tmp = tmp;
+    job.idx = idx;
+    job.idx_tmp = idx_tmp;
+    memset(tmp, 0, sizeof(tmp));
+    pciemu_sort_radix(&job);
+    EXPECT_EQ(job.keys, keys, "Should not move keys already in order");
+    EXPECT_EQ(idx[SORT_TEST_CNT - 1], SORT_TEST_CNT - 1,
+              "Should keep the indices of keys already in order");
+}
+
+TEST(pciemu_sort_radix_passes, "Test radix sort skipping shared digits")
+{
+    uint64_t keys[4] = { 0x300, 0x100, 0x200, 0x100 };
+    uint64_t tmp[4];
+    SortJob job = { .cnt = 4, .key_size = sizeof(uint64_t), .keys = keys,
+                    .tmp = tmp };
+    pciemu_sort_radix(&job);
+    EXPECT_EQ(job.keys, tmp, "Should run a single pass (second digit)");
+    EXPECT_EQ(tmp[0], 0x100, "Should sort the keys");
+    EXPECT_EQ(tmp[3], 0x300, "Should sort the keys");
+}
+
+TEST(pciemu_sort_work, "Test sort run by a worker")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    SortJob job = { .dev = &dev, .src = SORT_TEST_SRC, .dst = SORT_TEST_DST,
+                    .cnt = 2, .key_size = sizeof(uint32_t) };
+    uint32_t *src = (uint32_t *)sort_src, *dst = (uint32_t *)sort_dst;
+    src[0] = cpu_to_le32(2);
+    src[1] = cpu_to_le32(1);
+    RESET_FAKE(pciemu_hostnuma_pin);
+    RESET_FAKE(pciemu_hostnuma_unpin);
+    RESET_FAKE(address_space_rw);
+    RESET_FAKE(pciemu_trace_dma_hash);
+    address_space_rw_fake.custom_fake = address_space_rw_sort;
+    EXPECT_EQ(pciemu_sort_work(&job), 0, "Should succeed");
+    EXPECT_EQ(address_space_rw_fake.call_count, 2,
+              "Should read and write the keys on the worker");
+    EXPECT_EQ(le32_to_cpu(dst[0]), 1, "Should sort the keys");
+    EXPECT_EQ(job.written, 1, "Should write the keys");
+    EXPECT_EQ(pciemu_trace_dma_hash_fake.call_count, 1,
+              "Should hash the keys read before sorting them");
+    EXPECT_EQ(pciemu_hostnuma_pin_fake.call_count, 1,
+              "Should run on the host nodes of the device");
+    EXPECT_EQ(pciemu_hostnuma_unpin_fake.arg0_val,
+              pciemu_hostnuma_pin_fake.arg1_val,
+              "Should restore the affinity of the worker");
+    g_free(job.keys);
+    g_free(job.tmp);
+
+    SortJob fail = { .dev = &dev, .src = SORT_TEST_SRC, .cnt = 2,
+                     .key_size = sizeof(uint32_t) };
+    RESET_FAKE(address_space_rw);
+    address_space_rw_fake.return_val = MEMTX_DECODE_ERROR;
+    EXPECT_EQ(pciemu_sort_work(&fail), MEMTX_DECODE_ERROR,
+              "Should fail : keys not readable");
+    EXPECT_EQ(address_space_rw_fake.call_count, 1, "Should write nothing");
+    EXPECT_EQ(fail.written, 0, "Should write nothing");
+    g_free(fail.keys);
+    g_free(fail.tmp);
+    RESET_FAKE(address_space_rw);
+}
+
+TEST(pciemu_sort_start, "Test sorting keys from and to the guest")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    pciemu_sort_init(&dev);
+    qemu_mutex_iothread_locked_fake.return_val = true; /* main loop */
+    for (size_t i = 0; i < SORT_TEST_CNT; ++i)
+        sort_src[i] = cpu_to_le64((i * 7919) % SORT_TEST_CNT << 40);
+
+    RESET_FAKE(address_space_rw);
+    RESET_FAKE(thread_pool_submit_aio);
+    RESET_FAKE(pciemu_trace_dma);
+    RESET_FAKE(pciemu_trace_dma_hashed);
+    address_space_rw_fake.custom_fake = address_space_rw_sort;
+    pciemu_sort_start(&dev, SORT_TEST_SRC, SORT_TEST_DST, SORT_TEST_IDX,
+                      SORT_TEST_CNT, sizeof(uint64_t), true);
+    EXPECT_EQ(address_space_rw_fake.call_count, 0,
+              "Should leave the keys to the worker");
+    EXPECT_EQ(thread_pool_submit_aio_fake.call_count, 1,
+              "Should hand the sort to a worker");
+    EXPECT_TRUE(pciemu_sort_active(&dev), "Should wait for the worker");
+
+    RESET_FAKE(pciemu_dma_sort_end);
+    void *job = thread_pool_submit_aio_fake.arg1_val;
+    pciemu_sort_done(job, pciemu_sort_work(job));
+    EXPECT_FALSE(pciemu_sort_active(&dev), "Should end the sort");
+    EXPECT_EQ(pciemu_dma_sort_end_fake.call_count, 1, "Should end once");
+    EXPECT_EQ(pciemu_dma_sort_end_fake.arg1_val, PCIEMU_HW_DMA_ERR_NONE,
+              "Should succeed");
+    EXPECT_EQ(address_space_rw_fake.call_count, 1 + 2,
+              "Should read the keys, write them and the indices");
+    EXPECT_EQ(pciemu_trace_dma_hashed_fake.arg3_val,
+              SORT_TEST_CNT * sizeof(uint64_t), "Should trace the read");
+    EXPECT_EQ(pciemu_trace_dma_fake.call_count, 2,
+              "Should trace the keys and the indices written");
+    bool ok = true;
+    for (size_t i = 0; i < SORT_TEST_CNT; ++i) {
+        ok &= le64_to_cpu(sort_dst[i]) == (uint64_t)i << 40;
+        ok &= sort_src[le32_to_cpu(sort_idx[i])] == sort_dst[i];
+    }
+    EXPECT_TRUE(ok, "Should write the sorted keys and their indices");
+
+    memset(sort_idx, 0, sizeof(sort_idx));
+    sort_test_run(&dev, SORT_TEST_CNT / 2, sizeof(uint32_t), false);
+    EXPECT_EQ(address_space_rw_fake.call_count, 1 + 1,
+              "Should only write the keys");
+    EXPECT_EQ(sort_idx[1], 0, "Should not write the indices");
+    RESET_FAKE(address_space_rw);
+}
+
+TEST(pciemu_sort_done, "Test completion of a sort")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    pciemu_sort_init(&dev);
+    qemu_mutex_iothread_locked_fake.return_val = true; /* main loop */
+    RESET_FAKE(address_space_rw);
+    RESET_FAKE(thread_pool_submit_aio);
+    RESET_FAKE(pciemu_dma_sort_end);
+    address_space_rw_fake.custom_fake = address_space_rw_sort;
+    pciemu_sort_start(&dev, SORT_TEST_SRC, SORT_TEST_DST, SORT_TEST_IDX, 4,
+                      sizeof(uint32_t), false);
+    RESET_FAKE(aio_poll);
+    aio_poll_fake.custom_fake = aio_poll_sort;
+    pciemu_sort_reset(&dev);
+    EXPECT_EQ(aio_poll_fake.call_count, 1, "Should wait for the worker");
+    EXPECT_FALSE(dev.dma.sort.busy, "Should leave no worker behind");
+    EXPECT_EQ(pciemu_dma_sort_end_fake.call_count, 0,
+              "Should drop a sort aborted by a reset");
+    EXPECT_EQ(address_space_rw_fake.call_count, 1,
+              "Should not write the keys of an aborted sort");
+
+    RESET_FAKE(aio_poll);
+    RESET_FAKE(address_space_rw);
+    RESET_FAKE(pciemu_trace_dma);
+    pciemu_sort_start(&dev, SORT_TEST_SRC, SORT_TEST_DST, SORT_TEST_IDX, 4,
+                      sizeof(uint32_t), false);
+    void *job = thread_pool_submit_aio_fake.arg1_val;
+    address_space_rw_fake.return_val = MEMTX_DECODE_ERROR;
+    pciemu_sort_done(job, pciemu_sort_work(job));
+    EXPECT_EQ(pciemu_dma_sort_end_fake.arg1_val, PCIEMU_HW_DMA_ERR_BUS,
+              "Should fail : keys not readable");
+    EXPECT_EQ(pciemu_trace_dma_fake.call_count, 0, "Should write nothing");
+
+    RESET_FAKE(pciemu_dma_sort_end);
+    pciemu_sort_start(&dev, SORT_TEST_SRC, SORT_TEST_DST, SORT_TEST_IDX, 4,
+                      sizeof(uint32_t), false);
+    job = thread_pool_submit_aio_fake.arg1_val;
+    MemTxResult rets[] = { MEMTX_OK, MEMTX_DECODE_ERROR };
+    SET_RETURN_SEQ(address_space_rw, rets, 2);
+    pciemu_sort_done(job, pciemu_sort_work(job));
+    EXPECT_EQ(pciemu_dma_sort_end_fake.arg1_val, PCIEMU_HW_DMA_ERR_BUS,
+              "Should fail : destination not writable");
+    EXPECT_EQ(pciemu_trace_dma_fake.call_count, 1,
+              "Should trace the failed write");
+    RESET_FAKE(address_space_rw);
+}
+
+TEST(pciemu_sort_start_vcpu, "Test sorts started by a vCPU")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    pciemu_sort_init(&dev);
+    RESET_FAKE(address_space_rw);
+    RESET_FAKE(thread_pool_submit_aio);
+    RESET_FAKE(timer_mod_ns);
+    RESET_FAKE(pciemu_dma_sort_end);
+    RESET_FAKE(qemu_mutex_iothread_locked);
+    address_space_rw_fake.custom_fake = address_space_rw_sort;
+    pciemu_sort_start(&dev, SORT_TEST_SRC, SORT_TEST_DST, SORT_TEST_IDX, 4,
+                      sizeof(uint32_t), false);
+    EXPECT_EQ(thread_pool_submit_aio_fake.call_count, 0,
+              "Should not reach the thread pool from a vCPU");
+    EXPECT_EQ(timer_mod_ns_fake.arg0_val, &dev.dma.sort.timer,
+              "Should leave the sort to the main loop");
+    EXPECT_TRUE(pciemu_sort_active(&dev), "Should be in progress");
+
+    qemu_mutex_iothread_locked_fake.return_val = true;
+    pciemu_sort_timer_cb(&dev);
+    EXPECT_EQ(thread_pool_submit_aio_fake.call_count, 1,
+              "Should hand the sort to a worker in the main loop");
+    void *job = thread_pool_submit_aio_fake.arg1_val;
+    pciemu_sort_done(job, pciemu_sort_work(job));
+    EXPECT_EQ(pciemu_dma_sort_end_fake.call_count, 1, "Should end once");
+
+    qemu_mutex_iothread_locked_fake.return_val = false;
+    pciemu_sort_start(&dev, SORT_TEST_SRC, SORT_TEST_DST, SORT_TEST_IDX, 4,
+                      sizeof(uint32_t), false);
+    pciemu_sort_reset(&dev);
+    EXPECT_TRUE(dev.dma.sort.job == NULL, "Should drop the sort");
+    pciemu_sort_timer_cb(&dev);
+    EXPECT_EQ(thread_pool_submit_aio_fake.call_count, 1,
+              "Should not hand an aborted sort over");
+    RESET_FAKE(qemu_mutex_iothread_locked);
+    RESET_FAKE(address_space_rw);
+}
+
+TEST(pciemu_sort_reset, "Test reset of the sort")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    pciemu_sort_init(&dev);
+    uint64_t gen = dev.dma.sort.gen;
+    dev.dma.sort.active = true;
+    RESET_FAKE(aio_poll);
+    pciemu_sort_reset(&dev);
+    EXPECT_FALSE(pciemu_sort_active(&dev), "Should drop the sort");
+    EXPECT_NEQ(dev.dma.sort.gen, gen, "Should ignore the worker in flight");
+    EXPECT_EQ(aio_poll_fake.call_count, 0, "Should not wait without worker");
+}
+
+TEST_MAIN()
@@ -0,0 +1,161 @@
+/* pciemu_stats.c - Unit tests for hw/pciemu/stats.c file
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "unitctest/unitctest.h"
+#include "fff/fff.h"
+#include "qemu.fake.h"
+
+/* include the source file to test static functions */
+#include "../src/hw/pciemu/stats.c"
+
+DEFINE_FFF_GLOBALS;
+
+TEST(pciemu_stats_bin, "Test log-linear bins")
+{
+    for (uint64_t ns = 0; ns < PCIEMU_STATS_SUB; ++ns)
+        EXPECT_EQ(pciemu_stats_bin(ns), ns, "Should be exact for small values");
+    EXPECT_EQ(pciemu_stats_bin(PCIEMU_STATS_SUB), PCIEMU_STATS_SUB,
+              "Should start the linear bins of the first power of two");
+    EXPECT_EQ(pciemu_stats_bin(UINT64_MAX), PCIEMU_STATS_BINS - 1,
+              "Should hold the whole 64-bit range");
+
+    uint64_t values[] = { 9, 100, 1000, 12345, 1000000, 1ULL << 40 };
+    for (size_t i = 0; i < ARRAY_SIZE(values); ++i) {
+        unsigned int bin = pciemu_stats_bin(values[i]);
+        EXPECT_TRUE(values[i] <= pciemu_stats_bin_max(bin),
+                    "Should be below the upper bound of its bin");
+        EXPECT_TRUE(values[i] > pciemu_stats_bin_max(bin - 1),
+                    "Should be above the upper bound of the previous bin");
+        EXPECT_TRUE(pciemu_stats_bin_max(bin) - values[i] <=
+                        values[i] / PCIEMU_STATS_SUB,
+                    "Should be within the relative error");
+    }
+    EXPECT_EQ(pciemu_stats_bin_max(PCIEMU_STATS_BINS - 1), UINT64_MAX,
+              "Should bound the last bin with the largest value");
+}
+
+TEST(pciemu_stats_record, "Test recording latencies")
+{
+    StatsHist hist = { 0 };
+    for (int i = 1; i <= 100; ++i)
+        pciemu_stats_record(&hist, i * 1000);
+    pciemu_stats_record(&hist, -5);
+    EXPECT_EQ(hist.count, 101, "Should count every sample");
+    EXPECT_EQ(hist.min_ns, 0, "Should clamp negative deltas");
+    EXPECT_EQ(hist.max_ns, 100000, "Should keep the max");
+    EXPECT_EQ(hist.sum_ns, 5050000, "Should sum the samples");
+    EXPECT_EQ(hist.bins[0], 1, "Should bin the clamped sample at 0");
+
+    uint64_t p50 = pciemu_stats_percentile(&hist, 500);
+    EXPECT_TRUE(p50 >= 50000 && p50 <= 50000 + 50000 / PCIEMU_STATS_SUB,
+                "Should approximate the median");
+    EXPECT_EQ(pciemu_stats_percentile(&hist, 1000), 100000,
+              "Should not go above the max");
+}
+
+TEST(pciemu_stats_event, "Test timestamping a DMA command")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    Error *e = NULL;
+    StatsHist *hist = dev.stats.hist;
+    pciemu_stats_init(&dev, &e);
+    RESET_FAKE(qemu_clock_get_ns);
+    int64_t clock[] = { 1100, 4100, 9100 };
+    SET_RETURN_SEQ(qemu_clock_get_ns, clock, ARRAY_SIZE(clock));
+
+    pciemu_stats_doorbell(&dev, 1000);
+    pciemu_stats_event(&dev, STATS_EVENT_DMA_START);
+    pciemu_stats_event(&dev, STATS_EVENT_DMA_END);
+    pciemu_stats_irq(&dev, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR);
+    EXPECT_EQ(hist[STATS_STAGE_DOORBELL_TO_START].sum_ns, 100,
+              "Should measure the wait for the engine");
+    EXPECT_EQ(hist[STATS_STAGE_START_TO_END].sum_ns, 3000,
+              "Should measure the transfer");
+    EXPECT_EQ(hist[STATS_STAGE_END_TO_IRQ].sum_ns, 5000,
+              "Should measure the completion");
+    EXPECT_EQ(hist[STATS_STAGE_DOORBELL_TO_IRQ].sum_ns, 8100,
+              "Should measure the whole command");
+    EXPECT_FALSE(dev.stats.pending, "Should not wait for another IRQ");
+
+    pciemu_stats_irq(&dev, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR);
+    EXPECT_EQ(hist[STATS_STAGE_DOORBELL_TO_IRQ].count, 1,
+              "Should ignore an IRQ without command");
+
+    RESET_FAKE(qemu_clock_get_ns);
+    qemu_clock_get_ns_fake.return_val = 20000;
+    pciemu_stats_doorbell(&dev, 12000);
+    EXPECT_EQ(hist[STATS_STAGE_DOORBELL_TO_START].count, 1,
+              "Should not count a doorbell before its command starts");
+    pciemu_stats_event(&dev, STATS_EVENT_DMA_START);
+    EXPECT_EQ(hist[STATS_STAGE_DOORBELL_TO_START].max_ns, 8000,
+              "Should count the time the doorbell waited");
+    EXPECT_EQ(dev.stats.stamp[STATS_EVENT_DOORBELL], 12000,
+              "Should stamp the arrival of the doorbell");
+    pciemu_stats_irq(&dev, PCIEMU_HW_IRQ_DMA_ENDED_VECTOR + 1);
+    EXPECT_EQ(hist[STATS_STAGE_DOORBELL_TO_IRQ].count, 1,
+              "Should ignore the other vectors");
+
+    dev.dma.config.cmd = PCIEMU_HW_DMA_CMD_FLAG_NO_IRQ;
+    pciemu_stats_event(&dev, STATS_EVENT_DMA_START);
+    EXPECT_FALSE(dev.stats.pending, "Should not wait for a skipped IRQ");
+
+    dev.dma.config.cmd = 0;
+    pciemu_stats_event(&dev, STATS_EVENT_DMA_START);
+    pciemu_stats_reset(&dev);
+    EXPECT_FALSE(dev.stats.pending, "Should drop the command in flight");
+    EXPECT_EQ(hist[STATS_STAGE_START_TO_END].count, 1,
+              "Should keep the histograms across resets");
+    RESET_FAKE(qemu_clock_get_ns);
+}
+
+TEST(pciemu_stats_get, "Test reading the latency-stats property")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    Error *e = NULL;
+    pciemu_stats_init(&dev, &e);
+    pciemu_stats_record(&dev.stats.hist[STATS_STAGE_START_TO_END], 100);
+    pciemu_stats_record(&dev.stats.hist[STATS_STAGE_START_TO_END], 200);
+    RESET_FAKE(object_dynamic_cast_assert);
+    RESET_FAKE(visit_start_struct);
+    RESET_FAKE(visit_start_list);
+    RESET_FAKE(visit_type_uint64);
+    RESET_FAKE(visit_check_struct);
+    RESET_FAKE(visit_check_list);
+    RESET_FAKE(visit_end_struct);
+    object_dynamic_cast_assert_fake.return_val = (Object *)&dev;
+    visit_start_struct_fake.return_val = true;
+    visit_start_list_fake.return_val = true;
+    visit_type_uint64_fake.return_val = true;
+    visit_check_struct_fake.return_val = true;
+    visit_check_list_fake.return_val = true;
+
+    pciemu_stats_get(OBJECT(&dev), NULL, "latency-stats", NULL, &e);
+    EXPECT_EQ(visit_start_list_fake.call_count, STATS_STAGE_CNT,
+              "Should visit the bins of every stage");
+    /* 4 stages of 8 values, and 2 values for each of the 2 non-empty bins */
+    EXPECT_EQ(visit_type_uint64_fake.call_count, 4 * 8 + 2 * 2,
+              "Should visit the values and the non-empty bins only");
+    EXPECT_EQ(visit_start_struct_fake.call_count, 1 + 4 + 2,
+              "Should visit the property, the stages and the bins");
+    EXPECT_EQ(visit_end_struct_fake.call_count,
+              visit_start_struct_fake.call_count,
+              "Should end every struct started");
+
+    RESET_FAKE(visit_start_struct);
+    RESET_FAKE(visit_end_struct);
+    RESET_FAKE(visit_type_uint64);
+    visit_start_struct_fake.return_val = true;
+    pciemu_stats_get(OBJECT(&dev), NULL, "latency-stats", NULL, &e);
+    EXPECT_EQ(visit_start_struct_fake.call_count, 2,
+              "Should stop at the first error");
+    EXPECT_EQ(visit_end_struct_fake.call_count, 2,
+              "Should end every struct started on errors");
+    RESET_FAKE(object_dynamic_cast_assert);
+}
+
+TEST_MAIN()
@@ -0,0 +1,148 @@
+/* pciemu_trace.c - Unit tests for hw/pciemu/trace.c file
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#include "unitctest/unitctest.h"
+#include "fff/fff.h"
+#include "qemu.fake.h"
+
+/* include the source file to test static functions */
+#include "../src/hw/pciemu/trace.c"
+
+DEFINE_FFF_GLOBALS;
+
+/* open a temporary trace file for the device */
+static void trace_open(PCIEMUDevice *dev, char *path, bool payload_hash)
+{
+    Error *e = NULL;
+    close(mkstemp(path));
+    dev->trace.file = path;
+    dev->trace.payload_hash = payload_hash;
+    pciemu_trace_init(dev, &e);
+}
+
+/* read back the whole trace file, returning the number of records */
+static size_t trace_load(const char *path, PCIEMUTraceHeader *hdr,
+                         PCIEMUTraceRecord *rec, size_t cnt)
+{
+    FILE *fp = fopen(path, "rb");
+    size_t n = 0;
+    if (fread(hdr, sizeof(*hdr), 1, fp) == 1)
+        n = fread(rec, sizeof(*rec), cnt, fp);
+    fclose(fp);
+    unlink(path);
+    return n;
+}
+
+TEST(pciemu_trace_hash, "Test hash of DMA payloads")
+{
+    EXPECT_EQ(pciemu_trace_hash("", 0), 0xcbf29ce484222325ULL,
+              "Should return the FNV-1a offset basis for empty payloads");
+    EXPECT_EQ(pciemu_trace_hash("a", 1), 0xaf63dc4c8601ec8cULL,
+              "Should match the FNV-1a reference value");
+    EXPECT_NEQ(pciemu_trace_hash("ab", 2), pciemu_trace_hash("ba", 2),
+               "Should depend on the order of the bytes");
+}
+
+TEST(pciemu_trace_init, "Test initialization of trace")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    char path[] = "/tmp/pciemu_trace_XXXXXX";
+    PCIEMUTraceHeader hdr;
+    PCIEMUTraceRecord rec[1];
+    Error *e = NULL;
+    pciemu_trace_init(&dev, &e);
+    EXPECT_EQ(dev.trace.fp, NULL, "Should not record without trace-file");
+
+    trace_open(&dev, path, true);
+    EXPECT_NEQ(dev.trace.fp, NULL, "Should open the trace file");
+    pciemu_trace_fini(&dev);
+    EXPECT_EQ(dev.trace.fp, NULL, "Should close the trace file");
+    EXPECT_EQ(trace_load(path, &hdr, rec, 1), 0, "Should have no records");
+    EXPECT_EQ(memcmp(hdr.magic, PCIEMU_TRACE_MAGIC, sizeof(hdr.magic)), 0,
+              "Should write the magic");
+    EXPECT_EQ(hdr.version, PCIEMU_TRACE_VERSION, "Should write the version");
+    EXPECT_EQ(hdr.flags, PCIEMU_TRACE_FLAG_PAYLOAD_HASH,
+              "Should flag the payload hash");
+
+    RESET_FAKE(error_setg_internal);
+    dev.trace.file = "/nonexistent/dir/pciemu.trace";
+    pciemu_trace_init(&dev, &e);
+    EXPECT_EQ(error_setg_internal_fake.call_count, 1,
+              "Should fail if the file cannot be opened");
+    EXPECT_EQ(dev.trace.fp, NULL, "Should not record");
+}
+
+TEST(pciemu_trace_records, "Test records of MMIO, DMA and reset")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    char path[] = "/tmp/pciemu_trace_XXXXXX";
+    uint8_t payload[64] = { 0xa5 };
+    PCIEMUTraceHeader hdr;
+    PCIEMUTraceRecord rec[8];
+    RESET_FAKE(qemu_clock_get_ns);
+    qemu_clock_get_ns_fake.return_val = 1000;
+    trace_open(&dev, path, false);
+    pciemu_trace_mmio(&dev, PCIEMU_TRACE_MMIO_WRITE, 0x10, 8, 0xcafe);
+    pciemu_trace_mmio(&dev, PCIEMU_TRACE_MMIO_READ, 0x18, 4, 0xbeef);
+    pciemu_trace_dma(&dev, DMA_DIRECTION_TO_DEVICE, 0xd0000, payload,
+                     sizeof(payload));
+    dev.trace.payload_hash = true;
+    qemu_clock_get_ns_fake.return_val = 2000;
+    pciemu_trace_dma(&dev, DMA_DIRECTION_FROM_DEVICE, 0xe0000, payload,
+                     sizeof(payload));
+    pciemu_trace_reset(&dev);
+    pciemu_trace_fini(&dev);
+
+    EXPECT_EQ(trace_load(path, &hdr, rec, 8), 5, "Should write 5 records");
+    EXPECT_EQ(rec[0].type, PCIEMU_TRACE_MMIO_WRITE, "Should record a write");
+    EXPECT_EQ(rec[0].addr, 0x10, "Should record the address");
+    EXPECT_EQ(rec[0].len, 8, "Should record the size");
+    EXPECT_EQ(rec[0].val, 0xcafe, "Should record the value");
+    EXPECT_EQ(rec[0].ts_ns, 1000, "Should record the timestamp");
+    EXPECT_EQ(rec[1].type, PCIEMU_TRACE_MMIO_READ, "Should record a read");
+    EXPECT_EQ(rec[2].type, PCIEMU_TRACE_DMA_READ, "Should record a DMA read");
+    EXPECT_EQ(rec[2].len, sizeof(payload), "Should record the length");
+    EXPECT_EQ(rec[2].val, 0, "Should not hash the payload when disabled");
+    EXPECT_EQ(rec[3].type, PCIEMU_TRACE_DMA_WRITE, "Should record a DMA write");
+    EXPECT_EQ(rec[3].val, pciemu_trace_hash(payload, sizeof(payload)),
+              "Should hash the payload");
+    EXPECT_EQ(rec[3].ts_ns, 2000, "Should record the timestamp");
+    EXPECT_EQ(rec[4].type, PCIEMU_TRACE_RESET, "Should record the reset");
+}
+
+TEST(pciemu_trace_records_len, "Test records of transfers of 4 GiB or more")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    char path[] = "/tmp/pciemu_trace_XXXXXX";
+    PCIEMUTraceHeader hdr;
+    PCIEMUTraceRecord rec[1];
+    trace_open(&dev, path, false);
+    /* the payload is not hashed, so it is never read */
+    pciemu_trace_dma(&dev, DMA_DIRECTION_TO_DEVICE, 0xd0000, NULL,
+                     (5ULL << 30) + 8);
+    pciemu_trace_fini(&dev);
+
+    EXPECT_EQ(trace_load(path, &hdr, rec, 1), 1, "Should write 1 record");
+    EXPECT_EQ(rec[0].len, (5ULL << 30) + 8,
+              "Should record the whole length");
+    EXPECT_EQ(rec[0].type, PCIEMU_TRACE_DMA_READ, "Should keep the type");
+    EXPECT_EQ(sizeof(PCIEMUTraceRecord), 32, "Should keep 32-byte records");
+}
+
+TEST(pciemu_trace_disabled, "Test that nothing happens without a trace file")
+{
+    PCIEMUDevice dev = { .pci_dev = { .name = "pciemu_test" } };
+    RESET_FAKE(qemu_clock_get_ns);
+    pciemu_trace_mmio(&dev, PCIEMU_TRACE_MMIO_WRITE, 0x10, 8, 0xcafe);
+    pciemu_trace_dma(&dev, DMA_DIRECTION_TO_DEVICE, 0xd0000, NULL, 0);
+    pciemu_trace_reset(&dev);
+    pciemu_trace_fini(&dev);
+    EXPECT_EQ(qemu_clock_get_ns_fake.call_count, 0, "Should not record");
+}
+
+TEST_MAIN()
@@ -0,0 +1,24 @@
+/* arbiter.fake.h - Arbiter fake functions header
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_ARBITER_FAKE_H
+#define PCIEMU_ARBITER_FAKE_H
+
+#include "fff_config.h"
+
+#include "arbiter.h"
+
+DECLARE_FAKE_VALUE_FUNC(uint64_t, pciemu_arbiter_read, PCIEMUDevice *, hwaddr);
+DECLARE_FAKE_VOID_FUNC(pciemu_arbiter_write, PCIEMUDevice *, hwaddr,
+                       uint64_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_arbiter_kick, PCIEMUDevice *);
+DECLARE_FAKE_VOID_FUNC(pciemu_arbiter_complete, PCIEMUDevice *, uint64_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_arbiter_reset, PCIEMUDevice *);
+DECLARE_FAKE_VOID_FUNC(pciemu_arbiter_init, PCIEMUDevice *);
+
+#endif /* PCIEMU_ARBITER_FAKE_H */
@@ -0,0 +1,81 @@
+/* pciemu_bench.h - Helpers for the microbenchmarks of the device hot paths
+ *
+ * A benchmark runs its body in a loop, doubling the iteration count until
+ * the loop lasts at least PCIEMU_BENCH_MIN_NS, and reports the last run as
+ * one JSON object per line on stdout :
+ *   {"bench":"dma_execute_to_device","size":4096,"iters":65536,
+ *    "ns_per_op":120.5,"gb_per_s":33.991}
+ * size is the number of bytes moved per operation (0 if not relevant, in
+ * which case gb_per_s is 0 too).
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_BENCH_H
+#define PCIEMU_BENCH_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+/* minimum duration of the measured loop of a benchmark */
+#define PCIEMU_BENCH_MIN_NS (100 * 1000 * 1000ULL)
+
+/* host memory seen on the bus and device memory (see pciemu_bench_device.c) */
+#define PCIEMU_BENCH_BUS_ADDR 0x100000ULL
+#define PCIEMU_BENCH_MEM_SIZE (1024 * 1024ULL)
+
+/* forward declaration (defined in pciemu.h) */
+typedef struct PCIEMUDevice PCIEMUDevice;
+
+/* device instance, initialized as in pciemu.c */
+PCIEMUDevice *pciemu_bench_device_init(void);
+
+/* other instance (one per vCPU thread), with its inline device memory */
+PCIEMUDevice *pciemu_bench_device_new(void);
+
+static inline uint64_t pciemu_bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void pciemu_bench_report(const char *name, uint64_t size,
+                                       uint64_t iters, uint64_t elapsed_ns)
+{
+    double ns_per_op = (double)elapsed_ns / iters;
+    printf("{\"bench\":\"%s\",\"size\":%" PRIu64 ",\"iters\":%" PRIu64
+           ",\"ns_per_op\":%.1f,\"gb_per_s\":%.3f}\n",
+           name, size, iters, ns_per_op, size / ns_per_op);
+    fflush(stdout);
+}
+
+/**
+ * BENCH: Time body and report it as benchmark name
+ *
+ * @name: name of the benchmark (string)
+ * @size: bytes moved by one execution of body
+ * @body: statement(s) being measured
+ */
+#define BENCH(name, size, body)                                     \
+    do {                                                            \
+        for (uint64_t iters_ = 1;; iters_ *= 2) {                   \
+            uint64_t start_ = pciemu_bench_now_ns();                \
+            for (uint64_t i_ = 0; i_ < iters_; ++i_) {              \
+                body;                                               \
+                /* keep an inlined body from vanishing */           \
+                __asm__ __volatile__("" ::: "memory");              \
+            }                                                       \
+            uint64_t elapsed_ = pciemu_bench_now_ns() - start_;     \
+            if (elapsed_ >= PCIEMU_BENCH_MIN_NS) {                  \
+                pciemu_bench_report(name, size, iters_, elapsed_);  \
+                break;                                              \
+            }                                                       \
+        }                                                           \
+    } while (0)
+
+#endif /* PCIEMU_BENCH_H */
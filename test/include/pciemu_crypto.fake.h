@@ -0,0 +1,26 @@
+/* crypto.fake.h - Crypto fake functions header
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_CRYPTO_FAKE_H
+#define PCIEMU_CRYPTO_FAKE_H
+
+#include "fff_config.h"
+
+#include "crypto.h"
+
+DECLARE_FAKE_VALUE_FUNC(uint64_t, pciemu_crypto_read, PCIEMUDevice *, hwaddr);
+DECLARE_FAKE_VOID_FUNC(pciemu_crypto_write, PCIEMUDevice *, hwaddr, uint64_t,
+                       unsigned int);
+DECLARE_FAKE_VALUE_FUNC(bool, pciemu_crypto_key_loaded, PCIEMUDevice *,
+                        uint32_t);
+DECLARE_FAKE_VALUE_FUNC(int, pciemu_crypto_xts, PCIEMUDevice *, uint32_t,
+                        uint64_t, uint32_t, uint8_t *, size_t, bool);
+DECLARE_FAKE_VOID_FUNC(pciemu_crypto_reset, PCIEMUDevice *);
+DECLARE_FAKE_VOID_FUNC(pciemu_crypto_init, PCIEMUDevice *);
+
+#endif /* PCIEMU_CRYPTO_FAKE_H */
@@ -13,6 +13,8 @@
 
 #include "dma.h"
 
+DECLARE_FAKE_VALUE_FUNC(int, pciemu_dma_rw, PCIEMUDevice *, dma_addr_t, void *,
+                        dma_addr_t, DMADirection);
 DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_txdesc_src, PCIEMUDevice *,
                        dma_addr_t);
 DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_txdesc_dst, PCIEMUDevice *,
@@ -20,7 +22,46 @@ DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_txdesc_dst, PCIEMUDevice *,
 DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_txdesc_len, PCIEMUDevice *,
                        dma_size_t);
 DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_cmd, PCIEMUDevice *, dma_cmd_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_pattern, PCIEMUDevice *,
+                       dma_pattern_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_pattern_seed, PCIEMUDevice *,
+                       uint32_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_crypto_key_slot, PCIEMUDevice *,
+                       uint32_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_crypto_sector_size, PCIEMUDevice *,
+                       uint32_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_crypto_sector, PCIEMUDevice *,
+                       uint64_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_atomic_operand, PCIEMUDevice *,
+                       uint64_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_atomic_compare, PCIEMUDevice *,
+                       uint64_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_2d_rows, PCIEMUDevice *, uint32_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_2d_src_stride, PCIEMUDevice *,
+                       dma_size_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_2d_dst_stride, PCIEMUDevice *,
+                       dma_size_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_mcast_cnt, PCIEMUDevice *, uint32_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_raid_src_cnt, PCIEMUDevice *,
+                       uint32_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_raid_q_dst, PCIEMUDevice *,
+                       dma_addr_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_scan_key_lo, PCIEMUDevice *,
+                       uint64_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_scan_key_hi, PCIEMUDevice *,
+                       uint64_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_scan_ctrl, PCIEMUDevice *, uint32_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_scan_max, PCIEMUDevice *, uint64_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_sort_ctrl, PCIEMUDevice *, uint32_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_config_sort_idx_dst, PCIEMUDevice *,
+                       dma_addr_t);
 DECLARE_FAKE_VOID_FUNC(pciemu_dma_doorbell_ring, PCIEMUDevice *);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_desc_execute, PCIEMUDevice *,
+                       const uint8_t *);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_desc_doorbell_ring, PCIEMUDevice *,
+                       uint64_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_stream_end, PCIEMUDevice *, dma_err_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_dma_sort_end, PCIEMUDevice *, dma_err_t);
 DECLARE_FAKE_VOID_FUNC(pciemu_dma_init, PCIEMUDevice *, Error **);
 DECLARE_FAKE_VOID_FUNC(pciemu_dma_fini, PCIEMUDevice *);
 DECLARE_FAKE_VOID_FUNC(pciemu_dma_reset, PCIEMUDevice *);
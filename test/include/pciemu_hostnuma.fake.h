@@ -0,0 +1,31 @@
+/* hostnuma.fake.h - Host NUMA placement fake functions header
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_HOSTNUMA_FAKE_H
+#define PCIEMU_HOSTNUMA_FAKE_H
+
+#include "fff_config.h"
+
+#include "hostnuma.h"
+
+DECLARE_FAKE_VOID_FUNC(pciemu_hostnuma_get_nodes, Object *, Visitor *,
+                       const char *, void *, Error **);
+DECLARE_FAKE_VOID_FUNC(pciemu_hostnuma_set_nodes, Object *, Visitor *,
+                       const char *, void *, Error **);
+DECLARE_FAKE_VALUE_FUNC(int, pciemu_hostnuma_get_policy, Object *, Error **);
+DECLARE_FAKE_VOID_FUNC(pciemu_hostnuma_set_policy, Object *, int, Error **);
+DECLARE_FAKE_VALUE_FUNC(bool, pciemu_hostnuma_enabled, PCIEMUDevice *);
+DECLARE_FAKE_VALUE_FUNC(uint8_t *, pciemu_hostnuma_alloc, PCIEMUDevice *,
+                        size_t, Error **);
+DECLARE_FAKE_VOID_FUNC(pciemu_hostnuma_pin, PCIEMUDevice *,
+                       HostNumaAffinity *);
+DECLARE_FAKE_VOID_FUNC(pciemu_hostnuma_unpin, HostNumaAffinity *);
+DECLARE_FAKE_VOID_FUNC(pciemu_hostnuma_init, PCIEMUDevice *, Error **);
+DECLARE_FAKE_VOID_FUNC(pciemu_hostnuma_fini, PCIEMUDevice *);
+
+#endif /* PCIEMU_HOSTNUMA_FAKE_H */
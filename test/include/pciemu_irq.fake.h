@@ -16,6 +16,9 @@
 DECLARE_FAKE_VOID_FUNC(pciemu_irq_init, PCIEMUDevice *, Error **);
 DECLARE_FAKE_VOID_FUNC(pciemu_irq_fini, PCIEMUDevice *);
 DECLARE_FAKE_VOID_FUNC(pciemu_irq_reset, PCIEMUDevice *);
+DECLARE_FAKE_VALUE_FUNC(uint64_t, pciemu_irq_read, PCIEMUDevice *, hwaddr);
+DECLARE_FAKE_VOID_FUNC(pciemu_irq_write, PCIEMUDevice *, hwaddr, uint64_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_irq_event, PCIEMUDevice *, uint32_t);
 DECLARE_FAKE_VOID_FUNC(pciemu_irq_raise, PCIEMUDevice *, unsigned int);
 DECLARE_FAKE_VOID_FUNC(pciemu_irq_lower, PCIEMUDevice *, unsigned int);
 
@@ -0,0 +1,20 @@
+/* latency.fake.h - Latency model fake functions header
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_LATENCY_FAKE_H
+#define PCIEMU_LATENCY_FAKE_H
+
+#include "fff_config.h"
+
+#include "latency.h"
+
+DECLARE_FAKE_VALUE_FUNC(uint64_t, pciemu_latency_sample, LatencyModel *);
+DECLARE_FAKE_VOID_FUNC(pciemu_latency_reset, LatencyModel *);
+DECLARE_FAKE_VOID_FUNC(pciemu_latency_init, LatencyModel *, Error **);
+
+#endif /* PCIEMU_LATENCY_FAKE_H */
@@ -0,0 +1,24 @@
+/* mapcache.fake.h - Map cache fake functions header
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_MAPCACHE_FAKE_H
+#define PCIEMU_MAPCACHE_FAKE_H
+
+#include "fff_config.h"
+
+#include "mapcache.h"
+
+DECLARE_FAKE_VALUE_FUNC(bool, pciemu_mapcache_rw, PCIEMUDevice *, dma_addr_t,
+                        void *, dma_addr_t, DMADirection);
+DECLARE_FAKE_VOID_FUNC(pciemu_mapcache_get, Object *, Visitor *, const char *,
+                       void *, Error **);
+DECLARE_FAKE_VOID_FUNC(pciemu_mapcache_reset, PCIEMUDevice *);
+DECLARE_FAKE_VOID_FUNC(pciemu_mapcache_init, PCIEMUDevice *, Error **);
+DECLARE_FAKE_VOID_FUNC(pciemu_mapcache_fini, PCIEMUDevice *);
+
+#endif /* PCIEMU_MAPCACHE_FAKE_H */
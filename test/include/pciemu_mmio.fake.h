@@ -16,6 +16,9 @@
 DECLARE_FAKE_VOID_FUNC(pciemu_mmio_init, PCIEMUDevice *, Error **);
 DECLARE_FAKE_VOID_FUNC(pciemu_mmio_fini, PCIEMUDevice *);
 DECLARE_FAKE_VOID_FUNC(pciemu_mmio_reset, PCIEMUDevice *);
+DECLARE_FAKE_VOID_FUNC(pciemu_mmio_lock_bql, PCIEMUDevice *);
+DECLARE_FAKE_VOID_FUNC(pciemu_mmio_dma_prepare, PCIEMUDevice *, dma_addr_t,
+                       dma_addr_t, DMADirection);
 
 
 #endif /* PCIEMU_MMIO_FAKE_H */
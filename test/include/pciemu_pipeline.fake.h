@@ -0,0 +1,22 @@
+/* pipeline.fake.h - Pipeline fake functions header
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_PIPELINE_FAKE_H
+#define PCIEMU_PIPELINE_FAKE_H
+
+#include "fff_config.h"
+
+#include "pipeline.h"
+
+DECLARE_FAKE_VALUE_FUNC(bool, pciemu_pipeline_enabled, PCIEMUDevice *);
+DECLARE_FAKE_VOID_FUNC(pciemu_pipeline_start, PCIEMUDevice *, dma_addr_t,
+                       dma_addr_t, dma_addr_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_pipeline_reset, PCIEMUDevice *);
+DECLARE_FAKE_VOID_FUNC(pciemu_pipeline_init, PCIEMUDevice *, Error **);
+
+#endif /* PCIEMU_PIPELINE_FAKE_H */
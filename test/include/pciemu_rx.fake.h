@@ -0,0 +1,28 @@
+/* rx.fake.h - RX fake functions header
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_RX_FAKE_H
+#define PCIEMU_RX_FAKE_H
+
+#include "fff_config.h"
+
+#include "rx.h"
+
+DECLARE_FAKE_VOID_FUNC(pciemu_rx_config_ring_addr, PCIEMUDevice *,
+                       dma_addr_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_rx_config_ring_size, PCIEMUDevice *, uint32_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_rx_config_pkt_size, PCIEMUDevice *, uint32_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_rx_config_rate, PCIEMUDevice *, uint64_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_rx_config_burst, PCIEMUDevice *, uint64_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_rx_tail_update, PCIEMUDevice *, uint32_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_rx_ctrl, PCIEMUDevice *, uint64_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_rx_init, PCIEMUDevice *, Error **);
+DECLARE_FAKE_VOID_FUNC(pciemu_rx_fini, PCIEMUDevice *);
+DECLARE_FAKE_VOID_FUNC(pciemu_rx_reset, PCIEMUDevice *);
+
+#endif /* PCIEMU_RX_FAKE_H */
@@ -0,0 +1,22 @@
+/* sort.fake.h - Sort fake functions header
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_SORT_FAKE_H
+#define PCIEMU_SORT_FAKE_H
+
+#include "fff_config.h"
+
+#include "sort.h"
+
+DECLARE_FAKE_VALUE_FUNC(bool, pciemu_sort_active, PCIEMUDevice *);
+DECLARE_FAKE_VOID_FUNC(pciemu_sort_start, PCIEMUDevice *, dma_addr_t,
+                       dma_addr_t, dma_addr_t, size_t, unsigned int, bool);
+DECLARE_FAKE_VOID_FUNC(pciemu_sort_reset, PCIEMUDevice *);
+DECLARE_FAKE_VOID_FUNC(pciemu_sort_init, PCIEMUDevice *);
+
+#endif /* PCIEMU_SORT_FAKE_H */
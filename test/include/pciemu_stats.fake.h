@@ -0,0 +1,25 @@
+/* stats.fake.h - Latency stats fake functions header
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_STATS_FAKE_H
+#define PCIEMU_STATS_FAKE_H
+
+#include "fff_config.h"
+
+#include "stats.h"
+
+DECLARE_FAKE_VOID_FUNC(pciemu_stats_doorbell, PCIEMUDevice *, int64_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_stats_event, PCIEMUDevice *, StatsEvent);
+DECLARE_FAKE_VOID_FUNC(pciemu_stats_irq, PCIEMUDevice *, unsigned int);
+DECLARE_FAKE_VOID_FUNC(pciemu_stats_get, Object *, Visitor *, const char *,
+                       void *, Error **);
+DECLARE_FAKE_VOID_FUNC(pciemu_stats_reset, PCIEMUDevice *);
+DECLARE_FAKE_VOID_FUNC(pciemu_stats_init, PCIEMUDevice *, Error **);
+DECLARE_FAKE_VOID_FUNC(pciemu_stats_fini, PCIEMUDevice *);
+
+#endif /* PCIEMU_STATS_FAKE_H */
@@ -0,0 +1,28 @@
+/* trace.fake.h - Trace fake functions header
+ *
+ * Copyright (c) 2023 Luiz Henrique Suraty Filho <luiz-dev@suraty.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PCIEMU_TRACE_FAKE_H
+#define PCIEMU_TRACE_FAKE_H
+
+#include "fff_config.h"
+
+#include "trace.h"
+
+DECLARE_FAKE_VOID_FUNC(pciemu_trace_mmio, PCIEMUDevice *, uint8_t, hwaddr,
+                       unsigned int, uint64_t);
+DECLARE_FAKE_VALUE_FUNC(uint64_t, pciemu_trace_dma_hash, PCIEMUDevice *,
+                        const void *, dma_addr_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_trace_dma_hashed, PCIEMUDevice *, DMADirection,
+                       dma_addr_t, dma_addr_t, uint64_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_trace_dma, PCIEMUDevice *, DMADirection,
+                       dma_addr_t, const void *, dma_addr_t);
+DECLARE_FAKE_VOID_FUNC(pciemu_trace_reset, PCIEMUDevice *);
+DECLARE_FAKE_VOID_FUNC(pciemu_trace_init, PCIEMUDevice *, Error **);
+DECLARE_FAKE_VOID_FUNC(pciemu_trace_fini, PCIEMUDevice *);
+
+#endif /* PCIEMU_TRACE_FAKE_H */
@@ -13,7 +13,26 @@
 
 #include "qemu/osdep.h"
 #include "qom/object.h"
+#include "qapi/visitor.h"
 #include "exec/memory.h"
+#include "qemu/timer.h"
+#include "qemu/thread.h"
+#include "qemu/rcu.h"
+#include "qemu/main-loop.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "hw/qdev-properties.h"
+#include "sysemu/hostmem.h"
+#include "block/thread-pool.h"
+#include "block/aio-wait.h"
+#include "hw/pci/pcie.h"
+#include "crypto/cipher.h"
+#include "hw/boards.h"
+#include "qapi/qapi-builtin-visit.h"
+
+#ifdef CONFIG_NUMA
+#include <numaif.h>
+#endif
 
 DECLARE_FAKE_VALUE_FUNC(Type, type_register_static, const TypeInfo *);
 DECLARE_FAKE_VALUE_FUNC(ObjectClass *, object_class_dynamic_cast_assert,
@@ -28,6 +47,15 @@ DECLARE_FAKE_VOID_FUNC(register_module_init, type_init_fn_arg,
 DECLARE_FAKE_VALUE_FUNC(MemTxResult, address_space_rw, AddressSpace *, hwaddr,
                         MemTxAttrs, void *, hwaddr, bool);
 
+DECLARE_FAKE_VALUE_FUNC(void *, address_space_map, AddressSpace *, hwaddr,
+                        hwaddr *, bool, MemTxAttrs);
+
+DECLARE_FAKE_VOID_FUNC(address_space_unmap, AddressSpace *, void *, hwaddr,
+                       bool, hwaddr);
+
+DECLARE_FAKE_VALUE_FUNC(MemoryRegion *, flatview_translate, FlatView *, hwaddr,
+                        hwaddr *, hwaddr *, bool, MemTxAttrs);
+
 DECLARE_FAKE_VALUE_FUNC(size_t, qemu_target_page_size);
 
 DECLARE_FAKE_VOID_FUNC_VARARG(qemu_log, const char *, ...);
@@ -46,7 +74,170 @@ DECLARE_FAKE_VOID_FUNC(msi_notify, PCIDevice *, unsigned int);
 
 DECLARE_FAKE_VOID_FUNC(msi_uninit, struct PCIDevice *);
 
+DECLARE_FAKE_VALUE_FUNC(int, pcie_endpoint_cap_init, PCIDevice *, uint8_t);
+
+DECLARE_FAKE_VOID_FUNC(pcie_cap_exit, PCIDevice *);
+
 DECLARE_FAKE_VOID_FUNC(memory_region_init_io, MemoryRegion *, Object *,
                        const MemoryRegionOps *, void *, const char *, uint64_t);
 
+DECLARE_FAKE_VOID_FUNC(memory_region_init_ram, MemoryRegion *, Object *,
+                       const char *, uint64_t, Error **);
+
+DECLARE_FAKE_VOID_FUNC(memory_region_clear_global_locking, MemoryRegion *);
+
+DECLARE_FAKE_VOID_FUNC(timer_init_full, QEMUTimer *, QEMUTimerListGroup *,
+                       QEMUClockType, int, int, QEMUTimerCB *, void *);
+
+DECLARE_FAKE_VOID_FUNC(timer_mod_ns, QEMUTimer *, int64_t);
+
+DECLARE_FAKE_VOID_FUNC(timer_del, QEMUTimer *);
+
+DECLARE_FAKE_VALUE_FUNC(bool, timer_pending, QEMUTimer *);
+
+DECLARE_FAKE_VALUE_FUNC(int64_t, qemu_clock_get_ns, QEMUClockType);
+
+DECLARE_FAKE_VOID_FUNC(qemu_rec_mutex_init, QemuRecMutex *);
+
+DECLARE_FAKE_VOID_FUNC(qemu_rec_mutex_destroy, QemuRecMutex *);
+
+DECLARE_FAKE_VOID_FUNC(qemu_rec_mutex_lock_impl, QemuRecMutex *, const char *,
+                       int);
+
+DECLARE_FAKE_VOID_FUNC(qemu_rec_mutex_unlock_impl, QemuRecMutex *,
+                       const char *, int);
+
+DECLARE_FAKE_VOID_FUNC(qemu_event_set, QemuEvent *);
+
+DECLARE_FAKE_VALUE_FUNC(bool, qemu_mutex_iothread_locked);
+
+DECLARE_FAKE_VOID_FUNC(qemu_mutex_lock_iothread_impl, const char *, int);
+
+DECLARE_FAKE_VOID_FUNC(qemu_mutex_unlock_iothread);
+
+DECLARE_FAKE_VOID_FUNC_VARARG(error_setg_internal, Error **, const char *,
+                              int, const char *, const char *, ...);
+
+DECLARE_FAKE_VOID_FUNC(error_propagate, Error **, Error *);
+
+DECLARE_FAKE_VOID_FUNC_VARARG(warn_report, const char *, ...);
+
+DECLARE_FAKE_VOID_FUNC(device_class_set_props, DeviceClass *, Property *);
+
+DECLARE_FAKE_VALUE_FUNC(MemoryRegion *, host_memory_backend_get_memory,
+                        HostMemoryBackend *);
+
+DECLARE_FAKE_VALUE_FUNC(bool, host_memory_backend_is_mapped,
+                        HostMemoryBackend *);
+
+DECLARE_FAKE_VOID_FUNC(host_memory_backend_set_mapped, HostMemoryBackend *,
+                       bool);
+
+DECLARE_FAKE_VALUE_FUNC(void *, memory_region_get_ram_ptr, MemoryRegion *);
+
+DECLARE_FAKE_VALUE_FUNC(uint64_t, memory_region_size, MemoryRegion *);
+
+DECLARE_FAKE_VALUE_FUNC(MemoryRegion *, memory_region_from_host, void *,
+                        ram_addr_t *);
+
+DECLARE_FAKE_VALUE_FUNC(bool, memory_region_is_ram_device, MemoryRegion *);
+
+DECLARE_FAKE_VOID_FUNC(memory_region_set_dirty, MemoryRegion *, hwaddr,
+                       hwaddr);
+
+DECLARE_FAKE_VOID_FUNC(memory_listener_register, MemoryListener *,
+                       AddressSpace *);
+
+DECLARE_FAKE_VOID_FUNC(memory_listener_unregister, MemoryListener *);
+
+DECLARE_FAKE_VALUE_FUNC(int, memory_region_register_iommu_notifier,
+                        MemoryRegion *, IOMMUNotifier *, Error **);
+
+DECLARE_FAKE_VOID_FUNC(memory_region_unregister_iommu_notifier,
+                       MemoryRegion *, IOMMUNotifier *);
+
+DECLARE_FAKE_VALUE_FUNC(int, memory_region_iommu_attrs_to_index,
+                        IOMMUMemoryRegion *, MemTxAttrs);
+
+DECLARE_FAKE_VALUE_FUNC(ObjectProperty *, object_class_property_add,
+                        ObjectClass *, const char *, const char *,
+                        ObjectPropertyAccessor *, ObjectPropertyAccessor *,
+                        ObjectPropertyRelease *, void *);
+
+DECLARE_FAKE_VALUE_FUNC(bool, visit_start_struct, Visitor *, const char *,
+                        void **, size_t, Error **);
+
+DECLARE_FAKE_VALUE_FUNC(bool, visit_check_struct, Visitor *, Error **);
+
+DECLARE_FAKE_VOID_FUNC(visit_end_struct, Visitor *, void **);
+
+DECLARE_FAKE_VALUE_FUNC(bool, visit_start_list, Visitor *, const char *,
+                        GenericList **, size_t, Error **);
+
+DECLARE_FAKE_VALUE_FUNC(bool, visit_check_list, Visitor *, Error **);
+
+DECLARE_FAKE_VOID_FUNC(visit_end_list, Visitor *, void **);
+
+DECLARE_FAKE_VALUE_FUNC(bool, visit_type_uint64, Visitor *, const char *,
+                        uint64_t *, Error **);
+
+DECLARE_FAKE_VALUE_FUNC(BlockAIOCB *, thread_pool_submit_aio, ThreadPoolFunc *,
+                        void *, BlockCompletionFunc *, void *);
+
+DECLARE_FAKE_VALUE_FUNC(AioContext *, qemu_get_current_aio_context);
+
+DECLARE_FAKE_VALUE_FUNC(AioContext *, qemu_get_aio_context);
+
+DECLARE_FAKE_VALUE_FUNC(bool, aio_poll, AioContext *, bool);
+
+DECLARE_FAKE_VOID_FUNC(aio_context_acquire, AioContext *);
+
+DECLARE_FAKE_VOID_FUNC(aio_context_release, AioContext *);
+
+DECLARE_FAKE_VALUE_FUNC(QCryptoCipher *, qcrypto_cipher_new,
+                        QCryptoCipherAlgorithm, QCryptoCipherMode,
+                        const uint8_t *, size_t, Error **);
+
+DECLARE_FAKE_VOID_FUNC(qcrypto_cipher_free, QCryptoCipher *);
+
+DECLARE_FAKE_VALUE_FUNC(int, qcrypto_cipher_setiv, QCryptoCipher *,
+                        const uint8_t *, size_t, Error **);
+
+DECLARE_FAKE_VALUE_FUNC(int, qcrypto_cipher_encrypt, QCryptoCipher *,
+                        const void *, void *, size_t, Error **);
+
+DECLARE_FAKE_VALUE_FUNC(int, qcrypto_cipher_decrypt, QCryptoCipher *,
+                        const void *, void *, size_t, Error **);
+
+DECLARE_FAKE_VOID_FUNC_VARARG(error_setg_errno_internal, Error **,
+                              const char *, int, const char *, int,
+                              const char *, ...);
+
+typedef int (*enum_get_fn_arg)(Object *, Error **);
+typedef void (*enum_set_fn_arg)(Object *, int, Error **);
+DECLARE_FAKE_VALUE_FUNC(ObjectProperty *, object_class_property_add_enum,
+                        ObjectClass *, const char *, const char *,
+                        const QEnumLookup *, enum_get_fn_arg, enum_set_fn_arg);
+
+DECLARE_FAKE_VALUE_FUNC(bool, visit_type_uint16List, Visitor *, const char *,
+                        uint16List **, Error **);
+
+DECLARE_FAKE_VOID_FUNC(qapi_free_uint16List, uint16List *);
+
+DECLARE_FAKE_VALUE_FUNC(const char *, qapi_enum_lookup, const QEnumLookup *,
+                        int);
+
+DECLARE_FAKE_VALUE_FUNC(BusState *, qdev_get_parent_bus, const DeviceState *);
+
+DECLARE_FAKE_VALUE_FUNC(int, pci_bus_numa_node, PCIBus *);
+
+DECLARE_FAKE_VALUE_FUNC(void *, qemu_memalign, size_t, size_t);
+
+DECLARE_FAKE_VOID_FUNC(qemu_vfree, void *);
+
+#ifdef CONFIG_NUMA
+DECLARE_FAKE_VALUE_FUNC(long, mbind, void *, unsigned long, int,
+                        const unsigned long *, unsigned long, unsigned int);
+#endif
+
 #endif /* QEMU_FAKE_H */